@@ -1253,7 +1253,9 @@ class udp_server {
 
         future<> respond(udp_channel& chan) {
             int i = 0;
-            return do_for_each(_out_bufs.begin(), _out_bufs.end(), [this, i, &chan] (packet& p) mutable {
+            // Queue all datagrams of the response at once so the stack can
+            // send them together.
+            return parallel_for_each(_out_bufs.begin(), _out_bufs.end(), [this, i, &chan] (packet& p) mutable {
                 header* out_hdr = p.prepend_header<header>(0);
                 out_hdr->_request_id = _request_id;
                 out_hdr->_sequence_number = i++;
@@ -207,13 +207,18 @@ tests = [
     'tests/semaphore_test',
     'tests/expiring_fifo_test',
     'tests/packet_test',
+    'tests/arp_test',
     'tests/tls_test',
     'tests/fair_queue_test',
     'tests/rpc_test',
     'tests/connect_test',
+    'tests/udp_test',
     'tests/chunked_fifo_test',
     'tests/circular_buffer_test',
     'tests/perf/perf_fstream',
+    'tests/perf/perf_tcp_pingpong',
+    'tests/perf/perf_rpc',
+    'tests/perf/perf_routes',
     'tests/json_formatter_test',
     'tests/dns_test',
     'tests/execution_stage_test',
@@ -305,6 +310,7 @@ core = [
     'net/inet_address.cc',
     'rpc/rpc.cc',
     'rpc/lz4_compressor.cc',
+    'rpc/zstd_compressor.cc',
     ]
 
 protobuf = [
@@ -327,7 +333,12 @@ http = ['http/transformers.cc',
         'http/httpd.cc',
         'http/reply.cc',
         'http/request_parser.rl',
+        'http/http_response_parser.rl',
         'http/api_docs.cc',
+        'http/client.cc',
+        'http/compression.cc',
+        'http/hpack.cc',
+        'http/http2.cc',
         ]
 
 boost_test_lib = [
@@ -348,7 +359,7 @@ libs = ' '.join(['-laio',
                               '-lboost_program_options -lboost_system -lboost_filesystem'),
                  '-lstdc++ -lm',
                  maybe_static(args.staticboost, '-lboost_thread'),
-                 '-lcryptopp -lrt -lgnutls -lgnutlsxx -llz4 -lprotobuf -ldl -lgcc_s -lunwind',
+                 '-lcryptopp -lrt -lgnutls -lgnutlsxx -llz4 -lzstd -lz -lprotobuf -ldl -lgcc_s -lunwind',
                  ])
 
 boost_unit_test_lib = maybe_static(args.staticboost, '-lboost_unit_test_framework')
@@ -432,7 +443,7 @@ deps = {
     'tests/sstring_test': ['tests/sstring_test.cc'] + core,
     'tests/unwind_test': ['tests/unwind_test.cc'] + core,
     'tests/defer_test': ['tests/defer_test.cc'] + core,
-    'tests/httpd': ['tests/httpd.cc'] + http + core,
+    'tests/httpd': ['tests/httpd.cc'] + http + core + libnet,
     'tests/allocator_test': ['tests/allocator_test.cc'] + core,
     'tests/output_stream_test': ['tests/output_stream_test.cc'] + core + libnet,
     'tests/udp_zero_copy': ['tests/udp_zero_copy.cc'] + core + libnet,
@@ -445,11 +456,16 @@ deps = {
     'tests/rpc': ['tests/rpc.cc'] + core + libnet,
     'tests/rpc_test': ['tests/rpc_test.cc'] + core + libnet,
     'tests/packet_test': ['tests/packet_test.cc'] + core + libnet,
+    'tests/arp_test': ['tests/arp_test.cc'] + core + libnet,
     'tests/connect_test': ['tests/connect_test.cc'] + core + libnet,
+    'tests/udp_test': ['tests/udp_test.cc'] + core + libnet,
     'tests/chunked_fifo_test': ['tests/chunked_fifo_test.cc'] + core,
     'tests/circular_buffer_test': ['tests/circular_buffer_test.cc'] + core,
     'tests/perf/perf_fstream': ['tests/perf/perf_fstream.cc'] + core,
-    'tests/json_formatter_test': ['tests/json_formatter_test.cc'] + core + http,
+    'tests/perf/perf_tcp_pingpong': ['tests/perf/perf_tcp_pingpong.cc'] + core + libnet,
+    'tests/perf/perf_rpc': ['tests/perf/perf_rpc.cc'] + core + libnet,
+    'tests/perf/perf_routes': ['tests/perf/perf_routes.cc'] + http + core + libnet,
+    'tests/json_formatter_test': ['tests/json_formatter_test.cc'] + core + libnet + http,
     'tests/dns_test': ['tests/dns_test.cc'] + core + libnet,
     'tests/execution_stage_test': ['tests/execution_stage_test.cc'] + core,
 }
@@ -470,6 +486,7 @@ boost_tests = [
     'tests/fstream_test',
     'tests/rpc_test',
     'tests/connect_test',
+    'tests/udp_test',
     'tests/json_formatter_test',
     'tests/dns_test',
     'tests/execution_stage_test',
@@ -394,6 +394,30 @@ output_stream<CharType>::flush() {
     return make_ready_future<>();
 }
 
+template <typename CharType>
+future<>
+output_stream<CharType>::flush_to_sink() {
+    if (_ex) {
+        return make_exception_future<>(std::move(_ex));
+    }
+    // if flush is scheduled, disable it, and wait for one in progress
+    _flush = false;
+    auto f = _flushing ? _in_batch.value().get_future() : make_ready_future<>();
+    return f.then([this] {
+        auto f = make_ready_future<>();
+        if (_end) {
+            _buf.trim(_end);
+            _end = 0;
+            f = _fd.put(std::move(_buf));
+        } else if (_zc_bufs) {
+            f = _fd.put(std::move(_zc_bufs));
+        }
+        return f.then([this] {
+            return _fd.flush();
+        });
+    });
+}
+
 void add_to_flush_poller(output_stream<char>* x);
 
 template <typename CharType>
@@ -219,6 +219,10 @@ class output_stream final {
     future<> write(scattered_message<char_type> msg);
     future<> write(temporary_buffer<char_type>);
     future<> flush();
+    // Like flush(), but resolves only once the data was handed to the
+    // data sink, even when flushes are batched; for writing to what is
+    // under the sink next.
+    future<> flush_to_sink();
     future<> close();
 private:
     friend class reactor;
@@ -21,6 +21,9 @@
 
 #include "metrics.hh"
 #include "metrics_api.hh"
+#include "bitops.hh"
+#include <algorithm>
+#include <cmath>
 #include <boost/range/algorithm.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/algorithm/string/replace.hpp>
@@ -317,5 +320,41 @@ histogram histogram::operator+(histogram&& c) const {
     return std::move(c);
 }
 
+constexpr unsigned latency_histogram::bucket_count;
+
+void latency_histogram::add(std::chrono::nanoseconds latency) {
+    auto us = uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(latency).count());
+    unsigned bucket = us <= 1 ? 0 : 64 - count_leading_zeros(us - 1);
+    _buckets[std::min(bucket, bucket_count)]++;
+    _count++;
+    _sum += latency;
+}
+
+std::chrono::microseconds latency_histogram::quantile(double q) const {
+    auto rank = uint64_t(std::ceil(_count * q));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < bucket_count; i++) {
+        seen += _buckets[i];
+        if (seen >= rank && seen) {
+            return std::chrono::microseconds(uint64_t(1) << i);
+        }
+    }
+    return seen < rank ? std::chrono::microseconds::max() : std::chrono::microseconds(0);
+}
+
+histogram latency_histogram::to_metrics_histogram() const {
+    histogram h;
+    h.sample_count = _count;
+    h.sample_sum = std::chrono::duration<double, std::micro>(_sum).count();
+    h.buckets.resize(bucket_count);
+    uint64_t cumulative = 0;
+    for (unsigned i = 0; i < bucket_count; i++) {
+        cumulative += _buckets[i];
+        h.buckets[i].count = cumulative;
+        h.buckets[i].upper_bound = uint64_t(1) << i;
+    }
+    return h;
+}
+
 }
 }
@@ -20,6 +20,9 @@
  */
 
 #pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <vector>
 
 namespace seastar {
@@ -78,6 +81,34 @@ struct histogram {
 
 };
 
+/*!
+ * \brief Latency distribution in power of two buckets of microseconds
+ *
+ * Bucket i counts latencies of at most 2^i us.  Larger ones are only
+ * counted in the total, which exporters report as the +Inf bucket.
+ */
+class latency_histogram {
+public:
+    static constexpr unsigned bucket_count = 26;
+private:
+    // and one more for what is larger than the last bound
+    std::array<uint64_t, bucket_count + 1> _buckets{};
+    uint64_t _count = 0;
+    std::chrono::nanoseconds _sum{0};
+public:
+    void add(std::chrono::nanoseconds latency);
+    uint64_t count() const {
+        return _count;
+    }
+    std::chrono::nanoseconds sum() const {
+        return _sum;
+    }
+    /// Upper bound of the bucket that holds the q-th quantile, or
+    /// microseconds::max() when it is larger than the last bound.
+    std::chrono::microseconds quantile(double q) const;
+    histogram to_metrics_histogram() const;
+};
+
 }
 
 }
@@ -72,7 +72,7 @@ class file_desc {
 public:
     file_desc() = delete;
     file_desc(const file_desc&) = delete;
-    file_desc(file_desc&& x) : _fd(x._fd) { x._fd = -1; }
+    file_desc(file_desc&& x) noexcept : _fd(x._fd) { x._fd = -1; }
     ~file_desc() { if (_fd != -1) { ::close(_fd); } }
     void operator=(const file_desc&) = delete;
     file_desc& operator=(file_desc&& x) {
@@ -187,6 +187,12 @@ class file_desc {
         throw_system_error_on(r == -1, "getsockopt");
         return r;
     }
+    struct stat stat() {
+        struct stat buf;
+        auto r = ::fstat(_fd, &buf);
+        throw_system_error_on(r == -1, "fstat");
+        return buf;
+    }
     size_t size() {
         struct stat buf;
         auto r = ::fstat(_fd, &buf);
@@ -217,6 +223,14 @@ class file_desc {
         throw_system_error_on(r == -1, "recvmsg");
         return { size_t(r) };
     }
+    boost::optional<size_t> recvmmsg(mmsghdr* msgs, unsigned vlen, int flags) {
+        auto r = ::recvmmsg(_fd, msgs, vlen, flags, nullptr);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "recvmmsg");
+        return { size_t(r) };
+    }
     boost::optional<size_t> send(const void* buffer, size_t len, int flags) {
         auto r = ::send(_fd, buffer, len, flags);
         if (r == -1 && errno == EAGAIN) {
@@ -241,6 +255,14 @@ class file_desc {
         throw_system_error_on(r == -1, "sendmsg");
         return { size_t(r) };
     }
+    boost::optional<size_t> sendmmsg(mmsghdr* msgs, unsigned vlen, int flags) {
+        auto r = ::sendmmsg(_fd, msgs, vlen, flags);
+        if (r == -1 && errno == EAGAIN) {
+            return {};
+        }
+        throw_system_error_on(r == -1, "sendmmsg");
+        return { size_t(r) };
+    }
     void bind(sockaddr& sa, socklen_t sl) {
         auto r = ::bind(_fd, &sa, sl);
         throw_system_error_on(r == -1, "bind");
@@ -314,6 +336,7 @@ class file_desc {
 
 private:
     file_desc(int fd) : _fd(fd) {}
+    friend class reactor;
  };
 
 
@@ -193,13 +193,12 @@ std::string get_text_representation(const metrics_families& families, const conf
                 auto&& h = value.get_histogram();
                 std::map<sstring, sstring> labels = id.labels();
                 auto& le = labels["le"];
-                uint64_t count = 0;
                 auto bucket = name + "_bucket";
+                // the counts are cumulative already, as in the protobuf format
                 for (auto  i : h.buckets) {
                      le = std::to_string(i.upper_bound);
-                    count += i.count;
                     add_name(s, bucket, labels, ctx);
-                    s << count;
+                    s << i.count;
                     s << "\n";
                 }
                 labels["le"] = "+Inf";
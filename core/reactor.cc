@@ -46,6 +46,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/eventfd.h>
+#include <poll.h>
 #include <boost/filesystem.hpp>
 #include <boost/thread/barrier.hpp>
 #include <boost/algorithm/string/classification.hpp>
@@ -77,6 +78,7 @@
 #endif
 
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/utsname.h>
 #include <linux/falloc.h>
 #include <linux/magic.h>
@@ -618,13 +620,7 @@ void reactor::configure(boost::program_options::variables_map vm) {
     }
 }
 
-future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
-        promise<> pollable_fd_state::*pr, int event) {
-    if (pfd.events_known & event) {
-        pfd.events_known &= ~event;
-        return make_ready_future();
-    }
-    pfd.events_requested |= event;
+void reactor_backend_epoll::install_epoll_event(pollable_fd_state& pfd, int event) {
     if (!(pfd.events_epoll & event)) {
         auto ctl = pfd.events_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
         pfd.events_epoll |= event;
@@ -635,12 +631,9 @@ future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
         assert(r == 0);
         engine().start_epoll();
     }
-    pfd.*pr = promise<>();
-    return (pfd.*pr).get_future();
 }
 
-void reactor_backend_epoll::abort_fd(pollable_fd_state& pfd, std::exception_ptr ex,
-                                     promise<> pollable_fd_state::* pr, int event) {
+void reactor_backend_epoll::remove_epoll_event(pollable_fd_state& pfd, int event) {
     if (pfd.events_epoll & event) {
         pfd.events_epoll &= ~event;
         auto ctl = pfd.events_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
@@ -650,6 +643,61 @@ void reactor_backend_epoll::abort_fd(pollable_fd_state& pfd, std::exception_ptr
         int r = ::epoll_ctl(_epollfd.get(), ctl, pfd.fd.get(), &eevt);
         assert(r == 0);
     }
+}
+
+future<> reactor_backend_epoll::get_epoll_future(pollable_fd_state& pfd,
+        promise<> pollable_fd_state::*pr, int event) {
+    if (pfd.events_known & event) {
+        pfd.events_known &= ~event;
+        return make_ready_future();
+    }
+    pfd.events_requested |= event;
+    if (event == EPOLLIN && pfd.busy_poll.count()) {
+        // A read that ran out of budget left the fd registered with epoll,
+        // where it stays until epoll reports it unwanted; take it out, so
+        // this read is busy-polled again.
+        remove_epoll_event(pfd, EPOLLIN);
+        _busy_fds.push_back({&pfd, std::chrono::steady_clock::now() + pfd.busy_poll});
+    } else {
+        install_epoll_event(pfd, event);
+    }
+    pfd.*pr = promise<>();
+    return (pfd.*pr).get_future();
+}
+
+bool reactor_backend_epoll::poll_busy_fds() {
+    if (_busy_fds.empty()) {
+        return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    bool did_work = false;
+    auto done = std::remove_if(_busy_fds.begin(), _busy_fds.end(), [&] (const busy_polled_fd& b) {
+        auto& pfd = *b.fd;
+        if (!(pfd.events_requested & EPOLLIN)) {
+            // Aborted.
+            return true;
+        }
+        ::pollfd pollfd = { pfd.fd.get(), POLLIN, 0 };
+        if (::poll(&pollfd, 1, 0) == 1) {
+            // Readable, or in error; either way the reader will find out.
+            complete_epoll_event(pfd, &pollable_fd_state::pollin, EPOLLIN, EPOLLIN);
+            did_work = true;
+            return true;
+        }
+        if (now >= b.deadline) {
+            install_epoll_event(pfd, EPOLLIN);
+            did_work = true;
+            return true;
+        }
+        return false;
+    });
+    _busy_fds.erase(done, _busy_fds.end());
+    return did_work;
+}
+
+void reactor_backend_epoll::abort_fd(pollable_fd_state& pfd, std::exception_ptr ex,
+                                     promise<> pollable_fd_state::* pr, int event) {
+    remove_epoll_event(pfd, event);
     if (pfd.events_requested & event) {
         pfd.events_requested &= ~event;
         (pfd.*pr).set_exception(std::move(ex));
@@ -677,6 +725,11 @@ void reactor_backend_epoll::forget(pollable_fd_state& fd) {
     if (fd.events_epoll) {
         ::epoll_ctl(_epollfd.get(), EPOLL_CTL_DEL, fd.fd.get(), nullptr);
     }
+    if (!_busy_fds.empty()) {
+        _busy_fds.erase(std::remove_if(_busy_fds.begin(), _busy_fds.end(), [&fd] (const busy_polled_fd& b) {
+            return b.fd == &fd;
+        }), _busy_fds.end());
+    }
 }
 
 future<> reactor_backend_epoll::notified(reactor_notifier *n) {
@@ -1702,6 +1755,35 @@ reactor::file_type(sstring name) {
     });
 }
 
+future<file_desc>
+reactor::open_file_desc(sstring name, open_flags flags) {
+    return _thread_pool.submit<syscall_result<int>>([name, flags] {
+        return wrap_syscall<int>(::open(name.c_str(), O_CLOEXEC | static_cast<int>(flags)));
+    }).then([] (syscall_result<int> sr) {
+        sr.throw_if_error();
+        return file_desc(sr.result);
+    });
+}
+
+future<size_t>
+reactor::sendfile(pollable_fd_state& fd, int in_fd, uint64_t offset, size_t len) {
+    return writeable(fd).then([this, &fd, in_fd, offset, len] {
+        return _thread_pool.submit<syscall_result<ssize_t>>([out_fd = fd.fd.get(), in_fd, offset, len] {
+            off_t off = offset;
+            return wrap_syscall<ssize_t>(::sendfile(out_fd, in_fd, &off, len));
+        });
+    }).then([this, &fd, in_fd, offset, len] (syscall_result<ssize_t> sr) {
+        if (sr.result == -1 && sr.error == EAGAIN) {
+            return sendfile(fd, in_fd, offset, len);
+        }
+        sr.throw_if_error();
+        if (size_t(sr.result) == len) {
+            fd.speculate_epoll(EPOLLOUT);
+        }
+        return make_ready_future<size_t>(sr.result);
+    });
+}
+
 future<uint64_t>
 reactor::file_size(sstring pathname) {
     return _thread_pool.submit<syscall_result_extra<struct stat>>([pathname] {
@@ -1714,6 +1796,18 @@ reactor::file_size(sstring pathname) {
     });
 }
 
+future<struct stat>
+reactor::fstat(int fd) {
+    return _thread_pool.submit<syscall_result_extra<struct stat>>([fd] {
+        struct stat st;
+        auto ret = ::fstat(fd, &st);
+        return wrap_syscall(ret, st);
+    }).then([] (syscall_result_extra<struct stat> sr) {
+        sr.throw_if_error();
+        return make_ready_future<struct stat>(sr.extra);
+    });
+}
+
 future<bool>
 reactor::file_exists(sstring pathname) {
     return _thread_pool.submit<syscall_result_extra<struct stat>>([pathname] {
@@ -2632,6 +2726,25 @@ class reactor::epoll_pollfn final : public reactor::pollfn {
     }
 };
 
+class reactor::busy_poll_pollfn final : public reactor::pollfn {
+    reactor& _r;
+public:
+    busy_poll_pollfn(reactor& r) : _r(r) {}
+    virtual bool poll() final override {
+        return _r._backend.poll_busy_fds();
+    }
+    virtual bool pure_poll() override final {
+        return _r._backend.has_busy_fds();
+    }
+    virtual bool try_enter_interrupt_mode() override {
+        // Sleeping would defeat busy polling; the budgets are bounded, so
+        // the reactor can sleep once they all run out.
+        return !_r._backend.has_busy_fds();
+    }
+    virtual void exit_interrupt_mode() override final {
+    }
+};
+
 void
 reactor::wakeup() {
     pthread_kill(_thread_id, alarm_signal());
@@ -2675,6 +2788,7 @@ int reactor::run() {
     poller aio_poller(std::make_unique<aio_batch_submit_pollfn>(*this));
     poller batch_flush_poller(std::make_unique<batch_flush_pollfn>(*this));
     poller execution_stage_poller(std::make_unique<execution_stage_pollfn>());
+    poller busy_poll_poller(std::make_unique<busy_poll_pollfn>(*this));
 
     start_aio_eventfd_loop();
 
@@ -4118,7 +4232,7 @@ void add_to_flush_poller(output_stream<char>* os) {
 }
 
 network_stack_registrator nsr_posix{"posix",
-    boost::program_options::options_description(),
+    posix_network_stack::get_options_description(),
     [](boost::program_options::variables_map ops) {
         return smp::main_thread() ? posix_network_stack::create(ops) : posix_ap_network_stack::create(ops);
     },
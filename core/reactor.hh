@@ -107,6 +107,9 @@ class pollable_fd_state {
     int events_requested = 0; // wanted by pollin/pollout promises
     int events_epoll = 0;     // installed in epoll
     int events_known = 0;     // returned from epoll
+    // If nonzero, a reader waiting for input polls the fd from the reactor's
+    // poll loop for up to this long before falling back to epoll.
+    std::chrono::microseconds busy_poll = {};
     promise<> pollin;
     promise<> pollout;
     friend class reactor;
@@ -143,11 +146,15 @@ class pollable_fd {
     void abort_reader(std::exception_ptr ex);
     void abort_writer(std::exception_ptr ex);
     future<pollable_fd, socket_address> accept();
-    future<size_t> sendmsg(struct msghdr *msg);
+    future<size_t> sendmsg(struct msghdr *msg, int flags = 0);
     future<size_t> recvmsg(struct msghdr *msg);
+    future<size_t> recvmmsg(struct mmsghdr *msgs, size_t vlen);
     future<size_t> sendto(socket_address addr, const void* buf, size_t len);
+    future<size_t> sendfile(int in_fd, uint64_t offset, size_t len);
     file_desc& get_file_desc() const { return _s->fd; }
     void shutdown(int how) { _s->fd.shutdown(how); }
+    // Busy-poll for input for up to budget before waiting in epoll (0 disables).
+    void set_busy_poll(std::chrono::microseconds budget) { _s->busy_poll = budget; }
     void close() { _s.reset(); }
 protected:
     int get_fd() const { return _s->fd.get(); }
@@ -451,6 +458,12 @@ class reactor_backend {
     virtual future<> notified(reactor_notifier *n) = 0;
     // Methods for allowing sending notifications events between threads.
     virtual std::unique_ptr<reactor_notifier> make_reactor_notifier() = 0;
+    // Checks file descriptors that are busy-polled for readability (see
+    // pollable_fd_state::busy_poll).  Returns true if any became ready or
+    // fell back to regular polling.
+    virtual bool poll_busy_fds() { return false; }
+    // Whether any file descriptor is being busy-polled.
+    virtual bool has_busy_fds() const { return false; }
 };
 
 // reactor backend using file-descriptor & epoll, suitable for running on
@@ -459,9 +472,16 @@ class reactor_backend {
 // using mechanisms like timerfd, signalfd and eventfd respectively.
 class reactor_backend_epoll : public reactor_backend {
 private:
+    struct busy_polled_fd {
+        pollable_fd_state* fd;
+        std::chrono::steady_clock::time_point deadline;
+    };
     file_desc _epollfd;
+    std::vector<busy_polled_fd> _busy_fds;
     future<> get_epoll_future(pollable_fd_state& fd,
             promise<> pollable_fd_state::* pr, int event);
+    void install_epoll_event(pollable_fd_state& fd, int event);
+    void remove_epoll_event(pollable_fd_state& fd, int event);
     void complete_epoll_event(pollable_fd_state& fd,
             promise<> pollable_fd_state::* pr, int events, int event);
     void abort_fd(pollable_fd_state& fd, std::exception_ptr ex,
@@ -475,6 +495,8 @@ class reactor_backend_epoll : public reactor_backend {
     virtual void forget(pollable_fd_state& fd) override;
     virtual future<> notified(reactor_notifier *n) override;
     virtual std::unique_ptr<reactor_notifier> make_reactor_notifier() override;
+    virtual bool poll_busy_fds() override;
+    virtual bool has_busy_fds() const override { return !_busy_fds.empty(); }
     void abort_reader(pollable_fd_state& fd, std::exception_ptr ex);
     void abort_writer(pollable_fd_state& fd, std::exception_ptr ex);
 };
@@ -600,6 +622,7 @@ class reactor {
     class lowres_timer_pollfn;
     class manual_timer_pollfn;
     class epoll_pollfn;
+    class busy_poll_pollfn;
     class syscall_pollfn;
     class execution_stage_pollfn;
     friend io_pollfn;
@@ -611,6 +634,7 @@ class reactor {
     friend lowres_timer_pollfn;
     friend class manual_clock;
     friend class epoll_pollfn;
+    friend class busy_poll_pollfn;
     friend class syscall_pollfn;
     friend class execution_stage_pollfn;
     friend class file_data_source_impl; // for fstream statistics
@@ -834,12 +858,21 @@ class reactor {
 
     future<> write_all(pollable_fd_state& fd, const void* buffer, size_t size);
 
+    // Sends len bytes of in_fd from offset, with sendfile(2) run in the
+    // syscall thread, since reading the file may block on the disk.
+    future<size_t> sendfile(pollable_fd_state& fd, int in_fd, uint64_t offset, size_t len);
+
     future<file> open_file_dma(sstring name, open_flags flags, file_open_options options = {});
+    // Opens a file as a plain descriptor, through the page cache, for system
+    // calls that take one, such as sendfile(2).
+    future<file_desc> open_file_desc(sstring name, open_flags flags);
     future<file> open_directory(sstring name);
     future<> make_directory(sstring name);
     future<> touch_directory(sstring name);
     future<std::experimental::optional<directory_entry_type>>  file_type(sstring name);
     future<uint64_t> file_size(sstring pathname);
+    // fstat(2) of a descriptor, such as one opened by open_file_desc().
+    future<struct stat> fstat(int fd);
     future<bool> file_exists(sstring pathname);
     future<fs_type> file_system_at(sstring pathname);
     future<> remove_file(sstring pathname);
@@ -1134,7 +1167,9 @@ reactor::read_some(pollable_fd_state& fd, void* buffer, size_t len) {
         if (!r) {
             return read_some(fd, buffer, len);
         }
-        if (size_t(*r) == len) {
+        // Busy-polled fds expect more input soon, so try the next read
+        // before polling, even if this one drained the socket.
+        if (size_t(*r) == len || fd.busy_poll.count()) {
             fd.speculate_epoll(EPOLLIN);
         }
         return make_ready_future<size_t>(*r);
@@ -1303,11 +1338,27 @@ future<size_t> pollable_fd::recvmsg(struct msghdr *msg) {
 };
 
 inline
-future<size_t> pollable_fd::sendmsg(struct msghdr* msg) {
-    return engine().writeable(*_s).then([this, msg] () mutable {
-        auto r = get_file_desc().sendmsg(msg, 0);
+future<size_t> pollable_fd::recvmmsg(struct mmsghdr *msgs, size_t vlen) {
+    return engine().readable(*_s).then([this, msgs, vlen] {
+        auto r = get_file_desc().recvmmsg(msgs, vlen, 0);
+        if (!r) {
+            return recvmmsg(msgs, vlen);
+        }
+        // Unlike recvmsg(), a short batch tells us the queue was drained, so
+        // only speculate when all slots were filled.
+        if (*r == vlen) {
+            _s->speculate_epoll(EPOLLIN);
+        }
+        return make_ready_future<size_t>(*r);
+    });
+}
+
+inline
+future<size_t> pollable_fd::sendmsg(struct msghdr* msg, int flags) {
+    return engine().writeable(*_s).then([this, msg, flags] () mutable {
+        auto r = get_file_desc().sendmsg(msg, flags);
         if (!r) {
-            return sendmsg(msg);
+            return sendmsg(msg, flags);
         }
         // For UDP this will always speculate. We can't know if there's room
         // or not, but most of the time there should be so the cost of mis-
@@ -1334,6 +1385,11 @@ future<size_t> pollable_fd::sendto(socket_address addr, const void* buf, size_t
     });
 }
 
+inline
+future<size_t> pollable_fd::sendfile(int in_fd, uint64_t offset, size_t len) {
+    return engine().sendfile(*_s, in_fd, offset, len);
+}
+
 template <typename Clock>
 inline
 timer<Clock>::timer(callback_t&& callback) : _callback(std::move(callback)) {
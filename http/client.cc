@@ -0,0 +1,379 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "http/client.hh"
+#include "http/httpd.hh"
+#include "http/http_response_parser.hh"
+#include "core/future-util.hh"
+#include "core/semaphore.hh"
+#include "core/print.hh"
+#include <strings.h>
+
+namespace http {
+
+class tcp_connection_factory : public connection_factory {
+    socket_address _addr;
+public:
+    explicit tcp_connection_factory(socket_address addr) : _addr(addr) {
+    }
+    virtual future<connected_socket> make() override {
+        return engine().net().connect(_addr);
+    }
+};
+
+class tls_connection_factory : public connection_factory {
+    socket_address _addr;
+    ::shared_ptr<seastar::tls::certificate_credentials> _creds;
+    sstring _server_name;
+public:
+    tls_connection_factory(socket_address addr, ::shared_ptr<seastar::tls::certificate_credentials> creds, const sstring& server_name)
+        : _addr(addr), _creds(std::move(creds)), _server_name(server_name) {
+    }
+    virtual future<connected_socket> make() override {
+        return seastar::tls::connect(_creds, _addr, _server_name);
+    }
+};
+
+std::unique_ptr<connection_factory> make_connection_factory(socket_address addr) {
+    return std::make_unique<tcp_connection_factory>(addr);
+}
+
+std::unique_ptr<connection_factory> make_tls_connection_factory(socket_address addr,
+        ::shared_ptr<seastar::tls::certificate_credentials> creds, const sstring& server_name) {
+    return std::make_unique<tls_connection_factory>(addr, std::move(creds), server_name);
+}
+
+// Reads a body that ends with the connection.
+class until_eof_source_impl : public data_source_impl {
+    input_stream<char>& _in;
+public:
+    explicit until_eof_source_impl(input_stream<char>& in) : _in(in) {
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        return _in.read();
+    }
+};
+
+static bool header_equals(const response& rsp, const char* name, const char* value) {
+    auto it = rsp._headers.find(name);
+    return it != rsp._headers.end() && !strcasecmp(it->second.c_str(), value);
+}
+
+class client::connection : public enable_lw_shared_from_this<connection> {
+    connected_socket _fd;
+    input_stream<char> _read_buf;
+    output_stream<char> _write_buf;
+    http_response_parser _parser;
+    // requests are written, and their responses read, in the order they
+    // were sent
+    semaphore _write_lock { 1 };
+    semaphore _read_lock { 1 };
+    unsigned _in_flight = 0;
+    unsigned _served = 0;
+    bool _keep_alive = true;
+private:
+    future<> write_request(request& req, const sstring& host) {
+        sstring head = req._method + " " + req._url + " HTTP/1.1\r\n";
+        if (!req._headers.count("Host")) {
+            head += "Host: " + host + "\r\n";
+        }
+        for (auto&& h : req._headers) {
+            head += h.first + ": " + h.second + "\r\n";
+        }
+        if (req._body_writer) {
+            head += "Transfer-Encoding: chunked\r\n";
+        } else if (!req._content.empty() || req._method == "POST" || req._method == "PUT") {
+            head += "Content-Length: " + to_sstring(req._content.size()) + "\r\n";
+        }
+        head += "\r\n";
+        return _write_buf.write(head).then([this, &req] {
+            if (req._body_writer) {
+                return req._body_writer(httpd::make_reply_body_stream(_write_buf, true));
+            }
+            return _write_buf.write(req._content);
+        }).then([this] {
+            return _write_buf.flush();
+        });
+    }
+    future<> read_response(const request& req, const body_reader& reader) {
+        _parser.init();
+        return _read_buf.consume(_parser).then([this, &req, &reader] {
+            if (_parser._state != http_response_parser::state::done) {
+                throw std::runtime_error(_parser.eof() ? "connection closed by the server"
+                        : _parser.too_many_headers() ? "too many headers in http response" : "malformed http response");
+            }
+            auto parsed = _parser.get_parsed_response();
+            response rsp;
+            rsp._status = parsed->_status;
+            rsp._version = std::move(parsed->_version);
+            rsp._headers = std::move(parsed->_headers);
+            if (rsp._version == "1.0") {
+                _keep_alive = _keep_alive && header_equals(rsp, "Connection", "keep-alive");
+            } else {
+                _keep_alive = _keep_alive && !header_equals(rsp, "Connection", "close");
+            }
+            uint64_t length = 0;
+            bool chunked = false;
+            bool until_eof = false;
+            auto te = rsp._headers.find("Transfer-Encoding");
+            auto cl = rsp._headers.find("Content-Length");
+            if (req._method == "HEAD" || rsp._status / 100 == 1 || rsp._status == 204 || rsp._status == 304) {
+                // no body
+            } else if (te != rsp._headers.end()) {
+                chunked = true;
+            } else if (cl != rsp._headers.end()) {
+                length = std::stoull(cl->second);
+            } else {
+                until_eof = true;
+                _keep_alive = false;
+            }
+            auto body = until_eof ? input_stream<char>(data_source(std::make_unique<until_eof_source_impl>(_read_buf)))
+                    : httpd::make_request_body_stream(_read_buf, length, chunked, nullptr, 0);
+            return do_with(std::move(rsp), std::move(body), [this, &reader] (response& rsp, input_stream<char>& body) {
+                return reader(rsp, body).then([&body] {
+                    return repeat([&body] {
+                        return body.read().then([] (temporary_buffer<char> buf) {
+                            return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+                        });
+                    });
+                }).then([this] {
+                    ++_served;
+                });
+            });
+        });
+    }
+public:
+    explicit connection(connected_socket fd)
+        : _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()) {
+        _fd.set_nodelay(true);
+    }
+    unsigned in_flight() const {
+        return _in_flight;
+    }
+    // Responses read in full on the connection.
+    unsigned served() const {
+        return _served;
+    }
+    bool keep_alive() const {
+        return _keep_alive;
+    }
+    // Fails the requests in progress on the connection.
+    void abort() {
+        _keep_alive = false;
+        _fd.shutdown_input();
+        _fd.shutdown_output();
+    }
+    future<> send(request& req, const sstring& host, const body_reader& reader) {
+        ++_in_flight;
+        auto fail = [this] (std::exception_ptr ex) {
+            // a request that failed half way leaves the connection unusable
+            abort();
+            return make_exception_future<>(ex);
+        };
+        auto written = with_semaphore(_write_lock, 1, [this, &req, &host] {
+            return write_request(req, host);
+        }).handle_exception(fail);
+        auto read = with_semaphore(_read_lock, 1, [this, &req, &reader] {
+            return read_response(req, reader);
+        }).handle_exception(fail);
+        return when_all(std::move(written), std::move(read)).then([this] (std::tuple<future<>, future<>> results) {
+            --_in_flight;
+            auto& written = std::get<0>(results);
+            auto& read = std::get<1>(results);
+            if (written.failed()) {
+                read.ignore_ready_future();
+                return std::move(written);
+            }
+            return std::move(read);
+        });
+    }
+    future<> close() {
+        return _write_buf.close().then_wrapped([this] (future<> f) {
+            f.ignore_ready_future();
+            return _read_buf.close();
+        }).handle_exception([] (std::exception_ptr) {
+            // nothing to do about a connection that fails to close
+        });
+    }
+};
+
+client::client(std::unique_ptr<connection_factory> factory, const sstring& host, client_options options)
+    : _factory(std::move(factory)), _host(host), _options(options) {
+    _options.max_connections = std::max(_options.max_connections, 1u);
+    _options.max_pipelined = std::max(_options.max_pipelined, 1u);
+}
+
+client::client(ipv4_addr addr, client_options options)
+    : client(make_connection_factory(make_ipv4_address(addr)), sprint("%s", addr), options) {
+}
+
+client::client(ipv4_addr addr, ::shared_ptr<seastar::tls::certificate_credentials> creds,
+        const sstring& server_name, client_options options)
+    : client(make_tls_connection_factory(make_ipv4_address(addr), std::move(creds), server_name), server_name, options) {
+}
+
+client::~client() {
+}
+
+future<lw_shared_ptr<client::connection>> client::connect(clock_type::time_point timeout) {
+    ++_connecting;
+    // a connection that completes after the timeout is still added to the pool
+    auto f = with_gate(_gate, [this] {
+        return _factory->make().then_wrapped([this] (future<connected_socket> f) {
+            --_connecting;
+            _available.signal();
+            auto c = make_lw_shared<connection>(std::get<0>(f.get()));
+            _connections.push_back(c);
+            return c;
+        });
+    });
+    if (timeout == clock_type::time_point::max()) {
+        return f;
+    }
+    return with_timeout(timeout, std::move(f));
+}
+
+future<lw_shared_ptr<client::connection>> client::get_connection(clock_type::time_point timeout) {
+    using opt_connection = std::experimental::optional<lw_shared_ptr<connection>>;
+    return repeat_until_value([this, timeout] {
+        // an idle connection, else a new one, else pipeline behind the
+        // fewest requests
+        lw_shared_ptr<connection> best;
+        for (auto&& c : _connections) {
+            if (!best || c->in_flight() < best->in_flight()) {
+                best = c;
+            }
+        }
+        if (best && !best->in_flight()) {
+            return make_ready_future<opt_connection>(best);
+        }
+        if (_connections.size() + _connecting < _options.max_connections) {
+            return connect(timeout).then([] (lw_shared_ptr<connection> c) {
+                return opt_connection(std::move(c));
+            });
+        }
+        if (best && best->in_flight() < _options.max_pipelined) {
+            return make_ready_future<opt_connection>(best);
+        }
+        return _available.wait(timeout).then_wrapped([] (future<> f) {
+            try {
+                f.get();
+            } catch (condition_variable_timed_out&) {
+                throw timed_out_error();
+            }
+            return opt_connection();
+        });
+    });
+}
+
+void client::done_with(lw_shared_ptr<connection> c) {
+    if (!c->keep_alive()) {
+        auto it = std::find(_connections.begin(), _connections.end(), c);
+        if (it != _connections.end()) {
+            _connections.erase(it);
+        }
+        if (!c->in_flight()) {
+            c->close().finally([c] {});
+        }
+    }
+    _available.signal();
+}
+
+static bool is_idempotent(const request& req) {
+    // a streamed body cannot be written again
+    return !req._body_writer && (req._method == "GET" || req._method == "HEAD" || req._method == "PUT"
+            || req._method == "DELETE" || req._method == "OPTIONS" || req._method == "TRACE");
+}
+
+future<> client::send_request(request& req, body_reader& reader, clock_type::time_point timeout, bool may_retry) {
+    return get_connection(timeout).then([this, &req, &reader, timeout, may_retry] (lw_shared_ptr<connection> c) {
+        // The server may close a kept alive connection while it is idle, as
+        // the request is sent.  Then the request fails before any response
+        // arrives, and is sent once more on another connection if that is
+        // safe.
+        bool retry = may_retry && c->served() && !c->in_flight() && is_idempotent(req);
+        return do_with(body_reader(), false, false, timer<clock_type>(), [this, c, &req, &reader, timeout, retry] (body_reader& tracked, bool& responded, bool& timed_out, timer<clock_type>& t) {
+            tracked = [&reader, &responded] (const response& rsp, input_stream<char>& body) {
+                responded = true;
+                return reader(rsp, body);
+            };
+            if (timeout != clock_type::time_point::max()) {
+                t.set_callback([c, &timed_out] {
+                    timed_out = true;
+                    c->abort();
+                });
+                t.arm(timeout);
+            }
+            return c->send(req, _host, tracked).then_wrapped([this, c, &req, &reader, timeout, retry, &responded, &timed_out, &t] (future<> f) {
+                t.cancel();
+                done_with(c);
+                if (timed_out) {
+                    f.ignore_ready_future();
+                    throw timed_out_error();
+                }
+                if (f.failed() && retry && !responded) {
+                    f.ignore_ready_future();
+                    return send_request(req, reader, timeout, false);
+                }
+                return std::move(f);
+            });
+        });
+    });
+}
+
+future<> client::make_request(request req, body_reader reader, clock_type::time_point timeout) {
+    return with_gate(_gate, [this, req = std::move(req), reader = std::move(reader), timeout] () mutable {
+        return do_with(std::move(req), std::move(reader), [this, timeout] (request& req, body_reader& reader) {
+            return send_request(req, reader, timeout, true);
+        });
+    });
+}
+
+future<response> client::make_request(request req, clock_type::time_point timeout) {
+    auto rsp = make_lw_shared<response>();
+    auto reader = [rsp] (const response& r, input_stream<char>& body) {
+        *rsp = r;
+        return repeat([rsp, &body] {
+            return body.read().then([rsp] (temporary_buffer<char> buf) {
+                if (buf.empty()) {
+                    return stop_iteration::yes;
+                }
+                rsp->_content.append(buf.get(), buf.size());
+                return stop_iteration::no;
+            });
+        });
+    };
+    return make_request(std::move(req), std::move(reader), timeout).then([rsp] {
+        return std::move(*rsp);
+    });
+}
+
+future<> client::close() {
+    return _gate.close().then([this] {
+        return do_with(std::move(_connections), [] (std::vector<lw_shared_ptr<connection>>& connections) {
+            return parallel_for_each(connections, [] (lw_shared_ptr<connection> c) {
+                return c->close();
+            });
+        });
+    });
+}
+
+}
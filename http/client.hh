@@ -0,0 +1,196 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/reactor.hh"
+#include "core/iostream.hh"
+#include "core/sstring.hh"
+#include "core/shared_ptr.hh"
+#include "core/condition-variable.hh"
+#include "core/gate.hh"
+#include "net/tls.hh"
+#include "http/header_map.hh"
+#include <functional>
+#include <chrono>
+
+namespace http {
+
+/**
+ * A request sent by a \ref client.
+ */
+struct request {
+    sstring _method = "GET";
+    /**
+     * The path and query, e.g. "/api/items?limit=10".
+     */
+    sstring _url;
+    httpd::header_map _headers;
+    /**
+     * The body, sent with a Content-Length, unless _body_writer is set.
+     */
+    sstring _content;
+    /**
+     * When set, writes the body instead of _content, see write_body().
+     */
+    std::function<future<>(output_stream<char>&&)> _body_writer;
+
+    request() = default;
+    request(const sstring& method, const sstring& url) : _method(method), _url(url) {
+    }
+
+    request& add_header(const sstring& h, const sstring& value) {
+        _headers[h] = value;
+        return *this;
+    }
+
+    /**
+     * Send the body by calling body_writer once the headers are sent, with
+     * chunked transfer encoding.  body_writer must close the stream it is
+     * passed when done.
+     */
+    request& write_body(std::function<future<>(output_stream<char>&&)>&& body_writer) {
+        _body_writer = std::move(body_writer);
+        return *this;
+    }
+};
+
+/**
+ * A response received by a \ref client.
+ */
+struct response {
+    int _status = 0;
+    sstring _version;
+    httpd::header_map _headers;
+    /**
+     * The body, unless it was read with a \ref client::body_reader.
+     */
+    sstring _content;
+
+    /**
+     * @return the value of a header, or an empty string if it is missing
+     */
+    sstring get_header(const sstring& name) const {
+        auto it = _headers.find(name);
+        if (it == _headers.end()) {
+            return "";
+        }
+        return it->second;
+    }
+};
+
+/**
+ * Opens the connections of a \ref client.
+ */
+class connection_factory {
+public:
+    virtual ~connection_factory() {}
+    virtual future<connected_socket> make() = 0;
+};
+
+/**
+ * @return a factory for TCP connections to addr
+ */
+std::unique_ptr<connection_factory> make_connection_factory(socket_address addr);
+
+/**
+ * @return a factory for TLS connections to addr, verifying that the
+ * server's certificate is valid for server_name
+ */
+std::unique_ptr<connection_factory> make_tls_connection_factory(socket_address addr,
+        ::shared_ptr<seastar::tls::certificate_credentials> creds, const sstring& server_name);
+
+struct client_options {
+    /**
+     * Connections to the server kept open at most.  A request waits for a
+     * connection when they are all in use.
+     */
+    unsigned max_connections = 16;
+    /**
+     * Requests sent on a connection while waiting for its responses.  A
+     * request is only pipelined behind others once max_connections are
+     * open; 1 disables pipelining.
+     */
+    unsigned max_pipelined = 1;
+};
+
+/**
+ * An HTTP/1.1 client of a single server.
+ *
+ * Connections are kept open between requests (unless the server asks
+ * otherwise) and reused.  Responses are read in full into
+ * response::_content, or streamed to a body_reader.
+ */
+class client {
+public:
+    using clock_type = std::chrono::steady_clock;
+    /**
+     * Reads a response body from the stream it is passed.  Whatever it
+     * leaves unread is skipped once its future resolves.
+     */
+    using body_reader = std::function<future<>(const response&, input_stream<char>&)>;
+private:
+    class connection;
+    std::unique_ptr<connection_factory> _factory;
+    sstring _host;
+    client_options _options;
+    // connections that can take more requests
+    std::vector<lw_shared_ptr<connection>> _connections;
+    unsigned _connecting = 0;
+    condition_variable _available;
+    seastar::gate _gate;
+private:
+    future<lw_shared_ptr<connection>> get_connection(clock_type::time_point timeout);
+    future<lw_shared_ptr<connection>> connect(clock_type::time_point timeout);
+    future<> send_request(request& req, body_reader& reader, clock_type::time_point timeout, bool may_retry);
+    void done_with(lw_shared_ptr<connection> c);
+public:
+    /**
+     * @param host the value of the Host header of requests
+     */
+    client(std::unique_ptr<connection_factory> factory, const sstring& host, client_options options = {});
+    client(ipv4_addr addr, client_options options = {});
+    client(ipv4_addr addr, ::shared_ptr<seastar::tls::certificate_credentials> creds,
+            const sstring& server_name, client_options options = {});
+    client(client&&) = delete;
+    ~client();
+
+    /**
+     * Sends req and reads the response, with its body.  Fails with
+     * timed_out_error if the response is not in by timeout.
+     *
+     * An idempotent request without a streamed body is sent again, once,
+     * when the kept alive connection it was sent on turns out to have been
+     * closed by the server before any response arrived.
+     */
+    future<response> make_request(request req, clock_type::time_point timeout = clock_type::time_point::max());
+    /**
+     * Sends req and passes the response to reader to read its body.
+     */
+    future<> make_request(request req, body_reader reader, clock_type::time_point timeout = clock_type::time_point::max());
+    /**
+     * Waits for the requests in progress and closes all connections.  No
+     * requests may be made afterwards.
+     */
+    future<> close();
+};
+
+}
@@ -36,4 +36,17 @@ operation_type str2type(const sstring& type) {
     return GET;
 }
 
+const char* type2str(operation_type type) {
+    switch (type) {
+    case POST:
+        return "POST";
+    case PUT:
+        return "PUT";
+    case DELETE:
+        return "DELETE";
+    default:
+        return "GET";
+    }
+}
+
 }
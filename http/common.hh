@@ -23,32 +23,112 @@
 #define COMMON_HH_
 
 #include <unordered_map>
+#include <vector>
+#include <stdexcept>
+#include <experimental/string_view>
 #include "core/sstring.hh"
 
 namespace httpd {
 
 
+/**
+ * The parameters matched in a url.  A value is a copy, or when set with
+ * set_view(), a view into the url it was matched in, which must outlive
+ * the parameters object.  Copies own all their values, so they can outlive
+ * the url.
+ */
 class parameters {
-    std::unordered_map<sstring, sstring> params;
+    struct param {
+        sstring name;
+        std::experimental::string_view view;
+        sstring value;
+        bool owned;
+        std::experimental::string_view get() const {
+            return owned ? std::experimental::string_view(value) : view;
+        }
+        param(sstring name, std::experimental::string_view view, sstring value, bool owned)
+            : name(std::move(name)), view(view), value(std::move(value)), owned(owned) {
+        }
+        param(const param& x)
+            : name(x.name), value(x.get().data(), x.get().size()), owned(true) {
+        }
+        param(param&&) noexcept = default;
+        param& operator=(const param& x) {
+            auto v = x.get();
+            value = sstring(v.data(), v.size());
+            name = x.name;
+            view = {};
+            owned = true;
+            return *this;
+        }
+        param& operator=(param&&) noexcept = default;
+    };
+    // a handful at most, so searched linearly
+    std::vector<param> params;
+private:
+    param* find(std::experimental::string_view key) {
+        for (auto&& p : params) {
+            if (std::experimental::string_view(p.name) == key) {
+                return &p;
+            }
+        }
+        return nullptr;
+    }
+    const param* find(std::experimental::string_view key) const {
+        return const_cast<parameters*>(this)->find(key);
+    }
+    param& get_or_add(std::experimental::string_view key) {
+        auto p = find(key);
+        if (!p) {
+            params.push_back(param{sstring(key.data(), key.size()), {}, {}, false});
+            p = &params.back();
+        }
+        return *p;
+    }
 public:
-    const sstring& path(const sstring& key) const {
-        return params.at(key);
+    /**
+     * @return the value of a parameter, with its leading slash
+     * @throws std::out_of_range if it is missing
+     */
+    std::experimental::string_view get_path(std::experimental::string_view key) const {
+        auto p = find(key);
+        if (!p) {
+            throw std::out_of_range("no such parameter");
+        }
+        return p->get();
+    }
+
+    sstring path(const sstring& key) const {
+        auto v = get_path(key);
+        return sstring(v.data(), v.size());
     }
 
     sstring operator[](const sstring& key) const {
-        return params.at(key).substr(1);
+        auto v = get_path(key);
+        if (v.empty()) {
+            throw std::out_of_range("sstring::substr out of range");
+        }
+        return sstring(v.data() + 1, v.size() - 1);
     }
 
-    const sstring& at(const sstring& key) const {
+    sstring at(const sstring& key) const {
         return path(key);
     }
 
     bool exists(const sstring& key) const {
-        return params.find(key) != params.end();
+        return find(key) != nullptr;
     }
 
     void set(const sstring& key, const sstring& value) {
-        params[key] = value;
+        auto& p = get_or_add(key);
+        p.value = value;
+        p.owned = true;
+    }
+
+    void set_view(std::experimental::string_view key, std::experimental::string_view value) {
+        auto& p = get_or_add(key);
+        p.view = value;
+        p.owned = false;
     }
 
     void clear() {
@@ -68,6 +148,11 @@ enum operation_type {
  */
 operation_type str2type(const sstring& type);
 
+/**
+ * @return the method name of an operation type, such as "GET"
+ */
+const char* type2str(operation_type type);
+
 }
 
 #endif /* COMMON_HH_ */
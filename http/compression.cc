@@ -0,0 +1,357 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "http/compression.hh"
+#include "http/header_map.hh"
+#include "core/future-util.hh"
+#include "core/print.hh"
+#include <zlib.h>
+#include <zstd.h>
+#include <algorithm>
+#include <cstdlib>
+
+namespace httpd {
+
+using std::experimental::string_view;
+
+const char* to_string(content_encoding e) {
+    switch (e) {
+    case content_encoding::identity:
+        return "identity";
+    case content_encoding::gzip:
+        return "gzip";
+    case content_encoding::deflate:
+        return "deflate";
+    case content_encoding::zstd:
+        return "zstd";
+    }
+    return "identity";
+}
+
+static string_view trim(string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+content_encoding negotiate_encoding(string_view accept_encoding, const std::vector<content_encoding>& supported) {
+    // q-values of the supported encodings, -1 when not mentioned
+    std::vector<double> q(supported.size(), -1);
+    double any = -1;
+    while (!accept_encoding.empty()) {
+        auto comma = accept_encoding.find(',');
+        auto item = accept_encoding.substr(0, comma);
+        accept_encoding = comma == string_view::npos ? string_view() : accept_encoding.substr(comma + 1);
+        auto semicolon = item.find(';');
+        auto name = trim(item.substr(0, semicolon));
+        double value = 1;
+        if (semicolon != string_view::npos) {
+            auto param = trim(item.substr(semicolon + 1));
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                value = std::strtod(sstring(param.data() + 2, param.size() - 2).c_str(), nullptr);
+            }
+        }
+        if (name == "*") {
+            any = value;
+            continue;
+        }
+        for (size_t i = 0; i < supported.size(); i++) {
+            if (header_map::name_equals(name, to_string(supported[i]))) {
+                q[i] = value;
+            }
+        }
+    }
+    auto best = content_encoding::identity;
+    double best_q = 0;
+    for (size_t i = 0; i < supported.size(); i++) {
+        auto value = q[i] < 0 ? any : q[i];
+        if (value > best_q) {
+            best = supported[i];
+            best_q = value;
+        }
+    }
+    return best;
+}
+
+// Compresses a stream of data into buffers of output.
+class stream_compressor {
+protected:
+    static constexpr size_t buffer_size = 32 * 1024;
+    temporary_buffer<char> _buf;
+    size_t _used = 0;
+    std::vector<temporary_buffer<char>> _out;
+protected:
+    // room for output, taking a new buffer when the current one is full
+    std::pair<char*, size_t> room() {
+        if (_used == _buf.size()) {
+            push();
+            _buf = temporary_buffer<char>(buffer_size);
+        }
+        return {_buf.get_write() + _used, _buf.size() - _used};
+    }
+    void push() {
+        if (_used) {
+            _buf.trim(_used);
+            _out.push_back(std::move(_buf));
+            _used = 0;
+        }
+    }
+public:
+    enum class mode { none, flush, finish };
+    virtual ~stream_compressor() {}
+    /**
+     * Compresses data; with flush, so that all of it can be decompressed
+     * from the output, and with finish ending the compressed stream.
+     * @return the buffers of output completed
+     */
+    std::vector<temporary_buffer<char>> compress(const char* data, size_t size, mode m) {
+        do_compress(data, size, m);
+        if (m != mode::none) {
+            push();
+        }
+        return std::move(_out);
+    }
+    virtual void do_compress(const char* data, size_t size, mode m) = 0;
+};
+
+class zlib_compressor : public stream_compressor {
+    z_stream _zs;
+public:
+    zlib_compressor(bool gzip, int level) {
+        _zs.zalloc = Z_NULL;
+        _zs.zfree = Z_NULL;
+        _zs.opaque = Z_NULL;
+        // 16 more window bits make a gzip header and trailer
+        if (deflateInit2(&_zs, level ? level : Z_DEFAULT_COMPRESSION, Z_DEFLATED, gzip ? 15 + 16 : 15, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::bad_alloc();
+        }
+    }
+    ~zlib_compressor() {
+        deflateEnd(&_zs);
+    }
+    virtual void do_compress(const char* data, size_t size, mode m) override {
+        _zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        _zs.avail_in = size;
+        int flush = m == mode::finish ? Z_FINISH : m == mode::flush ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+        while (true) {
+            auto r = room();
+            _zs.next_out = reinterpret_cast<Bytef*>(r.first);
+            _zs.avail_out = r.second;
+            auto ret = deflate(&_zs, flush);
+            _used += r.second - _zs.avail_out;
+            if (ret == Z_STREAM_END || (_zs.avail_out && !_zs.avail_in && m != mode::finish)) {
+                return;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                throw std::runtime_error(sprint("deflate failed: %d", ret));
+            }
+        }
+    }
+};
+
+class zstd_compressor : public stream_compressor {
+    ZSTD_CStream* _zcs;
+public:
+    explicit zstd_compressor(int level) : _zcs(ZSTD_createCStream()) {
+        if (!_zcs) {
+            throw std::bad_alloc();
+        }
+        auto ret = ZSTD_initCStream(_zcs, level ? level : 3);
+        if (ZSTD_isError(ret)) {
+            ZSTD_freeCStream(_zcs);
+            throw std::runtime_error(sprint("zstd initialization failed: %s", ZSTD_getErrorName(ret)));
+        }
+    }
+    ~zstd_compressor() {
+        ZSTD_freeCStream(_zcs);
+    }
+    virtual void do_compress(const char* data, size_t size, mode m) override {
+        ZSTD_inBuffer in = { data, size, 0 };
+        auto check = [] (size_t ret) {
+            if (ZSTD_isError(ret)) {
+                throw std::runtime_error(sprint("zstd compression failed: %s", ZSTD_getErrorName(ret)));
+            }
+            return ret;
+        };
+        while (in.pos < in.size) {
+            auto r = room();
+            ZSTD_outBuffer out = { r.first, r.second, 0 };
+            check(ZSTD_compressStream(_zcs, &out, &in));
+            _used += out.pos;
+        }
+        if (m == mode::none) {
+            return;
+        }
+        size_t left;
+        do {
+            auto r = room();
+            ZSTD_outBuffer out = { r.first, r.second, 0 };
+            left = check(m == mode::finish ? ZSTD_endStream(_zcs, &out) : ZSTD_flushStream(_zcs, &out));
+            _used += out.pos;
+        } while (left);
+    }
+};
+
+class compressing_sink_impl : public data_sink_impl {
+    output_stream<char> _out;
+    std::unique_ptr<stream_compressor> _compressor;
+private:
+    future<> compress(net::packet data, stream_compressor::mode m) {
+        std::vector<temporary_buffer<char>> compressed;
+        for (auto&& f : data.fragments()) {
+            auto out = _compressor->compress(f.base, f.size, stream_compressor::mode::none);
+            std::move(out.begin(), out.end(), std::back_inserter(compressed));
+        }
+        if (m != stream_compressor::mode::none) {
+            auto out = _compressor->compress(nullptr, 0, m);
+            std::move(out.begin(), out.end(), std::back_inserter(compressed));
+        }
+        return do_with(std::move(compressed), [this] (std::vector<temporary_buffer<char>>& compressed) {
+            return do_for_each(compressed, [this] (temporary_buffer<char>& buf) {
+                return _out.write(std::move(buf));
+            });
+        });
+    }
+public:
+    compressing_sink_impl(output_stream<char>&& out, std::unique_ptr<stream_compressor> compressor)
+        : _out(std::move(out)), _compressor(std::move(compressor)) {
+    }
+    virtual future<> put(net::packet data) override {
+        return compress(std::move(data), stream_compressor::mode::none);
+    }
+    virtual future<> flush() override {
+        return compress(net::packet(), stream_compressor::mode::flush).then([this] {
+            return _out.flush();
+        });
+    }
+    virtual future<> close() override {
+        return compress(net::packet(), stream_compressor::mode::finish).then([this] {
+            return _out.close();
+        });
+    }
+};
+
+output_stream<char> make_compressing_stream(output_stream<char>&& out, content_encoding e, int level) {
+    std::unique_ptr<stream_compressor> compressor;
+    switch (e) {
+    case content_encoding::gzip:
+    case content_encoding::deflate:
+        compressor = std::make_unique<zlib_compressor>(e == content_encoding::gzip, level);
+        break;
+    case content_encoding::zstd:
+        compressor = std::make_unique<zstd_compressor>(level);
+        break;
+    case content_encoding::identity:
+        return std::move(out);
+    }
+    return output_stream<char>(data_sink(std::make_unique<compressing_sink_impl>(std::move(out), std::move(compressor))),
+            32 * 1024);
+}
+
+// whether a comma separated header value has name in it
+static bool mentions(string_view value, string_view name) {
+    while (!value.empty()) {
+        auto comma = value.find(',');
+        if (header_map::name_equals(trim(value.substr(0, comma)), name)) {
+            return true;
+        }
+        value = comma == string_view::npos ? string_view() : value.substr(comma + 1);
+    }
+    return false;
+}
+
+static bool compressible_type(const reply& rep, const compression_options& options) {
+    auto type = rep._headers.find("Content-Type");
+    if (type == rep._headers.end()) {
+        return false;
+    }
+    return std::any_of(options.content_types.begin(), options.content_types.end(), [&type] (const sstring& t) {
+        return type->second.size() >= t.size() && header_map::name_equals(string_view(type->second).substr(0, t.size()), t);
+    });
+}
+
+bool compress_reply(reply& rep, string_view accept_encoding, const compression_options& options) {
+    using mode = reply::compression_mode;
+    if (options.encodings.empty() || rep._compression == mode::never
+            || rep._status == reply::status_type::no_content || rep._status == reply::status_type::not_modified
+            || rep._status == reply::status_type::partial_content
+            || rep._headers.count("Content-Encoding")) {
+        return false;
+    }
+    auto size = rep._file ? rep._file->length : rep._content.size();
+    if (!rep._body_writer && !size) {
+        return false;
+    }
+    if (rep._compression == mode::automatic
+            && (!compressible_type(rep, options) || (!rep._body_writer && size < options.min_size))) {
+        return false;
+    }
+    // the body depends on Accept-Encoding, whatever the client sent
+    auto& vary = rep._headers["Vary"];
+    if (vary.empty()) {
+        vary = "Accept-Encoding";
+    } else if (!mentions(vary, "Accept-Encoding")) {
+        vary += ", Accept-Encoding";
+    }
+    auto encoding = negotiate_encoding(accept_encoding, options.encodings);
+    if (encoding == content_encoding::identity) {
+        return false;
+    }
+    rep._headers["Content-Encoding"] = to_string(encoding);
+    auto etag = rep._headers.find("ETag");
+    if (etag != rep._headers.end() && etag->second.size() >= 2 && etag->second.back() == '"') {
+        // the compressed body is another representation, with a tag of its own
+        auto& tag = etag->second;
+        tag = tag.substr(0, tag.size() - 1) + "-" + to_string(encoding) + "\"";
+    }
+    rep.read_file_body();
+    auto level = options.level;
+    if (rep._body_writer) {
+        rep._body_writer = [writer = std::move(rep._body_writer), encoding, level] (output_stream<char>&& out) {
+            return writer(make_compressing_stream(std::move(out), encoding, level));
+        };
+    } else {
+        rep._body_writer = [content = std::move(rep._content), encoding, level] (output_stream<char>&& out) {
+            return do_with(make_compressing_stream(std::move(out), encoding, level), size_t(0),
+                    [&content] (output_stream<char>& out, size_t& pos) {
+                // a piece at a time, so that compressing a large body
+                // does not stall other work
+                return do_until([&content, &pos] { return pos == content.size(); }, [&content, &out, &pos] {
+                    auto size = std::min(content.size() - pos, size_t(128 * 1024));
+                    auto piece = content.begin() + pos;
+                    pos += size;
+                    return out.write(piece, size);
+                }).then([&out] {
+                    return out.close();
+                });
+            });
+        };
+        rep._content = "";
+    }
+    return true;
+}
+
+}
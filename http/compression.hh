@@ -0,0 +1,94 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/iostream.hh"
+#include "core/sstring.hh"
+#include "http/reply.hh"
+#include <experimental/string_view>
+#include <vector>
+
+namespace httpd {
+
+enum class content_encoding {
+    identity,
+    gzip,
+    deflate,
+    zstd,
+};
+
+/**
+ * @return the name of an encoding in Accept-Encoding and Content-Encoding
+ */
+const char* to_string(content_encoding e);
+
+/**
+ * Picks the encoding to send a body with: of those in supported that the
+ * Accept-Encoding header value accept_encoding allows, the one with the
+ * highest q-value, and of those the first.
+ * @return the encoding, or identity if the client accepts none of them
+ */
+content_encoding negotiate_encoding(std::experimental::string_view accept_encoding,
+        const std::vector<content_encoding>& supported);
+
+/**
+ * Returns a stream that compresses what is written to it into out.
+ * Flushing it flushes what was compressed so far, and closing it ends
+ * the compressed data and closes out.
+ * @param level the compression level; for gzip and deflate from 1 to 9,
+ * for zstd from 1 to 22, with 0 the library's default
+ */
+output_stream<char> make_compressing_stream(output_stream<char>&& out, content_encoding e, int level = 0);
+
+/**
+ * When and how an \ref http_server compresses replies.
+ */
+struct compression_options {
+    /**
+     * The encodings replies may be compressed with, in order of
+     * preference.  Empty disables compression.
+     */
+    std::vector<content_encoding> encodings;
+    /**
+     * Replies with a body in reply::_content shorter than this are sent
+     * as they are; compressing them saves little.
+     */
+    size_t min_size = 1024;
+    /**
+     * Content types (or prefixes of them, such as "text/") that compress
+     * well.  Replies of other types are sent as they are, unless their
+     * route asks for compression.
+     */
+    std::vector<sstring> content_types = {"text/", "application/json", "application/javascript",
+            "application/xml", "image/svg+xml"};
+    int level = 0;
+};
+
+/**
+ * Compresses a reply's body, if the options and the reply's
+ * reply::compression allow and the client accepts one of the encodings:
+ * the body is then sent by a body writer, compressed as it is written.
+ * @return true if the reply was compressed
+ */
+bool compress_reply(reply& rep, std::experimental::string_view accept_encoding, const compression_options& options);
+
+}
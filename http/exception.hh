@@ -103,6 +103,27 @@ class missing_param_exception : public bad_request_exception {
     }
 };
 
+/**
+ * Throwing this exception will result in a 413 payload too large result
+ */
+class payload_too_large_exception : public base_exception {
+public:
+    payload_too_large_exception(const std::string& msg = "Payload too large")
+            : base_exception(msg, reply::status_type::payload_too_large) {
+    }
+};
+
+/**
+ * Throwing this exception will result in a 431 request header fields too
+ * large result
+ */
+class request_header_fields_too_large_exception : public base_exception {
+public:
+    request_header_fields_too_large_exception(const std::string& msg = "Too many headers")
+            : base_exception(msg, reply::status_type::request_header_fields_too_large) {
+    }
+};
+
 class server_error_exception : public base_exception {
 public:
     server_error_exception(const std::string& msg)
@@ -27,6 +27,9 @@
 #include "core/shared_ptr.hh"
 #include "core/app-template.hh"
 #include "exception.hh"
+#include "compression.hh"
+#include "core/print.hh"
+#include <cctype>
 
 namespace httpd {
 
@@ -93,11 +96,188 @@ struct reader {
     }
 };
 
+static const char* precompressed_suffix(content_encoding e) {
+    return e == content_encoding::zstd ? ".zst" : ".gz";
+}
+
+using precompressed_file = std::experimental::optional<std::pair<file_desc, content_encoding>>;
+
+// Opens the first precompressed copy of file_name there is, of encodings.
+static future<precompressed_file> open_precompressed(sstring file_name, std::vector<content_encoding> encodings) {
+    if (encodings.empty()) {
+        return make_ready_future<precompressed_file>();
+    }
+    auto e = encodings.front();
+    return engine().open_file_desc(file_name + precompressed_suffix(e), open_flags::ro).then_wrapped(
+            [file_name = std::move(file_name), encodings = std::move(encodings), e] (future<file_desc> f) mutable {
+        try {
+            return make_ready_future<precompressed_file>(std::make_pair(std::get<0>(f.get()), e));
+        } catch (...) {
+            encodings.erase(encodings.begin());
+            return open_precompressed(std::move(file_name), std::move(encodings));
+        }
+    });
+}
+
+using std::experimental::string_view;
+
+static string_view trim(string_view s) {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t')) {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+// Whether an If-None-Match header value lists etag, comparing weakly, or the
+// tag the server compressing the reply makes of it.
+static bool etag_listed(string_view tags, string_view etag) {
+    while (!tags.empty()) {
+        auto comma = tags.find(',');
+        auto tag = trim(tags.substr(0, comma));
+        tags = comma == string_view::npos ? string_view() : tags.substr(comma + 1);
+        if (tag == "*") {
+            return true;
+        }
+        if (tag.substr(0, 2) == "W/") {
+            tag.remove_prefix(2);
+        }
+        if (tag == etag) {
+            return true;
+        }
+        auto dash = tag.rfind('-');
+        if (dash != string_view::npos && tag.substr(0, dash) == etag.substr(0, etag.size() - 1)) {
+            auto encoding = tag.substr(dash + 1, tag.size() - dash - 2);
+            for (auto e : {content_encoding::gzip, content_encoding::deflate, content_encoding::zstd}) {
+                if (encoding == to_string(e)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Parses a Range header value of a single range of bytes into the offset
+// and length it asks for of a file of size bytes.  Returns false for
+// a range to ignore, sending the whole file, and sets satisfiable to
+// false for a range that has nothing of the file.
+static bool parse_range(string_view range, uint64_t size, uint64_t& offset, uint64_t& length, bool& satisfiable) {
+    static const string_view unit = "bytes=";
+    if (range.substr(0, unit.size()) != unit || range.find(',') != string_view::npos) {
+        // multiple ranges are not worth a multipart reply
+        return false;
+    }
+    range = trim(range.substr(unit.size()));
+    auto dash = range.find('-');
+    if (dash == string_view::npos) {
+        return false;
+    }
+    auto first = trim(range.substr(0, dash));
+    auto last = trim(range.substr(dash + 1));
+    auto number = [] (string_view s, uint64_t& n) {
+        if (s.empty() || s.size() > 18 || !std::all_of(s.begin(), s.end(), ::isdigit)) {
+            return false;
+        }
+        n = 0;
+        for (auto c : s) {
+            n = n * 10 + (c - '0');
+        }
+        return true;
+    };
+    uint64_t a, b;
+    if (first.empty()) {
+        // the last b bytes
+        if (!number(last, b)) {
+            return false;
+        }
+        satisfiable = b > 0 && size > 0;
+        offset = size - std::min(b, size);
+        length = size - offset;
+        return true;
+    }
+    if (!number(first, a) || (!last.empty() && (!number(last, b) || b < a))) {
+        return false;
+    }
+    satisfiable = a < size;
+    offset = a;
+    length = satisfiable ? (last.empty() ? size : std::min(b + 1, size)) - a : 0;
+    return true;
+}
+
+// Replies with the file, or with the part of it the request asks for,
+// unless the client has it already.
+static std::unique_ptr<reply> send_file(file_desc fd, const sstring& path, const request& req, const struct stat& st, std::unique_ptr<reply> rep) {
+    uint64_t size = st.st_size;
+    auto etag = sprint("\"%x-%x\"", size, uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec);
+    rep->_headers["ETag"] = etag;
+    auto if_none_match = req._headers.find("If-None-Match");
+    if (if_none_match != req._headers.end() && etag_listed(if_none_match->second, etag)) {
+        rep->set_status(reply::status_type::not_modified);
+        return rep;
+    }
+    rep->_headers["Accept-Ranges"] = "bytes";
+    uint64_t offset = 0;
+    uint64_t length = size;
+    bool satisfiable = true;
+    auto range = req._headers.find("Range");
+    auto if_range = req._headers.find("If-Range");
+    if (range != req._headers.end() && (if_range == req._headers.end() || if_range->second == etag)
+            && parse_range(range->second, size, offset, length, satisfiable)) {
+        if (!satisfiable) {
+            rep->set_status(reply::status_type::range_not_satisfiable);
+            rep->_headers["Content-Range"] = sprint("bytes */%d", size);
+            return rep;
+        }
+        rep->set_status(reply::status_type::partial_content);
+        rep->_headers["Content-Range"] = sprint("bytes %d-%d/%d", offset, offset + length - 1, size);
+    }
+    rep->send_file(make_lw_shared<file_desc>(std::move(fd)), path, offset, length);
+    return rep;
+}
+
+// The same, after the file's size and modification time are read in the
+// syscall thread, as fstat(2) may block on the disk.
+static future<std::unique_ptr<reply>> send_file(file_desc fd, sstring path, std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    auto raw = fd.get();
+    return engine().fstat(raw).then([fd = std::move(fd), path = std::move(path), req = std::move(req), rep = std::move(rep)] (struct stat st) mutable {
+        return send_file(std::move(fd), path, *req, st, std::move(rep));
+    });
+}
+
 future<std::unique_ptr<reply>> file_interaction_handler::read(
         const sstring& file_name, std::unique_ptr<request> req,
         std::unique_ptr<reply> rep) {
     sstring extension = get_extension(file_name);
     rep->set_content_type(extension);
+    if (transformer == nullptr) {
+        // nothing to do with the content, the connection sends it from the
+        // file, where it can without reading it
+        std::vector<content_encoding> accepted;
+        if (precompressed) {
+            auto accept_encoding = req->get_header("Accept-Encoding");
+            for (auto e : {content_encoding::zstd, content_encoding::gzip}) {
+                if (negotiate_encoding(accept_encoding, {e}) == e) {
+                    accepted.push_back(e);
+                }
+            }
+            rep->_headers["Vary"] = "Accept-Encoding";
+        }
+        return open_precompressed(file_name, std::move(accepted)).then(
+                [file_name, req = std::move(req), rep = std::move(rep)] (precompressed_file f) mutable {
+            if (!f) {
+                return engine().open_file_desc(file_name, open_flags::ro).then(
+                        [file_name, req = std::move(req), rep = std::move(rep)] (file_desc fd) mutable {
+                    return send_file(std::move(fd), file_name, std::move(req), std::move(rep));
+                });
+            }
+            rep->_headers["Content-Encoding"] = to_string(f->second);
+            rep->set_compression(reply::compression_mode::never);
+            return send_file(std::move(f->first), file_name + precompressed_suffix(f->second), std::move(req), std::move(rep));
+        });
+    }
     return open_file_dma(file_name, open_flags::ro).then(
             [rep = std::move(rep), extension, this, req = std::move(req)](file f) mutable {
                 std::shared_ptr<reader> r = std::make_shared<reader>(std::move(f), std::move(rep));
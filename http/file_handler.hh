@@ -74,6 +74,18 @@ class file_interaction_handler : public handler_base {
         return this;
     }
 
+    /**
+     * Serve, to clients that accept it, a copy of a file compressed ahead
+     * of time and kept next to it: file.zst with zstd, or file.gz with
+     * gzip.  Files without such a copy are served as they are.  Not used
+     * with a transformer.
+     * @return this
+     */
+    file_interaction_handler* set_precompressed(bool p) {
+        precompressed = p;
+        return this;
+    }
+
     /**
      * if the url ends without a slash redirect
      * @param req the request
@@ -100,6 +112,7 @@ class file_interaction_handler : public handler_base {
     future<std::unique_ptr<reply> > read(const sstring& file,
             std::unique_ptr<request> req, std::unique_ptr<reply> rep);
     file_transformer* transformer;
+    bool precompressed = false;
 };
 
 /**
@@ -89,7 +89,7 @@ class function_handler : public handler_base {
             : _f_handle(
                     [_handle](std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
                         json::json_return_type res = _handle(*req.get());
-                        rep->_content += res._res;
+                        set_json_body(*rep, std::move(res));
                         return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
                     }), _type("json") {
     }
@@ -98,7 +98,7 @@ class function_handler : public handler_base {
             : _f_handle(
                     [_handle](std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
                         return _handle(std::move(req)).then([rep = std::move(rep)](json::json_return_type res) mutable {
-                                    rep->_content += res._res;
+                                    set_json_body(*rep, std::move(res));
                                     return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
                                 }
                         );
@@ -115,6 +115,15 @@ class function_handler : public handler_base {
     }
 
 protected:
+    // a streamed result is written as the reply is sent
+    static void set_json_body(reply& rep, json::json_return_type&& res) {
+        if (res._body_writer) {
+            rep.write_body("json", std::move(res._body_writer));
+        } else {
+            rep._content += res._res;
+        }
+    }
+
     future_handler_function _f_handle;
     sstring _type;
 };
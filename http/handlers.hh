@@ -26,13 +26,33 @@
 #include "common.hh"
 #include "reply.hh"
 #include "core/future-util.hh"
+#include "core/metrics_registration.hh"
+#include "core/metrics_types.hh"
 
+#include <array>
+#include <memory>
 #include <unordered_map>
 
 namespace httpd {
 
 typedef const httpd::request& const_req;
 
+/**
+ * What a server counts of the requests one handler handled, from routing
+ * a request until the handler returned its reply, or wrote the body of a
+ * streamed one; see routes::enable_metrics().
+ */
+struct handler_stats {
+    seastar::metrics::latency_histogram latency;
+    uint64_t requests_in_flight = 0;
+    uint64_t request_bytes = 0;
+    // the bodies the handler made, before they are compressed
+    uint64_t response_bytes = 0;
+    // replies by status class, 1xx to 5xx
+    std::array<uint64_t, 5> replies{};
+    seastar::metrics::metric_groups metrics;
+};
+
 /**
  * handlers holds the logic for serving an incoming request.
  * All handlers inherit from the base httpserver_handler and
@@ -64,7 +84,20 @@ class handler_base {
         return *this;
     }
 
+    /**
+     * Set whether the replies of this handler are compressed, see
+     * reply::compression_mode.  The handler can still change it per reply.
+     * @return a reference to the handler
+     */
+    handler_base& set_compression(reply::compression_mode mode) {
+        _compression = mode;
+        return *this;
+    }
+
     std::vector<sstring> _mandatory_param;
+    reply::compression_mode _compression = reply::compression_mode::automatic;
+    // made by the routes on the first request, when they count requests
+    std::unique_ptr<handler_stats> _stats;
 
 };
 
@@ -0,0 +1,134 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include <experimental/string_view>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace httpd {
+
+/**
+ * The headers of a request or a reply.
+ *
+ * Headers are kept in a vector, in the order they were added, and looked
+ * up by name ignoring case, as HTTP header names are.  Messages carry a
+ * dozen headers or so, which a vector holds in a single allocation and
+ * searches faster than a hash table can hash the name.  The interface is
+ * the subset of std::unordered_map the headers were used with.
+ */
+class header_map {
+public:
+    using value_type = std::pair<sstring, sstring>;
+    using iterator = std::vector<value_type>::iterator;
+    using const_iterator = std::vector<value_type>::const_iterator;
+private:
+    // enough for most messages, so that they allocate once
+    static constexpr size_t initial_capacity = 8;
+    std::vector<value_type> _headers;
+public:
+    static bool name_equals(std::experimental::string_view a, std::experimental::string_view b) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            // names are tokens, so folding the 0x20 bit is enough where
+            // either side is a letter
+            auto x = a[i];
+            auto y = b[i];
+            if (x != y && ((x | 0x20) != (y | 0x20) || (x | 0x20) < 'a' || (x | 0x20) > 'z')) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    iterator begin() {
+        return _headers.begin();
+    }
+    iterator end() {
+        return _headers.end();
+    }
+    const_iterator begin() const {
+        return _headers.begin();
+    }
+    const_iterator end() const {
+        return _headers.end();
+    }
+    size_t size() const {
+        return _headers.size();
+    }
+    bool empty() const {
+        return _headers.empty();
+    }
+    void clear() {
+        _headers.clear();
+    }
+
+    iterator find(std::experimental::string_view name) {
+        return std::find_if(_headers.begin(), _headers.end(), [name] (const value_type& h) {
+            return name_equals(h.first, name);
+        });
+    }
+    const_iterator find(std::experimental::string_view name) const {
+        return const_cast<header_map*>(this)->find(name);
+    }
+    size_t count(std::experimental::string_view name) const {
+        return find(name) != end();
+    }
+
+    /**
+     * @return the value of a header, added empty if it is missing
+     */
+    sstring& operator[](std::experimental::string_view name) {
+        auto it = find(name);
+        if (it != end()) {
+            return it->second;
+        }
+        return emplace(sstring(name.data(), name.size()), sstring()).second;
+    }
+
+    /**
+     * Adds a header, without looking for one of the same name; for names
+     * known not to be there already.
+     */
+    value_type& emplace(sstring name, sstring value) {
+        if (_headers.capacity() == 0) {
+            _headers.reserve(initial_capacity);
+        }
+        _headers.emplace_back(std::move(name), std::move(value));
+        return _headers.back();
+    }
+
+    size_t erase(std::experimental::string_view name) {
+        auto it = find(name);
+        if (it == end()) {
+            return 0;
+        }
+        _headers.erase(it);
+        return 1;
+    }
+};
+
+}
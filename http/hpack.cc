@@ -0,0 +1,505 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "http/hpack.hh"
+#include <array>
+#include <unordered_map>
+
+namespace httpd {
+
+namespace hpack {
+
+using std::experimental::string_view;
+
+struct static_entry {
+    string_view name;
+    string_view value;
+};
+
+// RFC 7541, appendix A
+static const static_entry static_table[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+static constexpr size_t static_table_size = sizeof(static_table) / sizeof(static_table[0]);
+
+struct huffman_code {
+    uint32_t code;
+    uint8_t length;
+};
+
+// RFC 7541, appendix B: the codes of the bytes, and of EOS last
+static const huffman_code huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+static constexpr unsigned eos = 256;
+
+// The Huffman code as a binary tree, for decoding bit by bit.  Each
+// internal node has the indexes of its two children; a leaf is stored in
+// its parent as ~symbol.
+class huffman_tree {
+    std::vector<std::array<int16_t, 2>> _nodes;
+public:
+    huffman_tree() {
+        _nodes.push_back({{0, 0}});
+        for (unsigned sym = 0; sym <= eos; sym++) {
+            auto& c = huffman_codes[sym];
+            unsigned n = 0;
+            for (unsigned bit = c.length - 1; bit > 0; bit--) {
+                auto b = (c.code >> bit) & 1;
+                if (!_nodes[n][b]) {
+                    _nodes[n][b] = _nodes.size();
+                    _nodes.push_back({{0, 0}});
+                }
+                n = _nodes[n][b];
+            }
+            _nodes[n][c.code & 1] = ~sym;
+        }
+    }
+    int16_t next(unsigned node, unsigned bit) const {
+        return _nodes[node][bit];
+    }
+};
+
+size_t huffman_encoded_size(string_view s) {
+    size_t bits = 0;
+    for (unsigned char c : s) {
+        bits += huffman_codes[c].length;
+    }
+    return (bits + 7) / 8;
+}
+
+void huffman_encode(std::vector<char>& out, string_view s) {
+    uint64_t bits = 0;
+    unsigned pending = 0;
+    for (unsigned char c : s) {
+        auto& h = huffman_codes[c];
+        bits = (bits << h.length) | h.code;
+        pending += h.length;
+        while (pending >= 8) {
+            pending -= 8;
+            out.push_back(char(bits >> pending));
+        }
+    }
+    if (pending) {
+        // padded with the most significant bits of EOS, all ones
+        out.push_back(char((bits << (8 - pending)) | (0xff >> pending)));
+    }
+}
+
+sstring huffman_decode(string_view s) {
+    static const huffman_tree tree;
+    std::vector<char> out;
+    out.reserve(s.size() * 8 / 5);
+    unsigned node = 0;
+    // the bits since the last symbol, which at the end must be padding:
+    // fewer than 8, all ones
+    unsigned depth = 0;
+    bool ones = true;
+    for (unsigned char c : s) {
+        for (int bit = 7; bit >= 0; bit--) {
+            auto b = (c >> bit) & 1;
+            auto next = tree.next(node, b);
+            if (next < 0) {
+                unsigned sym = ~next;
+                if (sym == eos) {
+                    throw decoding_error("EOS in a Huffman coded string");
+                }
+                out.push_back(char(sym));
+                node = 0;
+                depth = 0;
+                ones = true;
+            } else {
+                node = next;
+                depth++;
+                ones = ones && b;
+            }
+        }
+    }
+    if (depth > 7 || !ones) {
+        throw decoding_error("invalid Huffman padding");
+    }
+    return sstring(out.data(), out.size());
+}
+
+static void encode_integer(std::vector<char>& out, uint8_t first, unsigned prefix_bits, uint64_t value) {
+    uint64_t max = (1u << prefix_bits) - 1;
+    if (value < max) {
+        out.push_back(char(first | value));
+        return;
+    }
+    out.push_back(char(first | max));
+    value -= max;
+    while (value >= 128) {
+        out.push_back(char(value % 128 + 128));
+        value /= 128;
+    }
+    out.push_back(char(value));
+}
+
+static void encode_string(std::vector<char>& out, string_view s) {
+    auto huffman_size = huffman_encoded_size(s);
+    if (huffman_size < s.size()) {
+        encode_integer(out, 0x80, 7, huffman_size);
+        huffman_encode(out, s);
+    } else {
+        encode_integer(out, 0, 7, s.size());
+        out.insert(out.end(), s.begin(), s.end());
+    }
+}
+
+// Reads the representations of a header block.
+class block_reader {
+    const uint8_t* _p;
+    const uint8_t* _end;
+public:
+    explicit block_reader(string_view block)
+        : _p(reinterpret_cast<const uint8_t*>(block.data())), _end(_p + block.size()) {
+    }
+    bool empty() const {
+        return _p == _end;
+    }
+    uint8_t peek() const {
+        return *_p;
+    }
+    uint64_t integer(unsigned prefix_bits) {
+        if (_p == _end) {
+            throw decoding_error("truncated header block");
+        }
+        uint64_t max = (1u << prefix_bits) - 1;
+        uint64_t value = *_p++ & max;
+        if (value < max) {
+            return value;
+        }
+        unsigned shift = 0;
+        uint8_t b;
+        do {
+            if (_p == _end) {
+                throw decoding_error("truncated header block");
+            }
+            if (shift > 28) {
+                throw decoding_error("integer too large in header block");
+            }
+            b = *_p++;
+            value += uint64_t(b & 127) << shift;
+            shift += 7;
+        } while (b & 128);
+        return value;
+    }
+    sstring string() {
+        if (_p == _end) {
+            throw decoding_error("truncated header block");
+        }
+        bool huffman = *_p & 0x80;
+        auto length = integer(7);
+        if (length > size_t(_end - _p)) {
+            throw decoding_error("truncated header block");
+        }
+        string_view s(reinterpret_cast<const char*>(_p), length);
+        _p += length;
+        return huffman ? huffman_decode(s) : sstring(s.data(), s.size());
+    }
+};
+
+void dynamic_table::set_max_size(size_t max_size) {
+    _max_size = max_size;
+    while (_size > _max_size) {
+        _size -= entry_size(_entries.back());
+        _entries.pop_back();
+    }
+}
+
+void dynamic_table::add(header h) {
+    auto size = entry_size(h);
+    while (!_entries.empty() && _size + size > _max_size) {
+        _size -= entry_size(_entries.back());
+        _entries.pop_back();
+    }
+    if (size > _max_size) {
+        return;
+    }
+    _size += size;
+    _entries.push_front(std::move(h));
+}
+
+decoder::decoder(size_t max_table_size)
+    : _table(max_table_size), _max_table_size(max_table_size) {
+}
+
+std::vector<header> decoder::decode(string_view block, size_t max_list_size) {
+    auto get = [this] (uint64_t index) {
+        if (index == 0) {
+            throw decoding_error("header index 0");
+        }
+        if (index <= static_table_size) {
+            auto& e = static_table[index - 1];
+            return header(sstring(e.name.data(), e.name.size()), sstring(e.value.data(), e.value.size()));
+        }
+        index -= static_table_size + 1;
+        if (index >= _table.size()) {
+            throw decoding_error("header index out of the table");
+        }
+        return _table[index];
+    };
+    auto literal = [&get] (block_reader& r, unsigned prefix_bits) {
+        auto index = r.integer(prefix_bits);
+        auto name = index ? get(index).first : r.string();
+        return header(std::move(name), r.string());
+    };
+    block_reader r(block);
+    std::vector<header> headers;
+    size_t list_size = 0;
+    while (!r.empty()) {
+        auto b = r.peek();
+        if (b & 0x80) {
+            headers.push_back(get(r.integer(7)));
+        } else if ((b & 0xc0) == 0x40) {
+            headers.push_back(literal(r, 6));
+            _table.add(headers.back());
+        } else if ((b & 0xe0) == 0x20) {
+            if (!headers.empty()) {
+                throw decoding_error("table size update after a header");
+            }
+            auto size = r.integer(5);
+            if (size > _max_table_size) {
+                throw decoding_error("table size update beyond the limit");
+            }
+            _table.set_max_size(size);
+            continue;
+        } else {
+            // without indexing, or never indexed
+            headers.push_back(literal(r, 4));
+        }
+        list_size += dynamic_table::entry_size(headers.back());
+        if (list_size > max_list_size) {
+            throw decoding_error("header list too large");
+        }
+    }
+    return headers;
+}
+
+encoder::encoder(size_t max_table_size)
+    : _table(max_table_size), _limit(max_table_size), _min_size_update(max_table_size) {
+}
+
+void encoder::set_max_table_size(size_t size) {
+    size = std::min(size, _limit);
+    if (size == _table.max_size()) {
+        return;
+    }
+    _min_size_update = _size_updated ? std::min(_min_size_update, size) : size;
+    _size_updated = true;
+    _table.set_max_size(size);
+}
+
+void encoder::begin(std::vector<char>& out) {
+    if (_size_updated) {
+        if (_min_size_update < _table.max_size()) {
+            encode_integer(out, 0x20, 5, _min_size_update);
+        }
+        encode_integer(out, 0x20, 5, _table.max_size());
+        _size_updated = false;
+    }
+}
+
+// Headers whose values hardly repeat, and would only push useful ones out
+// of the table.
+static bool worth_indexing(string_view name) {
+    return name != "content-length" && name != "content-range" && name != "etag"
+            && name != "last-modified" && name != "location" && name != "set-cookie";
+}
+
+void encoder::encode(std::vector<char>& out, string_view name, string_view value) {
+    static const std::unordered_map<string_view, size_t> static_names = [] {
+        std::unordered_map<string_view, size_t> names;
+        for (size_t i = static_table_size; i > 0; i--) {
+            // the first of entries with the same name wins
+            names[static_table[i - 1].name] = i;
+        }
+        return names;
+    }();
+    size_t name_index = 0;
+    auto it = static_names.find(name);
+    if (it != static_names.end()) {
+        name_index = it->second;
+        for (auto i = name_index; i <= static_table_size && static_table[i - 1].name == name; i++) {
+            if (static_table[i - 1].value == value) {
+                encode_integer(out, 0x80, 7, i);
+                return;
+            }
+        }
+    }
+    for (size_t i = 0; i < _table.size(); i++) {
+        auto& h = _table[i];
+        if (string_view(h.first) == name) {
+            if (string_view(h.second) == value) {
+                encode_integer(out, 0x80, 7, static_table_size + 1 + i);
+                return;
+            }
+            if (!name_index) {
+                name_index = static_table_size + 1 + i;
+            }
+        }
+    }
+    bool index = worth_indexing(name)
+            && name.size() + value.size() + 32 <= _table.max_size();
+    if (index) {
+        encode_integer(out, 0x40, 6, name_index);
+    } else {
+        encode_integer(out, 0, 4, name_index);
+    }
+    if (!name_index) {
+        encode_string(out, name);
+    }
+    encode_string(out, value);
+    if (index) {
+        _table.add(header(sstring(name.data(), name.size()), sstring(value.data(), value.size())));
+    }
+}
+
+}
+
+}
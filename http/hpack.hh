@@ -0,0 +1,159 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include <experimental/string_view>
+#include <deque>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace httpd {
+
+/**
+ * HPACK, the header compression of HTTP/2 (RFC 7541).
+ *
+ * Each direction of a connection has a table of recently sent headers,
+ * which the encoder adds to and the decoder mirrors, so that header blocks
+ * must be decoded in the order they were encoded.
+ */
+namespace hpack {
+
+using header = std::pair<sstring, sstring>;
+
+/**
+ * Thrown for a header block that cannot be decoded; the connection it
+ * came on cannot be used any more, as its table is out of sync.
+ */
+class decoding_error : public std::runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
+
+/**
+ * The dynamic table: headers in the order they were added, newest first,
+ * evicted oldest first to keep their size (by the RFC's count) within
+ * the maximum.
+ */
+class dynamic_table {
+    std::deque<header> _entries;
+    size_t _size = 0;
+    size_t _max_size;
+public:
+    explicit dynamic_table(size_t max_size) : _max_size(max_size) {
+    }
+    static size_t entry_size(const header& h) {
+        return h.first.size() + h.second.size() + 32;
+    }
+    size_t max_size() const {
+        return _max_size;
+    }
+    void set_max_size(size_t max_size);
+    /**
+     * Adds a header, evicting what it takes; a header larger than the
+     * table just empties it.
+     */
+    void add(header h);
+    size_t size() const {
+        return _entries.size();
+    }
+    /**
+     * @return the index-th newest header, from 0
+     */
+    const header& operator[](size_t index) const {
+        return _entries[index];
+    }
+};
+
+/**
+ * Decodes header blocks.
+ */
+class decoder {
+    dynamic_table _table;
+    size_t _max_table_size;
+public:
+    /**
+     * @param max_table_size the table size the peer is allowed to use,
+     * which is what HTTP/2's SETTINGS_HEADER_TABLE_SIZE announces
+     */
+    explicit decoder(size_t max_table_size = 4096);
+    /**
+     * Decodes a whole header block.
+     * @param max_list_size the most the headers may take, by the RFC's
+     * count of the name and value sizes plus 32 each
+     * @throw decoding_error
+     */
+    std::vector<header> decode(std::experimental::string_view block, size_t max_list_size);
+};
+
+/**
+ * Encodes header blocks.
+ *
+ * Headers found whole in the static or dynamic table are sent as an
+ * index, others are added to the dynamic table unless their values are
+ * unlikely to repeat, and strings are Huffman coded when that makes them
+ * shorter.
+ */
+class encoder {
+    dynamic_table _table;
+    // the size the encoder was created with, which the peer can only lower
+    size_t _limit;
+    // the smallest size the table was limited to since the last block,
+    // which the next block has to announce
+    size_t _min_size_update;
+    bool _size_updated = false;
+public:
+    explicit encoder(size_t max_table_size = 4096);
+    /**
+     * Limits the table to what the peer allows (its
+     * SETTINGS_HEADER_TABLE_SIZE), and at most the size the encoder was
+     * created with.
+     */
+    void set_max_table_size(size_t size);
+    /**
+     * Starts a header block in out, announcing table size changes.
+     */
+    void begin(std::vector<char>& out);
+    /**
+     * Adds a header to the block in out; the name must be lower case.
+     */
+    void encode(std::vector<char>& out, std::experimental::string_view name, std::experimental::string_view value);
+};
+
+/**
+ * Huffman codes a string, appending it to out.
+ */
+void huffman_encode(std::vector<char>& out, std::experimental::string_view s);
+/**
+ * @return the size of s Huffman coded
+ */
+size_t huffman_encoded_size(std::experimental::string_view s);
+/**
+ * Decodes a Huffman coded string.
+ * @throw decoding_error
+ */
+sstring huffman_decode(std::experimental::string_view s);
+
+}
+
+}
@@ -0,0 +1,910 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "http/http2.hh"
+#include "http/httpd.hh"
+#include "http/exception.hh"
+#include "core/queue.hh"
+#include "core/future-util.hh"
+#include <algorithm>
+#include <cctype>
+#include <limits>
+
+namespace httpd {
+
+namespace http2 {
+
+const sstring client_preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+const sstring client_preface_tail = "SM\r\n\r\n";
+
+static constexpr size_t frame_header_size = 9;
+// the largest frame the server takes, the protocol's default
+static constexpr size_t max_frame_size = 16384;
+static constexpr int64_t max_window = 0x7fffffff;
+
+enum class setting : uint16_t {
+    header_table_size = 1,
+    enable_push = 2,
+    max_concurrent_streams = 3,
+    initial_window_size = 4,
+    max_frame_size = 5,
+    max_header_list_size = 6,
+};
+
+/**
+ * An error that ends the connection, after a GOAWAY frame with its code.
+ */
+class connection_error : public std::runtime_error {
+    error_code _code;
+public:
+    connection_error(error_code code, const char* what) : std::runtime_error(what), _code(code) {
+    }
+    error_code code() const {
+        return _code;
+    }
+};
+
+static uint32_t get_u32(const char* p) {
+    auto u = reinterpret_cast<const uint8_t*>(p);
+    return uint32_t(u[0]) << 24 | uint32_t(u[1]) << 16 | uint32_t(u[2]) << 8 | u[3];
+}
+
+static void put_u32(char* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+struct connection::frame_header {
+    uint32_t length;
+    frame_type type;
+    uint8_t flags;
+    uint32_t stream_id;
+};
+
+struct connection::stream {
+    uint32_t id;
+    // what the client lets the server send on the stream
+    int64_t send_window;
+    // what the client may still send, and what of it was consumed since
+    // the last WINDOW_UPDATE
+    int64_t recv_window = stream_window;
+    size_t recv_consumed = 0;
+    // received and not read yet
+    size_t buffered = 0;
+    bool remote_closed = false;
+    bool local_closed = false;
+    bool reset = false;
+    // the request body as it arrives; an empty buffer ends it
+    queue<temporary_buffer<char>> data { std::numeric_limits<size_t>::max() };
+    input_stream<char> body;
+
+    stream(uint32_t id, int64_t send_window) : id(id), send_window(send_window) {
+    }
+};
+
+// Reads a request body from the DATA frames of its stream, letting the
+// client send more as it is read.
+class connection::body_source : public data_source_impl {
+    connection& _c;
+    stream& _s;
+public:
+    body_source(connection& c, stream& s) : _c(c), _s(s) {
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        return _s.data.pop_eventually().then([this] (temporary_buffer<char> buf) {
+            if (buf.empty()) {
+                return make_ready_future<temporary_buffer<char>>();
+            }
+            _s.buffered -= buf.size();
+            return _c.consumed(&_s, buf.size()).then([buf = std::move(buf)] () mutable {
+                return std::move(buf);
+            });
+        });
+    }
+};
+
+// Sends a reply body in DATA frames; closing it ends the stream.
+class connection::body_sink : public data_sink_impl {
+    connection& _c;
+    lw_shared_ptr<stream> _s;
+public:
+    body_sink(connection& c, lw_shared_ptr<stream> s) : _c(c), _s(std::move(s)) {
+    }
+    virtual future<> put(net::packet data) override {
+        return do_with(data.release(), [this] (std::vector<temporary_buffer<char>>& bufs) {
+            return do_for_each(bufs, [this] (temporary_buffer<char>& buf) {
+                return _c.send_data(_s, std::move(buf), false);
+            });
+        });
+    }
+    virtual future<> close() override {
+        return _c.send_data(_s, {}, true);
+    }
+};
+
+static void strip_padding(uint8_t frame_flags, temporary_buffer<char>& payload) {
+    if (!(frame_flags & flags::padded)) {
+        return;
+    }
+    if (payload.empty() || uint8_t(payload[0]) >= payload.size()) {
+        throw connection_error(error_code::protocol_error, "invalid padding");
+    }
+    auto padding = uint8_t(payload[0]);
+    payload.trim_front(1);
+    payload.trim(payload.size() - padding);
+}
+
+static bool connection_specific(std::experimental::string_view name) {
+    return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+            || name == "transfer-encoding" || name == "upgrade";
+}
+
+// Builds a request from the headers of a stream.  A malformed request
+// throws bad_request_exception.
+static std::unique_ptr<request> make_request(std::vector<hpack::header> headers) {
+    auto req = std::make_unique<request>();
+    req->_version = "2.0";
+    sstring scheme;
+    sstring authority;
+    sstring cookie;
+    bool regular = false;
+    for (auto&& h : headers) {
+        auto& name = h.first;
+        if (name.empty() || std::any_of(name.begin(), name.end(), ::isupper)) {
+            throw bad_request_exception("Invalid header name");
+        }
+        if (name[0] == ':') {
+            if (regular) {
+                throw bad_request_exception("Pseudo-header after the headers");
+            }
+            if (name == ":method") {
+                req->_method = std::move(h.second);
+            } else if (name == ":path") {
+                req->_url = std::move(h.second);
+            } else if (name == ":scheme") {
+                scheme = std::move(h.second);
+            } else if (name == ":authority") {
+                authority = std::move(h.second);
+            } else {
+                throw bad_request_exception("Unknown pseudo-header");
+            }
+            continue;
+        }
+        regular = true;
+        if (connection_specific(name) || (name == "te" && h.second != "trailers")) {
+            throw bad_request_exception("Connection-specific header");
+        }
+        if (name == "cookie") {
+            // may be split in several, which HTTP/1 has in one
+            if (!cookie.empty()) {
+                cookie += "; ";
+            }
+            cookie += h.second;
+            continue;
+        }
+        req->_headers[name] = std::move(h.second);
+    }
+    if (req->_method.empty() || req->_url.empty() || scheme.empty()) {
+        throw bad_request_exception("Missing pseudo-header");
+    }
+    if (!cookie.empty()) {
+        req->_headers.emplace("cookie", std::move(cookie));
+    }
+    if (!authority.empty() && !req->_headers.count("host")) {
+        req->_headers.emplace("host", std::move(authority));
+    }
+    auto cl = req->_headers.find("content-length");
+    if (cl != req->_headers.end()) {
+        auto& v = cl->second;
+        if (v.empty() || v.size() > 18 || !std::all_of(v.begin(), v.end(), ::isdigit)) {
+            throw bad_request_exception("Invalid Content-Length");
+        }
+        req->content_length = std::stoull(v);
+    }
+    req->protocol_name = std::move(scheme);
+    return req;
+}
+
+connection::connection(http_server& server, input_stream<char>& in, output_stream<char>& out)
+    : _server(server), _in(in), _out(out) {
+}
+
+connection::~connection() {
+}
+
+future<> connection::process() {
+    temporary_buffer<char> settings(18);
+    auto put_setting = [p = settings.get_write()] (size_t i, setting id, uint32_t value) {
+        p[i * 6] = uint16_t(id) >> 8;
+        p[i * 6 + 1] = uint16_t(id);
+        put_u32(p + i * 6 + 2, value);
+    };
+    put_setting(0, setting::max_concurrent_streams, max_concurrent_streams);
+    put_setting(1, setting::initial_window_size, stream_window);
+    put_setting(2, setting::max_header_list_size, max_header_list_size);
+    return write_frame(frame_type::settings, 0, 0, std::move(settings)).then([this] {
+        return write_window_update(0, connection_window - 65535);
+    }).then([this] {
+        return read_frames();
+    }).then_wrapped([this] (future<> f) {
+        try {
+            f.get();
+        } catch (connection_error& e) {
+            ++_server._read_errors;
+            return write_goaway(e.code());
+        } catch (...) {
+            ++_server._read_errors;
+        }
+        return make_ready_future<>();
+    }).handle_exception([] (std::exception_ptr) {
+        // the connection broke
+    }).finally([this] {
+        close();
+        return _requests.close();
+    });
+}
+
+future<> connection::read_frames() {
+    return repeat([this] {
+        return _in.read_exactly(frame_header_size).then([this] (temporary_buffer<char> buf) {
+            if (buf.empty()) {
+                return make_ready_future<stop_iteration>(stop_iteration::yes);
+            }
+            if (buf.size() < frame_header_size) {
+                throw connection_error(error_code::protocol_error, "truncated frame");
+            }
+            auto p = reinterpret_cast<const uint8_t*>(buf.get());
+            frame_header h;
+            h.length = uint32_t(p[0]) << 16 | uint32_t(p[1]) << 8 | p[2];
+            h.type = frame_type(p[3]);
+            h.flags = p[4];
+            h.stream_id = get_u32(buf.get() + 5) & 0x7fffffff;
+            if (h.length > max_frame_size) {
+                throw connection_error(error_code::frame_size_error, "frame too large");
+            }
+            auto payload = h.length ? _in.read_exactly(h.length) : make_ready_future<temporary_buffer<char>>();
+            return payload.then([this, h] (temporary_buffer<char> payload) {
+                if (payload.size() < h.length) {
+                    throw connection_error(error_code::protocol_error, "truncated frame");
+                }
+                return handle_frame(h, std::move(payload));
+            }).then([] {
+                return stop_iteration::no;
+            });
+        });
+    });
+}
+
+future<> connection::handle_frame(const frame_header& h, temporary_buffer<char> payload) {
+    if (!_settings_received && h.type != frame_type::settings) {
+        throw connection_error(error_code::protocol_error, "expected SETTINGS after the preface");
+    }
+    if (_continued_stream && h.type != frame_type::continuation) {
+        throw connection_error(error_code::protocol_error, "expected CONTINUATION");
+    }
+    switch (h.type) {
+    case frame_type::data:
+        return handle_data(h, std::move(payload));
+    case frame_type::headers:
+        return handle_headers(h, std::move(payload));
+    case frame_type::priority:
+        // streams are served as they come, regardless of priorities
+        if (!h.stream_id) {
+            throw connection_error(error_code::protocol_error, "PRIORITY on stream 0");
+        }
+        return make_ready_future<>();
+    case frame_type::rst_stream:
+        return handle_rst_stream(h, std::move(payload));
+    case frame_type::settings:
+        return handle_settings(h, std::move(payload));
+    case frame_type::push_promise:
+        throw connection_error(error_code::protocol_error, "PUSH_PROMISE from a client");
+    case frame_type::ping:
+        return handle_ping(h, std::move(payload));
+    case frame_type::goaway:
+        // the client starts no more streams; those it did are served
+        return make_ready_future<>();
+    case frame_type::window_update:
+        return handle_window_update(h, std::move(payload));
+    case frame_type::continuation:
+        return handle_continuation(h, std::move(payload));
+    }
+    // frames of unknown types are ignored
+    return make_ready_future<>();
+}
+
+future<> connection::handle_data(const frame_header& h, temporary_buffer<char> payload) {
+    if (!h.stream_id) {
+        throw connection_error(error_code::protocol_error, "DATA on stream 0");
+    }
+    if (h.length > _recv_window) {
+        throw connection_error(error_code::flow_control_error, "DATA beyond the connection window");
+    }
+    _recv_window -= h.length;
+    strip_padding(h.flags, payload);
+    auto it = _streams.find(h.stream_id);
+    if (it == _streams.end()) {
+        if (h.stream_id > _last_stream_id) {
+            throw connection_error(error_code::protocol_error, "DATA on an idle stream");
+        }
+        // the stream was reset, or replied to; its data is dropped
+        return consumed(nullptr, h.length);
+    }
+    auto s = it->second;
+    if (s->remote_closed || h.length > s->recv_window) {
+        auto code = s->remote_closed ? error_code::stream_closed : error_code::flow_control_error;
+        return consumed(nullptr, h.length).then([this, s, code] {
+            return reset_stream(s, code);
+        });
+    }
+    s->recv_window -= h.length;
+    auto padding = h.length - payload.size();
+    if (!payload.empty()) {
+        s->buffered += payload.size();
+        s->data.push(std::move(payload));
+    }
+    if (h.flags & flags::end_stream) {
+        s->remote_closed = true;
+        s->data.push({});
+    }
+    return padding ? consumed(s.get(), padding) : make_ready_future<>();
+}
+
+future<> connection::handle_headers(const frame_header& h, temporary_buffer<char> payload) {
+    if (!h.stream_id) {
+        throw connection_error(error_code::protocol_error, "HEADERS on stream 0");
+    }
+    strip_padding(h.flags, payload);
+    if (h.flags & flags::priority) {
+        if (payload.size() < 5) {
+            throw connection_error(error_code::protocol_error, "truncated HEADERS");
+        }
+        payload.trim_front(5);
+    }
+    _header_block.assign(payload.get(), payload.get() + payload.size());
+    _continued_stream = h.stream_id;
+    _continued_flags = h.flags;
+    if (h.flags & flags::end_headers) {
+        return end_headers();
+    }
+    return make_ready_future<>();
+}
+
+future<> connection::handle_continuation(const frame_header& h, temporary_buffer<char> payload) {
+    if (!_continued_stream || h.stream_id != _continued_stream) {
+        throw connection_error(error_code::protocol_error, "unexpected CONTINUATION");
+    }
+    if (_header_block.size() + payload.size() > max_header_list_size) {
+        throw connection_error(error_code::enhance_your_calm, "header block too large");
+    }
+    _header_block.insert(_header_block.end(), payload.get(), payload.get() + payload.size());
+    if (h.flags & flags::end_headers) {
+        return end_headers();
+    }
+    return make_ready_future<>();
+}
+
+future<> connection::end_headers() {
+    auto id = std::exchange(_continued_stream, 0);
+    bool end_stream = _continued_flags & flags::end_stream;
+    // decoded even for a stream that is refused, as the table has to
+    // follow every block
+    std::vector<hpack::header> headers;
+    try {
+        headers = _decoder.decode(std::experimental::string_view(_header_block.data(), _header_block.size()),
+                max_header_list_size);
+    } catch (hpack::decoding_error& e) {
+        throw connection_error(error_code::compression_error, e.what());
+    }
+    auto it = _streams.find(id);
+    if (it != _streams.end()) {
+        // trailers, which end the request, and are dropped
+        auto s = it->second;
+        if (s->remote_closed) {
+            return reset_stream(s, error_code::stream_closed);
+        }
+        if (!end_stream) {
+            return reset_stream(s, error_code::protocol_error);
+        }
+        s->remote_closed = true;
+        s->data.push({});
+        return make_ready_future<>();
+    }
+    if (!(id & 1) || id <= _last_stream_id) {
+        throw connection_error(error_code::protocol_error, "HEADERS on a closed stream");
+    }
+    _last_stream_id = id;
+    if (_running >= max_concurrent_streams) {
+        return write_rst_stream(id, error_code::refused_stream);
+    }
+    std::unique_ptr<request> req;
+    try {
+        req = make_request(std::move(headers));
+    } catch (const bad_request_exception&) {
+        return write_rst_stream(id, error_code::protocol_error);
+    }
+    auto s = make_lw_shared<stream>(id, _initial_send_window);
+    _streams.emplace(id, s);
+    if (end_stream) {
+        s->remote_closed = true;
+        s->data.push({});
+    }
+    start_request(std::move(s), std::move(req));
+    return make_ready_future<>();
+}
+
+future<> connection::handle_rst_stream(const frame_header& h, temporary_buffer<char> payload) {
+    if (h.length != 4) {
+        throw connection_error(error_code::frame_size_error, "RST_STREAM of the wrong size");
+    }
+    if (!h.stream_id || h.stream_id > _last_stream_id) {
+        throw connection_error(error_code::protocol_error, "RST_STREAM on an idle stream");
+    }
+    auto it = _streams.find(h.stream_id);
+    if (it == _streams.end()) {
+        return make_ready_future<>();
+    }
+    if (++_unanswered_resets > max_concurrent_streams) {
+        throw connection_error(error_code::enhance_your_calm, "streams reset faster than they are answered");
+    }
+    auto s = it->second;
+    s->reset = true;
+    _window_updated.broadcast();
+    return remove_stream(*s);
+}
+
+future<> connection::handle_settings(const frame_header& h, temporary_buffer<char> payload) {
+    if (h.stream_id) {
+        throw connection_error(error_code::protocol_error, "SETTINGS on a stream");
+    }
+    if (h.flags & flags::ack) {
+        if (h.length) {
+            throw connection_error(error_code::frame_size_error, "SETTINGS acknowledgement with a payload");
+        }
+        return make_ready_future<>();
+    }
+    if (h.length % 6) {
+        throw connection_error(error_code::frame_size_error, "truncated SETTINGS");
+    }
+    for (size_t pos = 0; pos < payload.size(); pos += 6) {
+        auto p = payload.get() + pos;
+        auto id = setting(uint8_t(p[0]) << 8 | uint8_t(p[1]));
+        auto value = get_u32(p + 2);
+        switch (id) {
+        case setting::header_table_size:
+            _encoder.set_max_table_size(value);
+            break;
+        case setting::enable_push:
+            if (value > 1) {
+                throw connection_error(error_code::protocol_error, "invalid SETTINGS_ENABLE_PUSH");
+            }
+            break;
+        case setting::initial_window_size:
+            if (value > max_window) {
+                throw connection_error(error_code::flow_control_error, "invalid SETTINGS_INITIAL_WINDOW_SIZE");
+            }
+            for (auto&& s : _streams) {
+                s.second->send_window += int64_t(value) - _initial_send_window;
+            }
+            _initial_send_window = value;
+            break;
+        case setting::max_frame_size:
+            if (value < 16384 || value > 16777215) {
+                throw connection_error(error_code::protocol_error, "invalid SETTINGS_MAX_FRAME_SIZE");
+            }
+            _max_frame_size = value;
+            break;
+        default:
+            // the others limit what the server does not do, such as
+            // starting streams, or are advisory
+            break;
+        }
+    }
+    _settings_received = true;
+    _window_updated.broadcast();
+    return write_frame(frame_type::settings, flags::ack, 0);
+}
+
+future<> connection::handle_ping(const frame_header& h, temporary_buffer<char> payload) {
+    if (h.stream_id) {
+        throw connection_error(error_code::protocol_error, "PING on a stream");
+    }
+    if (h.length != 8) {
+        throw connection_error(error_code::frame_size_error, "PING of the wrong size");
+    }
+    if (h.flags & flags::ack) {
+        return make_ready_future<>();
+    }
+    return write_frame(frame_type::ping, flags::ack, 0, std::move(payload));
+}
+
+future<> connection::handle_window_update(const frame_header& h, temporary_buffer<char> payload) {
+    if (h.length != 4) {
+        throw connection_error(error_code::frame_size_error, "WINDOW_UPDATE of the wrong size");
+    }
+    auto increment = get_u32(payload.get()) & 0x7fffffff;
+    if (!h.stream_id) {
+        if (!increment) {
+            throw connection_error(error_code::protocol_error, "WINDOW_UPDATE of 0");
+        }
+        _send_window += increment;
+        if (_send_window > max_window) {
+            throw connection_error(error_code::flow_control_error, "connection window overflow");
+        }
+        _window_updated.broadcast();
+        return make_ready_future<>();
+    }
+    auto it = _streams.find(h.stream_id);
+    if (it == _streams.end()) {
+        if (h.stream_id > _last_stream_id) {
+            throw connection_error(error_code::protocol_error, "WINDOW_UPDATE on an idle stream");
+        }
+        return make_ready_future<>();
+    }
+    auto s = it->second;
+    if (!increment) {
+        return reset_stream(s, error_code::protocol_error);
+    }
+    s->send_window += increment;
+    if (s->send_window > max_window) {
+        return reset_stream(s, error_code::flow_control_error);
+    }
+    _window_updated.broadcast();
+    return make_ready_future<>();
+}
+
+void connection::start_request(lw_shared_ptr<stream> s, std::unique_ptr<request> req) {
+    ++_server._requests_served;
+    ++_running;
+    with_gate(_requests, [this, s, req = std::move(req)] () mutable {
+        return serve(s, std::move(req)).then([this] {
+            if (_unanswered_resets) {
+                --_unanswered_resets;
+            }
+        }).handle_exception([this, s] (std::exception_ptr ep) {
+            if (s->reset || _closed) {
+                return make_ready_future<>();
+            }
+            // a reply that failed half way cannot be finished
+            ++_server._respond_errors;
+            return reset_stream(s, error_code::internal_error);
+        }).finally([this] {
+            --_running;
+        });
+    }).handle_exception([] (std::exception_ptr) {
+        // the connection broke
+    });
+}
+
+future<> connection::serve(lw_shared_ptr<stream> s, std::unique_ptr<request> req) {
+    s->body = input_stream<char>(data_source(std::make_unique<body_source>(*this, *s)));
+    if (_server._content_streaming) {
+        req->content_stream = &s->body;
+        return handle(s, std::move(req));
+    }
+    if (req->content_length > _server._body_memory_limit) {
+        return send_error(s, payload_too_large_exception());
+    }
+    return do_with(size_t(0), [this, s, req = std::move(req)] (size_t& units) mutable {
+        auto& r = *req;
+        return read_content(*s, r, units).then_wrapped([this, s, req = std::move(req)] (future<> f) mutable {
+            try {
+                f.get();
+            } catch (const base_exception& e) {
+                return send_error(s, e);
+            }
+            return handle(s, std::move(req));
+        }).finally([this, &units] {
+            _server._body_memory.signal(units);
+        });
+    });
+}
+
+future<> connection::read_content(stream& s, request& req, size_t& units) {
+    // a body of known length takes its memory before it is read
+    return _server.take_body_memory(units, req.content_length).then([this, &s, &req, &units] {
+        return repeat([this, &s, &req, &units] {
+            return s.body.read().then([this, &req, &units] (temporary_buffer<char> buf) {
+                if (buf.empty()) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                auto size = req.content.size() + buf.size();
+                if (size > _server._body_memory_limit) {
+                    throw payload_too_large_exception();
+                }
+                return _server.take_body_memory(units, size).then([&req, buf = std::move(buf)] {
+                    req.content.append(buf.get(), buf.size());
+                    return stop_iteration::no;
+                });
+            });
+        });
+    });
+}
+
+future<> connection::handle(lw_shared_ptr<stream> s, std::unique_ptr<request> req) {
+    sstring url = http_server::connection::set_query_param(*req);
+    bool head = req->_method == "HEAD";
+    sstring accept_encoding;
+    if (!_server._compression.encodings.empty()) {
+        accept_encoding = req->get_header("Accept-Encoding");
+    }
+    return _server._routes.handle(url, std::move(req), std::make_unique<reply>()).then(
+            [this, s, head, accept_encoding = std::move(accept_encoding)] (std::unique_ptr<reply> rep) {
+        if (!_server._compression.encodings.empty()) {
+            compress_reply(*rep, accept_encoding, _server._compression);
+        }
+        rep->set_version("2.0").done();
+        return send_reply(s, std::move(rep), head);
+    });
+}
+
+future<> connection::send_error(lw_shared_ptr<stream> s, const base_exception& e) {
+    auto rep = std::make_unique<reply>();
+    rep->set_status(e.status(), json_exception(e).to_json());
+    rep->set_version("2.0").done("json");
+    return send_reply(s, std::move(rep), false);
+}
+
+future<> connection::send_reply(lw_shared_ptr<stream> s, std::unique_ptr<reply> rep, bool head) {
+    sstring length;
+    if (rep->_file) {
+        // sendfile would bypass the framing, the file is sent in DATA frames
+        length = to_sstring(rep->_file->length);
+        rep->read_file_body();
+    } else if (!rep->_body_writer) {
+        length = to_sstring(rep->_content.size());
+    }
+    bool end = head || (!rep->_body_writer && rep->_content.empty());
+    return do_with(std::move(rep), std::move(length), [this, s, end] (std::unique_ptr<reply>& rep, sstring& length) {
+        return send_headers(s, *rep, length, end).then([this, s, end, &rep] {
+            if (end) {
+                return make_ready_future<>();
+            }
+            if (rep->_body_writer) {
+                output_stream<char> out(data_sink(std::make_unique<body_sink>(*this, s)), _max_frame_size);
+                return rep->_body_writer(std::move(out)).then([this, s] {
+                    // a writer that did not close its stream still ends the body
+                    return s->local_closed ? make_ready_future<>() : send_data(s, {}, true);
+                });
+            }
+            auto content = make_lw_shared<sstring>(std::move(rep->_content));
+            temporary_buffer<char> data(content->begin(), content->size(), make_deleter([content] {}));
+            return send_data(s, std::move(data), true);
+        });
+    });
+}
+
+future<> connection::send_headers(lw_shared_ptr<stream> s, const reply& rep, const sstring& length, bool end) {
+    return with_semaphore(_write_lock, 1, [this, s, &rep, &length, end] {
+        if (s->reset || _closed) {
+            throw std::runtime_error("stream reset");
+        }
+        // encoded in the order the blocks are sent, which the client's
+        // table follows
+        std::vector<char> block;
+        _encoder.begin(block);
+        _encoder.encode(block, ":status", to_sstring(int(rep._status)));
+        for (auto&& h : rep._headers) {
+            sstring name = h.first;
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (connection_specific(name) || name == "server" || name == "date"
+                    || (name == "content-length" && !length.empty())) {
+                continue;
+            }
+            _encoder.encode(block, name, h.second);
+        }
+        _encoder.encode(block, "server", "Seastar httpd");
+        _encoder.encode(block, "date", _server._date);
+        if (!length.empty()) {
+            _encoder.encode(block, "content-length", length);
+        }
+        // a block larger than a frame continues in CONTINUATION frames,
+        // which nothing may come between
+        return do_with(temporary_buffer<char>(block.data(), block.size()), size_t(0),
+                [this, s, end] (temporary_buffer<char>& buf, size_t& pos) {
+            return repeat([this, s, end, &buf, &pos] {
+                auto n = std::min(buf.size() - pos, _max_frame_size);
+                auto type = pos ? frame_type::continuation : frame_type::headers;
+                uint8_t frame_flags = (pos + n == buf.size() ? flags::end_headers : 0)
+                        | (!pos && end ? flags::end_stream : 0);
+                auto frame = buf.share(pos, n);
+                pos += n;
+                return put_frame(type, frame_flags, s->id, std::move(frame)).then([&buf, &pos] {
+                    return pos == buf.size() ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        }).then([this] {
+            return _out.flush();
+        });
+    }).then([this, s, end] {
+        if (!end) {
+            return make_ready_future<>();
+        }
+        s->local_closed = true;
+        return finish_stream(s);
+    });
+}
+
+future<> connection::send_data(lw_shared_ptr<stream> s, temporary_buffer<char> data, bool last) {
+    if (data.empty() && !last) {
+        return make_ready_future<>();
+    }
+    return do_with(std::move(data), [this, s, last] (temporary_buffer<char>& data) {
+        return repeat([this, s, last, &data] {
+            return _window_updated.wait([this, s, &data] {
+                return _closed || s->reset || data.empty() || (_send_window > 0 && s->send_window > 0);
+            }).then([this, s, last, &data] {
+                if (_closed || s->reset) {
+                    throw std::runtime_error("stream reset");
+                }
+                size_t n = 0;
+                if (!data.empty()) {
+                    n = std::min<int64_t>({int64_t(data.size()), _send_window, s->send_window, int64_t(_max_frame_size)});
+                }
+                _send_window -= n;
+                s->send_window -= n;
+                auto frame = data.share(0, n);
+                data.trim_front(n);
+                bool end = last && data.empty();
+                return with_semaphore(_write_lock, 1, [this, s, end, frame = std::move(frame)] () mutable {
+                    if (s->reset || _closed) {
+                        throw std::runtime_error("stream reset");
+                    }
+                    return put_frame(frame_type::data, end ? flags::end_stream : 0, s->id, std::move(frame)).then([this] {
+                        return _out.flush();
+                    });
+                }).then([this, s, end, &data] {
+                    if (end) {
+                        s->local_closed = true;
+                        return finish_stream(s).then([] {
+                            return stop_iteration::yes;
+                        });
+                    }
+                    return make_ready_future<stop_iteration>(data.empty() ? stop_iteration::yes : stop_iteration::no);
+                });
+            });
+        });
+    });
+}
+
+// The reply was sent.  A request still being received is not needed any
+// more: its stream is reset, which stops the client sending it.
+future<> connection::finish_stream(lw_shared_ptr<stream> s) {
+    if (s->reset) {
+        return make_ready_future<>();
+    }
+    if (!s->remote_closed) {
+        return reset_stream(s, error_code::no_error);
+    }
+    return remove_stream(*s);
+}
+
+future<> connection::reset_stream(lw_shared_ptr<stream> s, error_code code) {
+    s->reset = true;
+    _window_updated.broadcast();
+    return remove_stream(*s).then([this, s, code] {
+        return write_rst_stream(s->id, code);
+    });
+}
+
+// What the client sent on a stream and was not read does not count
+// against the connection window once the stream is gone.
+future<> connection::remove_stream(stream& s) {
+    if (!_streams.erase(s.id)) {
+        return make_ready_future<>();
+    }
+    s.data.abort(std::make_exception_ptr(std::runtime_error("stream reset")));
+    return consumed(nullptr, std::exchange(s.buffered, 0));
+}
+
+// Lets the client send n more bytes on the connection, and on the stream
+// if it is still receiving, once enough were consumed to be worth a
+// WINDOW_UPDATE.
+future<> connection::consumed(stream* s, size_t n) {
+    uint32_t connection_increment = 0;
+    uint32_t stream_increment = 0;
+    _recv_consumed += n;
+    if (_recv_consumed >= connection_window / 2) {
+        connection_increment = std::exchange(_recv_consumed, 0);
+        _recv_window += connection_increment;
+    }
+    if (s && !s->remote_closed && !s->reset) {
+        s->recv_consumed += n;
+        if (s->recv_consumed >= stream_window / 2) {
+            stream_increment = std::exchange(s->recv_consumed, 0);
+            s->recv_window += stream_increment;
+        }
+    }
+    auto f = make_ready_future<>();
+    if (connection_increment) {
+        f = write_window_update(0, connection_increment);
+    }
+    if (stream_increment) {
+        f = f.then([this, id = s->id, stream_increment] {
+            return write_window_update(id, stream_increment);
+        });
+    }
+    return f;
+}
+
+// Writes a frame to the connection's stream, which copies it; the caller
+// holds _write_lock.
+future<> connection::put_frame(frame_type type, uint8_t frame_flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    char head[frame_header_size];
+    head[0] = payload.size() >> 16;
+    head[1] = payload.size() >> 8;
+    head[2] = payload.size();
+    head[3] = char(type);
+    head[4] = frame_flags;
+    put_u32(head + 5, stream_id);
+    auto f = _out.write(head, sizeof(head));
+    if (payload.empty()) {
+        return f;
+    }
+    return f.then([this, payload = std::move(payload)] {
+        return _out.write(payload.get(), payload.size());
+    });
+}
+
+future<> connection::write_frame(frame_type type, uint8_t frame_flags, uint32_t stream_id, temporary_buffer<char> payload) {
+    return with_semaphore(_write_lock, 1, [this, type, frame_flags, stream_id, payload = std::move(payload)] () mutable {
+        return put_frame(type, frame_flags, stream_id, std::move(payload)).then([this] {
+            return _out.flush();
+        });
+    });
+}
+
+future<> connection::write_rst_stream(uint32_t stream_id, error_code code) {
+    temporary_buffer<char> payload(4);
+    put_u32(payload.get_write(), uint32_t(code));
+    return write_frame(frame_type::rst_stream, 0, stream_id, std::move(payload));
+}
+
+future<> connection::write_window_update(uint32_t stream_id, uint32_t increment) {
+    temporary_buffer<char> payload(4);
+    put_u32(payload.get_write(), increment);
+    return write_frame(frame_type::window_update, 0, stream_id, std::move(payload));
+}
+
+future<> connection::write_goaway(error_code code) {
+    temporary_buffer<char> payload(8);
+    put_u32(payload.get_write(), _last_stream_id);
+    put_u32(payload.get_write() + 4, uint32_t(code));
+    return write_frame(frame_type::goaway, 0, 0, std::move(payload));
+}
+
+// Fails what waits on the connection: handlers reading request bodies,
+// and replies waiting for window.
+void connection::close() {
+    _closed = true;
+    for (auto&& s : _streams) {
+        s.second->reset = true;
+        s.second->data.abort(std::make_exception_ptr(std::runtime_error("connection closed")));
+    }
+    _streams.clear();
+    _window_updated.broadcast();
+}
+
+}
+
+}
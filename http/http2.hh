@@ -0,0 +1,193 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "http/hpack.hh"
+#include "http/request.hh"
+#include "http/reply.hh"
+#include "core/iostream.hh"
+#include "core/semaphore.hh"
+#include "core/condition-variable.hh"
+#include "core/gate.hh"
+#include "core/shared_ptr.hh"
+#include <unordered_map>
+#include <vector>
+
+namespace httpd {
+
+class http_server;
+class base_exception;
+
+/**
+ * The server side of HTTP/2 (RFC 7540).
+ */
+namespace http2 {
+
+enum class frame_type : uint8_t {
+    data = 0,
+    headers = 1,
+    priority = 2,
+    rst_stream = 3,
+    settings = 4,
+    push_promise = 5,
+    ping = 6,
+    goaway = 7,
+    window_update = 8,
+    continuation = 9,
+};
+
+enum class error_code : uint32_t {
+    no_error = 0,
+    protocol_error = 1,
+    internal_error = 2,
+    flow_control_error = 3,
+    settings_timeout = 4,
+    stream_closed = 5,
+    frame_size_error = 6,
+    refused_stream = 7,
+    cancel = 8,
+    compression_error = 9,
+    connect_error = 10,
+    enhance_your_calm = 11,
+    inadequate_security = 12,
+    http_1_1_required = 13,
+};
+
+namespace flags {
+
+constexpr uint8_t end_stream = 0x1;
+constexpr uint8_t ack = 0x1;
+constexpr uint8_t end_headers = 0x4;
+constexpr uint8_t padded = 0x8;
+constexpr uint8_t priority = 0x20;
+
+}
+
+/**
+ * What a client sends first on an HTTP/2 connection.
+ */
+extern const sstring client_preface;
+/**
+ * The client preface after its start, which parses as an HTTP/1 request,
+ * "PRI * HTTP/2.0".
+ */
+extern const sstring client_preface_tail;
+
+/**
+ * An HTTP/2 connection of an http_server.
+ *
+ * Each stream carries a request, which is handled as soon as its headers
+ * arrive, by the server's routes as HTTP/1 requests are, concurrently
+ * with the other streams.  The replies are sent as they are ready, their
+ * frames interleaved as the client's flow control windows allow.
+ */
+class connection {
+public:
+    static constexpr unsigned max_concurrent_streams = 100;
+    static constexpr size_t max_header_list_size = 64 << 10;
+    // the windows given to the client, for the connection and each stream
+    static constexpr size_t connection_window = 1 << 20;
+    static constexpr size_t stream_window = 256 << 10;
+private:
+    struct frame_header;
+    struct stream;
+    class body_source;
+    class body_sink;
+    http_server& _server;
+    input_stream<char>& _in;
+    output_stream<char>& _out;
+    hpack::decoder _decoder;
+    hpack::encoder _encoder;
+    std::unordered_map<uint32_t, lw_shared_ptr<stream>> _streams;
+    uint32_t _last_stream_id = 0;
+    // handlers started and not done, including those of streams the
+    // client reset, which keep running
+    unsigned _running = 0;
+    // streams the client reset while handled, less the requests answered
+    // since; a client resetting streams faster than they are answered
+    // only makes the server start handlers
+    unsigned _unanswered_resets = 0;
+    // a header block that continues in CONTINUATION frames
+    uint32_t _continued_stream = 0;
+    uint8_t _continued_flags = 0;
+    std::vector<char> _header_block;
+    // what the client lets the server send
+    int64_t _send_window = 65535;
+    int64_t _initial_send_window = 65535;
+    size_t _max_frame_size = 16384;
+    condition_variable _window_updated;
+    // what the client may still send, and what of it was consumed since
+    // the last WINDOW_UPDATE
+    int64_t _recv_window = connection_window;
+    size_t _recv_consumed = 0;
+    // frames are written whole, one at a time
+    semaphore _write_lock { 1 };
+    seastar::gate _requests;
+    bool _settings_received = false;
+    bool _closed = false;
+public:
+    /**
+     * @param in the connection's input, right after the client preface
+     */
+    connection(http_server& server, input_stream<char>& in, output_stream<char>& out);
+    ~connection();
+    /**
+     * Serves the connection until the client closes it, or breaks the
+     * protocol, and the requests in progress are done.
+     */
+    future<> process();
+private:
+    future<> read_frames();
+    future<> handle_frame(const frame_header& h, temporary_buffer<char> payload);
+    future<> handle_data(const frame_header& h, temporary_buffer<char> payload);
+    future<> handle_headers(const frame_header& h, temporary_buffer<char> payload);
+    future<> handle_continuation(const frame_header& h, temporary_buffer<char> payload);
+    future<> end_headers();
+    future<> handle_rst_stream(const frame_header& h, temporary_buffer<char> payload);
+    future<> handle_settings(const frame_header& h, temporary_buffer<char> payload);
+    future<> handle_ping(const frame_header& h, temporary_buffer<char> payload);
+    future<> handle_window_update(const frame_header& h, temporary_buffer<char> payload);
+
+    void start_request(lw_shared_ptr<stream> s, std::unique_ptr<request> req);
+    future<> serve(lw_shared_ptr<stream> s, std::unique_ptr<request> req);
+    future<> read_content(stream& s, request& req, size_t& units);
+    future<> handle(lw_shared_ptr<stream> s, std::unique_ptr<request> req);
+    future<> send_error(lw_shared_ptr<stream> s, const base_exception& e);
+    future<> send_reply(lw_shared_ptr<stream> s, std::unique_ptr<reply> rep, bool head);
+    future<> send_headers(lw_shared_ptr<stream> s, const reply& rep, const sstring& length, bool end);
+    future<> send_data(lw_shared_ptr<stream> s, temporary_buffer<char> data, bool last);
+    future<> finish_stream(lw_shared_ptr<stream> s);
+    future<> reset_stream(lw_shared_ptr<stream> s, error_code code);
+    future<> remove_stream(stream& s);
+    future<> consumed(stream* s, size_t n);
+
+    future<> write_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload = {});
+    future<> put_frame(frame_type type, uint8_t flags, uint32_t stream_id, temporary_buffer<char> payload);
+    future<> write_rst_stream(uint32_t stream_id, error_code code);
+    future<> write_window_update(uint32_t stream_id, uint32_t increment);
+    future<> write_goaway(error_code code);
+    void close();
+};
+
+}
+
+}
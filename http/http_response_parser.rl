@@ -21,11 +21,12 @@
 
 #include "core/ragel.hh"
 #include <memory>
-#include <unordered_map>
+#include "http/header_map.hh"
 
 struct http_response {
     sstring _version;
-    std::unordered_map<sstring, sstring> _headers;
+    int _status = 0;
+    httpd::header_map _headers;
 };
 
 %% machine http_response;
@@ -42,6 +43,10 @@ action store_version {
     _rsp->_version = str();
 }
 
+action store_status {
+    _rsp->_status = std::stoi(str());
+}
+
 action store_field_name {
     _field_name = str();
 }
@@ -51,6 +56,10 @@ action store_value {
 }
 
 action assign_field {
+    if (_rsp->_headers.size() == max_headers) {
+        _state = state::too_many_headers;
+        fbreak;
+    }
     _rsp->_headers[_field_name] = std::move(_value);
 }
 
@@ -78,8 +87,9 @@ http_version = 'HTTP/' (digit '.' digit) >mark %store_version;
 
 field = tchar+ >mark %store_field_name;
 value = any* >mark %store_value;
-start_line = http_version space digit digit digit space (any - cr - lf)* crlf;
-header_1st = (field sp_ht* ':' value :> crlf) %assign_field;
+status = (digit digit digit) >mark %store_status;
+start_line = http_version space status space (any - cr - lf)* crlf;
+header_1st = (field sp_ht* ':' sp_ht* value :> crlf) %assign_field;
 header_cont = (sp_ht+ value sp_ht* crlf) %extend_field;
 header = header_1st header_cont*;
 main := start_line header* :> (crlf @done);
@@ -93,7 +103,11 @@ public:
         error,
         eof,
         done,
+        too_many_headers,
     };
+    // the most headers a message may have, as each one is looked up among
+    // those before it
+    static constexpr size_t max_headers = 100;
     std::unique_ptr<http_response> _rsp;
     sstring _field_name;
     sstring _value;
@@ -113,6 +127,9 @@ public:
             _state = state::error;
         }
         %% write exec;
+        if (_state == state::too_many_headers) {
+            return p;
+        }
         if (!done) {
             p = nullptr;
         } else {
@@ -126,4 +143,7 @@ public:
     bool eof() const {
         return _state == state::eof;
     }
+    bool too_many_headers() const {
+        return _state == state::too_many_headers;
+    }
 };
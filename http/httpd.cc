@@ -27,6 +27,7 @@
 #include "core/queue.hh"
 #include "core/future-util.hh"
 #include "core/metrics.hh"
+#include "core/print.hh"
 #include <iostream>
 #include <algorithm>
 #include <unordered_map>
@@ -55,6 +56,201 @@ http_stats::http_stats(http_server& server, const sstring& name)
     });
 }
 
+class reply_body_sink_impl : public data_sink_impl {
+    output_stream<char>& _out;
+    bool _chunked;
+private:
+    // The connection's stream is a buffered one, so the data is copied
+    // into it rather than appended as packet fragments.
+    future<> write(net::packet data) {
+        return do_with(std::move(data), [this] (net::packet& data) {
+            auto frags = data.fragments();
+            return do_for_each(frags.begin(), frags.end(), [this] (net::fragment f) {
+                return _out.write(f.base, f.size);
+            });
+        });
+    }
+public:
+    reply_body_sink_impl(output_stream<char>& out, bool chunked) : _out(out), _chunked(chunked) {
+    }
+    virtual future<> put(net::packet data) override {
+        if (!_chunked) {
+            return write(std::move(data));
+        }
+        if (!data.len()) {
+            // an empty chunk would end the body
+            return make_ready_future<>();
+        }
+        auto size = sprint("%x\r\n", data.len());
+        return _out.write(size).then([this, data = std::move(data)] () mutable {
+            return write(std::move(data));
+        }).then([this] {
+            return _out.write("\r\n", 2);
+        });
+    }
+    virtual future<> flush() override {
+        return _out.flush();
+    }
+    virtual future<> close() override {
+        if (!_chunked) {
+            return make_ready_future<>();
+        }
+        return _out.write("0\r\n\r\n", 5);
+    }
+};
+
+output_stream<char> make_reply_body_stream(output_stream<char>& out, bool chunked) {
+    return output_stream<char>(data_sink(std::make_unique<reply_body_sink_impl>(out, chunked)), 32 * 1024);
+}
+
+// Consumes the framing of a chunked body up to the data of the next chunk,
+// or to the end of the body.
+class chunk_framing_parser {
+    static constexpr size_t max_line = 4096;
+    sstring _line;
+    bool _after_data = false;
+    bool _in_trailer = false;
+    bool _done = false;
+    uint64_t _chunk_size = 0;
+private:
+    // returns true when the data of a chunk or the end of the body is next
+    bool handle_line() {
+        if (_after_data) {
+            if (!_line.empty()) {
+                throw bad_request_exception("Malformed chunked encoding");
+            }
+            _after_data = false;
+            return false;
+        }
+        if (_in_trailer) {
+            _done = _line.empty();
+            return _done;
+        }
+        auto end = std::find_if(_line.begin(), _line.end(), [] (char c) {
+            return c == ';' || c == ' ' || c == '\t';
+        });
+        if (end == _line.begin() || end - _line.begin() > 15 || !std::all_of(_line.begin(), end, ::isxdigit)) {
+            throw bad_request_exception("Malformed chunked encoding");
+        }
+        _chunk_size = std::stoull(std::string(_line.begin(), end), nullptr, 16);
+        _in_trailer = !_chunk_size;
+        return _chunk_size;
+    }
+public:
+    using unconsumed_remainder = std::experimental::optional<temporary_buffer<char>>;
+    future<unconsumed_remainder> operator()(temporary_buffer<char> data) {
+        if (data.empty()) {
+            return make_exception_future<unconsumed_remainder>(bad_request_exception("Unexpected end of chunked body"));
+        }
+        auto p = data.begin();
+        while (p != data.end()) {
+            auto nl = std::find(p, data.end(), '\n');
+            _line.append(p, nl - p);
+            if (_line.size() > max_line) {
+                return make_exception_future<unconsumed_remainder>(bad_request_exception("Malformed chunked encoding"));
+            }
+            if (nl == data.end()) {
+                break;
+            }
+            p = nl + 1;
+            if (!_line.empty() && _line[_line.size() - 1] == '\r') {
+                _line.resize(_line.size() - 1);
+            }
+            bool next;
+            try {
+                next = handle_line();
+            } catch (...) {
+                return make_exception_future<unconsumed_remainder>(std::current_exception());
+            }
+            _line = {};
+            if (next) {
+                data.trim_front(p - data.begin());
+                return make_ready_future<unconsumed_remainder>(std::move(data));
+            }
+        }
+        return make_ready_future<unconsumed_remainder>();
+    }
+    void chunk_consumed() {
+        _after_data = true;
+    }
+    uint64_t chunk_size() const {
+        return _chunk_size;
+    }
+    bool done() const {
+        return _done;
+    }
+};
+
+class request_body_source_impl : public data_source_impl {
+    static constexpr size_t max_read = 64 * 1024;
+    input_stream<char>& _in;
+    semaphore* _memory;
+    size_t _memory_limit;
+    bool _chunked;
+    // left to read of the body, or of the current chunk if chunked
+    uint64_t _remaining;
+    chunk_framing_parser _framing;
+private:
+    future<temporary_buffer<char>> read() {
+        auto n = std::min<uint64_t>(_remaining, max_read);
+        if (_memory) {
+            n = std::min<uint64_t>(n, std::max<size_t>(_memory_limit, 1));
+        }
+        auto units = _memory ? _memory->wait(n) : make_ready_future<>();
+        return units.then([this, n] {
+            return _in.read_up_to(n);
+        }).then_wrapped([this, n] (future<temporary_buffer<char>> f) {
+            if (f.failed()) {
+                if (_memory) {
+                    _memory->signal(n);
+                }
+                return std::move(f);
+            }
+            auto buf = f.get0();
+            if (_memory) {
+                _memory->signal(n - buf.size());
+            }
+            if (buf.empty()) {
+                return make_exception_future<temporary_buffer<char>>(bad_request_exception("Unexpected end of request body"));
+            }
+            _remaining -= buf.size();
+            if (_chunked && !_remaining) {
+                _framing.chunk_consumed();
+            }
+            if (_memory) {
+                auto size = buf.size();
+                buf = temporary_buffer<char>(buf.get_write(), size,
+                        make_deleter(buf.release(), [memory = _memory, size] { memory->signal(size); }));
+            }
+            return make_ready_future<temporary_buffer<char>>(std::move(buf));
+        });
+    }
+public:
+    request_body_source_impl(input_stream<char>& in, uint64_t length, bool chunked, semaphore* memory, size_t memory_limit)
+        : _in(in), _memory(memory), _memory_limit(memory_limit), _chunked(chunked), _remaining(length) {
+    }
+    virtual future<temporary_buffer<char>> get() override {
+        if (_remaining) {
+            return read();
+        }
+        if (!_chunked || _framing.done()) {
+            return make_ready_future<temporary_buffer<char>>();
+        }
+        return _in.consume(_framing).then([this] {
+            if (_framing.done()) {
+                return make_ready_future<temporary_buffer<char>>();
+            }
+            _remaining = _framing.chunk_size();
+            return read();
+        });
+    }
+};
+
+input_stream<char> make_request_body_stream(input_stream<char>& in, uint64_t length, bool chunked,
+        semaphore* memory, size_t memory_limit) {
+    return input_stream<char>(data_source(std::make_unique<request_body_source_impl>(in, length, chunked, memory, memory_limit)));
+}
+
 sstring http_server_control::generate_server_name() {
     static thread_local uint16_t idgen;
     return seastar::format("http-{}", idgen++);
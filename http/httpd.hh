@@ -33,6 +33,7 @@
 #include "core/queue.hh"
 #include "core/future-util.hh"
 #include "core/metrics_registration.hh"
+#include "core/semaphore.hh"
 #include <iostream>
 #include <algorithm>
 #include <unordered_map>
@@ -44,6 +45,10 @@
 #include <boost/intrusive/list.hpp>
 #include "reply.hh"
 #include "http/routes.hh"
+#include "http/exception.hh"
+#include "http/compression.hh"
+#include "http/http2.hh"
+#include "net/tls.hh"
 
 namespace httpd {
 
@@ -58,6 +63,21 @@ class http_stats {
     http_stats(http_server& server, const sstring& name);
 };
 
+/**
+ * Returns a stream that writes a reply body to out, framed as chunks when
+ * chunked is set.  Closing it ends the body but leaves out open.
+ */
+output_stream<char> make_reply_body_stream(output_stream<char>& out, bool chunked);
+
+/**
+ * Returns a stream that reads a request body from in: length bytes, or
+ * if chunked, the chunks up to the last one, decoded.  If memory is set,
+ * units of it are taken for each buffer read (up to memory_limit at a
+ * time) and returned when the buffer is freed.
+ */
+input_stream<char> make_request_body_stream(input_stream<char>& in, uint64_t length, bool chunked,
+        semaphore* memory, size_t memory_limit);
+
 class http_server {
     std::vector<server_socket> _listeners;
     http_stats _stats;
@@ -67,30 +87,90 @@ class http_server {
     uint64_t _connections_being_accepted = 0;
     uint64_t _read_errors = 0;
     uint64_t _respond_errors = 0;
+    bool _content_streaming = false;
+    size_t _body_memory_limit = default_body_memory_limit;
+    compression_options _compression;
+    semaphore _body_memory { default_body_memory_limit };
     sstring _date = http_date();
     timer<> _date_format_timer { [this] {_date = http_date();} };
     bool _stopping = false;
     promise<> _all_connections_stopped;
     future<> _stopped = _all_connections_stopped.get_future();
+    friend class http2::connection;
 private:
     void maybe_idle() {
         if (_stopping && !_connections_being_accepted && !_current_connections) {
             _all_connections_stopped.set_value();
         }
     }
+    // Makes units, the body memory a request holds, cover size bytes.  If
+    // it has to wait, it gives back what it holds and takes it all in one
+    // wait, so that bodies holding part of the memory never wait for each
+    // other.
+    future<> take_body_memory(size_t& units, size_t size) {
+        if (size <= units) {
+            return make_ready_future<>();
+        }
+        if (_body_memory.try_wait(size - units)) {
+            units = size;
+            return make_ready_future<>();
+        }
+        _body_memory.signal(std::exchange(units, 0));
+        return _body_memory.wait(size).then([&units, size] {
+            units = size;
+        });
+    }
 public:
+    static constexpr size_t default_body_memory_limit = 64 << 20;
+
     routes _routes;
 
     explicit http_server(const sstring& name) : _stats(*this, name) {
+        _routes.enable_metrics(name);
         _date_format_timer.arm_periodic(1s);
     }
     future<> listen(ipv4_addr addr) {
         listen_options lo;
         lo.reuse_address = true;
-        _listeners.push_back(engine().listen(make_ipv4_address(addr), lo));
+        return listen(engine().listen(make_ipv4_address(addr), lo));
+    }
+    future<> listen(server_socket ss) {
+        _listeners.push_back(std::move(ss));
         _stopped = when_all(std::move(_stopped), do_accepts(_listeners.size() - 1)).discard_result();
         return make_ready_future<>();
     }
+    /**
+     * When set, handlers read request bodies from request::content_stream
+     * as they arrive, instead of getting them whole in request::content.
+     */
+    void set_content_streaming(bool streaming) {
+        _content_streaming = streaming;
+    }
+    /**
+     * Compress replies to clients that accept it, per options; see
+     * compression_options.  Off by default.  Routes can turn it off or on
+     * regardless of the content type with handler_base::set_compression().
+     * Replies to HTTP/1.0 clients are never compressed, as they are
+     * compressed while being sent and need chunked encoding.
+     */
+    void set_compression(compression_options options) {
+        _compression = std::move(options);
+    }
+    /**
+     * Limits the memory taken by request bodies on all connections.  A
+     * streamed body is read only while the buffers handlers hold stay
+     * within the limit, and a handler must not hold more than the limit
+     * itself.  A body read into request::content holds its size until the
+     * handler is done, and a body larger than the limit gets a 413 reply.
+     */
+    void set_body_memory_limit(size_t limit) {
+        if (limit > _body_memory_limit) {
+            _body_memory.signal(limit - _body_memory_limit);
+        } else {
+            _body_memory.consume(_body_memory_limit - limit);
+        }
+        _body_memory_limit = limit;
+    }
     future<> stop() {
         _stopping = true;
         for (auto&& l : _listeners) {
@@ -107,6 +187,7 @@ class http_server {
                 [this, which] (future<connected_socket, socket_address> f_cs_sa) mutable {
                     --_connections_being_accepted;
                     if (_stopping) {
+                        f_cs_sa.ignore_ready_future();
                         maybe_idle();
                         return;
                     }
@@ -139,8 +220,14 @@ class http_server {
         http_request_parser _parser;
         std::unique_ptr<request> _req;
         std::unique_ptr<reply> _resp;
+        // body of the request being handled
+        input_stream<char> _body;
+        // body memory units held by the request being handled
+        size_t _content_units = 0;
         // null element marks eof
         queue<std::unique_ptr<reply>> _replies { 10 };bool _done = false;
+        // the client sent the HTTP/2 preface, the rest is HTTP/2
+        bool _http2 = false;
     public:
         connection(http_server& server, connected_socket&& fd,
                 socket_address addr)
@@ -156,13 +243,38 @@ class http_server {
             _server.maybe_idle();
         }
         future<> process() {
+            if (seastar::tls::get_alpn_protocol(_fd) == "h2") {
+                // no HTTP/1 request parses the start of the preface first
+                return read_http2_preface(http2::client_preface).then([this] {
+                    return process_http2();
+                }).handle_exception([this] (std::exception_ptr) {
+                    _server._read_errors++;
+                    return _read_buf.close();
+                });
+            }
             // Launch read and write "threads" simultaneously:
             return when_all(read(), respond()).then(
-                    [] (std::tuple<future<>, future<>> joined) {
-                        // FIXME: notify any exceptions in joined?
-                        return make_ready_future<>();
+                    [this] (std::tuple<future<>, future<>> joined) {
+                        // errors are counted by read() and respond(); what
+                        // is left is failing to close a broken connection
+                        std::get<0>(joined).ignore_ready_future();
+                        std::get<1>(joined).ignore_ready_future();
+                        return _http2 ? process_http2() : make_ready_future<>();
                     });
         }
+        future<> process_http2() {
+            _http2 = true;
+            auto c = std::make_unique<http2::connection>(_server, _read_buf, _write_buf);
+            auto& conn = *c;
+            return conn.process().finally([this, c = std::move(c)] {
+                return _write_buf.close().then_wrapped([this] (future<> f) {
+                    f.ignore_ready_future();
+                    return _read_buf.close();
+                }).handle_exception([] (std::exception_ptr) {
+                    // nothing to do about a connection that fails to close
+                });
+            });
+        }
         void shutdown() {
             _fd.shutdown_input();
             _fd.shutdown_output();
@@ -178,7 +290,7 @@ class http_server {
                 f.ignore_ready_future();
                 return _replies.push_eventually( {});
             }).finally([this] {
-                return _read_buf.close();
+                return _http2 ? make_ready_future<>() : _read_buf.close();
             });
         }
         future<> read_one() {
@@ -188,16 +300,143 @@ class http_server {
                     _done = true;
                     return make_ready_future<>();
                 }
-                ++_server._requests_served;
                 std::unique_ptr<httpd::request> req = _parser.get_parsed_request();
+                if (_parser.too_many_headers()) {
+                    return _replies.not_full().then([req = std::move(req), this] () mutable {
+                        _done = reject(*req, request_header_fields_too_large_exception());
+                    });
+                }
+                if (req->_method == "PRI" && req->_version == "2.0") {
+                    return read_http2_preface();
+                }
+                ++_server._requests_served;
 
                 return _replies.not_full().then([req = std::move(req), this] () mutable {
-                    return generate_reply(std::move(req));
+                    return handle_request(std::move(req));
                 }).then([this](bool done) {
                     _done = done;
                 });
             });
         }
+        /**
+         * Reads the HTTP/2 client preface, or the rest of it when its start
+         * parsed as a request, after which the connection switches to HTTP/2
+         * once the replies to requests before it are sent.
+         */
+        future<> read_http2_preface(const sstring& preface = http2::client_preface_tail) {
+            return _read_buf.read_exactly(preface.size()).then([this, &preface] (temporary_buffer<char> buf) {
+                if (std::experimental::string_view(buf.get(), buf.size()) != preface) {
+                    throw std::runtime_error("Invalid HTTP/2 preface");
+                }
+                _http2 = true;
+                _done = true;
+            });
+        }
+        /**
+         * Reads the request's body into its content, or hands it to the
+         * handler as a stream, and queues the reply.
+         */
+        future<bool> handle_request(std::unique_ptr<request> req) {
+            try {
+                start_body(*req);
+            } catch (const base_exception& e) {
+                return make_ready_future<bool>(reject(*req, e));
+            }
+            if (_server._content_streaming) {
+                req->content_stream = &_body;
+                return generate_reply(std::move(req)).then([this] (bool done) {
+                    if (done) {
+                        return make_ready_future<bool>(done);
+                    }
+                    return skip_body().then([] {
+                        return false;
+                    });
+                });
+            }
+            auto& r = *req;
+            return read_content(r).then_wrapped([this, req = std::move(req)] (future<> f) mutable {
+                try {
+                    f.get();
+                } catch (const base_exception& e) {
+                    return make_ready_future<bool>(reject(*req, e));
+                }
+                return generate_reply(std::move(req));
+            }).finally([this] {
+                _server._body_memory.signal(std::exchange(_content_units, 0));
+            });
+        }
+        /**
+         * Sets _body up to read the body req has according to its
+         * Transfer-Encoding and Content-Length headers.
+         */
+        void start_body(request& req) {
+            uint64_t length = 0;
+            bool chunked = false;
+            auto te = req._headers.find("Transfer-Encoding");
+            if (te != req._headers.end()) {
+                static const sstring chunked_coding = "chunked";
+                auto& v = te->second;
+                if (v.size() < chunked_coding.size()
+                        || v.compare(v.size() - chunked_coding.size(), chunked_coding.size(), chunked_coding)) {
+                    throw bad_request_exception("Unsupported transfer encoding");
+                }
+                chunked = true;
+            } else {
+                auto cl = req._headers.find("Content-Length");
+                if (cl != req._headers.end()) {
+                    auto& v = cl->second;
+                    if (v.empty() || v.size() > 18 || !std::all_of(v.begin(), v.end(), ::isdigit)) {
+                        throw bad_request_exception("Invalid Content-Length");
+                    }
+                    length = std::stoull(v);
+                    req.content_length = length;
+                }
+            }
+            if (!_server._content_streaming && length > _server._body_memory_limit) {
+                throw payload_too_large_exception();
+            }
+            _body = make_request_body_stream(_read_buf, length, chunked,
+                    _server._content_streaming ? &_server._body_memory : nullptr, _server._body_memory_limit);
+        }
+        future<> read_content(request& req) {
+            // a body of known length takes its memory before it is read
+            return _server.take_body_memory(_content_units, req.content_length).then([this, &req] {
+                return repeat([this, &req] {
+                    return _body.read().then([this, &req] (temporary_buffer<char> buf) {
+                        if (buf.empty()) {
+                            return make_ready_future<stop_iteration>(stop_iteration::yes);
+                        }
+                        auto size = req.content.size() + buf.size();
+                        if (size > _server._body_memory_limit) {
+                            throw payload_too_large_exception();
+                        }
+                        return _server.take_body_memory(_content_units, size).then([&req, buf = std::move(buf)] {
+                            req.content.append(buf.get(), buf.size());
+                            return stop_iteration::no;
+                        });
+                    });
+                });
+            });
+        }
+        future<> skip_body() {
+            return repeat([this] {
+                return _body.read().then([] (temporary_buffer<char> buf) {
+                    return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+                });
+            });
+        }
+        /**
+         * Queues an error reply for a request whose body cannot be read,
+         * after which the connection is closed.
+         */
+        bool reject(request& req, const base_exception& e) {
+            auto rep = std::make_unique<reply>();
+            rep->set_status(e.status(), json_exception(e).to_json());
+            rep->_headers["Connection"] = "close";
+            rep->set_version(req._version).done("json");
+            _replies.push(std::move(rep));
+            return true;
+        }
         future<> respond() {
             return do_response_loop().then_wrapped([this] (future<> f) {
                 // swallow error
@@ -205,7 +444,7 @@ class http_server {
                     _server._respond_errors++;
                 }
                 f.ignore_ready_future();
-                return _write_buf.close();
+                return _http2 ? make_ready_future<>() : _write_buf.close();
             });
         }
         future<> do_response_loop() {
@@ -222,16 +461,23 @@ class http_server {
                     });
         }
         future<> start_response() {
-            _resp->_headers["Server"] = "Seastar httpd";
-            _resp->_headers["Date"] = _server._date;
-            _resp->_headers["Content-Length"] = to_sstring(
-                    _resp->_content.size());
-            return _write_buf.write(_resp->_response_line.begin(),
-                    _resp->_response_line.size()).then([this] {
-                return write_reply_headers(_resp->_headers.begin());
-            }).then([this] {
-                return _write_buf.write("\r\n", 2);
-            }).then([this] {
+            // the whole head is formatted in one buffer, the write copies it
+            sstring head;
+            if (_resp->_file) {
+                auto length = to_sstring(_resp->_file->length);
+                head = _resp->format_head({{"Server", "Seastar httpd"}, {"Date", _server._date},
+                        {"Content-Length", length}});
+            } else if (!_resp->_body_writer) {
+                auto length = to_sstring(_resp->_content.size());
+                head = _resp->format_head({{"Server", "Seastar httpd"}, {"Date", _server._date},
+                        {"Content-Length", length}});
+            } else if (_resp->_version != "1.0") {
+                head = _resp->format_head({{"Server", "Seastar httpd"}, {"Date", _server._date},
+                        {"Transfer-Encoding", "chunked"}});
+            } else {
+                head = _resp->format_head({{"Server", "Seastar httpd"}, {"Date", _server._date}});
+            }
+            return _write_buf.write(head).then([this] {
                 return write_body();
             }).then([this] {
                 return _write_buf.flush();
@@ -239,22 +485,6 @@ class http_server {
                 _resp.reset();
             });
         }
-        future<> write_reply_headers(
-                std::unordered_map<sstring, sstring>::iterator hi) {
-            if (hi == _resp->_headers.end()) {
-                return make_ready_future<>();
-            }
-            return _write_buf.write(hi->first.begin(), hi->first.size()).then(
-                    [this] {
-                        return _write_buf.write(": ", 2);
-                    }).then([hi, this] {
-                return _write_buf.write(hi->second.begin(), hi->second.size());
-            }).then([this] {
-                return _write_buf.write("\r\n", 2);
-            }).then([hi, this] () mutable {
-                return write_reply_headers(++hi);
-            });
-        }
 
         static short hex_to_byte(char c) {
             if (c >='a' && c <= 'z') {
@@ -369,15 +599,41 @@ class http_server {
             }
             sstring url = set_query_param(*req.get());
             sstring version = req->_version;
+            sstring accept_encoding;
+            if (!_server._compression.encodings.empty() && version != "1.0") {
+                accept_encoding = req->get_header("Accept-Encoding");
+            }
             return _server._routes.handle(url, std::move(req), std::move(resp)).
             // Caller guarantees enough room
-            then([this, should_close, version = std::move(version)](std::unique_ptr<reply> rep) {
+            then([this, should_close, version = std::move(version),
+                    accept_encoding = std::move(accept_encoding)](std::unique_ptr<reply> rep) mutable {
+                if (!_server._compression.encodings.empty() && version != "1.0") {
+                    compress_reply(*rep, accept_encoding, _server._compression);
+                }
+                if (rep->_body_writer && version == "1.0") {
+                    // no chunked encoding, the body ends with the connection
+                    rep->_headers.erase("Connection");
+                    should_close = true;
+                }
                 rep->set_version(version).done();
                 this->_replies.push(std::move(rep));
                 return make_ready_future<bool>(should_close);
             });
         }
         future<> write_body() {
+            if (_resp->_file) {
+                auto& range = *_resp->_file;
+                if (!_fd.can_send_file()) {
+                    return write_file_range(range, _write_buf);
+                }
+                // the head goes out before the file, which bypasses _write_buf
+                return _write_buf.flush_to_sink().then([this, &range] {
+                    return _fd.send_file(range.fd->get(), range.offset, range.length);
+                });
+            }
+            if (_resp->_body_writer) {
+                return _resp->_body_writer(make_reply_body_stream(_write_buf, _resp->_version != "1.0"));
+            }
             return _write_buf.write(_resp->_content.begin(),
                     _resp->_content.size());
         }
@@ -446,7 +702,9 @@ class http_server_control {
     }
 
     future<> listen(ipv4_addr addr) {
-        return _server_dist->invoke_on_all(&http_server::listen, addr);
+        return _server_dist->invoke_on_all([addr] (http_server& server) {
+            return server.listen(addr);
+        });
     }
 
     distributed<http_server>& server() {
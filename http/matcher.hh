@@ -77,6 +77,14 @@ class param_matcher : public matcher {
 
     virtual size_t match(const sstring& url, size_t ind, parameters& param)
             override;
+
+    const sstring& name() const {
+        return _name;
+    }
+
+    bool entire_path() const {
+        return _entire_path;
+    }
 private:
     sstring _name;
     bool _entire_path;
@@ -100,6 +108,10 @@ class str_matcher : public matcher {
 
     virtual size_t match(const sstring& url, size_t ind, parameters& param)
             override;
+
+    const sstring& str() const {
+        return _cmp;
+    }
 private:
     sstring _cmp;
     unsigned _len;
@@ -108,6 +108,14 @@ class match_rule {
         return *this;
     }
 
+    const std::vector<matcher*>& matchers() const {
+        return _match_list;
+    }
+
+    handler_base* handler() const {
+        return _handler;
+    }
+
 private:
     std::vector<matcher*> _match_list;
     handler_base* _handler;
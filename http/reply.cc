@@ -29,6 +29,10 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 //
 #include "reply.hh"
+#include "core/fstream.hh"
+#include "core/future-util.hh"
+#include "core/reactor.hh"
+#include <algorithm>
 
 namespace httpd {
 
@@ -38,6 +42,7 @@ const sstring ok = " 200 OK\r\n";
 const sstring created = " 201 Created\r\n";
 const sstring accepted = " 202 Accepted\r\n";
 const sstring no_content = " 204 No Content\r\n";
+const sstring partial_content = " 206 Partial Content\r\n";
 const sstring multiple_choices = " 300 Multiple Choices\r\n";
 const sstring moved_permanently = " 301 Moved Permanently\r\n";
 const sstring moved_temporarily = " 302 Moved Temporarily\r\n";
@@ -46,6 +51,9 @@ const sstring bad_request = " 400 Bad Request\r\n";
 const sstring unauthorized = " 401 Unauthorized\r\n";
 const sstring forbidden = " 403 Forbidden\r\n";
 const sstring not_found = " 404 Not Found\r\n";
+const sstring payload_too_large = " 413 Payload Too Large\r\n";
+const sstring range_not_satisfiable = " 416 Range Not Satisfiable\r\n";
+const sstring request_header_fields_too_large = " 431 Request Header Fields Too Large\r\n";
 const sstring internal_server_error = " 500 Internal Server Error\r\n";
 const sstring not_implemented = " 501 Not Implemented\r\n";
 const sstring bad_gateway = " 502 Bad Gateway\r\n";
@@ -61,6 +69,8 @@ static const sstring& to_string(reply::status_type status) {
         return accepted;
     case reply::status_type::no_content:
         return no_content;
+    case reply::status_type::partial_content:
+        return partial_content;
     case reply::status_type::multiple_choices:
         return multiple_choices;
     case reply::status_type::moved_permanently:
@@ -77,6 +87,12 @@ static const sstring& to_string(reply::status_type status) {
         return forbidden;
     case reply::status_type::not_found:
         return not_found;
+    case reply::status_type::payload_too_large:
+        return payload_too_large;
+    case reply::status_type::range_not_satisfiable:
+        return range_not_satisfiable;
+    case reply::status_type::request_header_fields_too_large:
+        return request_header_fields_too_large;
     case reply::status_type::internal_server_error:
         return internal_server_error;
     case reply::status_type::not_implemented:
@@ -95,4 +111,88 @@ sstring reply::response_line() {
     return "HTTP/" + _version + status_strings::to_string(_status);
 }
 
+void reply::read_file_body() {
+    if (!_file) {
+        return;
+    }
+    _body_writer = [range = std::move(*_file)] (output_stream<char>&& out) {
+        return do_with(std::move(out), [&range] (output_stream<char>& out) {
+            return write_file_range(range, out).then([&out] {
+                return out.close();
+            });
+        });
+    };
+    _file = {};
+}
+
+future<> write_file_range(const reply::file_range& range, output_stream<char>& out) {
+    return open_file_dma(range.path, open_flags::ro).then([&range, &out] (file f) {
+        return do_with(make_file_input_stream(std::move(f), range.offset, range.length), uint64_t(0),
+                [&range, &out] (input_stream<char>& in, uint64_t& written) {
+            return repeat([&in, &out, &written] {
+                return in.read().then([&out, &written] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    written += buf.size();
+                    // out may be buffering what was written before, which
+                    // cannot be mixed with buffers handed over as they are
+                    return out.write(buf.get(), buf.size()).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([&range, &written] {
+                if (written != range.length) {
+                    // the file was truncated since its length was sent
+                    throw std::runtime_error("file ended before the data to send");
+                }
+            }).finally([&in] {
+                return in.close();
+            });
+        });
+    });
+}
+
+sstring reply::format_head(std::initializer_list<header> extra) const {
+    auto replaced = [&extra] (const sstring& name) {
+        return std::any_of(extra.begin(), extra.end(), [&name] (const header& h) {
+            return header_map::name_equals(name, h.first);
+        });
+    };
+    auto& status = status_strings::to_string(_status);
+    size_t size = 5 + _version.size() + status.size() + 2;
+    for (auto&& h : _headers) {
+        if (!replaced(h.first)) {
+            size += h.first.size() + h.second.size() + 4;
+        }
+    }
+    for (auto&& h : extra) {
+        size += h.first.size() + h.second.size() + 4;
+    }
+    sstring head(sstring::initialized_later(), size);
+    auto p = head.begin();
+    auto append = [&p] (std::experimental::string_view s) {
+        p = std::copy(s.begin(), s.end(), p);
+    };
+    auto append_header = [&append] (std::experimental::string_view name, std::experimental::string_view value) {
+        append(name);
+        append(": ");
+        append(value);
+        append("\r\n");
+    };
+    append("HTTP/");
+    append(_version);
+    append(status);
+    for (auto&& h : _headers) {
+        if (!replaced(h.first)) {
+            append_header(h.first, h.second);
+        }
+    }
+    for (auto&& h : extra) {
+        append_header(h.first, h.second);
+    }
+    append("\r\n");
+    return head;
+}
+
 } // namespace server
@@ -32,8 +32,14 @@
 #pragma once
 
 #include "core/sstring.hh"
-#include <unordered_map>
+#include "core/iostream.hh"
+#include "core/posix.hh"
+#include "core/shared_ptr.hh"
+#include <functional>
+#include <initializer_list>
+#include <experimental/optional>
 #include "http/mime_types.hh"
+#include "http/header_map.hh"
 
 namespace httpd {
 /**
@@ -48,6 +54,7 @@ struct reply {
         created = 201, //!< created
         accepted = 202, //!< accepted
         no_content = 204, //!< no_content
+        partial_content = 206, //!< partial_content
         multiple_choices = 300, //!< multiple_choices
         moved_permanently = 301, //!< moved_permanently
         moved_temporarily = 302, //!< moved_temporarily
@@ -56,6 +63,9 @@ struct reply {
         unauthorized = 401, //!< unauthorized
         forbidden = 403, //!< forbidden
         not_found = 404, //!< not_found
+        payload_too_large = 413, //!< payload_too_large
+        range_not_satisfiable = 416, //!< range_not_satisfiable
+        request_header_fields_too_large = 431, //!< request_header_fields_too_large
         internal_server_error = 500, //!< internal_server_error
         not_implemented = 501, //!< not_implemented
         bad_gateway = 502, //!< bad_gateway
@@ -65,7 +75,7 @@ struct reply {
     /**
      * The headers to be included in the reply.
      */
-    std::unordered_map<sstring, sstring> _headers;
+    header_map _headers;
 
     sstring _version;
     /**
@@ -73,7 +83,32 @@ struct reply {
      */
     sstring _content;
 
-    sstring _response_line;
+    /**
+     * When set, writes the body instead of _content, see write_body().
+     */
+    std::function<future<>(output_stream<char>&&)> _body_writer;
+
+    /**
+     * A part of a file sent as the body, see send_file().
+     */
+    struct file_range {
+        lw_shared_ptr<file_desc> fd;
+        // the file's name, to read it where it cannot be sent from fd
+        sstring path;
+        uint64_t offset;
+        uint64_t length;
+    };
+    std::experimental::optional<file_range> _file;
+
+    /**
+     * Whether a server that compresses replies compresses this one: by its
+     * content type and size, whatever they are, or not at all.
+     */
+    enum class compression_mode {
+        automatic,
+        always,
+        never,
+    } _compression = compression_mode::automatic;
     reply()
             : _status(status_type::ok) {
     }
@@ -88,6 +123,11 @@ struct reply {
         return *this;
     }
 
+    reply& set_compression(compression_mode mode) {
+        _compression = mode;
+        return *this;
+    }
+
     reply& set_status(status_type status, const sstring& content = "") {
         _status = status;
         if (content != "") {
@@ -115,18 +155,61 @@ struct reply {
         return *this;
     }
 
+    /**
+     * Send the body by calling body_writer instead of from _content, so
+     * that it does not have to be held in memory or its length known in
+     * advance.  Once the headers are sent, body_writer is called with a
+     * stream to write the body to, which it must close when done.  The
+     * reply is sent with chunked transfer encoding, or to an HTTP/1.0
+     * client by closing the connection after the body.
+     */
+    reply& write_body(const sstring& content_type,
+            std::function<future<>(output_stream<char>&&)>&& body_writer) {
+        set_content_type(content_type);
+        _body_writer = std::move(body_writer);
+        return *this;
+    }
+
+    /**
+     * Send length bytes of an open file from offset as the body.  Where
+     * the connection allows, the server has the kernel copy them from the
+     * file to the socket, without reading them into memory.
+     */
+    reply& send_file(lw_shared_ptr<file_desc> fd, const sstring& path, uint64_t offset, uint64_t length) {
+        _file = file_range{std::move(fd), path, offset, length};
+        return *this;
+    }
+
+    /**
+     * Turns a body set by send_file() into a body writer that reads the
+     * file, for a body that is transformed as it is written.
+     */
+    void read_file_body();
+
     reply& done(const sstring& content_type) {
         return set_content_type(content_type).done();
     }
     /**
      * Done should be called before using the reply.
-     * It would set the response line
      */
     reply& done() {
-        _response_line = response_line();
         return *this;
     }
     sstring response_line();
+
+    using header = std::pair<std::experimental::string_view, std::experimental::string_view>;
+    /**
+     * Formats the status line and the headers, and the empty line that
+     * ends them, into a single buffer to be written at once.  The extra
+     * headers are added after those of the reply, and replace any of the
+     * same name.
+     */
+    sstring format_head(std::initializer_list<header> extra) const;
 };
 
+/**
+ * Writes a part of a file to out, reading it from the disk.
+ */
+future<> write_file_range(const reply::file_range& range, output_stream<char>& out);
+
 } // namespace httpd
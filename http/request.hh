@@ -32,10 +32,12 @@
 #define HTTP_REQUEST_HPP
 
 #include "core/sstring.hh"
+#include "core/iostream.hh"
 #include <string>
 #include <vector>
 #include <strings.h>
 #include "common.hh"
+#include "header_map.hh"
 
 namespace httpd {
 class connection;
@@ -56,11 +58,17 @@ struct request {
     int http_version_minor;
     ctclass content_type_class;
     size_t content_length = 0;
-    std::unordered_map<sstring, sstring> _headers;
+    header_map _headers;
     std::unordered_map<sstring, sstring> query_parameters;
     connection* connection_ptr;
     parameters param;
     sstring content;
+    /**
+     * When the server streams request bodies, the body is read from this
+     * stream instead of being in content.  The stream is only valid until
+     * the handler's future resolves; whatever it leaves unread is skipped.
+     */
+    input_stream<char>* content_stream = nullptr;
     sstring protocol_name;
 
     /**
@@ -59,6 +59,10 @@ action store_value {
 }
 
 action assign_field {
+    if (_req->_headers.size() == max_headers) {
+        _state = state::too_many_headers;
+        fbreak;
+    }
     _req->_headers[_field_name] = std::move(_value);
 }
 
@@ -103,7 +107,11 @@ public:
         error,
         eof,
         done,
+        too_many_headers,
     };
+    // the most headers a message may have, as each one is looked up among
+    // those before it
+    static constexpr size_t max_headers = 100;
     std::unique_ptr<httpd::request> _req;
     sstring _field_name;
     sstring _value;
@@ -123,6 +131,9 @@ public:
             _state = state::error;
         }
         %% write exec;
+        if (_state == state::too_many_headers) {
+            return p;
+        }
         if (!done) {
             p = nullptr;
         } else {
@@ -136,4 +147,7 @@ public:
     bool eof() const {
         return _state == state::eof;
     }
+    bool too_many_headers() const {
+        return _state == state::too_many_headers;
+    }
 };
@@ -22,10 +22,252 @@
 #include "routes.hh"
 #include "reply.hh"
 #include "exception.hh"
+#include "core/metrics.hh"
+#include <algorithm>
+#include <chrono>
+#include <limits>
 
 namespace httpd {
 
 using namespace std;
+using std::experimental::string_view;
+
+/**
+ * The compiled form of a list of match rules: a trie of url segments,
+ * with an edge per static segment, one for any segment (a parameter) and
+ * rules ending at the nodes, either exactly or with a parameter taking
+ * the rest of the url.  A url is walked down all the edges it matches,
+ * and the first rule (in insertion order) reached wins, as it would when
+ * trying the rules one by one.
+ */
+class route_trie {
+    struct target {
+        size_t rule;
+        handler_base* handler;
+        // of the parameters on the way, followed by the remainder's
+        std::vector<sstring> names;
+    };
+    struct node {
+        // sorted by segment
+        std::vector<std::pair<sstring, std::unique_ptr<node>>> children;
+        std::unique_ptr<node> param;
+        std::unique_ptr<target> end;
+        std::unique_ptr<target> remainder;
+        // lowest rule in the subtree, to skip subtrees that cannot win
+        size_t min_rule = std::numeric_limits<size_t>::max();
+    };
+    struct token {
+        sstring segment;
+        const param_matcher* param;
+    };
+    // the state of a lookup
+    struct walk {
+        string_view url;
+        // positions of the slashes starting the segments of the url
+        std::vector<size_t> slashes;
+        std::vector<size_t> captures;
+        const target* best = nullptr;
+        bool best_is_remainder = false;
+        size_t best_remainder = 0;
+        std::vector<size_t> best_captures;
+    };
+    node _root;
+    // rules that are not made of str_matcher and param_matcher
+    std::vector<std::pair<size_t, match_rule*>> _others;
+    const std::vector<match_rule*>& _rules;
+private:
+    static bool compile(const match_rule& rule, std::vector<token>& tokens) {
+        bool remainder = false;
+        for (auto m : rule.matchers()) {
+            if (remainder) {
+                return false;
+            }
+            if (auto s = dynamic_cast<const str_matcher*>(m)) {
+                auto& str = s->str();
+                if (str.empty()) {
+                    continue;
+                }
+                if (str[0] != '/' || str[str.size() - 1] == '/') {
+                    return false;
+                }
+                size_t pos = 0;
+                while (pos != sstring::npos) {
+                    auto next = str.find('/', pos + 1);
+                    auto end = next == sstring::npos ? str.size() : next;
+                    tokens.push_back(token{str.substr(pos + 1, end - pos - 1), nullptr});
+                    pos = next;
+                }
+            } else if (auto p = dynamic_cast<const param_matcher*>(m)) {
+                tokens.push_back(token{{}, p});
+                remainder = p->entire_path();
+            } else {
+                return false;
+            }
+        }
+        return true;
+    }
+    void insert(size_t index, match_rule* rule, const std::vector<token>& tokens) {
+        auto t = std::make_unique<target>();
+        t->rule = index;
+        t->handler = rule->handler();
+        node* n = &_root;
+        n->min_rule = std::min(n->min_rule, index);
+        for (auto& tok : tokens) {
+            if (tok.param && tok.param->entire_path()) {
+                t->names.push_back(tok.param->name());
+                if (!n->remainder) {
+                    n->remainder = std::move(t);
+                }
+                return;
+            }
+            std::unique_ptr<node>* child;
+            if (tok.param) {
+                t->names.push_back(tok.param->name());
+                child = &n->param;
+            } else {
+                auto it = std::lower_bound(n->children.begin(), n->children.end(), tok.segment,
+                        [] (const std::pair<sstring, std::unique_ptr<node>>& c, const sstring& seg) {
+                    return c.first < seg;
+                });
+                if (it == n->children.end() || it->first != tok.segment) {
+                    it = n->children.emplace(it, tok.segment, nullptr);
+                }
+                child = &it->second;
+            }
+            if (!*child) {
+                *child = std::make_unique<node>();
+            }
+            n = child->get();
+            n->min_rule = std::min(n->min_rule, index);
+        }
+        if (!n->end) {
+            n->end = std::move(t);
+        }
+    }
+    string_view segment(const walk& w, size_t i) const {
+        auto end = i + 1 < w.slashes.size() ? w.slashes[i + 1] : w.url.size();
+        return w.url.substr(w.slashes[i] + 1, end - w.slashes[i] - 1);
+    }
+    void found(walk& w, const target* t, bool remainder, size_t seg) const {
+        if (w.best && w.best->rule <= t->rule) {
+            return;
+        }
+        w.best = t;
+        w.best_is_remainder = remainder;
+        w.best_remainder = seg < w.slashes.size() ? w.slashes[seg] : w.url.size();
+        w.best_captures = w.captures;
+    }
+    void find(const node& n, size_t seg, walk& w) const {
+        if (w.best && w.best->rule <= n.min_rule) {
+            return;
+        }
+        auto segs = w.slashes.size();
+        // a trailing slash is allowed
+        if (n.end && (seg == segs || (seg + 1 == segs && segment(w, seg).empty()))) {
+            found(w, n.end.get(), false, seg);
+        }
+        if (n.remainder) {
+            found(w, n.remainder.get(), true, seg);
+        }
+        if (seg == segs) {
+            return;
+        }
+        auto s = segment(w, seg);
+        auto it = std::lower_bound(n.children.begin(), n.children.end(), s,
+                [] (const std::pair<sstring, std::unique_ptr<node>>& c, string_view seg) {
+            return string_view(c.first) < seg;
+        });
+        if (it != n.children.end() && string_view(it->first) == s) {
+            find(*it->second, seg + 1, w);
+        }
+        if (n.param) {
+            w.captures.push_back(seg);
+            find(*n.param, seg + 1, w);
+            w.captures.pop_back();
+        }
+    }
+    static void set_param(parameters& params, const sstring& name, string_view value, bool views) {
+        if (views) {
+            params.set_view(name, value);
+        } else {
+            params.set(name, sstring(value.data(), value.size()));
+        }
+    }
+    handler_base* get_one_by_one(string_view url, parameters& params, size_t before) const {
+        sstring u(url.data(), url.size());
+        for (auto& r : _others) {
+            if (r.first >= before) {
+                break;
+            }
+            auto handler = r.second->get(u, params);
+            if (handler) {
+                return handler;
+            }
+            params.clear();
+        }
+        return nullptr;
+    }
+public:
+    explicit route_trie(const std::vector<match_rule*>& rules) : _rules(rules) {
+        std::vector<token> tokens;
+        for (size_t i = 0; i < rules.size(); i++) {
+            tokens.clear();
+            if (compile(*rules[i], tokens)) {
+                insert(i, rules[i], tokens);
+            } else {
+                _others.emplace_back(i, rules[i]);
+            }
+        }
+    }
+    /**
+     * Returns the handler of the first rule url matches and sets its
+     * parameters, as views into url if views is set.
+     */
+    handler_base* get(string_view url, parameters& params, bool views) const {
+        if (!url.empty() && url[0] != '/') {
+            // not made of segments, try all the rules
+            sstring u(url.data(), url.size());
+            for (auto r : _rules) {
+                auto handler = r->get(u, params);
+                if (handler) {
+                    return handler;
+                }
+                params.clear();
+            }
+            return nullptr;
+        }
+        static thread_local walk w;
+        w.url = url;
+        w.slashes.clear();
+        for (size_t i = 0; i < url.size(); i++) {
+            if (url[i] == '/') {
+                w.slashes.push_back(i);
+            }
+        }
+        w.best = nullptr;
+        find(_root, 0, w);
+        auto before = w.best ? w.best->rule : std::numeric_limits<size_t>::max();
+        if (!_others.empty()) {
+            auto handler = get_one_by_one(url, params, before);
+            if (handler) {
+                return handler;
+            }
+        }
+        if (!w.best) {
+            return nullptr;
+        }
+        auto& names = w.best->names;
+        for (size_t i = 0; i < w.best_captures.size(); i++) {
+            auto seg = w.best_captures[i];
+            auto end = seg + 1 < w.slashes.size() ? w.slashes[seg + 1] : url.size();
+            set_param(params, names[i], url.substr(w.slashes[seg], end - w.slashes[seg]), views);
+        }
+        if (w.best_is_remainder) {
+            set_param(params, names.back(), url.substr(w.best_remainder), views);
+        }
+        return w.best->handler;
+    }
+};
 
 void verify_param(const request& req, const sstring& param) {
     if (req.get_query_param(param) == "") {
@@ -50,6 +292,21 @@ routes::~routes() {
 
 }
 
+routes& routes::add(match_rule* rule, operation_type type) {
+    sstring name;
+    for (auto m : rule->matchers()) {
+        if (auto str = dynamic_cast<str_matcher*>(m)) {
+            name += str->str();
+        } else if (auto param = dynamic_cast<param_matcher*>(m)) {
+            name += "{" + param->name() + "}";
+        }
+    }
+    _route_names.emplace(rule->handler(), std::make_pair(type, std::move(name)));
+    _rules[type].push_back(rule);
+    _tries[type].reset();
+    return *this;
+}
+
 std::unique_ptr<reply> routes::exception_reply(std::exception_ptr eptr) {
     auto rep = std::make_unique<reply>();
     try {
@@ -81,54 +338,177 @@ std::unique_ptr<reply> routes::exception_reply(std::exception_ptr eptr) {
 }
 
 future<std::unique_ptr<reply> > routes::handle(const sstring& path, std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    // parameters can be views into the request's own url, which lives as
+    // long as they do, but not into path
+    string_view url = path;
+    bool views = req->_url.size() >= path.size() && !req->_url.compare(0, path.size(), path);
+    if (views) {
+        url = string_view(req->_url).substr(0, path.size());
+    }
     handler_base* handler = get_handler(str2type(req->_method),
-            normalize_url(path), req->param);
+            normalize_url(url), req->param, views);
     if (handler != nullptr) {
-        try {
-            for (auto& i : handler->_mandatory_param) {
-                verify_param(*req.get(), i);
-            }
-            auto r =  handler->handle(path, std::move(req), std::move(rep));
-            return r.handle_exception(_general_handler);
-        } catch (const redirect_exception& _e) {
-            rep.reset(new reply());
-            rep->add_header("Location", _e.url).set_status(_e.status()).done(
-                    "json");
-        } catch (...) {
-            rep = exception_reply(std::current_exception());
-        }
-    } else {
+        if (_metrics_enabled) {
+            return call_counted(*handler, path, std::move(req), std::move(rep));
+        }
+        return call_handler(*handler, path, std::move(req), std::move(rep));
+    }
+    rep.reset(new reply());
+    json_exception ex(not_found_exception("Not found"));
+    rep->set_status(reply::status_type::not_found, ex.to_json()).done(
+            "json");
+    return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+}
+
+future<std::unique_ptr<reply>> routes::call_handler(handler_base& handler, const sstring& path,
+        std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    try {
+        for (auto& i : handler._mandatory_param) {
+            verify_param(*req.get(), i);
+        }
+        rep->_compression = handler._compression;
+        auto r =  handler.handle(path, std::move(req), std::move(rep));
+        return r.handle_exception(_general_handler);
+    } catch (const redirect_exception& _e) {
         rep.reset(new reply());
-        json_exception ex(not_found_exception("Not found"));
-        rep->set_status(reply::status_type::not_found, ex.to_json()).done(
+        rep->add_header("Location", _e.url).set_status(_e.status()).done(
                 "json");
+    } catch (...) {
+        rep = exception_reply(std::current_exception());
     }
     return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
 }
 
-sstring routes::normalize_url(const sstring& url) {
-    if (url.length() < 2 || url.at(url.length() - 1) != '/') {
-        return url;
+// Passes a reply body on to out, counting its bytes.
+class counting_sink_impl : public data_sink_impl {
+    output_stream<char> _out;
+    uint64_t& _bytes;
+public:
+    counting_sink_impl(output_stream<char>&& out, uint64_t& bytes) : _out(std::move(out)), _bytes(bytes) {
     }
-    return url.substr(0, url.length() - 1);
+    virtual future<> put(net::packet data) override {
+        _bytes += data.len();
+        return _out.write(std::move(data));
+    }
+    virtual future<> flush() override {
+        return _out.flush();
+    }
+    virtual future<> close() override {
+        return _out.close();
+    }
+};
+
+// Ends a request in its route's stats, once: when its reply is returned,
+// or for a streamed reply, when its body is written, or at the latest when
+// the reply is dropped without being sent.
+class request_tracker {
+    handler_stats& _stats;
+    std::chrono::steady_clock::time_point _start;
+    bool _done = false;
+public:
+    request_tracker(handler_stats& stats, std::chrono::steady_clock::time_point start) : _stats(stats), _start(start) {
+        _stats.requests_in_flight++;
+    }
+    ~request_tracker() {
+        done();
+    }
+    void done() {
+        if (!_done) {
+            _done = true;
+            _stats.requests_in_flight--;
+            _stats.latency.add(std::chrono::steady_clock::now() - _start);
+        }
+    }
+};
+
+future<std::unique_ptr<reply>> routes::call_counted(handler_base& handler, const sstring& path,
+        std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+    auto& stats = stats_for(handler);
+    stats.request_bytes += std::max(req->content_length, req->content.size());
+    auto tracker = make_lw_shared<request_tracker>(stats, std::chrono::steady_clock::now());
+    return call_handler(handler, path, std::move(req), std::move(rep)).then_wrapped([&stats, tracker] (future<std::unique_ptr<reply>> f) {
+        auto rep = f.get0();
+        auto status_class = std::min(std::max(int(rep->_status) / 100, 1), 5);
+        stats.replies[status_class - 1]++;
+        stats.response_bytes += rep->_content.size();
+        if (rep->_file) {
+            stats.response_bytes += rep->_file->length;
+        }
+        if (!rep->_body_writer) {
+            tracker->done();
+            return rep;
+        }
+        rep->_body_writer = [writer = std::move(rep->_body_writer), &stats, tracker] (output_stream<char>&& out) {
+            return writer(output_stream<char>(data_sink(std::make_unique<counting_sink_impl>(std::move(out),
+                    stats.response_bytes)), 32 * 1024)).finally([tracker] {
+                tracker->done();
+            });
+        };
+        return rep;
+    });
 }
 
-handler_base* routes::get_handler(operation_type type, const sstring& url,
-        parameters& params) {
-    handler_base* handler = get_exact_match(type, url);
-    if (handler != nullptr) {
-        return handler;
+handler_stats& routes::stats_for(handler_base& handler) {
+    if (handler._stats) {
+        return *handler._stats;
     }
+    handler._stats = std::make_unique<handler_stats>();
+    auto& stats = *handler._stats;
+    auto name = _route_names.find(&handler);
+    namespace sm = seastar::metrics;
+    std::vector<sm::label_instance> labels{
+        sm::label_instance("service", _metrics_service),
+        sm::label_instance("method", name != _route_names.end() ? type2str(name->second.first) : "unknown"),
+        sm::label_instance("route", name != _route_names.end() ? name->second.second : sstring("unknown")),
+    };
+    stats.metrics.add_group("httpd_route", {
+        sm::make_histogram("latency", sm::description("Time from routing a request until its handler returned the reply, or wrote the body of a streamed one, in microseconds"), labels, [&stats] {
+            return stats.latency.to_metrics_histogram();
+        }),
+        sm::make_gauge("requests_in_flight", sm::description("The number of requests the handler is handling"), labels, [&stats] {
+            return stats.requests_in_flight;
+        }),
+        sm::make_derive("request_bytes", sm::description("The total size of the request bodies"), labels, [&stats] {
+            return stats.request_bytes;
+        }),
+        sm::make_derive("response_bytes", sm::description("The total size of the reply bodies, before compression"), labels, [&stats] {
+            return stats.response_bytes;
+        }),
+    });
+    for (unsigned i = 0; i < stats.replies.size(); i++) {
+        auto status_labels = labels;
+        status_labels.push_back(sm::label_instance("status", to_sstring(i + 1) + "xx"));
+        stats.metrics.add_group("httpd_route", {
+            sm::make_derive("replies", sm::description("The total number of replies by status class"), status_labels, [&stats, i] {
+                return stats.replies[i];
+            }),
+        });
+    }
+    return stats;
+}
 
-    for (auto rule = _rules[type].cbegin(); rule != _rules[type].cend();
-            ++rule) {
-        handler = (*rule)->get(url, params);
-        if (handler != nullptr) {
-            return handler;
+string_view routes::normalize_url(string_view url) {
+    if (url.length() < 2 || url[url.length() - 1] != '/') {
+        return url;
+    }
+    return url.substr(0, url.length() - 1);
+}
+
+handler_base* routes::get_handler(operation_type type, string_view url,
+        parameters& params, bool url_outlives_params) {
+    if (!_map[type].empty()) {
+        auto exact = _map[type].find(sstring(url.data(), url.size()));
+        if (exact != _map[type].end()) {
+            return exact->second;
         }
-        params.clear();
     }
-    return nullptr;
+    if (_rules[type].empty()) {
+        return nullptr;
+    }
+    if (!_tries[type]) {
+        _tries[type] = std::make_unique<route_trie>(_rules[type]);
+    }
+    return _tries[type]->get(url, params, url_outlives_params);
 }
 
 routes& routes::add(operation_type type, const url& url,
@@ -34,6 +34,8 @@
 
 namespace httpd {
 
+class route_trie;
+
 /**
  * The url helps defining a route.
  */
@@ -72,6 +74,12 @@ class url {
  * (an optional leading slash is permitted) it is choosen
  * If not, the matching rules are used.
  * matching rules are evaluated by their insertion order
+ *
+ * Rules made of str_matcher and param_matcher (as url and json2code
+ * generated rules are) are compiled, on first use after a change, into a
+ * trie of url segments, so a url is matched against all of them in one
+ * walk.  Parameters are then views into the request url rather than
+ * copies.  Other rules are tried one by one, as before.
  */
 class routes {
 public:
@@ -91,6 +99,7 @@ class routes {
         //FIXME if a handler is already exists, it need to be
         // deleted to prevent memory leak
         _map[type][url] = handler;
+        _route_names.emplace(handler, std::make_pair(type, url));
         return *this;
     }
 
@@ -103,10 +112,7 @@ class routes {
      * @param type the operation type
      * @return it self
      */
-    routes& add(match_rule* rule, operation_type type = GET) {
-        _rules[type].push_back(rule);
-        return *this;
-    }
+    routes& add(match_rule* rule, operation_type type = GET);
 
     /**
      * Add a url match to a handler:
@@ -130,6 +136,18 @@ class routes {
      */
     future<std::unique_ptr<reply> > handle(const sstring& path, std::unique_ptr<request> req, std::unique_ptr<reply> rep);
 
+    /**
+     * Count the requests each handler handles, and export that as metrics
+     * labelled with the service and the handler's method and route (the
+     * first it was added with): a latency histogram, the requests in
+     * flight, request and response body bytes and replies by status class.
+     * @param service the service label, the server's name
+     */
+    void enable_metrics(const sstring& service) {
+        _metrics_service = service;
+        _metrics_enabled = true;
+    }
+
     /**
      * Search and return an exact match
      * @param url the request url
@@ -149,20 +167,31 @@ class routes {
      * @param params a parameter object that will be filled during the match
      * @return a handler based on the type/url match
      */
-    handler_base* get_handler(operation_type type, const sstring& url,
-            parameters& params);
+    handler_base* get_handler(operation_type type, std::experimental::string_view url,
+            parameters& params, bool url_outlives_params);
 
     /**
      * Normalize the url to remove the last / if exists
-     * and get the parameter part
      * @param url the full url path
-     * @param param_part will hold the string with the parameters
      * @return the url from the request without the last /
      */
-    sstring normalize_url(const sstring& url);
+    std::experimental::string_view normalize_url(std::experimental::string_view url);
+
+    future<std::unique_ptr<reply>> call_handler(handler_base& handler, const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+    future<std::unique_ptr<reply>> call_counted(handler_base& handler, const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep);
+    handler_stats& stats_for(handler_base& handler);
 
     std::unordered_map<sstring, handler_base*> _map[NUM_OPERATION];
     std::vector<match_rule*> _rules[NUM_OPERATION];
+    // compiled from _rules on demand
+    std::unique_ptr<route_trie> _tries[NUM_OPERATION];
+    // the method and route each handler was first added with, to label
+    // its metrics
+    std::unordered_map<const handler_base*, std::pair<operation_type, sstring>> _route_names;
+    sstring _metrics_service;
+    bool _metrics_enabled = false;
 public:
     using exception_handler_fun = std::function<std::unique_ptr<reply>(std::exception_ptr eptr)>;
     using exception_handler_id = size_t;
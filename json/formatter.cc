@@ -21,12 +21,74 @@
 
 #include "formatter.hh"
 #include "json_elements.hh"
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 
 using namespace std;
 
 namespace json {
 
+// Numbers are formatted into a buffer on the stack, which to_json()
+// copies into a string and write() into the stream.
+static constexpr size_t number_buffer_size = 32;
+
+static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+// Writes n's digits to end at end, two at a time, and returns where they
+// start.
+static char* format_unsigned(char* end, unsigned long n) {
+    while (n >= 100) {
+        auto i = n % 100 * 2;
+        n /= 100;
+        *--end = digit_pairs[i + 1];
+        *--end = digit_pairs[i];
+    }
+    if (n >= 10) {
+        *--end = digit_pairs[n * 2 + 1];
+        *--end = digit_pairs[n * 2];
+    } else {
+        *--end = '0' + n;
+    }
+    return end;
+}
+
+static char* format_signed(char* end, long n) {
+    if (n >= 0) {
+        return format_unsigned(end, n);
+    }
+    auto p = format_unsigned(end, -static_cast<unsigned long>(n));
+    *--p = '-';
+    return p;
+}
+
+// Formats d as "%g" does, returning the length.  Integral values below
+// %g's precision, which are common, take the integer path.
+static size_t format_double(char* buf, double d, const char* type) {
+    if (std::isinf(d)) {
+        throw out_of_range(sstring("Infinite ") + type + " value is not supported");
+    } else if (std::isnan(d)) {
+        throw invalid_argument(sstring("Invalid ") + type + " value");
+    }
+    if (std::trunc(d) == d && std::abs(d) < 1e6 && !(d == 0 && std::signbit(d))) {
+        auto end = buf + number_buffer_size;
+        auto p = format_signed(end, static_cast<long>(d));
+        std::copy(p, end, buf);
+        return end - p;
+    }
+    return snprintf(buf, number_buffer_size, "%g", d);
+}
+
 sstring formatter::begin(state s) {
     switch (s) {
     case state::array: return "[";
@@ -56,29 +118,24 @@ sstring formatter::to_json(const char* str) {
 }
 
 sstring formatter::to_json(int n) {
-    return to_string(n);
+    return to_json(long(n));
 }
 
 sstring formatter::to_json(long n) {
-    return to_string(n);
+    char buf[number_buffer_size];
+    auto end = buf + sizeof(buf);
+    auto p = format_signed(end, n);
+    return sstring(p, end - p);
 }
 
 sstring formatter::to_json(float f) {
-    if (std::isinf(f)) {
-        throw out_of_range("Infinite float value is not supported");
-    } else if (std::isnan(f)) {
-        throw invalid_argument("Invalid float value");
-    }
-    return to_sstring(f);
+    char buf[number_buffer_size];
+    return sstring(buf, format_double(buf, f, "float"));
 }
 
 sstring formatter::to_json(double d) {
-    if (std::isinf(d)) {
-        throw out_of_range("Infinite double value is not supported");
-    } else if (std::isnan(d)) {
-        throw invalid_argument("Invalid double value");
-    }
-    return to_sstring(d);
+    char buf[number_buffer_size];
+    return sstring(buf, format_double(buf, d, "double"));
 }
 
 sstring formatter::to_json(bool b) {
@@ -98,7 +155,70 @@ sstring formatter::to_json(const jsonable& obj) {
 }
 
 sstring formatter::to_json(unsigned long l) {
-    return to_string(l);
+    char buf[number_buffer_size];
+    auto end = buf + sizeof(buf);
+    auto p = format_unsigned(end, l);
+    return sstring(p, end - p);
+}
+
+future<> formatter::write(output_stream<char>& s, const sstring& str) {
+    return write(s, str.c_str());
+}
+
+future<> formatter::write(output_stream<char>& s, const char* str) {
+    return s.write("\"", 1).then([&s, str] {
+        return s.write(str);
+    }).then([&s] {
+        return s.write("\"", 1);
+    });
+}
+
+future<> formatter::write(output_stream<char>& s, int n) {
+    return write(s, long(n));
+}
+
+future<> formatter::write(output_stream<char>& s, long n) {
+    char buf[number_buffer_size];
+    auto end = buf + sizeof(buf);
+    auto p = format_signed(end, n);
+    return s.write(p, end - p);
+}
+
+future<> formatter::write(output_stream<char>& s, unsigned long l) {
+    char buf[number_buffer_size];
+    auto end = buf + sizeof(buf);
+    auto p = format_unsigned(end, l);
+    return s.write(p, end - p);
+}
+
+future<> formatter::write(output_stream<char>& s, float f) {
+    char buf[number_buffer_size];
+    try {
+        return s.write(buf, format_double(buf, f, "float"));
+    } catch (...) {
+        return make_exception_future<>(std::current_exception());
+    }
+}
+
+future<> formatter::write(output_stream<char>& s, double d) {
+    char buf[number_buffer_size];
+    try {
+        return s.write(buf, format_double(buf, d, "double"));
+    } catch (...) {
+        return make_exception_future<>(std::current_exception());
+    }
+}
+
+future<> formatter::write(output_stream<char>& s, bool b) {
+    return b ? s.write("true", 4) : s.write("false", 5);
+}
+
+future<> formatter::write(output_stream<char>& s, const date_time& d) {
+    return s.write(to_json(d));
+}
+
+future<> formatter::write(output_stream<char>& s, const jsonable& obj) {
+    return obj.write(s);
 }
 
 }
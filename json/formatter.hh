@@ -29,6 +29,9 @@
 #include <time.h>
 #include <sstream>
 #include "core/sstring.hh"
+#include "core/iostream.hh"
+#include "core/future-util.hh"
+#include "core/do_with.hh"
 
 namespace json {
 
@@ -75,6 +78,45 @@ class formatter {
     static sstring to_json(state, const T& t) {
         return to_json(t);
     }
+
+    template<typename K, typename V>
+    static future<> write(output_stream<char>& s, state st, const std::pair<K, V>& p) {
+        if (st == state::array) {
+            return s.write("{", 1).then([&s, &p] {
+                return write(s, state::none, p);
+            }).then([&s] {
+                return s.write("}", 1);
+            });
+        }
+        return write(s, p.first).then([&s, &p] {
+            return s.write(":", 1);
+        }).then([&s, &p] {
+            return write(s, p.second);
+        });
+    }
+
+    template<typename Iter>
+    static future<> write(output_stream<char>& s, state st, Iter i, Iter e) {
+        return s.write(begin(st)).then([&s, st, i, e] {
+            return do_with(true, [&s, st, i, e] (bool& first) {
+                return do_for_each(i, e, [&s, st, &first] (const auto& v) {
+                    auto f = first ? make_ready_future<>() : s.write(",", 1);
+                    first = false;
+                    return f.then([&s, st, &v] {
+                        return write(s, st, v);
+                    });
+                });
+            });
+        }).then([&s, st] {
+            return s.write(end(st));
+        });
+    }
+
+    // fallback template
+    template<typename T>
+    static future<> write(output_stream<char>& s, state, const T& t) {
+        return write(s, t);
+    }
 public:
 
     /**
@@ -167,6 +209,38 @@ class formatter {
      */
     static sstring to_json(unsigned long l);
 
+    /**
+     * Writes values in a json format to a stream, as to_json() formats
+     * them, but without building the whole of it in memory: the future
+     * resolves when the stream took it, so a large value is written as
+     * fast as the stream drains.  The value must live until then.
+     */
+    static future<> write(output_stream<char>& s, const sstring& str);
+    static future<> write(output_stream<char>& s, const char* str);
+    static future<> write(output_stream<char>& s, int n);
+    static future<> write(output_stream<char>& s, long n);
+    static future<> write(output_stream<char>& s, unsigned long l);
+    static future<> write(output_stream<char>& s, float f);
+    static future<> write(output_stream<char>& s, double d);
+    static future<> write(output_stream<char>& s, bool b);
+    static future<> write(output_stream<char>& s, const date_time& d);
+    static future<> write(output_stream<char>& s, const jsonable& obj);
+
+    template<typename... Args>
+    static future<> write(output_stream<char>& s, const std::vector<Args...>& vec) {
+        return write(s, state::array, vec.begin(), vec.end());
+    }
+
+    template<typename... Args>
+    static future<> write(output_stream<char>& s, const std::map<Args...>& map) {
+        return write(s, state::map, map.begin(), map.end());
+    }
+
+    template<typename... Args>
+    static future<> write(output_stream<char>& s, const std::unordered_map<Args...>& map) {
+        return write(s, state::map, map.begin(), map.end());
+    }
+
 private:
 
     static constexpr const char* TIME_FORMAT = "%a %b %d %I:%M:%S %Z %Y";
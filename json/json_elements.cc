@@ -101,6 +101,29 @@ string json_base::to_json() const {
     return res.as_json();
 }
 
+future<> json_base::write(output_stream<char>& s) const {
+    return s.write("{", 1).then([this, &s] {
+        return do_with(true, [this, &s] (bool& first) {
+            return do_for_each(_elements, [&s, &first] (json_base_element* element) {
+                if (element == nullptr || element->_set == false) {
+                    return make_ready_future<>();
+                }
+                auto f = first ? s.write("\"", 1) : s.write(", \"", 3);
+                first = false;
+                return f.then([&s, element] {
+                    return s.write(element->_name);
+                }).then([&s] {
+                    return s.write("\": ", 3);
+                }).then([&s, element] {
+                    return element->write(s);
+                });
+            });
+        });
+    }).then([&s] {
+        return s.write("}", 1);
+    });
+}
+
 bool json_base::is_verify() const {
     for (auto i : _elements) {
         if (!i->is_verify()) {
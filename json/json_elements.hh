@@ -26,6 +26,7 @@
 #include <vector>
 #include <time.h>
 #include <sstream>
+#include <functional>
 #include "formatter.hh"
 #include "core/sstring.hh"
 
@@ -73,6 +74,14 @@ class json_base_element {
      */
     virtual std::string to_string() = 0;
 
+    /**
+     * Writes the internal value in a json format to a stream.
+     * By default it writes what to_string() returns.
+     */
+    virtual future<> write(output_stream<char>& s) {
+        return s.write(to_string());
+    }
+
     std::string _name;
     bool _mandatory;
     bool _set;
@@ -129,6 +138,10 @@ class json_element : public json_base_element {
         return formatter::to_json(_value);
     }
 
+    virtual future<> write(output_stream<char>& s) override {
+        return formatter::write(s, _value);
+    }
+
 private:
     T _value;
 };
@@ -157,6 +170,10 @@ class json_list : public json_base_element {
         return formatter::to_json(_elements);
     }
 
+    virtual future<> write(output_stream<char>& s) override {
+        return formatter::write(s, _elements);
+    }
+
     /**
      * Assignment can be done from any object that support const range
      * iteration and that it's elements can be assigned to the list elements
@@ -181,6 +198,15 @@ class jsonable {
      * @return the object formated.
      */
     virtual std::string to_json() const = 0;
+
+    /**
+     * Writes the object formatted to a stream; the object must live
+     * until the returned future resolves.
+     * By default it writes what to_json() returns.
+     */
+    virtual future<> write(output_stream<char>& s) const {
+        return s.write(to_json());
+    }
 };
 
 /**
@@ -209,6 +235,11 @@ struct json_base : public jsonable {
      */
     virtual std::string to_json() const;
 
+    /**
+     * Write the object formatted to a stream, an element at a time.
+     */
+    virtual future<> write(output_stream<char>& s) const override;
+
     /**
      * Check that all mandatory elements are set
      * @return true if all mandatory parameters are set
@@ -237,6 +268,9 @@ struct json_void : public jsonable{
     virtual std::string to_json() const {
         return "";
     }
+    virtual future<> write(output_stream<char>& s) const override {
+        return make_ready_future<>();
+    }
 };
 
 
@@ -254,14 +288,67 @@ struct json_void : public jsonable{
  */
 struct json_return_type {
     sstring _res;
+    /**
+     * When set, writes the value to the reply's body instead of _res,
+     * see stream_object() and stream_range_as_array().
+     */
+    std::function<future<>(output_stream<char>&&)> _body_writer;
     template<class T>
     json_return_type(const T& res) {
         _res = formatter::to_json(res);
     }
+    json_return_type(std::function<future<>(output_stream<char>&&)>&& body_writer)
+            : _body_writer(std::move(body_writer)) {
+    }
     json_return_type(json_return_type&&) = default;
     json_return_type& operator=(json_return_type&&) = default;
 };
 
+/**
+ * Returns a body writer that writes val in a json format as it goes,
+ * rather than formatting all of it first, and closes the stream.
+ * Return it as a json_return_type to stream a large reply.
+ */
+template<typename T>
+std::function<future<>(output_stream<char>&&)> stream_object(T val) {
+    return [val = std::move(val)] (output_stream<char>&& s) mutable {
+        return do_with(std::move(s), std::move(val), [] (output_stream<char>& s, const T& val) {
+            return formatter::write(s, val).finally([&s] {
+                return s.close();
+            });
+        });
+    };
+}
+
+/**
+ * Returns a body writer that writes a json array of what fun returns for
+ * each element of container, calling it as the array is written, so the
+ * values need not all exist at once.  Closes the stream.
+ */
+template<typename Container, typename Func>
+std::function<future<>(output_stream<char>&&)> stream_range_as_array(Container container, Func fun) {
+    return [container = std::move(container), fun = std::move(fun)] (output_stream<char>&& s) mutable {
+        return do_with(std::move(s), std::move(container), std::move(fun), true,
+                [] (output_stream<char>& s, const Container& container, Func& fun, bool& first) {
+            return s.write("[", 1).then([&s, &container, &fun, &first] {
+                return do_for_each(container, [&s, &fun, &first] (const auto& element) {
+                    auto f = first ? make_ready_future<>() : s.write(",", 1);
+                    first = false;
+                    return f.then([&s, &fun, &element] {
+                        return do_with(fun(element), [&s] (const auto& val) {
+                            return formatter::write(s, val);
+                        });
+                    });
+                });
+            }).then([&s] {
+                return s.write("]", 1);
+            }).finally([&s] {
+                return s.close();
+            });
+        });
+    };
+}
+
 }
 
 #endif /* JSON_ELEMENTS_HH_ */
@@ -24,6 +24,7 @@
 
 #include <memory>
 #include <vector>
+#include <chrono>
 #include <cstring>
 #include "core/future.hh"
 #include "net/byteorder.hh"
@@ -186,6 +187,30 @@ class connected_socket {
     void set_keepalive_parameters(const net::keepalive_params& p);
     /// Get TCP keepalive parameters
     net::keepalive_params get_keepalive_parameters() const;
+    /// Enables busy polling for incoming data
+    ///
+    /// While a read is waiting for data, the socket is polled from the
+    /// reactor's poll loop for up to \c budget before the reactor waits
+    /// for an event notification, trading CPU time for lower receive
+    /// latency.  A zero budget disables busy polling.  Stacks that do not
+    /// support it ignore this.
+    void set_busy_poll(std::chrono::microseconds budget);
+    /// Whether send_file() is supported
+    ///
+    /// \return true on the posix stack, where the kernel copies the file
+    /// to the socket; false on stacks that must read it into memory first.
+    bool can_send_file() const;
+    /// Sends part of a file to the remote endpoint
+    ///
+    /// The data goes from the page cache to the socket without passing
+    /// through user memory.  It bypasses the output stream, so anything
+    /// written to the stream must be flushed first, with
+    /// output_stream::flush_to_sink().
+    /// \param in_fd a descriptor of the file, which must stay open until
+    ///              the returned future resolves
+    /// \param offset where in the file the data starts
+    /// \param len how much of the file to send
+    future<> send_file(int in_fd, uint64_t offset, uint64_t len);
 
     /// Disables output to the socket.
     ///
@@ -28,7 +28,10 @@
 #include "core/byteorder.hh"
 #include "ethernet.hh"
 #include "core/print.hh"
+#include "core/lowres_clock.hh"
+#include "core/bitops.hh"
 #include <unordered_map>
+#include <vector>
 
 namespace net {
 
@@ -37,6 +40,130 @@ class arp_for_protocol;
 template <typename L3>
 class arp_for;
 
+// Open-addressing (linear probing) map from protocol to hardware addresses.
+// Lookups happen for every transmitted packet, so keep them to a probe or
+// two over a contiguous array instead of chasing unordered_map nodes.
+template <typename L3Addr, typename L2Addr>
+class neighbor_table {
+public:
+    struct entry {
+        L3Addr paddr;
+        L2Addr hwaddr;
+        lowres_clock::time_point expires;
+        bool used = false;
+        bool occupied = false;
+    };
+private:
+    std::vector<entry> _slots;
+    size_t _size = 0;
+    unsigned _shift;
+private:
+    size_t index_of(const L3Addr& a) const {
+        // Fibonacci hashing; neighbors tend to be sequential addresses.
+        return (uint64_t(std::hash<L3Addr>()(a)) * 0x9e3779b97f4a7c15ull) >> _shift;
+    }
+    size_t next(size_t i) const {
+        return (i + 1) & (_slots.size() - 1);
+    }
+    void grow() {
+        auto old = std::move(_slots);
+        _slots = std::vector<entry>(old.size() * 2);
+        _shift -= 1;
+        _size = 0;
+        for (auto& e : old) {
+            if (e.occupied) {
+                insert(e.paddr) = e;
+            }
+        }
+    }
+public:
+    // initial_capacity must be a power of two
+    explicit neighbor_table(size_t initial_capacity = 64)
+        : _slots(initial_capacity), _shift(64 - log2ceil(initial_capacity)) {
+    }
+    entry* find(const L3Addr& a) {
+        for (auto i = index_of(a); _slots[i].occupied; i = next(i)) {
+            if (_slots[i].paddr == a) {
+                return &_slots[i];
+            }
+        }
+        return nullptr;
+    }
+    // Returns the existing entry for a, or a fresh occupied entry whose
+    // remaining fields the caller is expected to fill in.
+    entry& insert(const L3Addr& a) {
+        if ((_size + 1) * 2 > _slots.size()) {
+            grow();
+        }
+        auto i = index_of(a);
+        for (; _slots[i].occupied; i = next(i)) {
+            if (_slots[i].paddr == a) {
+                return _slots[i];
+            }
+        }
+        auto& e = _slots[i];
+        e = entry();
+        e.paddr = a;
+        e.occupied = true;
+        ++_size;
+        return e;
+    }
+    void erase(const L3Addr& a) {
+        auto i = index_of(a);
+        while (_slots[i].occupied && !(_slots[i].paddr == a)) {
+            i = next(i);
+        }
+        if (!_slots[i].occupied) {
+            return;
+        }
+        // Backward-shift deletion: pull later members of the probe chain
+        // into the hole so that lookups never need tombstones.
+        auto hole = i;
+        for (auto j = next(hole); _slots[j].occupied; j = next(j)) {
+            auto home = index_of(_slots[j].paddr);
+            if (((j - home) & (_slots.size() - 1)) >= ((j - hole) & (_slots.size() - 1))) {
+                _slots[hole] = _slots[j];
+                hole = j;
+            }
+        }
+        _slots[hole].occupied = false;
+        --_size;
+    }
+    template <typename Func>
+    void for_each(Func&& func) {
+        for (auto& e : _slots) {
+            if (e.occupied) {
+                func(e);
+            }
+        }
+    }
+    // Erases the entries that expired by now.  Entries used since their
+    // last refresh that expire within window are passed to refresh(), which
+    // is expected to get them extended, and marked unused.  Entries that
+    // expire at time_point::max() are static and left alone.
+    template <typename Func>
+    void age(lowres_clock::time_point now, lowres_clock::duration window, Func&& refresh) {
+        std::vector<L3Addr> expired;
+        for_each([&] (entry& e) {
+            if (e.expires == lowres_clock::time_point::max()) {
+                return;
+            }
+            if (now >= e.expires) {
+                expired.push_back(e.paddr);
+            } else if (e.used && e.expires - now <= window) {
+                e.used = false;
+                refresh(e);
+            }
+        });
+        for (auto& paddr : expired) {
+            erase(paddr);
+        }
+    }
+    size_t size() const {
+        return _size;
+    }
+};
+
 class arp_for_protocol {
 protected:
     arp& _arp;
@@ -86,7 +213,19 @@ class arp_for : public arp_for_protocol {
     using l2addr = ethernet_address;
     using l3addr = typename L3::address_type;
 private:
+    // Bound on packets queued behind one unresolved destination, and on the
+    // number of destinations being resolved at once.
     static constexpr auto max_waiters = 512;
+    static constexpr auto max_resolutions = 1024;
+    // Resolutions with no waiters are abandoned after this many queries.
+    static constexpr unsigned max_query_attempts = 3;
+    static lowres_clock::duration tick_interval() { return std::chrono::milliseconds(100); }
+    static lowres_clock::duration query_interval() { return std::chrono::seconds(1); }
+    static lowres_clock::duration aging_interval() { return std::chrono::seconds(1); }
+    // Entries are refreshed shortly before they expire if they were used
+    // since the last refresh, and dropped otherwise.
+    static lowres_clock::duration reachable_time() { return std::chrono::seconds(60); }
+    static lowres_clock::duration refresh_window() { return std::chrono::seconds(5); }
     enum oper {
         op_request = 1,
         op_reply = 2,
@@ -132,29 +271,45 @@ class arp_for : public arp_for_protocol {
     };
     struct resolution {
         std::vector<promise<l2addr>> _waiters;
-        timer<> _timeout_timer;
+        lowres_clock::time_point _deadline;
+        unsigned _attempts = 0;
     };
+    using table_type = neighbor_table<l3addr, l2addr>;
 private:
     l3addr _l3self = L3::broadcast_address();
-    std::unordered_map<l3addr, l2addr> _table;
+    table_type _table;
     std::unordered_map<l3addr, resolution> _in_progress;
+    // One timer drives query retransmission for all pending resolutions as
+    // well as entry aging, so a burst of misses doesn't arm a timer per peer.
+    timer<lowres_clock> _timer;
+    lowres_clock::time_point _next_aging;
 private:
     packet make_query_packet(l3addr paddr);
     virtual future<> received(packet p) override;
     future<> handle_request(arp_hdr* ah);
     l2addr l2self() { return _arp.l2self(); }
     void send(l2addr to, packet p);
+    void set_static(l3addr paddr, l2addr hwaddr) {
+        auto& e = _table.insert(paddr);
+        e.hwaddr = hwaddr;
+        e.expires = lowres_clock::time_point::max();
+    }
+    void on_timer();
+    void retransmit_queries(lowres_clock::time_point now);
+    void age_entries(lowres_clock::time_point now);
 public:
     future<> send_query(const l3addr& paddr);
     explicit arp_for(arp& a) : arp_for_protocol(a, L3::arp_protocol_type()) {
-        _table[L3::broadcast_address()] = ethernet::broadcast_address();
+        set_static(L3::broadcast_address(), ethernet::broadcast_address());
+        _timer.set_callback([this] { on_timer(); });
+        _timer.arm_periodic(tick_interval());
     }
     future<ethernet_address> lookup(const l3addr& addr);
     void learn(l2addr l2, l3addr l3);
     void run();
     void set_self_addr(l3addr addr) {
         _table.erase(_l3self);
-        _table[addr] = l2self();
+        set_static(addr, l2self());
         _l3self = addr;
     }
     friend class arp;
@@ -209,25 +364,22 @@ class arp_queue_full_error : public arp_error {
 template <typename L3>
 future<ethernet_address>
 arp_for<L3>::lookup(const l3addr& paddr) {
-    auto i = _table.find(paddr);
-    if (i != _table.end()) {
-        return make_ready_future<ethernet_address>(i->second);
+    auto e = _table.find(paddr);
+    if (e) {
+        e->used = true;
+        return make_ready_future<ethernet_address>(e->hwaddr);
     }
     auto j = _in_progress.find(paddr);
-    auto first_request = j == _in_progress.end();
-    auto& res = first_request ? _in_progress[paddr] : j->second;
-
-    if (first_request) {
-        res._timeout_timer.set_callback([paddr, this, &res] {
-            send_query(paddr);
-            for (auto& w : res._waiters) {
-                w.set_exception(arp_timeout_error());
-            }
-            res._waiters.clear();
-        });
-        res._timeout_timer.arm_periodic(std::chrono::seconds(1));
+    if (j == _in_progress.end()) {
+        if (_in_progress.size() >= max_resolutions) {
+            return make_exception_future<ethernet_address>(arp_queue_full_error());
+        }
+        j = _in_progress.emplace(paddr, resolution()).first;
+        j->second._deadline = lowres_clock::now() + query_interval();
+        j->second._attempts = 1;
         send_query(paddr);
     }
+    auto& res = j->second;
 
     if (res._waiters.size() >= max_waiters) {
         return make_exception_future<ethernet_address>(arp_queue_full_error());
@@ -240,11 +392,16 @@ arp_for<L3>::lookup(const l3addr& paddr) {
 template <typename L3>
 void
 arp_for<L3>::learn(l2addr hwaddr, l3addr paddr) {
-    _table[paddr] = hwaddr;
+    auto& e = _table.insert(paddr);
+    if (e.expires == lowres_clock::time_point::max()) {
+        // broadcast and our own address are not up for negotiation
+        return;
+    }
+    e.hwaddr = hwaddr;
+    e.expires = lowres_clock::now() + reachable_time();
     auto i = _in_progress.find(paddr);
     if (i != _in_progress.end()) {
         auto& res = i->second;
-        res._timeout_timer.cancel();
         for (auto &&pr : res._waiters) {
             pr.set_value(hwaddr);
         }
@@ -252,6 +409,54 @@ arp_for<L3>::learn(l2addr hwaddr, l3addr paddr) {
     }
 }
 
+template <typename L3>
+void
+arp_for<L3>::on_timer() {
+    auto now = lowres_clock::now();
+    if (!_in_progress.empty()) {
+        retransmit_queries(now);
+    }
+    if (now >= _next_aging) {
+        age_entries(now);
+        _next_aging = now + aging_interval();
+    }
+}
+
+template <typename L3>
+void
+arp_for<L3>::retransmit_queries(lowres_clock::time_point now) {
+    for (auto i = _in_progress.begin(); i != _in_progress.end();) {
+        auto& res = i->second;
+        if (now < res._deadline) {
+            ++i;
+            continue;
+        }
+        auto had_waiters = !res._waiters.empty();
+        for (auto& w : res._waiters) {
+            w.set_exception(arp_timeout_error());
+        }
+        res._waiters.clear();
+        if (!had_waiters && res._attempts >= max_query_attempts) {
+            i = _in_progress.erase(i);
+            continue;
+        }
+        send_query(i->first);
+        ++res._attempts;
+        res._deadline = now + query_interval();
+        ++i;
+    }
+}
+
+template <typename L3>
+void
+arp_for<L3>::age_entries(lowres_clock::time_point now) {
+    _table.age(now, refresh_window(), [this] (typename table_type::entry& e) {
+        // The reply is learned on every shard, so other shards using
+        // this neighbor get their entries extended as well.
+        send_query(e.paddr);
+    });
+}
+
 template <typename L3>
 future<>
 arp_for<L3>::received(packet p) {
@@ -23,8 +23,30 @@
 #include "net.hh"
 #include "packet.hh"
 #include "api.hh"
+#include "core/metrics.hh"
 #include <netinet/tcp.h>
 #include <netinet/sctp.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
 
 namespace net {
 
@@ -103,9 +125,11 @@ class posix_connected_socket_operations<transport::SCTP> {
 template <transport Transport>
 class posix_connected_socket_impl final : public connected_socket_impl, posix_connected_socket_operations<Transport> {
     lw_shared_ptr<pollable_fd> _fd;
+    conntrack::handle _handle;
     using _ops = posix_connected_socket_operations<Transport>;
 private:
-    explicit posix_connected_socket_impl(lw_shared_ptr<pollable_fd> fd) : _fd(std::move(fd)) {}
+    explicit posix_connected_socket_impl(lw_shared_ptr<pollable_fd> fd, conntrack::handle h = conntrack::handle(engine().cpu_id()))
+        : _fd(std::move(fd)), _handle(std::move(h)) {}
 public:
     virtual data_source source() override {
         return data_source(std::make_unique< posix_data_source_impl>(_fd));
@@ -137,6 +161,31 @@ class posix_connected_socket_impl final : public connected_socket_impl, posix_co
     keepalive_params get_keepalive_parameters() const override {
         return _ops::get_keepalive_parameters(_fd->get_file_desc());
     }
+    void set_busy_poll(std::chrono::microseconds budget) override {
+        _fd->set_busy_poll(budget);
+        try {
+            // Lets the kernel poll the device queue too; raising it above
+            // net.core.busy_poll needs CAP_NET_ADMIN, so failure is not fatal.
+            _fd->get_file_desc().setsockopt(SOL_SOCKET, SO_BUSY_POLL, int(budget.count()));
+        } catch (std::system_error&) {
+        }
+    }
+    virtual bool can_send_file() const override {
+        return true;
+    }
+    virtual future<> send_file(int in_fd, uint64_t offset, uint64_t len) override {
+        if (!len) {
+            return make_ready_future<>();
+        }
+        // sendfile(2) sends up to 2GB at a time
+        auto part = std::min(len, uint64_t(1) << 30);
+        return _fd->sendfile(in_fd, offset, part).then([this, in_fd, offset, len] (size_t sent) {
+            if (!sent) {
+                throw std::runtime_error("file ended before the data to send");
+            }
+            return send_file(in_fd, offset + sent, len - sent);
+        });
+    }
     friend class posix_server_socket_impl<Transport>;
     friend class posix_ap_server_socket_impl<Transport>;
     friend class posix_reuseport_server_socket_impl<Transport>;
@@ -182,17 +231,19 @@ template <transport Transport>
 future<connected_socket, socket_address>
 posix_server_socket_impl<Transport>::accept() {
     return _lfd.accept().then([this] (pollable_fd fd, socket_address sa) {
-        static unsigned balance = 0;
-        auto cpu = balance++ % smp::count;
+        auto cpu = _lba == load_balancing_algorithm::port
+                ? shard_id(ntohs(sa.as_posix_sockaddr_in().sin_port) % smp::count)
+                : conntrack::pick(_lba);
+        auto h = conntrack::handle(cpu);
 
         if (cpu == engine().cpu_id()) {
             std::unique_ptr<connected_socket_impl> csi(
-                    new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(fd))));
+                    new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(fd)), std::move(h)));
             return make_ready_future<connected_socket, socket_address>(
                     connected_socket(std::move(csi)), sa);
         } else {
-            smp::submit_to(cpu, [this, fd = std::move(fd.get_file_desc()), sa] () mutable {
-                posix_ap_server_socket_impl<Transport>::move_connected_socket(_sa, pollable_fd(std::move(fd)), sa);
+            smp::submit_to(cpu, [this, fd = std::move(fd.get_file_desc()), sa, h = std::move(h)] () mutable {
+                posix_ap_server_socket_impl<Transport>::move_connected_socket(_sa, pollable_fd(std::move(fd)), sa, std::move(h));
             });
             return accept();
         }
@@ -213,7 +264,7 @@ future<connected_socket, socket_address> posix_ap_server_socket_impl<Transport>:
         conn_q.erase(conni);
         try {
             std::unique_ptr<connected_socket_impl> csi(
-                    new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(c.fd))));
+                    new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(c.fd)), std::move(c.conn_handle)));
             return make_ready_future<connected_socket, socket_address>(connected_socket(std::move(csi)), std::move(c.addr));
         } catch (...) {
             return make_exception_future<connected_socket, socket_address>(std::current_exception());
@@ -258,19 +309,61 @@ posix_reuseport_server_socket_impl<Transport>::abort_accept() {
 }
 
 template <transport Transport>
-void  posix_ap_server_socket_impl<Transport>::move_connected_socket(socket_address sa, pollable_fd fd, socket_address addr) {
+void  posix_ap_server_socket_impl<Transport>::move_connected_socket(socket_address sa, pollable_fd fd, socket_address addr, conntrack::handle h) {
     auto i = sockets.find(sa.as_posix_sockaddr_in());
     if (i != sockets.end()) {
         try {
-            std::unique_ptr<connected_socket_impl> csi(new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(fd))));
+            std::unique_ptr<connected_socket_impl> csi(new posix_connected_socket_impl<Transport>(make_lw_shared(std::move(fd)), std::move(h)));
             i->second.set_value(connected_socket(std::move(csi)), std::move(addr));
         } catch (...) {
             i->second.set_exception(std::current_exception());
         }
         sockets.erase(i);
     } else {
-        conn_q.emplace(std::piecewise_construct, std::make_tuple(sa.as_posix_sockaddr_in()), std::make_tuple(std::move(fd), std::move(addr)));
+        conn_q.emplace(std::piecewise_construct, std::make_tuple(sa.as_posix_sockaddr_in()), std::make_tuple(std::move(fd), std::move(addr), std::move(h)));
+    }
+}
+
+conntrack::shard_state& conntrack::state(shard_id cpu) {
+    // Shared by all shards and never freed, so that handles released
+    // during shutdown still find it.
+    static shard_state* states = new shard_state[smp::count];
+    return states[cpu];
+}
+
+shard_id conntrack::pick(load_balancing_algorithm lba) {
+    static std::atomic<unsigned> balance = { 0 };
+    // Start from a rotating shard so that ties do not all go to shard 0.
+    auto start = balance.fetch_add(1, std::memory_order_relaxed) % smp::count;
+    if (lba == load_balancing_algorithm::round_robin) {
+        return start;
+    }
+    // Shards within this much utilization of the least busy one count as
+    // equally loaded; utilization is only sampled once a second, so a finer
+    // comparison would send a whole burst of connections to one shard.
+    static constexpr float utilization_slack = 0.1;
+    float min_utilization = 0;
+    if (lba == load_balancing_algorithm::reactor_load) {
+        min_utilization = utilization(0);
+        for (shard_id cpu = 1; cpu < smp::count; ++cpu) {
+            min_utilization = std::min(min_utilization, utilization(cpu));
+        }
+    }
+    auto best = start;
+    auto best_connections = std::numeric_limits<uint64_t>::max();
+    for (unsigned i = 0; i < smp::count; ++i) {
+        auto cpu = (start + i) % smp::count;
+        if (lba == load_balancing_algorithm::reactor_load
+                && utilization(cpu) > min_utilization + utilization_slack) {
+            continue;
+        }
+        auto c = connections(cpu);
+        if (c < best_connections) {
+            best = cpu;
+            best_connections = c;
+        }
     }
+    return best;
 }
 
 future<temporary_buffer<char>>
@@ -306,14 +399,197 @@ std::vector<iovec> to_iovec(std::vector<temporary_buffer<char>>& buf_vec) {
     return v;
 }
 
+size_t posix_zerocopy_tracker::threshold() const {
+    return _manager.threshold();
+}
+
+posix_zerocopy_manager::stats& posix_zerocopy_tracker::get_stats() {
+    return _manager.get_stats();
+}
+
+future<> posix_zerocopy_tracker::put(packet& p) {
+    _hdr = {};
+    _hdr.msg_iov = reinterpret_cast<iovec*>(p.fragment_array());
+    _hdr.msg_iovlen = p.nr_frags();
+    return _fd->sendmsg(&_hdr, MSG_ZEROCOPY | MSG_NOSIGNAL).then([this, &p] (size_t size) {
+        auto& st = get_stats();
+        st.sends++;
+        st.bytes += size;
+        st.in_flight++;
+        _in_flight.push_back(zerocopy_send{p.share(0, size)});
+        _manager.track(shared_from_this());
+        if (size == p.len()) {
+            return make_ready_future<>();
+        }
+        p.trim_front(size);
+        return put(p);
+    });
+}
+
+bool posix_zerocopy_tracker::reap() {
+    bool did_work = false;
+    while (!_in_flight.empty()) {
+        char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+        ::msghdr mh = {};
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        boost::optional<size_t> r;
+        try {
+            r = _fd->get_file_desc().recvmsg(&mh, MSG_ERRQUEUE);
+        } catch (std::system_error&) {
+            break;
+        }
+        if (!r) {
+            break;
+        }
+        did_work = true;
+        for (auto cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                    && !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            auto serr = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            complete(serr->ee_info, serr->ee_data, serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+        }
+    }
+    return did_work;
+}
+
+void posix_zerocopy_tracker::complete(uint32_t lo, uint32_t hi, bool copied) {
+    auto& st = get_stats();
+    for (uint32_t seq = lo;; ++seq) {
+        uint32_t idx = seq - _first_seq;
+        if (idx < _in_flight.size() && !_in_flight[idx].completed) {
+            _in_flight[idx].completed = true;
+            _in_flight[idx].p = packet();
+            st.completions++;
+            st.copied += copied;
+            st.in_flight--;
+        }
+        if (seq == hi) {
+            break;
+        }
+    }
+    while (!_in_flight.empty() && _in_flight.front().completed) {
+        _in_flight.pop_front();
+        ++_first_seq;
+    }
+}
+
+static thread_local posix_zerocopy_manager* local_zerocopy_manager;
+
+posix_zerocopy_manager::posix_zerocopy_manager(size_t threshold) : _threshold(threshold) {
+    local_zerocopy_manager = this;
+    if (!_threshold) {
+        return;
+    }
+
+    namespace sm = seastar::metrics;
+    _metrics.add_group("posix_stack", {
+        sm::make_derive("zerocopy_sends", _stats.sends,
+                sm::description("Number of sendmsg() calls issued with MSG_ZEROCOPY")),
+        sm::make_derive("zerocopy_bytes", _stats.bytes,
+                sm::description("Number of bytes sent with MSG_ZEROCOPY")),
+        sm::make_derive("zerocopy_completions", _stats.completions,
+                sm::description("Number of zerocopy sends reported complete by the kernel")),
+        sm::make_derive("zerocopy_copied", _stats.copied,
+                sm::description("Number of zerocopy sends for which the kernel fell back to copying the data")),
+        sm::make_derive("zerocopy_fallbacks", _stats.fallbacks,
+                sm::description("Number of packets on zerocopy-enabled sockets sent with a regular copying send, "
+                        "because they were below the threshold or the kernel was out of notification memory")),
+        sm::make_gauge("zerocopy_in_flight", _stats.in_flight,
+                sm::description("Number of zerocopy sends whose buffers are held until the kernel reports completion")),
+    });
+}
+
+posix_zerocopy_manager::~posix_zerocopy_manager() {
+    if (local_zerocopy_manager == this) {
+        local_zerocopy_manager = nullptr;
+    }
+}
+
+posix_zerocopy_manager* posix_zerocopy_manager::local() {
+    return local_zerocopy_manager;
+}
+
+void posix_zerocopy_manager::track(lw_shared_ptr<posix_zerocopy_tracker> t) {
+    if (!t->_tracked) {
+        t->_tracked = true;
+        _pending.push_back(std::move(t));
+        if (!_poller) {
+            _poller.emplace(reactor::poller::simple([this] { return poll(); }));
+        }
+    }
+}
+
+bool posix_zerocopy_manager::poll() {
+    bool did_work = false;
+    for (auto& t : _pending) {
+        did_work |= t->reap();
+    }
+    _pending.erase(std::remove_if(_pending.begin(), _pending.end(), [] (const lw_shared_ptr<posix_zerocopy_tracker>& t) {
+        if (t->idle()) {
+            t->_tracked = false;
+            return true;
+        }
+        return false;
+    }), _pending.end());
+    if (_pending.empty()) {
+        // The poller keeps the shard from sleeping, so it only stays while
+        // sends are in flight.  Dropping it from its own callback is safe:
+        // the reactor defers the deregistration, and nothing captured is
+        // touched after this point.
+        _poller = std::experimental::nullopt;
+    }
+    return did_work;
+}
+
+posix_data_sink_impl::posix_data_sink_impl(lw_shared_ptr<pollable_fd> fd) : _fd(std::move(fd)) {
+    auto zc = posix_zerocopy_manager::local();
+    if (zc && zc->threshold()) {
+        try {
+            _fd->get_file_desc().setsockopt(SOL_SOCKET, SO_ZEROCOPY, 1);
+            _zc = make_lw_shared<posix_zerocopy_tracker>(_fd, *zc);
+        } catch (std::system_error&) {
+            // Kernel or socket type without MSG_ZEROCOPY support: use regular sends.
+        }
+    }
+}
+
 future<>
 posix_data_sink_impl::put(temporary_buffer<char> buf) {
+    if (_zc && buf.size() >= _zc->threshold()) {
+        return put(packet(std::move(buf)));
+    }
     return _fd->write_all(buf.get(), buf.size()).then([d = buf.release()] {});
 }
 
 future<>
 posix_data_sink_impl::put(packet p) {
     _p = std::move(p);
+    if (_zc) {
+        if (_p.len() >= _zc->threshold()) {
+            return _zc->put(_p).then_wrapped([this] (future<> f) {
+                try {
+                    f.get();
+                } catch (std::system_error& e) {
+                    if (e.code().value() != ENOBUFS) {
+                        throw;
+                    }
+                    // Out of socket option memory for completion notifications;
+                    // send whatever is left with a regular copy.
+                    _zc->get_stats().fallbacks++;
+                    return _fd->write_all(_p).then([this] { _p.reset(); });
+                }
+                _p.reset();
+                return make_ready_future<>();
+            });
+        }
+        _zc->get_stats().fallbacks++;
+    }
     return _fd->write_all(_p).then([this] { _p.reset(); });
 }
 
@@ -323,18 +599,51 @@ posix_data_sink_impl::close() {
     return make_ready_future<>();
 }
 
+posix_network_stack::posix_network_stack(boost::program_options::variables_map opts)
+    : _reuseport(engine().posix_reuseport_available())
+    , _zerocopy(opts.count("posix-zerocopy-threshold") ? opts["posix-zerocopy-threshold"].as<size_t>() : 0)
+    , _last_busy_time(engine().total_busy_time()) {
+    using namespace std::chrono_literals;
+    static constexpr auto utilization_period = 1s;
+    _utilization_timer.set_callback([this] {
+        auto busy = engine().total_busy_time();
+        auto u = std::chrono::duration<float>(busy - _last_busy_time) / utilization_period;
+        _last_busy_time = busy;
+        conntrack::set_utilization(engine().cpu_id(), std::min(u, 1.0f));
+    });
+    _utilization_timer.arm_periodic(utilization_period);
+
+    namespace sm = seastar::metrics;
+    _metrics.add_group("posix_stack", {
+        sm::make_gauge("connections", [] { return conntrack::connections(engine().cpu_id()); },
+                sm::description("Number of open TCP and SCTP connections on this shard, including accepted ones still being handed over")),
+    });
+}
+
+boost::program_options::options_description
+posix_network_stack::get_options_description() {
+    boost::program_options::options_description opts(
+            "Posix networking stack options");
+    opts.add_options()
+        ("posix-zerocopy-threshold",
+                boost::program_options::value<size_t>()->default_value(0),
+                "Send TCP packets of at least this many bytes with MSG_ZEROCOPY (0 disables zerocopy sends)")
+        ;
+    return opts;
+}
+
 server_socket
 posix_network_stack::listen(socket_address sa, listen_options opt) {
     if (opt.proto == transport::TCP) {
         return _reuseport ?
             server_socket(std::make_unique<posix_reuseport_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)))
             :
-            server_socket(std::make_unique<posix_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt)));
+            server_socket(std::make_unique<posix_server_tcp_socket_impl>(sa, engine().posix_listen(sa, opt), opt.lba));
     } else {
         return _reuseport ?
             server_socket(std::make_unique<posix_reuseport_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt)))
             :
-            server_socket(std::make_unique<posix_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt)));
+            server_socket(std::make_unique<posix_server_sctp_socket_impl>(sa, engine().posix_listen(sa, opt), opt.lba));
     }
 }
 
@@ -362,56 +671,190 @@ posix_ap_network_stack::listen(socket_address sa, listen_options opt) {
     }
 }
 
-struct cmsg_with_pktinfo {
-    struct cmsghdrcmh;
-    struct in_pktinfo pktinfo;
+// Control message buffers; cmsghdr ends with a flexible array member, so it
+// can only be used to align them.
+union cmsg_with_pktinfo {
+    char buf[CMSG_SPACE(sizeof(struct in_pktinfo))];
+    struct cmsghdr align;
+};
+
+union cmsg_with_gso_size {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
 };
 
+// Datagrams are received and sent in batches with recvmmsg()/sendmmsg().
+//
+// Received datagrams are queued and handed out one per receive() call; the
+// receive buffers form a ring that is reused across batches.  Sends are
+// queued and flushed by a poller once per poll cycle, so all datagrams
+// queued by the tasks run in between leave with a single sendmmsg().  Runs
+// of queued datagrams to the same destination are further merged into one
+// UDP_SEGMENT (GSO) message when the kernel supports it.  The poller keeps
+// the shard from sleeping, so it is only registered while datagrams are
+// queued and the socket has room for them.
 class posix_udp_channel : public udp_channel_impl {
 private:
     static constexpr int MAX_DATAGRAM_SIZE = 65507;
+    // Number of datagrams received or sent with a single system call.
+    static constexpr unsigned batch_size = 16;
+    // Received datagrams up to this size are copied out of the receive ring;
+    // larger ones take their buffer with them and the slot gets a new one.
+    static constexpr size_t max_copied_datagram_size = 2048;
+    // UDP_MAX_SEGMENTS in the kernel.
+    static constexpr unsigned max_gso_segments = 64;
     struct recv_ctx {
-        struct msghdr _hdr;
-        struct iovec _iov;
-        socket_address _src_addr;
-        char* _buffer;
-        cmsg_with_pktinfo _cmsg;
+        std::array<struct mmsghdr, batch_size> _msgs;
+        std::array<struct iovec, batch_size> _iovs;
+        std::array<socket_address, batch_size> _src_addrs;
+        std::array<cmsg_with_pktinfo, batch_size> _cmsgs;
+        std::array<temporary_buffer<char>, batch_size> _buffers;
+        circular_buffer<udp_datagram> _ready;
 
         recv_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_iov = &_iov;
-            _hdr.msg_iovlen = 1;
-            _hdr.msg_name = &_src_addr.u.sa;
-            _hdr.msg_namelen = sizeof(_src_addr.u.sas);
-            memset(&_cmsg, 0, sizeof(_cmsg));
-            _hdr.msg_control = &_cmsg;
-            _hdr.msg_controllen = sizeof(_cmsg);
+            memset(_msgs.data(), 0, sizeof(_msgs));
         }
 
         void prepare() {
-            _buffer = new char[MAX_DATAGRAM_SIZE];
-            _iov.iov_base = _buffer;
-            _iov.iov_len = MAX_DATAGRAM_SIZE;
+            for (unsigned i = 0; i < batch_size; ++i) {
+                if (!_buffers[i]) {
+                    _buffers[i] = temporary_buffer<char>(MAX_DATAGRAM_SIZE);
+                }
+                _iovs[i].iov_base = _buffers[i].get_write();
+                _iovs[i].iov_len = _buffers[i].size();
+                auto& hdr = _msgs[i].msg_hdr;
+                hdr.msg_iov = &_iovs[i];
+                hdr.msg_iovlen = 1;
+                hdr.msg_name = &_src_addrs[i].u.sa;
+                hdr.msg_namelen = sizeof(_src_addrs[i].u.sas);
+                memset(&_cmsgs[i], 0, sizeof(_cmsgs[i]));
+                hdr.msg_control = &_cmsgs[i];
+                hdr.msg_controllen = sizeof(_cmsgs[i]);
+                hdr.msg_flags = 0;
+                _msgs[i].msg_len = 0;
+            }
+        }
+
+        uint32_t dst_ip(unsigned i) {
+            auto& hdr = _msgs[i].msg_hdr;
+            for (auto cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+                if (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_PKTINFO) {
+                    return reinterpret_cast<const in_pktinfo*>(CMSG_DATA(cm))->ipi_addr.s_addr;
+                }
+            }
+            return 0;
         }
+
+        packet take(unsigned i) {
+            size_t size = _msgs[i].msg_len;
+            if (size <= max_copied_datagram_size) {
+                return packet(fragment{_buffers[i].get_write(), size});
+            }
+            auto buf = std::move(_buffers[i]);
+            buf.trim(size);
+            return packet(std::move(buf));
+        }
+    };
+    struct send_entry {
+        socket_address dst;
+        packet p;
+        promise<> pr;
     };
     struct send_ctx {
-        struct msghdr _hdr;
+        circular_buffer<send_entry> _queue;
+        std::array<struct mmsghdr, batch_size> _msgs;
+        // Number of queued datagrams carried by each of _msgs.
+        std::array<unsigned, batch_size> _nr_datagrams;
+        std::array<cmsg_with_gso_size, batch_size> _cmsgs;
         std::vector<struct iovec> _iovecs;
-        socket_address _dst;
-        packet _p;
+        bool _gso = false;
+        bool _waiting_for_room = false;
 
         send_ctx() {
-            memset(&_hdr, 0, sizeof(_hdr));
-            _hdr.msg_name = &_dst.u.sa;
-            _hdr.msg_namelen = sizeof(_dst.u.sas);
+            memset(_msgs.data(), 0, sizeof(_msgs));
+        }
+
+        // Number of datagrams at the front of the queue, starting at idx,
+        // that can go out as a single message.
+        unsigned group(size_t idx) {
+            auto& first = _queue[idx];
+            auto segment_size = first.p.len();
+            if (!_gso || !segment_size) {
+                return 1;
+            }
+            unsigned n = 1;
+            size_t len = segment_size;
+            // All segments but the last must be exactly segment_size long.
+            while (idx + n < _queue.size() && n < max_gso_segments
+                    && _queue[idx + n - 1].p.len() == segment_size) {
+                auto& next = _queue[idx + n];
+                if (!(next.dst == first.dst) || !next.p.len() || next.p.len() > segment_size
+                        || len + next.p.len() > MAX_DATAGRAM_SIZE) {
+                    break;
+                }
+                len += next.p.len();
+                ++n;
+            }
+            return n;
         }
 
-        void prepare(ipv4_addr dst, packet p) {
-            _dst = make_ipv4_address(dst);
-            _p = std::move(p);
-            _iovecs = std::move(to_iovec(_p));
-            _hdr.msg_iov = _iovecs.data();
-            _hdr.msg_iovlen = _iovecs.size();
+        // Fills _msgs from the front of the queue; returns the number of messages.
+        unsigned prepare() {
+            unsigned nr_msgs = 0;
+            size_t nr_frags = 0;
+            for (size_t idx = 0; idx < _queue.size() && nr_msgs < batch_size; ++nr_msgs) {
+                auto n = group(idx);
+                _nr_datagrams[nr_msgs] = n;
+                for (unsigned j = 0; j < n; ++j) {
+                    nr_frags += _queue[idx + j].p.nr_frags();
+                }
+                idx += n;
+            }
+            _iovecs.clear();
+            _iovecs.reserve(nr_frags);
+            size_t idx = 0;
+            for (unsigned i = 0; i < nr_msgs; ++i) {
+                auto& first = _queue[idx];
+                auto& hdr = _msgs[i].msg_hdr;
+                hdr.msg_name = &first.dst.u.sa;
+                hdr.msg_namelen = sizeof(first.dst.u.sas);
+                hdr.msg_iov = _iovecs.data() + _iovecs.size();
+                for (unsigned j = 0; j < _nr_datagrams[i]; ++j) {
+                    for (auto&& f : _queue[idx + j].p.fragments()) {
+                        _iovecs.push_back({.iov_base = f.base, .iov_len = f.size});
+                    }
+                }
+                hdr.msg_iovlen = _iovecs.data() + _iovecs.size() - hdr.msg_iov;
+                if (_nr_datagrams[i] > 1) {
+                    memset(&_cmsgs[i], 0, sizeof(_cmsgs[i]));
+                    hdr.msg_control = &_cmsgs[i];
+                    hdr.msg_controllen = sizeof(_cmsgs[i]);
+                    auto cm = CMSG_FIRSTHDR(&hdr);
+                    cm->cmsg_level = SOL_UDP;
+                    cm->cmsg_type = UDP_SEGMENT;
+                    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                    uint16_t gso_size = first.p.len();
+                    memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+                } else {
+                    hdr.msg_control = nullptr;
+                    hdr.msg_controllen = 0;
+                }
+                idx += _nr_datagrams[i];
+            }
+            return nr_msgs;
+        }
+
+        // Completes the datagrams carried by the first message.
+        void complete_one(std::exception_ptr ex = nullptr) {
+            auto n = _nr_datagrams[0];
+            while (n--) {
+                if (ex) {
+                    _queue.front().pr.set_exception(ex);
+                } else {
+                    _queue.front().pr.set_value();
+                }
+                _queue.pop_front();
+            }
         }
     };
     std::unique_ptr<pollable_fd> _fd;
@@ -419,6 +862,7 @@ class posix_udp_channel : public udp_channel_impl {
     recv_ctx _recv;
     send_ctx _send;
     bool _closed;
+    std::experimental::optional<reactor::poller> _send_poller;
 public:
     posix_udp_channel(ipv4_addr bind_address)
             : _closed(false) {
@@ -429,6 +873,12 @@ class posix_udp_channel : public udp_channel_impl {
             fd.setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
         }
         fd.bind(sa.u.sa, sizeof(sa.u.sas));
+        try {
+            // Only probes for UDP_SEGMENT support; the size is set per message.
+            fd.getsockopt<int>(SOL_UDP, UDP_SEGMENT);
+            _send._gso = true;
+        } catch (std::system_error&) {
+        }
         _address = ipv4_addr(fd.get_address());
         _fd = std::make_unique<pollable_fd>(std::move(fd));
     }
@@ -438,24 +888,90 @@ class posix_udp_channel : public udp_channel_impl {
     virtual future<> send(ipv4_addr dst, packet p);
     virtual void close() override {
         _closed = true;
-        _fd->abort_reader(std::make_exception_ptr(std::system_error(EPIPE, std::system_category())));
-        _fd->abort_writer(std::make_exception_ptr(std::system_error(EPIPE, std::system_category())));
+        auto ex = std::make_exception_ptr(std::system_error(EPIPE, std::system_category()));
+        _fd->abort_reader(ex);
+        _fd->abort_writer(ex);
         _fd.reset();
+        _send_poller = std::experimental::nullopt;
+        while (!_send._queue.empty()) {
+            _send._queue.front().pr.set_exception(ex);
+            _send._queue.pop_front();
+        }
     }
     virtual bool is_closed() const override { return _closed; }
+private:
+    void start_flushing() {
+        if (!_send_poller) {
+            _send_poller.emplace(reactor::poller::simple([this] { return flush_sends(); }));
+        }
+    }
+    bool flush_sends();
+    bool send_batch();
 };
 
 future<> posix_udp_channel::send(ipv4_addr dst, const char *message) {
-    auto len = strlen(message);
-    return _fd->sendto(make_ipv4_address(dst), message, len)
-            .then([len] (size_t size) { assert(size == len); });
+    return send(dst, packet(message, strlen(message)));
 }
 
 future<> posix_udp_channel::send(ipv4_addr dst, packet p) {
-    auto len = p.len();
-    _send.prepare(dst, std::move(p));
-    return _fd->sendmsg(&_send._hdr)
-            .then([len] (size_t size) { assert(size == len); });
+    if (_closed) {
+        return make_exception_future<>(std::system_error(EPIPE, std::system_category()));
+    }
+    _send._queue.push_back(send_entry{make_ipv4_address(dst), std::move(p), promise<>()});
+    if (!_send._waiting_for_room) {
+        start_flushing();
+    }
+    return _send._queue.back().pr.get_future();
+}
+
+bool posix_udp_channel::flush_sends() {
+    auto did_work = send_batch();
+    if (_send._queue.empty() || _send._waiting_for_room) {
+        // Dropping the poller from its own callback is safe: the reactor
+        // defers the deregistration, and nothing captured is touched after
+        // this point.
+        _send_poller = std::experimental::nullopt;
+    }
+    return did_work;
+}
+
+bool posix_udp_channel::send_batch() {
+    if (_send._queue.empty() || _send._waiting_for_room) {
+        return false;
+    }
+    auto nr_msgs = _send.prepare();
+    boost::optional<size_t> r;
+    try {
+        r = _fd->get_file_desc().sendmmsg(_send._msgs.data(), nr_msgs, 0);
+    } catch (std::system_error& e) {
+        // The first message failed.  If it was segmented, the likely cause is
+        // an egress device without checksum offload (EIO); stop using GSO on
+        // this channel and retry the datagrams one by one.
+        if (_send._nr_datagrams[0] > 1 && (e.code().value() == EIO || e.code().value() == EINVAL)) {
+            _send._gso = false;
+        } else {
+            _send.complete_one(std::current_exception());
+        }
+        return true;
+    }
+    if (!r) {
+        _send._waiting_for_room = true;
+        _fd->writeable().then_wrapped([this] (future<> f) {
+            if (f.failed()) {
+                // aborted by close(); the channel may be gone
+                f.ignore_ready_future();
+                return;
+            }
+            _send._waiting_for_room = false;
+            start_flushing();
+        });
+        return true;
+    }
+    for (size_t i = 0; i < *r; ++i) {
+        _send.complete_one();
+        std::copy(_send._nr_datagrams.begin() + 1, _send._nr_datagrams.end(), _send._nr_datagrams.begin());
+    }
+    return true;
 }
 
 udp_channel
@@ -478,14 +994,19 @@ class posix_datagram : public udp_datagram_impl {
 
 future<udp_datagram>
 posix_udp_channel::receive() {
+    if (!_recv._ready.empty()) {
+        auto dgram = std::move(_recv._ready.front());
+        _recv._ready.pop_front();
+        return make_ready_future<udp_datagram>(std::move(dgram));
+    }
     _recv.prepare();
-    return _fd->recvmsg(&_recv._hdr).then([this] (size_t size) {
-        auto dst = ipv4_addr(_recv._cmsg.pktinfo.ipi_addr.s_addr, _address.port);
-        return make_ready_future<udp_datagram>(udp_datagram(std::make_unique<posix_datagram>(
-            _recv._src_addr, dst, packet(fragment{_recv._buffer, size}, make_deleter([buf = _recv._buffer] { delete[] buf; })))));
-    }).handle_exception([p = _recv._buffer](auto ep) {
-        delete[] p;
-        return make_exception_future<udp_datagram>(std::move(ep));
+    return _fd->recvmmsg(_recv._msgs.data(), batch_size).then([this] (size_t nr) {
+        for (unsigned i = 0; i < nr; ++i) {
+            auto dst = ipv4_addr(ntoh(_recv.dst_ip(i)), _address.port);
+            _recv._ready.push_back(udp_datagram(std::make_unique<posix_datagram>(
+                _recv._src_addrs[i], dst, _recv.take(i))));
+        }
+        return receive();
     });
 }
 
@@ -23,8 +23,12 @@
 #define POSIX_STACK_HH_
 
 #include "core/reactor.hh"
+#include "core/metrics_registration.hh"
+#include "core/circular_buffer.hh"
 #include "stack.hh"
 #include <boost/program_options.hpp>
+#include <experimental/optional>
+#include <atomic>
 
 namespace net {
 
@@ -41,22 +45,145 @@ class posix_data_source_impl final : public data_source_impl {
     future<> close() override;
 };
 
+class posix_zerocopy_manager;
+
+struct posix_zerocopy_manager_stats {
+    uint64_t sends = 0;       // sendmsg() calls issued with MSG_ZEROCOPY
+    uint64_t bytes = 0;       // bytes sent with MSG_ZEROCOPY
+    uint64_t completions = 0; // sends reported complete by the kernel
+    uint64_t copied = 0;      // completed sends where the kernel copied anyway
+    uint64_t fallbacks = 0;   // packets sent with a regular, copying send
+    uint64_t in_flight = 0;   // sends still waiting for completion
+};
+
+// Keeps the packets sent with MSG_ZEROCOPY on one socket alive until the
+// kernel reports them complete.
+//
+// The kernel numbers zerocopy sendmsg() calls on a socket consecutively from
+// zero and reports completions as [lo, hi] ranges of those numbers, usually
+// but not necessarily in order.
+class posix_zerocopy_tracker : public enable_lw_shared_from_this<posix_zerocopy_tracker> {
+    struct zerocopy_send {
+        packet p;
+        bool completed = false;
+    };
+    lw_shared_ptr<pollable_fd> _fd;
+    posix_zerocopy_manager& _manager;
+    // The sequence number of _in_flight[i] is _first_seq + i.
+    circular_buffer<zerocopy_send> _in_flight;
+    uint32_t _first_seq = 0;
+    ::msghdr _hdr;
+    bool _tracked = false;
+public:
+    posix_zerocopy_tracker(lw_shared_ptr<pollable_fd> fd, posix_zerocopy_manager& manager)
+        : _fd(std::move(fd)), _manager(manager) {}
+    size_t threshold() const;
+    posix_zerocopy_manager_stats& get_stats();
+    // Sends all of p; p must stay alive until the returned future resolves.
+    future<> put(packet& p);
+    // Consumes completion notifications from the socket's error queue.
+    // Returns true if any were found.
+    bool reap();
+    bool idle() const { return _in_flight.empty(); }
+private:
+    void complete(uint32_t lo, uint32_t hi, bool copied);
+    friend class posix_zerocopy_manager;
+};
+
+// Per-shard state for MSG_ZEROCOPY sends.
+//
+// Packets of at least threshold() bytes are sent with MSG_ZEROCOPY, so the
+// kernel references their pages directly instead of copying them.  Such a
+// packet (and hence its deleter) must stay alive until the kernel reports
+// the send as complete on the socket's error queue; the manager polls the
+// error queues of all sockets with sends in flight and releases the packets
+// as completions arrive.  The kernel does not wake the reactor for them, so
+// the manager registers a poller, but only while sends are in flight.
+class posix_zerocopy_manager {
+public:
+    using stats = posix_zerocopy_manager_stats;
+private:
+    size_t _threshold;
+    stats _stats;
+    std::vector<lw_shared_ptr<posix_zerocopy_tracker>> _pending;
+    std::experimental::optional<reactor::poller> _poller;
+    seastar::metrics::metric_groups _metrics;
+public:
+    explicit posix_zerocopy_manager(size_t threshold);
+    ~posix_zerocopy_manager();
+    // Minimal packet size sent with MSG_ZEROCOPY; 0 means zerocopy is disabled.
+    size_t threshold() const { return _threshold; }
+    stats& get_stats() { return _stats; }
+    void track(lw_shared_ptr<posix_zerocopy_tracker> t);
+    static posix_zerocopy_manager* local();
+private:
+    bool poll();
+};
+
 class posix_data_sink_impl : public data_sink_impl {
     lw_shared_ptr<pollable_fd> _fd;
     packet _p;
+    lw_shared_ptr<posix_zerocopy_tracker> _zc;
 public:
-    explicit posix_data_sink_impl(lw_shared_ptr<pollable_fd> fd) : _fd(std::move(fd)) {}
+    explicit posix_data_sink_impl(lw_shared_ptr<pollable_fd> fd);
     future<> put(packet p) override;
     future<> put(temporary_buffer<char> buf) override;
     future<> close() override;
 };
 
+// Counts the open posix connections of every shard, so that the shard
+// accepting connections on behalf of all shards can balance them.
+//
+// A connection is charged to its shard as soon as that shard is picked,
+// before the socket is handed over, so a burst of accepts sees its own
+// decisions.
+class conntrack {
+    // Padded to a cache line to limit false sharing between shards.
+    struct shard_state {
+        std::atomic<uint64_t> connections = { 0 };
+        std::atomic<float> utilization = { 0 };
+        char padding[64 - sizeof(std::atomic<uint64_t>) - sizeof(std::atomic<float>)];
+    };
+    static shard_state& state(shard_id cpu);
+public:
+    class handle {
+        shard_id _cpu;
+        bool _valid;
+    public:
+        explicit handle(shard_id cpu) : _cpu(cpu), _valid(true) {
+            state(_cpu).connections.fetch_add(1, std::memory_order_relaxed);
+        }
+        handle(handle&& x) noexcept : _cpu(x._cpu), _valid(std::exchange(x._valid, false)) {}
+        handle(const handle&) = delete;
+        void operator=(const handle&) = delete;
+        ~handle() {
+            if (_valid) {
+                state(_cpu).connections.fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+    };
+    static uint64_t connections(shard_id cpu) {
+        return state(cpu).connections.load(std::memory_order_relaxed);
+    }
+    // Fraction of time the shard was busy during the last measurement period.
+    static float utilization(shard_id cpu) {
+        return state(cpu).utilization.load(std::memory_order_relaxed);
+    }
+    static void set_utilization(shard_id cpu, float u) {
+        state(cpu).utilization.store(u, std::memory_order_relaxed);
+    }
+    // Picks the shard for a new connection.
+    static shard_id pick(load_balancing_algorithm lba);
+};
+
 template <transport Transport>
 class posix_ap_server_socket_impl : public server_socket_impl {
     struct connection {
         pollable_fd fd;
         socket_address addr;
-        connection(pollable_fd xfd, socket_address xaddr) : fd(std::move(xfd)), addr(xaddr) {}
+        conntrack::handle conn_handle;
+        connection(pollable_fd xfd, socket_address xaddr, conntrack::handle h)
+            : fd(std::move(xfd)), addr(xaddr), conn_handle(std::move(h)) {}
     };
     static thread_local std::unordered_map<::sockaddr_in, promise<connected_socket, socket_address>> sockets;
     static thread_local std::unordered_multimap<::sockaddr_in, connection> conn_q;
@@ -65,7 +192,7 @@ class posix_ap_server_socket_impl : public server_socket_impl {
     explicit posix_ap_server_socket_impl(socket_address sa) : _sa(sa) {}
     virtual future<connected_socket, socket_address> accept() override;
     virtual void abort_accept() override;
-    static void move_connected_socket(socket_address sa, pollable_fd fd, socket_address addr);
+    static void move_connected_socket(socket_address sa, pollable_fd fd, socket_address addr, conntrack::handle h);
 };
 using posix_tcp_ap_server_socket_impl = posix_ap_server_socket_impl<transport::TCP>;
 using posix_sctp_ap_server_socket_impl = posix_ap_server_socket_impl<transport::SCTP>;
@@ -74,8 +201,11 @@ template <transport Transport>
 class posix_server_socket_impl : public server_socket_impl {
     socket_address _sa;
     pollable_fd _lfd;
+    load_balancing_algorithm _lba;
 public:
-    explicit posix_server_socket_impl(socket_address sa, pollable_fd lfd) : _sa(sa), _lfd(std::move(lfd)) {}
+    explicit posix_server_socket_impl(socket_address sa, pollable_fd lfd,
+            load_balancing_algorithm lba = load_balancing_algorithm::round_robin)
+        : _sa(sa), _lfd(std::move(lfd)), _lba(lba) {}
     virtual future<connected_socket, socket_address> accept();
     virtual void abort_accept() override;
 };
@@ -97,8 +227,12 @@ using posix_reuseport_server_sctp_socket_impl = posix_reuseport_server_socket_im
 class posix_network_stack : public network_stack {
 private:
     const bool _reuseport;
+    posix_zerocopy_manager _zerocopy;
+    timer<lowres_clock> _utilization_timer;
+    steady_clock_type::duration _last_busy_time;
+    seastar::metrics::metric_groups _metrics;
 public:
-    explicit posix_network_stack(boost::program_options::variables_map opts) : _reuseport(engine().posix_reuseport_available()) {}
+    explicit posix_network_stack(boost::program_options::variables_map opts);
     virtual server_socket listen(socket_address sa, listen_options opts) override;
     virtual ::seastar::socket socket() override;
     virtual ::net::udp_channel make_udp_channel(ipv4_addr addr) override;
@@ -106,6 +240,7 @@ class posix_network_stack : public network_stack {
         return make_ready_future<std::unique_ptr<network_stack>>(std::unique_ptr<network_stack>(new posix_network_stack(opts)));
     }
     virtual bool has_per_core_namespace() override { return _reuseport; };
+    static boost::program_options::options_description get_options_description();
 };
 
 class posix_ap_network_stack : public posix_network_stack {
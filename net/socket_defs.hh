@@ -56,6 +56,22 @@ enum class transport {
     SCTP = IPPROTO_SCTP
 };
 
+/// How a listening socket whose connections are accepted by one shard
+/// spreads them over all shards.
+enum class load_balancing_algorithm {
+    /// Cycle through the shards.
+    round_robin,
+    /// Pick the shard with the fewest open connections.
+    connection_count,
+    /// Pick the least busy shard, preferring the one with fewer open
+    /// connections among shards of similar load.
+    reactor_load,
+    /// Hand the connection to shard (client port % smp::count), letting a
+    /// client that knows the shard count pick the shard it talks to by
+    /// binding a matching local port.
+    port,
+};
+
 
 namespace net {
 class inet_address;
@@ -66,6 +82,7 @@ class inet_address;
 struct listen_options {
     seastar::transport proto = seastar::transport::TCP;
     bool reuse_address = false;
+    seastar::load_balancing_algorithm lba = seastar::load_balancing_algorithm::round_robin;
     listen_options(bool rua = false)
         : reuse_address(rua)
     {}
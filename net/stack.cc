@@ -96,6 +96,16 @@ void connected_socket::set_keepalive_parameters(const net::keepalive_params& p)
 net::keepalive_params connected_socket::get_keepalive_parameters() const {
     return _csi->get_keepalive_parameters();
 }
+void connected_socket::set_busy_poll(std::chrono::microseconds budget) {
+    _csi->set_busy_poll(budget);
+}
+
+bool connected_socket::can_send_file() const {
+    return _csi->can_send_file();
+}
+future<> connected_socket::send_file(int in_fd, uint64_t offset, uint64_t len) {
+    return _csi->send_file(in_fd, offset, len);
+}
 
 void connected_socket::shutdown_output() {
     _csi->shutdown_output();
@@ -39,6 +39,11 @@ class connected_socket_impl {
     virtual bool get_keepalive() const = 0;
     virtual void set_keepalive_parameters(const keepalive_params&) = 0;
     virtual keepalive_params get_keepalive_parameters() const = 0;
+    virtual void set_busy_poll(std::chrono::microseconds budget) {}
+    virtual bool can_send_file() const { return false; }
+    virtual future<> send_file(int in_fd, uint64_t offset, uint64_t len) {
+        return make_exception_future<>(std::runtime_error("sending files is not supported"));
+    }
 };
 
 class socket_impl {
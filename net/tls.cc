@@ -38,6 +38,9 @@ class net::get_impl {
     static std::unique_ptr<connected_socket_impl> get(connected_socket s) {
         return std::move(s._csi);
     }
+    static connected_socket_impl* peek(const connected_socket& s) {
+        return s._csi.get();
+    }
 };
 
 class blob_wrapper: public gnutls_datum_t {
@@ -311,6 +314,12 @@ class seastar::tls::certificate_credentials::impl: public gnutlsobj {
     gnutls_priority_t get_priority() const {
         return _priority.get();
     }
+    void set_alpn_protocols(const std::vector<sstring>& protocols) {
+        _alpn_protocols = protocols;
+    }
+    const std::vector<sstring>& get_alpn_protocols() const {
+        return _alpn_protocols;
+    }
 private:
     friend class credentials_builder;
     friend class session;
@@ -331,6 +340,7 @@ class seastar::tls::certificate_credentials::impl: public gnutlsobj {
     std::unique_ptr<tls::dh_params::impl> _dh_params;
     std::unique_ptr<std::remove_pointer_t<gnutls_priority_t>, void(*)(gnutls_priority_t)> _priority;
     client_auth _client_auth = client_auth::NONE;
+    std::vector<sstring> _alpn_protocols;
     bool _load_system_trust = false;
     semaphore _system_trust_sem {1};
 };
@@ -406,6 +416,10 @@ void seastar::tls::certificate_credentials::set_priority_string(const sstring& p
     _impl->set_priority_string(prio);
 }
 
+void seastar::tls::certificate_credentials::set_alpn_protocols(const std::vector<sstring>& protocols) {
+    _impl->set_alpn_protocols(protocols);
+}
+
 seastar::tls::server_credentials::server_credentials(::shared_ptr<dh_params> dh)
     : server_credentials(*dh)
 {}
@@ -473,6 +487,10 @@ void seastar::tls::credentials_builder::set_priority_string(const sstring& prio)
     _priority = prio;
 }
 
+void seastar::tls::credentials_builder::set_alpn_protocols(const std::vector<sstring>& protocols) {
+    _alpn_protocols = protocols;
+}
+
 void seastar::tls::credentials_builder::apply_to(certificate_credentials& creds) const {
     // Could potentially be templated down, but why bother...
     {
@@ -516,6 +534,9 @@ void seastar::tls::credentials_builder::apply_to(certificate_credentials& creds)
     if (!_priority.empty()) {
         creds.set_priority_string(_priority);
     }
+    if (!_alpn_protocols.empty()) {
+        creds.set_alpn_protocols(_alpn_protocols);
+    }
 
     creds._impl->set_client_auth(_client_auth);
 }
@@ -589,6 +610,16 @@ class session : public enable_lw_shared_from_this<session> {
             gtls_chk(gnutls_priority_set(*this, prio));
         }
 
+        auto& alpn = _creds->_impl->get_alpn_protocols();
+        if (!alpn.empty()) {
+            // copied by gnutls
+            std::vector<gnutls_datum_t> protocols;
+            for (auto& p : alpn) {
+                protocols.push_back({reinterpret_cast<unsigned char*>(const_cast<char*>(p.c_str())), unsigned(p.size())});
+            }
+            gtls_chk(gnutls_alpn_set_protocols(*this, protocols.data(), protocols.size(), 0));
+        }
+
         gnutls_transport_set_ptr(*this, this);
         gnutls_transport_set_vec_push_function(*this, &vec_push_wrapper);
         gnutls_transport_set_pull_function(*this, &pull_wrapper);
@@ -671,6 +702,14 @@ class session : public enable_lw_shared_from_this<session> {
         return make_ready_future<>();
     }
 
+    sstring get_alpn_protocol() {
+        gnutls_datum_t protocol;
+        if (gnutls_alpn_get_selected_protocol(*this, &protocol) < 0) {
+            return {};
+        }
+        return sstring(reinterpret_cast<const char*>(protocol.data), protocol.size);
+    }
+
     size_t in_avail() const {
         return _input.size();
     }
@@ -1008,6 +1047,12 @@ class tls_connected_socket_impl : public ::net::connected_socket_impl, public se
     ::net::keepalive_params get_keepalive_parameters() const override {
         return _session->socket().get_keepalive_parameters();
     }
+    void set_busy_poll(std::chrono::microseconds budget) override {
+        _session->socket().set_busy_poll(budget);
+    }
+    sstring get_alpn_protocol() {
+        return _session->get_alpn_protocol();
+    }
 };
 
 
@@ -1204,6 +1249,11 @@ future<::connected_socket> seastar::tls::wrap_server(::shared_ptr<server_credent
     });
 }
 
+sstring seastar::tls::get_alpn_protocol(const ::connected_socket& s) {
+    auto impl = dynamic_cast<tls_connected_socket_impl*>(::net::get_impl::peek(s));
+    return impl ? impl->get_alpn_protocol() : sstring();
+}
+
 ::server_socket seastar::tls::listen(::shared_ptr<server_credentials> creds, ::socket_address sa, ::listen_options opts) {
     return listen(std::move(creds), engine().listen(sa, opts));
 }
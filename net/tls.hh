@@ -153,6 +153,14 @@ namespace tls {
          * Allows specifying order and allowance for handshake alg.
          */
         void set_priority_string(const sstring&);
+
+        /**
+         * Application protocols to negotiate with ALPN (RFC 7301), such
+         * as "h2" and "http/1.1", in order of preference.  A server picks
+         * the first of its protocols the client offers; see
+         * get_alpn_protocol().
+         */
+        void set_alpn_protocols(const std::vector<sstring>&);
     private:
         class impl;
         friend class session;
@@ -212,6 +220,7 @@ namespace tls {
         future<> set_system_trust();
         void set_client_auth(client_auth);
         void set_priority_string(const sstring&);
+        void set_alpn_protocols(const std::vector<sstring>&);
 
         void apply_to(certificate_credentials&) const;
 
@@ -222,6 +231,7 @@ namespace tls {
         std::multimap<sstring, boost::any> _blobs;
         client_auth _client_auth = client_auth::NONE;
         sstring _priority;
+        std::vector<sstring> _alpn_protocols;
     };
 
     /**
@@ -255,6 +265,13 @@ namespace tls {
     future<::connected_socket> wrap_server(::shared_ptr<server_credentials>, ::connected_socket&&);
     /// @}
 
+    /**
+     * The application protocol a TLS connection negotiated with ALPN.
+     * \return the protocol, or an empty string if none was negotiated or
+     * the connection is not a TLS one
+     */
+    sstring get_alpn_protocol(const ::connected_socket&);
+
     /**
      * Creates a server socket that accepts SSL/TLS clients using default network stack
      * and the supplied credentials.
@@ -1,4 +1,5 @@
 #include "rpc.hh"
+#include <random>
 
 namespace rpc {
   no_wait_type no_wait;
@@ -19,6 +20,456 @@ namespace rpc {
       }
   }
 
+  lw_shared_ptr<stream_source_state> stream_connection::get_source(int64_t id) {
+      auto it = _sources.find(id);
+      if (it != _sources.end()) {
+          return it->second;
+      }
+      // Data for a stream may arrive before the message that carries its
+      // source, or for a stream no handler ever makes a source for; keep a
+      // bounded number of those, for a bounded time.
+      if (_unclaimed_sources >= max_unclaimed_streams) {
+          throw rpc_protocol_error();
+      }
+      auto s = make_lw_shared<stream_source_state>(this, id);
+      s->claim_deadline = lowres_clock::now() + _unclaimed_stream_timeout;
+      _sources.emplace(id, s);
+      if (!_unclaimed_sources++) {
+          _unclaimed_timer.set_callback([this] { expire_unclaimed(); });
+          _unclaimed_timer.arm(s->claim_deadline);
+      }
+      return s;
+  }
+
+  lw_shared_ptr<stream_source_state> stream_connection::claim_source(int64_t id) {
+      auto it = _sources.find(id);
+      if (it == _sources.end()) {
+          auto s = make_lw_shared<stream_source_state>(this, id);
+          s->claimed = true;
+          _sources.emplace(id, s);
+          return s;
+      }
+      auto& s = *it->second;
+      if (!s.claimed && !s.abandoned) {
+          --_unclaimed_sources;
+      }
+      s.claimed = true;
+      return it->second;
+  }
+
+  void stream_connection::expire_unclaimed() {
+      auto now = lowres_clock::now();
+      auto next = lowres_clock::time_point::max();
+      std::vector<lw_shared_ptr<stream_source_state>> expired;
+      for (auto&& e : _sources) {
+          auto& s = *e.second;
+          if (s.claimed || s.abandoned) {
+              continue;
+          }
+          if (s.claim_deadline <= now) {
+              expired.push_back(e.second);
+          } else {
+              next = std::min(next, s.claim_deadline);
+          }
+      }
+      for (auto&& s : expired) {
+          --_unclaimed_sources;
+          s->ex = std::make_exception_ptr(timeout_error());
+          abandon_source(*s);
+      }
+      if (_unclaimed_sources) {
+          _unclaimed_timer.arm(next);
+      }
+  }
+
+  void stream_connection::wake(stream_source_state& s) {
+      if (s.ready) {
+          auto p = std::move(*s.ready);
+          s.ready = std::experimental::nullopt;
+          p.set_value();
+      }
+  }
+
+  void stream_connection::send_credit(stream_source_state& s) {
+      if (!s.consumed) {
+          return;
+      }
+      auto head = stream_frame_head_space();
+      snd_buf data(head + 8);
+      auto p = data.front().get_write() + head;
+      write_le<uint32_t>(p, uint32_t(stream_frame_type::CREDIT));
+      write_le<uint32_t>(p + 4, s.consumed);
+      s.unacked -= s.consumed;
+      s.consumed = 0;
+      // the connection going down takes care of failing the stream
+      send_stream_frame(s.id, std::move(data)).handle_exception([] (std::exception_ptr) {});
+  }
+
+  void stream_connection::handle_stream_frame(int64_t id, rcv_buf data) {
+      if (data.size < 4) {
+          throw rpc_protocol_error();
+      }
+      auto in = make_deserializer_stream(data);
+      uint32_t v32;
+      in.read(reinterpret_cast<char*>(&v32), 4);
+      switch (stream_frame_type(le_to_cpu(v32))) {
+      case stream_frame_type::DATA: {
+          auto s = get_source(id);
+          auto cost = std::min(size_t(data.size - 4), stream_window);
+          if (s->unacked + cost > stream_window) {
+              // the sink did not wait for credit
+              throw rpc_protocol_error();
+          }
+          s->unacked += cost;
+          if (s->abandoned) {
+              // nobody will read it; keep the sink going until it closes
+              s->consumed += cost;
+              send_credit(*s);
+          } else {
+              s->bufs.push_back(std::move(data));
+              wake(*s);
+          }
+          break;
+      }
+      case stream_frame_type::CREDIT: {
+          if (data.size < 8) {
+              throw rpc_protocol_error();
+          }
+          in.read(reinterpret_cast<char*>(&v32), 4);
+          auto it = _sinks.find(id);
+          if (it != _sinks.end()) {
+              it->second->credits.signal(le_to_cpu(v32));
+          }
+          break;
+      }
+      case stream_frame_type::CLOSE: {
+          auto s = get_source(id);
+          if (s->abandoned) {
+              _sources.erase(id);
+          } else {
+              s->eof = true;
+              wake(*s);
+          }
+          break;
+      }
+      default:
+          throw rpc_protocol_error();
+      }
+  }
+
+  void stream_connection::abort_streams() {
+      for (auto&& e : _sinks) {
+          e.second->con = nullptr;
+          e.second->credits.broken(std::make_exception_ptr(closed_error()));
+      }
+      for (auto&& e : _sources) {
+          auto& s = *e.second;
+          s.con = nullptr;
+          if (!s.eof) {
+              s.ex = std::make_exception_ptr(closed_error());
+          }
+          wake(s);
+      }
+      _sinks.clear();
+      _sources.clear();
+      _unclaimed_sources = 0;
+      _unclaimed_timer.cancel();
+  }
+
+  future<> stream_connection::send_to_stream(lw_shared_ptr<stream_sink_state> s, stream_frame_type type, snd_buf data, size_t cost) {
+      write_le<uint32_t>(data.front().get_write() + stream_frame_head_space(), uint32_t(type));
+      s->pending.push_back(std::move(data));
+      // Waiters can be resumed in a different order than they queued their
+      // frames, so each one sends whichever frame is oldest.
+      return s->credits.wait(cost).then([s] {
+          if (!s->con) {
+              return make_exception_future<>(closed_error());
+          }
+          auto data = std::move(s->pending.front());
+          s->pending.pop_front();
+          return s->con->send_stream_frame(s->id, std::move(data));
+      });
+  }
+
+  future<> stream_connection::close_sink(lw_shared_ptr<stream_sink_state> s) {
+      if (s->closed) {
+          return make_exception_future<>(closed_error());
+      }
+      s->closed = true;
+      return send_to_stream(s, stream_frame_type::CLOSE, snd_buf(stream_frame_head_space() + 4), 0).finally([s] {
+          if (s->con) {
+              s->con->_sinks.erase(s->id);
+          }
+      });
+  }
+
+  void stream_connection::consumed(stream_source_state& s, size_t cost) {
+      s.consumed += cost;
+      // Return credit in batches, but never sit on it once we have drained
+      // everything: the sink may be waiting for a large element.
+      if (s.consumed >= stream_window / 4 || s.bufs.empty()) {
+          send_credit(s);
+      }
+  }
+
+  void stream_connection::abandon_source(stream_source_state& s) {
+      if (s.eof) {
+          release_source(s);
+          return;
+      }
+      s.abandoned = true;
+      while (!s.bufs.empty()) {
+          s.consumed += std::min(size_t(s.bufs.front().size - 4), stream_window);
+          s.bufs.pop_front();
+      }
+      send_credit(s);
+  }
+
+  void stream_connection::release_source(stream_source_state& s) {
+      _sources.erase(s.id);
+  }
+
+  constexpr unsigned compression_policy::sample_window;
+  constexpr unsigned compression_policy::reprobe_interval;
+
+  bool compression_policy::should_compress(uint64_t verb, size_t size) {
+      if (size < _options.threshold) {
+          return false;
+      }
+      if (!_options.adaptive) {
+          return true;
+      }
+      auto& v = _verbs[verb];
+      if (v.disabled) {
+          if (++v.skipped < reprobe_interval) {
+              return false;
+          }
+          v.disabled = false;
+          v.skipped = 0;
+      }
+      return true;
+  }
+
+  void compression_policy::account(uint64_t verb, size_t in, size_t out, std::chrono::nanoseconds cpu) {
+      auto& v = _verbs[verb];
+      v.in += in;
+      v.out += out;
+      v.cpu += cpu;
+      if (++v.samples < sample_window) {
+          return;
+      }
+      auto saved = v.in > v.out ? v.in - v.out : 0;
+      auto disabled = saved < v.in * _options.min_savings || v.cpu.count() > saved * _options.max_ns_per_saved_byte;
+      v = verb_state();
+      v.disabled = disabled;
+  }
+
+  static thread_local uint64_t current_trace = 0;
+
+  uint64_t current_trace_id() {
+      return current_trace;
+  }
+
+  trace_id_scope::trace_id_scope(uint64_t id) : _saved(current_trace) {
+      current_trace = id;
+  }
+
+  trace_id_scope::~trace_id_scope() {
+      current_trace = _saved;
+  }
+
+  uint64_t sample_trace_id(double trace_sampling) {
+      if (current_trace) {
+          return current_trace;
+      }
+      if (trace_sampling <= 0) {
+          return 0;
+      }
+      static thread_local std::default_random_engine random_engine{std::random_device()()};
+      if (std::uniform_real_distribution<double>()(random_engine) >= trace_sampling) {
+          return 0;
+      }
+      uint64_t id;
+      do {
+          id = std::uniform_int_distribution<uint64_t>()(random_engine);
+      } while (!id);
+      return id;
+  }
+
+  template <typename Buf>
+  static Buf do_make_shard_local(foreign_ptr<std::unique_ptr<Buf>> buf) {
+      auto owner = make_lw_shared(std::move(buf));
+      auto local = [&owner] (temporary_buffer<char>& b) {
+          return temporary_buffer<char>(b.get_write(), b.size(), make_deleter([owner] {}));
+      };
+      Buf ret;
+      ret.size = (*owner)->size;
+      auto* one = boost::get<temporary_buffer<char>>(&(*owner)->bufs);
+      if (one) {
+          ret.bufs = local(*one);
+      } else {
+          std::vector<temporary_buffer<char>> v;
+          for (auto&& b : boost::get<std::vector<temporary_buffer<char>>>((*owner)->bufs)) {
+              v.push_back(local(b));
+          }
+          ret.bufs = std::move(v);
+      }
+      return ret;
+  }
+
+  rcv_buf make_shard_local(foreign_ptr<std::unique_ptr<rcv_buf>> buf) {
+      return do_make_shard_local(std::move(buf));
+  }
+
+  snd_buf make_shard_local(foreign_ptr<std::unique_ptr<snd_buf>> buf) {
+      return do_make_shard_local(std::move(buf));
+  }
+
+  uint64_t take_trace_id(rcv_buf& data) {
+      if (data.size < 8) {
+          throw rpc_protocol_error();
+      }
+      uint64_t id;
+      auto in = make_deserializer_stream(data);
+      in.read(reinterpret_cast<char*>(&id), sizeof(id));
+      auto* one = boost::get<temporary_buffer<char>>(&data.bufs);
+      if (one) {
+          one->trim_front(sizeof(id));
+      } else {
+          auto& v = boost::get<std::vector<temporary_buffer<char>>>(data.bufs);
+          size_t left = sizeof(id);
+          auto it = v.begin();
+          while (left) {
+              auto n = std::min(left, it->size());
+              it->trim_front(n);
+              left -= n;
+              if (it->empty()) {
+                  ++it;
+              }
+          }
+          v.erase(v.begin(), it);
+      }
+      data.size -= sizeof(id);
+      return le_to_cpu(id);
+  }
+
+  temporary_buffer<char> spliced_buffer::linearize() const {
+      if (_fragments.size() == 1) {
+          return _fragments.front().share();
+      }
+      temporary_buffer<char> ret(_size);
+      auto p = ret.get_write();
+      for (auto&& f : _fragments) {
+          p = std::copy_n(f.get(), f.size(), p);
+      }
+      return ret;
+  }
+
+  // Chunks snd_buf_writer slices messages from.  The unused tail of the
+  // last chunk is kept for the next message; a chunk's memory comes back to
+  // the free list once every message sliced from it has been sent.
+  class snd_buf_chunk_pool {
+      static constexpr size_t max_free_chunks = 16;
+      struct free_list {
+          std::vector<std::unique_ptr<char[]>> chunks;
+      };
+      lw_shared_ptr<free_list> _free = make_lw_shared<free_list>();
+      temporary_buffer<char> _tail;
+  public:
+      // Returns a buffer of at least size bytes to write into.
+      temporary_buffer<char> take(size_t size) {
+          assert(size <= snd_buf_writer::chunk_size);
+          if (_tail.size() >= size && !_tail.empty()) {
+              return std::move(_tail);
+          }
+          std::unique_ptr<char[]> chunk;
+          if (_free->chunks.empty()) {
+              chunk = std::make_unique<char[]>(snd_buf_writer::chunk_size);
+          } else {
+              chunk = std::move(_free->chunks.back());
+              _free->chunks.pop_back();
+          }
+          auto p = chunk.get();
+          // the free list outlives the pool if messages are still in flight
+          return temporary_buffer<char>(p, snd_buf_writer::chunk_size, make_deleter(deleter(), [list = _free, chunk = std::move(chunk)] () mutable {
+              if (list->chunks.size() < max_free_chunks) {
+                  list->chunks.push_back(std::move(chunk));
+              }
+          }));
+      }
+      // Returns the unused part of a buffer obtained from take().
+      void give_back(temporary_buffer<char> tail) {
+          if (tail.size() > _tail.size()) {
+              _tail = std::move(tail);
+          }
+      }
+  };
+
+  static thread_local snd_buf_chunk_pool snd_buf_chunks;
+
+  constexpr size_t snd_buf_writer::chunk_size;
+  constexpr size_t snd_buf_writer::min_splice_size;
+
+  snd_buf_writer::snd_buf_writer(size_t head_space) : _current(snd_buf_chunks.take(head_space)), _used(head_space), _size(head_space) {
+  }
+
+  snd_buf_writer::~snd_buf_writer() {
+      _current.trim_front(_used);
+      snd_buf_chunks.give_back(std::move(_current));
+  }
+
+  void snd_buf_writer::close_current() {
+      if (_used) {
+          _done.push_back(_current.share(0, _used));
+          _current.trim_front(_used);
+          _used = 0;
+      }
+      snd_buf_chunks.give_back(std::move(_current));
+      _current = temporary_buffer<char>();
+  }
+
+  void snd_buf_writer::write(const char* p, size_t size) {
+      _size += size;
+      while (size) {
+          if (_used == _current.size()) {
+              close_current();
+              // a large write gets a buffer of its own rather than a chain of chunks
+              _current = size >= chunk_size ? temporary_buffer<char>(size) : snd_buf_chunks.take(1);
+          }
+          auto n = std::min(size, _current.size() - _used);
+          std::copy_n(p, n, _current.get_write() + _used);
+          _used += n;
+          p += n;
+          size -= n;
+      }
+  }
+
+  void snd_buf_writer::splice(const spliced_buffer& buf) {
+      if (buf.size() < min_splice_size) {
+          for (auto&& f : buf.fragments()) {
+              write(f.get(), f.size());
+          }
+          return;
+      }
+      close_current();
+      for (auto&& f : buf.fragments()) {
+          _done.push_back(f.share());
+      }
+      _size += buf.size();
+  }
+
+  snd_buf snd_buf_writer::finish() && {
+      close_current();
+      snd_buf ret;
+      ret.size = _size;
+      if (_done.size() == 1) {
+          ret.bufs = std::move(_done.front());
+      } else if (!_done.empty()) {
+          ret.bufs = std::move(_done);
+      }
+      return ret;
+  }
+
   temporary_buffer<char>& snd_buf::front() {
       auto *one = boost::get<temporary_buffer<char>>(&bufs);
       if (one) {
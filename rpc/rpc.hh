@@ -23,7 +23,7 @@
 
 #include <unordered_map>
 #include <unordered_set>
-#include <list>
+#include <boost/intrusive/list.hpp>
 #include "core/future.hh"
 #include "net/api.hh"
 #include "core/reactor.hh"
@@ -31,6 +31,12 @@
 #include "core/shared_ptr.hh"
 #include "core/condition-variable.hh"
 #include "core/gate.hh"
+#include "core/shared_future.hh"
+#include "core/circular_buffer.hh"
+#include "core/thread.hh"
+#include "core/sharded.hh"
+#include "core/metrics_registration.hh"
+#include "core/metrics.hh"
 #include "rpc/rpc_types.hh"
 #include "core/byteorder.hh"
 
@@ -71,16 +77,150 @@ struct resource_limits {
     size_t max_memory = rpc_semaphore::max_counter(); ///< Maximum amount of memory that may be consumed by all requests
 };
 
+/// \brief Selects which messages are compressed once compression is negotiated
+///
+/// Both settings need a peer that supports sending messages uncompressed
+/// on a compressed connection; with older peers every message is compressed.
+struct compression_options {
+    /// Messages smaller than this many bytes are sent uncompressed.
+    size_t threshold = 0;
+    /// Measure compression ratio and CPU cost per verb, and stop compressing
+    /// verbs whose messages compress too poorly to be worth the CPU.  Such
+    /// verbs are re-examined from time to time.
+    bool adaptive = false;
+    /// Compression is kept for a verb while it saves at least this fraction of its bytes...
+    double min_savings = 0.1;
+    /// ...and costs at most this much CPU time per byte saved.
+    double max_ns_per_saved_byte = 50;
+};
+
 struct client_options {
     std::experimental::optional<net::tcp_keepalive_params> keepalive;
     compressor::factory* compressor_factory = nullptr;
     bool send_timeout_data = true;
+    compression_options compression;
+    /// Fraction of calls that are traced, see protocol::set_trace_handler().
+    /// Calls made by the handler of a traced request are traced as well.
+    double trace_sampling = 0;
+    /// Time stream data the server sends to an id this client has no
+    /// source for yet is kept; see server_options::unclaimed_stream_timeout.
+    std::chrono::milliseconds unclaimed_stream_timeout{10000};
+};
+
+/// \brief Admission limits for a group of verbs on an RPC server
+///
+/// Requests for verbs of a group are admitted against the group's limits
+/// first, and only then against the server wide \ref resource_limits, so
+/// that a flood of one kind of request cannot take all of the server's
+/// capacity.
+struct verb_group_limits {
+    size_t max_memory = rpc_semaphore::max_counter(); ///< Estimated memory of the group's requests being handled
+    size_t max_concurrency = rpc_semaphore::max_counter(); ///< Handlers of the group running at once
+    /// Requests of the group waiting for admission; further requests are
+    /// rejected right away with \ref overloaded_error.  Waiting requests
+    /// are read off their connection without taking server wide resources,
+    /// so this also bounds the memory they hold.
+    size_t max_queue_length = 1000;
+    /// If set, the group's handlers are started in a thread of this
+    /// scheduling group, so that a group over its CPU share gets its new
+    /// requests delayed.
+    seastar::thread_scheduling_group* scheduling_group = nullptr;
 };
 
 struct server_options {
     compressor::factory* compressor_factory = nullptr;
+    compression_options compression;
+    /// Admission limits of verb groups, see verb_group_of.
+    std::vector<verb_group_limits> verb_groups;
+    /// Index in verb_groups of the group of a verb; verbs not listed are
+    /// only subject to resource_limits.
+    std::unordered_map<uint64_t, unsigned> verb_group_of;
+    /// Time stream data is kept for an id whose source no handler has made
+    /// yet.  After that the data is dropped, the peer's sink is given its
+    /// credit back, and a source made later for it fails with \ref timeout_error.
+    std::chrono::milliseconds unclaimed_stream_timeout{10000};
+};
+
+// Per connection state behind compression_options.
+class compression_policy {
+    struct verb_state {
+        uint64_t in = 0;
+        uint64_t out = 0;
+        std::chrono::nanoseconds cpu{0};
+        unsigned samples = 0;
+        unsigned skipped = 0;
+        bool disabled = false;
+    };
+    // compressed messages of a verb measured before deciding on it
+    static constexpr unsigned sample_window = 64;
+    // uncompressed messages of a disabled verb before measuring it again
+    static constexpr unsigned reprobe_interval = 1024;
+    compression_options _options;
+    std::unordered_map<uint64_t, verb_state> _verbs;
+public:
+    compression_policy() = default;
+    explicit compression_policy(const compression_options& options) : _options(options) {}
+    bool adaptive() const {
+        return _options.adaptive;
+    }
+    bool should_compress(uint64_t verb, size_t size);
+    // Records the outcome of compressing a message of the verb.
+    void account(uint64_t verb, size_t in, size_t out, std::chrono::nanoseconds cpu);
+};
+
+using seastar::metrics::latency_histogram;
+
+/// \brief Client side latencies of the calls of a verb
+///
+/// \see protocol::enable_latency_metrics()
+struct verb_latency {
+    /// From the call until its request was written to the connection.
+    latency_histogram queue;
+    /// From writing the request until the reply arrived: network and server.
+    latency_histogram round_trip;
+    /// Time the server's handler took, as reported by the server.
+    latency_histogram handler;
+    seastar::metrics::metric_groups metrics;
+};
+
+/// \brief Timings of a traced call
+///
+/// \see protocol::set_trace_handler()
+struct trace_record {
+    uint64_t trace_id;
+    uint64_t verb;
+    /// Recorded by the server; only handler is set then.
+    bool server;
+    std::chrono::nanoseconds queue{0};
+    std::chrono::nanoseconds round_trip{0};
+    std::chrono::nanoseconds handler{0};
+};
+
+/// The trace id of the traced request whose handler is running, or 0.
+/// Only the part of a handler that runs before it first defers sees it.
+uint64_t current_trace_id();
+
+// Makes id the current trace id until destroyed.
+class trace_id_scope {
+    uint64_t _saved;
+public:
+    explicit trace_id_scope(uint64_t id);
+    trace_id_scope(const trace_id_scope&) = delete;
+    ~trace_id_scope();
 };
 
+// Trace id for a new call of a client sampling trace_sampling of its calls,
+// or 0 if the call is not traced.
+uint64_t sample_trace_id(double trace_sampling);
+
+// Removes the trace id a traced request carries in front of its data.
+uint64_t take_trace_id(rcv_buf& data);
+
+// Wraps a message that belongs to another shard in buffers of this shard
+// without copying it; it is released on its own shard once they are gone.
+rcv_buf make_shard_local(foreign_ptr<std::unique_ptr<rcv_buf>> buf);
+snd_buf make_shard_local(foreign_ptr<std::unique_ptr<snd_buf>> buf);
+
 inline
 size_t
 estimate_request_size(const resource_limits& lim, size_t serialized_size) {
@@ -95,11 +235,269 @@ struct negotiation_frame {
 enum class protocol_features : uint32_t {
     COMPRESS = 0,
     TIMEOUT = 1,
+    STREAM = 2,
+    COMPRESSION_BYPASS = 3,
+    TRACING = 4,
 };
 
+// With TRACING negotiated, a request whose verb has this bit set carries a
+// trace id in front of its data.
+static constexpr uint64_t traced_verb_bit = uint64_t(1) << 63;
+
+// With COMPRESSION_BYPASS negotiated, a compressed frame whose length has
+// this bit set carries an ordinary frame of the remaining length as is.
+static constexpr uint32_t uncompressed_frame_bit = uint32_t(1) << 31;
+
 // internal representation of feature data
 using feature_map = std::map<protocol_features, sstring>;
 
+// Each stream is flow controlled on its own: a sink may have at most
+// stream_window bytes that its source has not consumed yet, and the source
+// returns credit as it consumes.
+static constexpr size_t stream_window = 1 << 20;
+
+// Streams a connection keeps data for before a source is made for them;
+// a peer that opens more is dropped.
+static constexpr size_t max_unclaimed_streams = 64;
+
+// Stream frames travel as requests (client to server) or responses (server
+// to client) whose message id has this bit set; ordinary message ids never
+// get that far.
+static constexpr int64_t stream_id_bit = int64_t(1) << 62;
+
+enum class stream_frame_type : uint32_t {
+    DATA = 0,     // one element, marshalled
+    CREDIT = 1,   // uint32_t bytes of window returned to the sink
+    CLOSE = 2,    // end of stream
+};
+
+struct stream_sink_state {
+    stream_connection* con;
+    int64_t id;
+    rpc_semaphore credits{stream_window};
+    circular_buffer<snd_buf> pending;
+    bool closed = false;
+    stream_sink_state(stream_connection* c, int64_t i) : con(c), id(i) {}
+};
+
+struct stream_source_state {
+    stream_connection* con;
+    int64_t id;
+    circular_buffer<rcv_buf> bufs;
+    std::experimental::optional<promise<>> ready;
+    size_t consumed = 0;
+    // received and not given back as credit yet; never above stream_window
+    size_t unacked = 0;
+    bool eof = false;
+    bool abandoned = false;
+    // a source was made for it; until then it is dropped at claim_deadline
+    bool claimed = false;
+    lowres_clock::time_point claim_deadline;
+    std::exception_ptr ex;
+    stream_source_state(stream_connection* c, int64_t i) : con(c), id(i) {}
+};
+
+// Stream bookkeeping for an rpc connection.  The connection drops its
+// references to the stream states when it goes down, failing whoever waits
+// on them, so sinks and sources may outlive it.
+class stream_connection {
+    void* _serializer;
+protected:
+    bool _stream_negotiated = false;
+    int64_t _next_stream_id = 1;
+    std::unordered_map<int64_t, lw_shared_ptr<stream_sink_state>> _sinks;
+    std::unordered_map<int64_t, lw_shared_ptr<stream_source_state>> _sources;
+    size_t _unclaimed_sources = 0;
+    lowres_clock::duration _unclaimed_stream_timeout = std::chrono::seconds(10);
+    timer<lowres_clock> _unclaimed_timer;
+protected:
+    explicit stream_connection(void* serializer) : _serializer(serializer) {}
+    stream_connection(stream_connection&&) = default;
+    virtual ~stream_connection() {
+        abort_streams();
+    }
+    // Fills in the frame header and queues the frame for sending.
+    virtual future<> send_stream_frame(int64_t id, snd_buf data) = 0;
+    void handle_stream_frame(int64_t id, rcv_buf data);
+    void abort_streams();
+private:
+    lw_shared_ptr<stream_source_state> get_source(int64_t id);
+    lw_shared_ptr<stream_source_state> claim_source(int64_t id);
+    void expire_unclaimed();
+    void wake(stream_source_state& s);
+    void send_credit(stream_source_state& s);
+public:
+    // Bytes a stream frame reserves in front of its payload for the header.
+    virtual size_t stream_frame_head_space() const = 0;
+    bool stream_negotiated() const {
+        return _stream_negotiated;
+    }
+    future<> send_to_stream(lw_shared_ptr<stream_sink_state> s, stream_frame_type type, snd_buf data, size_t cost);
+    future<> close_sink(lw_shared_ptr<stream_sink_state> s);
+    void consumed(stream_source_state& s, size_t cost);
+    void abandon_source(stream_source_state& s);
+    void release_source(stream_source_state& s);
+
+    template <typename Serializer, typename... Out>
+    sink<Out...> make_sink();
+    template <typename Serializer, typename... In>
+    source<In...> make_source(int64_t id);
+};
+
+// Verb dispatch table.  Integer and enum verbs below max_dense are looked up
+// by indexing an array, allocated in full on first use so that registering a
+// verb from inside a handler never moves the handler being run; other verbs
+// (negative, large, or of a non-integral MsgType) fall back to a hash map.
+template <typename MsgType, typename Handler>
+class handler_table {
+    static constexpr size_t max_dense = 256;
+    std::vector<Handler> _dense;
+    std::unordered_map<MsgType, Handler> _sparse;
+private:
+    template <typename T>
+    static bool dense_index(T t, size_t& idx, std::true_type is_integral) {
+        using U = std::conditional_t<std::is_enum<T>::value, std::underlying_type<T>, std::common_type<T>>;
+        auto v = static_cast<typename U::type>(t);
+        if (v < 0 || uint64_t(v) >= max_dense) {
+            return false;
+        }
+        idx = size_t(v);
+        return true;
+    }
+    template <typename T>
+    static bool dense_index(const T&, size_t&, std::false_type is_integral) {
+        return false;
+    }
+    static bool dense_index(const MsgType& t, size_t& idx) {
+        return dense_index(t, idx, std::integral_constant<bool, std::is_integral<MsgType>::value || std::is_enum<MsgType>::value>());
+    }
+public:
+    // Like unordered_map::emplace, does not replace an existing handler.
+    void insert(MsgType t, Handler&& h) {
+        size_t idx;
+        if (dense_index(t, idx)) {
+            if (_dense.empty()) {
+                _dense.resize(max_dense);
+            }
+            if (!_dense[idx]) {
+                _dense[idx] = std::move(h);
+            }
+        } else {
+            _sparse.emplace(t, std::move(h));
+        }
+    }
+    void erase(MsgType t) {
+        size_t idx;
+        if (dense_index(t, idx)) {
+            if (idx < _dense.size()) {
+                _dense[idx] = Handler();
+            }
+        } else {
+            _sparse.erase(t);
+        }
+    }
+    // Returns nullptr if no handler is registered for t.
+    Handler* find(MsgType t) {
+        size_t idx;
+        if (dense_index(t, idx)) {
+            return idx < _dense.size() && _dense[idx] ? &_dense[idx] : nullptr;
+        }
+        auto it = _sparse.find(t);
+        return it != _sparse.end() ? &it->second : nullptr;
+    }
+};
+
+// Replies a client is waiting for, keyed by message id.  Ids are allocated
+// sequentially, so a power-of-two ring indexed by the low bits of the id
+// holds all of them without collisions as long as the ring is larger than
+// the spread of outstanding ids.  The ring doubles when it fills up; an id
+// that collides with a much older, still outstanding one goes to a small
+// overflow map instead, so a single stuck call cannot make the ring grow
+// without bound.
+template <typename T>
+class reply_table {
+    struct slot {
+        id_type id = 0;
+        std::unique_ptr<T> value;
+    };
+    std::vector<slot> _ring;
+    std::unordered_map<id_type, std::unique_ptr<T>> _overflow;
+    size_t _size = 0;
+private:
+    slot& slot_for(id_type id) {
+        return _ring[size_t(id) & (_ring.size() - 1)];
+    }
+    void grow() {
+        std::vector<slot> old(_ring.size() * 2);
+        std::swap(old, _ring);
+        for (auto&& s : old) {
+            if (s.value) {
+                auto& n = slot_for(s.id);
+                n.id = s.id;
+                n.value = std::move(s.value);
+            }
+        }
+    }
+public:
+    explicit reply_table(size_t initial_size = 256) : _ring(initial_size) {
+        assert(initial_size && !(initial_size & (initial_size - 1)));
+    }
+    size_t size() const {
+        return _size;
+    }
+    void insert(id_type id, std::unique_ptr<T> value) {
+        if (slot_for(id).value && _size >= _ring.size() / 2) {
+            grow();
+        }
+        auto& s = slot_for(id);
+        if (s.value) {
+            _overflow.emplace(id, std::move(value));
+        } else {
+            s.id = id;
+            s.value = std::move(value);
+        }
+        _size++;
+    }
+    T* find(id_type id) {
+        auto& s = slot_for(id);
+        if (s.value && s.id == id) {
+            return s.value.get();
+        } else if (!_overflow.empty()) {
+            auto it = _overflow.find(id);
+            if (it != _overflow.end()) {
+                return it->second.get();
+            }
+        }
+        return nullptr;
+    }
+    // Returns the entry for id, removing it from the table, or nullptr if
+    // there is none.
+    std::unique_ptr<T> remove(id_type id) {
+        std::unique_ptr<T> ret;
+        auto& s = slot_for(id);
+        if (s.value && s.id == id) {
+            ret = std::move(s.value);
+        } else if (!_overflow.empty()) {
+            auto it = _overflow.find(id);
+            if (it != _overflow.end()) {
+                ret = std::move(it->second);
+                _overflow.erase(it);
+            }
+        }
+        if (ret) {
+            _size--;
+        }
+        return ret;
+    }
+    void clear() {
+        for (auto&& s : _ring) {
+            s.value.reset();
+        }
+        _overflow.clear();
+        _size = 0;
+    }
+};
+
 // An rpc signature, in the form signature<Ret (In0, In1, In2)>.
 template <typename Function>
 struct signature;
@@ -109,7 +507,7 @@ struct signature;
 // do not forget to provide hash function for it
 template<typename Serializer, typename MsgType = uint32_t>
 class protocol {
-    class connection {
+    class connection : public stream_connection {
     protected:
         connected_socket _fd;
         input_stream<char> _read_buf;
@@ -120,35 +518,44 @@ class protocol {
         bool _connected = false;
         promise<> _stopped;
         stats _stats;
-        struct outgoing_entry {
+        // A message waiting in the send queue.  Entries are linked into the
+        // queue intrusively and recycled through a per-connection free list,
+        // so queueing a message does not allocate in the steady state.
+        struct outgoing_entry : public boost::intrusive::list_base_hook<> {
             timer<rpc_clock_type> t;
             snd_buf buf;
-            std::experimental::optional<promise<>> p = promise<>();
+            promise<> p;
             cancellable* pcancel = nullptr;
-            outgoing_entry(snd_buf b) : buf(std::move(b)) {}
-            outgoing_entry(outgoing_entry&& o) : t(std::move(o.t)), buf(std::move(o.buf)), p(std::move(o.p)), pcancel(o.pcancel) {
-                o.p = std::experimental::nullopt;
-            }
-            ~outgoing_entry() {
-                if (p) {
-                    if (pcancel) {
-                        pcancel->cancel_send = std::function<void()>();
-                        pcancel->send_back_pointer = nullptr;
-                    }
-                    p->set_value();
-                }
-            }
+            uint64_t verb = 0;
         };
-        friend outgoing_entry;
-        std::list<outgoing_entry> _outgoing_queue;
+        using outgoing_queue = boost::intrusive::list<outgoing_entry, boost::intrusive::constant_time_size<true>>;
+        // Upper bound on the fragments gathered into one write, kept well
+        // below IOV_MAX so that the batch goes out in a single sendmsg().
+        static constexpr size_t max_batch_fragments = 256;
+        static constexpr size_t max_free_entries = 128;
+        outgoing_queue _outgoing_queue;
+        std::vector<std::unique_ptr<outgoing_entry>> _free_entries;
+        std::vector<outgoing_entry*> _batch;
         condition_variable _outgoing_queue_cond;
         future<> _send_loop_stopped = make_ready_future<>();
         std::unique_ptr<compressor> _compressor;
         bool _timeout_negotiated = false;
+        bool _compression_bypass_negotiated = false;
+        bool _tracing_negotiated = false;
+        compression_policy _compression;
 
-        snd_buf compress(snd_buf buf) {
+        snd_buf compress(snd_buf buf, uint64_t verb) {
             if (_compressor) {
+                if (_compression_bypass_negotiated && !_compression.should_compress(verb, buf.size)) {
+                    _stats.uncompressed_messages++;
+                    return bypass_compression(std::move(buf));
+                }
+                auto size = buf.size;
+                auto start = _compression.adaptive() ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
                 buf = _compressor->compress(4, std::move(buf));
+                if (_compression.adaptive()) {
+                    _compression.account(verb, size, buf.size - 4, std::chrono::steady_clock::now() - start);
+                }
                 static_assert(snd_buf::chunk_size >= 4, "send buffer chunk size is too small");
                 write_le<uint32_t>(buf.front().get_write(), buf.size - 4);
                 return std::move(buf);
@@ -156,17 +563,88 @@ class protocol {
             return std::move(buf);
         }
 
-        future<> send_buffer(snd_buf buf) {
+        // Wraps a frame into a compressed frame that is marked as stored uncompressed.
+        static snd_buf bypass_compression(snd_buf buf) {
+            temporary_buffer<char> header(4);
+            write_le<uint32_t>(header.get_write(), buf.size | uncompressed_frame_bit);
+            std::vector<temporary_buffer<char>> bufs;
+            bufs.push_back(std::move(header));
+            auto* one = boost::get<temporary_buffer<char>>(&buf.bufs);
+            if (one) {
+                bufs.push_back(std::move(*one));
+            } else {
+                auto& ar = boost::get<std::vector<temporary_buffer<char>>>(buf.bufs);
+                std::move(ar.begin(), ar.end(), std::back_inserter(bufs));
+            }
+            buf.bufs = std::move(bufs);
+            buf.size += 4;
+            return buf;
+        }
+
+        // Appends the buffers of a message to bufs.
+        static void append_buffer(std::vector<temporary_buffer<char>>& bufs, snd_buf buf) {
             auto* b = boost::get<temporary_buffer<char>>(&buf.bufs);
             if (b) {
-                return _write_buf.write(std::move(*b));
+                bufs.push_back(std::move(*b));
             } else {
-                return do_with(std::move(boost::get<std::vector<temporary_buffer<char>>>(buf.bufs)),
-                        [this] (std::vector<temporary_buffer<char>>& ar) {
-                    return do_for_each(ar.begin(), ar.end(), [this] (auto& b) {
-                        return _write_buf.write(std::move(b));
-                    });
-                });
+                for (auto&& b : boost::get<std::vector<temporary_buffer<char>>>(buf.bufs)) {
+                    bufs.push_back(std::move(b));
+                }
+            }
+        }
+        // Slices of one send buffer chunk share its deleter, which a packet
+        // cannot hold twice, so the packet refers to the buffers' data and
+        // keeps them all alive with a single deleter.
+        static net::packet make_packet(std::vector<temporary_buffer<char>> bufs) {
+            std::vector<net::fragment> frags;
+            frags.reserve(bufs.size());
+            for (auto&& b : bufs) {
+                if (b.size()) {
+                    frags.push_back({b.get_write(), b.size()});
+                }
+            }
+            return net::packet(std::move(frags), make_object_deleter(std::move(bufs)));
+        }
+
+        outgoing_entry& get_entry() {
+            if (!_free_entries.empty()) {
+                auto e = _free_entries.back().release();
+                _free_entries.pop_back();
+                return *e;
+            }
+            auto e = new outgoing_entry;
+            e->t.set_callback([this, e] {
+                // timed out while still queued
+                _outgoing_queue.erase(_outgoing_queue.iterator_to(*e));
+                complete(*e);
+            });
+            return *e;
+        }
+
+        // Resolves the entry's future and returns it to the free list.
+        // The entry must already be unlinked from the queue.
+        void complete(outgoing_entry& e) {
+            e.t.cancel();
+            if (e.pcancel) {
+                e.pcancel->cancel_send = std::function<void()>();
+                e.pcancel->send_back_pointer = nullptr;
+                e.pcancel = nullptr;
+            }
+            e.buf = snd_buf();
+            e.p.set_value();
+            e.p = promise<>();
+            if (_free_entries.size() < max_free_entries) {
+                _free_entries.emplace_back(&e);
+            } else {
+                delete &e;
+            }
+        }
+
+        void clear_outgoing_queue() {
+            while (!_outgoing_queue.empty()) {
+                auto& e = _outgoing_queue.front();
+                _outgoing_queue.pop_front();
+                complete(e);
             }
         }
 
@@ -184,32 +662,46 @@ class protocol {
                     if (_outgoing_queue.empty()) {
                         return make_ready_future();
                     }
-                    auto d = std::move(_outgoing_queue.front());
-                    _outgoing_queue.pop_front();
-                    d.t.cancel(); // cancel timeout timer
-                    if (d.pcancel) {
-                        d.pcancel->cancel_send = std::function<void()>(); // request is no longer cancellable
-                    }
-                    if (QueueType == outgoing_queue_type::request) {
-                        static_assert(snd_buf::chunk_size >= 8, "send buffer chunk size is too small");
-                        if (_timeout_negotiated) {
-                            auto expire = d.t.get_timeout();
-                            uint64_t left = 0;
-                            if (expire != typename timer<rpc_clock_type>::time_point()) {
-                                left = std::chrono::duration_cast<std::chrono::milliseconds>(expire - timer<rpc_clock_type>::clock::now()).count();
+                    // Drain everything queued so far into a single packet, so that
+                    // a burst of small messages costs one write and one flush.
+                    std::vector<temporary_buffer<char>> bufs;
+                    while (!_outgoing_queue.empty() && bufs.size() < max_batch_fragments) {
+                        auto& d = _outgoing_queue.front();
+                        _outgoing_queue.pop_front();
+                        _batch.push_back(&d);
+                        d.t.cancel(); // cancel timeout timer
+                        if (d.pcancel) {
+                            d.pcancel->cancel_send = std::function<void()>(); // request is no longer cancellable
+                        }
+                        if (QueueType == outgoing_queue_type::request) {
+                            static_assert(snd_buf::chunk_size >= 8, "send buffer chunk size is too small");
+                            if (_timeout_negotiated) {
+                                auto expire = d.t.get_timeout();
+                                uint64_t left = 0;
+                                if (expire != typename timer<rpc_clock_type>::time_point()) {
+                                    left = std::chrono::duration_cast<std::chrono::milliseconds>(expire - timer<rpc_clock_type>::clock::now()).count();
+                                }
+                                write_le<uint64_t>(d.buf.front().get_write(), left);
+                            } else {
+                                d.buf.front().trim_front(8);
+                                d.buf.size -= 8;
                             }
-                            write_le<uint64_t>(d.buf.front().get_write(), left);
-                        } else {
-                            d.buf.front().trim_front(8);
-                            d.buf.size -= 8;
                         }
+                        append_buffer(bufs, compress(std::move(d.buf), d.verb));
                     }
-                    d.buf = compress(std::move(d.buf));
-                    auto f = send_buffer(std::move(d.buf)).then([this] {
-                        _stats.sent_messages++;
+                    auto f = _write_buf.write(make_packet(std::move(bufs))).then([this, n = _batch.size()] {
+                        _stats.sent_messages += n;
+                        _stats.flushes++;
+                        _proto._sent_messages += n;
+                        _proto._flushes++;
                         return _write_buf.flush();
                     });
-                    return f.finally([d = std::move(d)] {});
+                    return f.finally([this] {
+                        for (auto d : _batch) {
+                            complete(*d);
+                        }
+                        _batch.clear();
+                    });
                 });
             }).handle_exception([this] (std::exception_ptr eptr) {
                 _error = true;
@@ -227,13 +719,17 @@ class protocol {
                 _fd.shutdown_output();
             }
             return _send_loop_stopped.finally([this] {
-                _outgoing_queue.clear();
+                clear_outgoing_queue();
             });
         }
 
     public:
-        connection(connected_socket&& fd, protocol& proto) : _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()), _proto(proto), _connected(true) {}
-        connection(protocol& proto) : _proto(proto) {}
+        connection(connected_socket&& fd, protocol& proto) : stream_connection(&proto._serializer), _fd(std::move(fd)), _read_buf(_fd.input()), _write_buf(_fd.output()), _proto(proto), _connected(true) {}
+        connection(protocol& proto) : stream_connection(&proto._serializer), _proto(proto) {}
+        connection(connection&&) = default;
+        ~connection() {
+            clear_outgoing_queue();
+        }
         void set_socket(connected_socket&& fd) {
             if (_connected) {
                 throw std::runtime_error("already connected");
@@ -251,27 +747,29 @@ class protocol {
         }
         // functions below are public because they are used by external heavily templated functions
         // and I am not smart enough to know how to define them as friends
-        future<> send(snd_buf buf, std::experimental::optional<rpc_clock_type::time_point> timeout = {}, cancellable* cancel = nullptr) {
+        // verb identifies the message for compression_options::adaptive.
+        future<> send(snd_buf buf, std::experimental::optional<rpc_clock_type::time_point> timeout = {}, cancellable* cancel = nullptr, uint64_t verb = 0) {
             if (!_error) {
                 if (timeout && *timeout <= rpc_clock_type::now()) {
                     return make_ready_future<>();
                 }
-                _outgoing_queue.emplace_back(std::move(buf));
-                auto deleter = [this, it = std::prev(_outgoing_queue.cend())] {
-                    _outgoing_queue.erase(it);
-                };
+                auto& e = get_entry();
+                e.buf = std::move(buf);
+                e.verb = verb;
+                _outgoing_queue.push_back(e);
                 if (timeout) {
-                    auto& t = _outgoing_queue.back().t;
-                    t.set_callback(deleter);
-                    t.arm(timeout.value());
+                    e.t.arm(timeout.value());
                 }
                 if (cancel) {
-                    cancel->cancel_send = std::move(deleter);
-                    cancel->send_back_pointer = &_outgoing_queue.back().pcancel;
-                    _outgoing_queue.back().pcancel = cancel;
+                    cancel->cancel_send = [this, &e] {
+                        _outgoing_queue.erase(_outgoing_queue.iterator_to(e));
+                        complete(e);
+                    };
+                    cancel->send_back_pointer = &e.pcancel;
+                    e.pcancel = cancel;
                 }
                 _outgoing_queue_cond.signal();
-                return _outgoing_queue.back().p->get_future();
+                return e.p.get_future();
             } else {
                 return make_exception_future<>(closed_error());
             }
@@ -292,23 +790,49 @@ class protocol {
 public:
     class server {
     public:
+        // Units held by a request of a verb group while it is handled.
+        struct request_permit {
+            std::experimental::optional<resource_permit> memory;
+            std::experimental::optional<resource_permit> concurrency;
+            seastar::thread_scheduling_group* scheduling_group = nullptr;
+        };
+        struct verb_group {
+            verb_group_limits limits;
+            rpc_semaphore memory;
+            rpc_semaphore concurrency;
+            size_t queued = 0;
+            uint64_t rejected = 0;
+            explicit verb_group(const verb_group_limits& l) : limits(l), memory(l.max_memory), concurrency(l.max_concurrency) {}
+        };
         class connection : public protocol::connection, public enable_lw_shared_from_this<connection> {
             server& _server;
             client_info _info;
         private:
             future<> negotiate_protocol(input_stream<char>& in);
-            future<std::experimental::optional<uint64_t>, MsgType, int64_t, std::experimental::optional<rcv_buf>>
+            future<std::experimental::optional<uint64_t>, uint64_t, int64_t, std::experimental::optional<rcv_buf>>
             read_request_frame(input_stream<char>& in);
-            future<std::experimental::optional<uint64_t>, MsgType, int64_t, std::experimental::optional<rcv_buf>>
+            future<std::experimental::optional<uint64_t>, uint64_t, int64_t, std::experimental::optional<rcv_buf>>
             read_request_frame_compressed(input_stream<char>& in);
             feature_map negotiate(feature_map requested);
             void send_loop() {
                 protocol::connection::template send_loop<protocol::connection::outgoing_queue_type::response>();
             }
+            virtual future<> send_stream_frame(int64_t id, snd_buf data) override {
+                return respond(id | stream_id_bit, std::move(data), {});
+            }
         public:
             connection(server& s, connected_socket&& fd, socket_address&& addr, protocol& proto);
+            virtual size_t stream_frame_head_space() const override {
+                return 20;
+            }
             future<> process();
-            future<> respond(int64_t msg_id, snd_buf&& data, std::experimental::optional<rpc_clock_type::time_point> timeout);
+            // data starts with 20 bytes of head space for the header.
+            // handler_time is reported to the client if tracing is negotiated.
+            future<> respond(int64_t msg_id, snd_buf&& data, std::experimental::optional<rpc_clock_type::time_point> timeout, uint64_t verb = 0,
+                    std::chrono::nanoseconds handler_time = {});
+            bool tracing_negotiated() const {
+                return this->_tracing_negotiated;
+            }
             client_info& info() { return _info; }
             const client_info& info() const { return _info; }
             stats get_stats() const {
@@ -331,9 +855,15 @@ class protocol {
                     return get_units(_server._resources_available, memory_consumed);
                 }
             }
+            // Admits a request for verb against the limits of its group, if
+            // it has one; fails with overloaded_error if the group's queue
+            // is full.
+            future<request_permit> admit(uint64_t verb, size_t memory_consumed, std::experimental::optional<rpc_clock_type::time_point> timeout);
             size_t estimate_request_size(size_t serialized_size) {
                 return rpc::estimate_request_size(_server._limits, serialized_size);
             }
+            // Tells the client that a request was shed.
+            void reply_overloaded(int64_t msg_id, std::experimental::optional<rpc_clock_type::time_point> timeout);
             server& get_server() {
                 return _server;
             }
@@ -343,6 +873,7 @@ class protocol {
         server_socket _ss;
         resource_limits _limits;
         rpc_semaphore _resources_available;
+        std::vector<std::unique_ptr<verb_group>> _verb_groups;
         std::unordered_set<lw_shared_ptr<connection>> _conns;
         promise<> _ss_stopped;
         seastar::gate _reply_gate;
@@ -357,6 +888,10 @@ class protocol {
             _ss.abort_accept();
             _ss = server_socket();
             _resources_available.broken();
+            for (auto&& g : _verb_groups) {
+                g->memory.broken();
+                g->concurrency.broken();
+            }
             return when_all(_ss_stopped.get_future(),
                 parallel_for_each(_conns, [] (lw_shared_ptr<connection> conn) {
                     return conn->stop();
@@ -373,6 +908,11 @@ class protocol {
         seastar::gate& reply_gate() {
             return _reply_gate;
         }
+        /// Requests of the verb group at index group of server_options::verb_groups
+        /// that were rejected because its queue was full.
+        uint64_t rejected_requests(unsigned group) const {
+            return _verb_groups.at(group)->rejected;
+        }
         friend connection;
     };
 
@@ -382,6 +922,12 @@ class protocol {
         struct reply_handler_base {
             timer<rpc_clock_type> t;
             cancellable* pcancel = nullptr;
+            // set for calls whose latency is recorded, see track_latency()
+            bool tracked = false;
+            uint64_t verb = 0;
+            uint64_t trace_id = 0;
+            std::chrono::steady_clock::time_point start;
+            std::chrono::steady_clock::time_point written;
             virtual void operator()(client&, id_type, rcv_buf data) = 0;
             virtual void timeout() {}
             virtual void cancel() {}
@@ -412,19 +958,29 @@ class protocol {
             virtual ~reply_handler() {}
         };
     private:
-        std::unordered_map<id_type, std::unique_ptr<reply_handler_base>> _outstanding;
+        reply_table<reply_handler_base> _outstanding;
         ipv4_addr _server_addr;
         client_options _options;
+        shared_promise<> _negotiated;
+        bool _negotiation_done = false;
     private:
         future<> negotiate_protocol(input_stream<char>& in);
         void negotiate(feature_map server_features);
-        future<int64_t, std::experimental::optional<rcv_buf>>
+        future<int64_t, uint64_t, std::experimental::optional<rcv_buf>>
         read_response_frame(input_stream<char>& in);
-        future<int64_t, std::experimental::optional<rcv_buf>>
+        future<int64_t, uint64_t, std::experimental::optional<rcv_buf>>
         read_response_frame_compressed(input_stream<char>& in);
+        void record_latency(reply_handler_base& h, std::chrono::nanoseconds handler_time);
         void send_loop() {
             protocol::connection::template send_loop<protocol::connection::outgoing_queue_type::request>();
         }
+        virtual future<> send_stream_frame(int64_t id, snd_buf data) override {
+            auto p = data.front().get_write() + 8; // 8 extra bytes for expiration timer
+            write_le<uint64_t>(p, 0);
+            write_le<int64_t>(p + 8, id | stream_id_bit);
+            write_le<uint32_t>(p + 16, data.size - 28);
+            return this->send(std::move(data));
+        }
     public:
         /**
          * Create client object which will attempt to connect to the remote address.
@@ -464,18 +1020,38 @@ class protocol {
             }
             if (cancel) {
                 cancel->cancel_wait = [this, id] {
-                    _outstanding[id]->cancel();
-                    _outstanding.erase(id);
+                    _outstanding.remove(id)->cancel();
                 };
                 h->pcancel = cancel;
                 cancel->wait_back_pointer = &h->pcancel;
             }
-            _outstanding.emplace(id, std::move(h));
+            _outstanding.insert(id, std::move(h));
         }
         void wait_timed_out(id_type id) {
             this->_stats.timeout++;
-            _outstanding[id]->timeout();
-            _outstanding.erase(id);
+            _outstanding.remove(id)->timeout();
+        }
+        uint64_t next_trace_id() const {
+            return this->_tracing_negotiated ? sample_trace_id(_options.trace_sampling) : 0;
+        }
+        // Marks the call waiting for a reply as one whose latency is recorded;
+        // returns false if it has already completed.
+        bool track_latency(id_type id, uint64_t verb, uint64_t trace_id, std::chrono::steady_clock::time_point start) {
+            auto h = _outstanding.find(id);
+            if (!h) {
+                return false;
+            }
+            h->tracked = true;
+            h->verb = verb;
+            h->trace_id = trace_id;
+            h->start = start;
+            return true;
+        }
+        void request_written(id_type id) {
+            auto h = _outstanding.find(id);
+            if (h) {
+                h->written = std::chrono::steady_clock::now();
+            }
         }
 
         future<> stop() {
@@ -488,14 +1064,40 @@ class protocol {
         ipv4_addr peer_address() const {
             return _server_addr;
         }
+        virtual size_t stream_frame_head_space() const override {
+            return 28;
+        }
+        /// Creates a stream to the server, to be passed as an argument to a
+        /// verb whose handler takes a \ref source of the same types.  Fails
+        /// with \ref stream_not_supported_error if the server is too old.
+        template <typename... Out>
+        future<sink<Out...>> make_stream_sink() {
+            return _negotiated.get_shared_future().then([this] {
+                if (this->_error) {
+                    throw closed_error();
+                }
+                if (!this->_stream_negotiated) {
+                    throw stream_not_supported_error();
+                }
+                return this->template make_sink<Serializer, Out...>();
+            });
+        }
     };
     friend server;
 private:
     using rpc_handler = std::function<future<> (lw_shared_ptr<typename server::connection>, std::experimental::optional<rpc_clock_type::time_point> timeout, int64_t msgid,
-                                                rcv_buf data)>;
-    std::unordered_map<MsgType, rpc_handler> _handlers;
+                                                uint64_t trace_id, rcv_buf data)>;
+    handler_table<MsgType, rpc_handler> _handlers;
     Serializer _serializer;
     std::function<void(const sstring&)> _logger;
+    std::function<void(const trace_record&)> _trace_handler;
+    sstring _latency_metrics_name;
+    bool _track_latency = false;
+    std::unordered_map<uint64_t, std::unique_ptr<verb_latency>> _latency;
+    // summed over the connections of the protocol, see enable_metrics()
+    uint64_t _sent_messages = 0;
+    uint64_t _flushes = 0;
+    seastar::metrics::metric_groups _metrics;
 public:
     protocol(Serializer&& serializer) : _serializer(std::forward<Serializer>(serializer)) {}
     template<typename Func>
@@ -507,6 +1109,21 @@ class protocol {
     template<typename Func>
     auto register_handler(MsgType t, Func&& func);
 
+    /// Registers a handler that runs on the shard sharder picks for each
+    /// request, instead of the shard of the connection it arrived on.
+    ///
+    /// sharder is called on the connection's shard with the request's first
+    /// argument and returns a shard (taken modulo smp::count).  The request is
+    /// deserialized, handled and its reply serialized on that shard; the reply
+    /// is then sent from the connection's shard.  Neither message is copied.
+    ///
+    /// func and the serializer are used from other shards, so they must not
+    /// keep state of their own (func would typically capture a sharded<>
+    /// service and use local()).  func may not take client_info or streams,
+    /// and does not run in its verb group's scheduling group.
+    template<typename Sharder, typename Func>
+    auto register_handler(MsgType t, Sharder&& sharder, Func&& func);
+
     void unregister_handler(MsgType t) {
         _handlers.erase(t);
     }
@@ -515,6 +1132,83 @@ class protocol {
         _logger = logger;
     }
 
+    /// Starts recording the latencies of the calls clients of this protocol
+    /// make, per verb.  They are exported as histograms of the "rpc_latency"
+    /// metric group, labelled with name and the verb.  The server's handler
+    /// time is only recorded for clients created afterwards.
+    void enable_latency_metrics(sstring name) {
+        _latency_metrics_name = std::move(name);
+        _track_latency = true;
+    }
+
+    /// Exports the number of messages the protocol's connections sent and
+    /// the number of writes they were flushed in, as the "rpc" metric group
+    /// labelled with name.  Their ratio is the average number of messages
+    /// coalesced into a write.
+    void enable_metrics(sstring name) {
+        namespace sm = seastar::metrics;
+        std::vector<sm::label_instance> labels{sm::label_instance("protocol", name)};
+        _metrics.clear();
+        _metrics.add_group("rpc", {
+            sm::make_derive("sent_messages", sm::description("Number of messages sent"), labels, _sent_messages),
+            sm::make_derive("flushes", sm::description("Number of writes messages were sent in"), labels, _flushes),
+        });
+    }
+
+    /// Latencies recorded for calls of verb, or nullptr if there were none.
+    const verb_latency* get_latency(MsgType verb) const {
+        auto it = _latency.find(uint64_t(verb));
+        return it == _latency.end() ? nullptr : it->second.get();
+    }
+
+    /// Called with the timings of every traced call, on the client once the
+    /// reply arrives and on the server once the handler completes.  Trace ids
+    /// are only passed on by clients created afterwards, or with
+    /// client_options::trace_sampling set.
+    /// \see client_options::trace_sampling
+    void set_trace_handler(std::function<void(const trace_record&)> handler) {
+        _trace_handler = std::move(handler);
+    }
+
+    void trace(const trace_record& r) {
+        if (_trace_handler) {
+            _trace_handler(r);
+        }
+    }
+
+    bool tracks_latency() const {
+        return _track_latency;
+    }
+
+    bool has_trace_handler() const {
+        return bool(_trace_handler);
+    }
+
+    verb_latency& latency_for(uint64_t verb) {
+        auto& l = _latency[verb];
+        if (!l) {
+            l = std::make_unique<verb_latency>();
+            namespace sm = seastar::metrics;
+            std::vector<sm::label_instance> labels{
+                sm::label_instance("protocol", _latency_metrics_name),
+                sm::label_instance("verb", verb),
+            };
+            auto& v = *l;
+            v.metrics.add_group("rpc_latency", {
+                sm::make_histogram("queue", sm::description("Time from a call until its request was written, in microseconds"), labels, [&v] {
+                    return v.queue.to_metrics_histogram();
+                }),
+                sm::make_histogram("round_trip", sm::description("Time from writing a request until its reply arrived, in microseconds"), labels, [&v] {
+                    return v.round_trip.to_metrics_histogram();
+                }),
+                sm::make_histogram("handler", sm::description("Time the server's handler took, in microseconds"), labels, [&v] {
+                    return v.handler.to_metrics_histogram();
+                }),
+            });
+        }
+        return *l;
+    }
+
     void log(const sstring& str) {
         if (_logger) {
             _logger(str);
@@ -536,7 +1230,7 @@ class protocol {
     auto make_client(signature<Ret(In...)> sig, MsgType t);
 
     void register_receiver(MsgType t, rpc_handler&& handler) {
-        _handlers.emplace(t, std::move(handler));
+        _handlers.insert(t, std::move(handler));
     }
 
     template <typename FrameType, typename Info>
@@ -0,0 +1,189 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "rpc/rpc.hh"
+#include "core/metrics_registration.hh"
+#include "core/metrics.hh"
+#include "core/print.hh"
+#include <random>
+
+namespace rpc {
+
+/// \brief Options for a \ref client_pool
+struct client_pool_options {
+    /// Options every connection of the pool is opened with.
+    client_options client;
+    /// Connections kept to each peer (to each shard of a peer, see
+    /// peer_shards).  Calls are spread over them by verb, so that a large
+    /// response on one connection does not hold up calls on the others.
+    unsigned connections_per_peer = 1;
+    /// Calls whose size hint is at least this many bytes go to a connection
+    /// of their own, the last one of the peer; other calls use the rest.
+    /// Zero, or a single connection per peer, disables this.
+    size_t large_message_size = 0;
+    /// When non-zero, connections are opened per shard of the peer, which
+    /// must run this many shards and listen with
+    /// load_balancing_algorithm::port: the local port of each connection
+    /// is chosen so that it lands on the requested shard.
+    unsigned peer_shards = 0;
+};
+
+/// \brief A set of rpc connections to many peers
+///
+/// \ref get() returns the connection a call should be sent on, opening it
+/// on first use and reopening it once it has failed.  Each connection
+/// exports its in-flight calls as a metric, labelled with the pool name,
+/// the peer and the connection's index.
+template<typename Serializer, typename MsgType = uint32_t>
+class client_pool {
+public:
+    using protocol_type = protocol<Serializer, MsgType>;
+    using client_type = typename protocol_type::client;
+    // Maps a verb to a connection; taken modulo the number of connections.
+    using classifier = std::function<unsigned (MsgType)>;
+private:
+    struct slot {
+        std::unique_ptr<client_type> client;
+        uint64_t connects = 0;
+        seastar::metrics::metric_groups metrics;
+    };
+    struct peer {
+        std::vector<slot> slots;
+    };
+    protocol_type& _proto;
+    client_pool_options _options;
+    classifier _classify;
+    sstring _name;
+    std::unordered_map<uint64_t, peer> _peers;
+    // random start, so that a restarted process does not reuse ports
+    // whose previous connections are still in TIME_WAIT
+    unsigned _port_cursor = std::random_device()();
+    seastar::gate _stopping;
+    bool _stopped = false;
+private:
+    static uint64_t key(ipv4_addr addr) {
+        return uint64_t(addr.ip) << 16 | addr.port;
+    }
+    unsigned connections_per_shard() const {
+        return std::max(_options.connections_per_peer, 1u);
+    }
+    unsigned pick(MsgType verb, size_t size_hint) const {
+        auto n = connections_per_shard();
+        bool split_large = _options.large_message_size && n > 1;
+        if (split_large && size_hint >= _options.large_message_size) {
+            return n - 1;
+        }
+        auto c = _classify ? _classify(verb) : unsigned(uint64_t(verb));
+        return c % (split_large ? n - 1 : n);
+    }
+    // A local port in the ephemeral range that the peer's port based load
+    // balancing maps to shard.
+    uint16_t local_port_for(unsigned shard) {
+        static constexpr unsigned first = 32768;
+        static constexpr unsigned last = 60999;
+        auto n = _options.peer_shards;
+        auto port = first + (_port_cursor++ * n) % (last - first - n);
+        return port - port % n + shard + (port % n > shard ? n : 0);
+    }
+    void register_metrics(ipv4_addr addr, unsigned index, slot& s) {
+        namespace sm = seastar::metrics;
+        std::vector<sm::label_instance> labels{
+            sm::label_instance("pool", _name),
+            sm::label_instance("peer", sprint("%s", addr)),
+            sm::label_instance("connection", index),
+        };
+        s.metrics.add_group("rpc_client_pool", {
+            sm::make_gauge("in_flight", [&s] {
+                if (!s.client) {
+                    return 0.0;
+                }
+                auto st = s.client->get_stats();
+                return double(st.wait_reply + st.pending);
+            }, sm::description("Calls sent or queued on the connection that have not completed"), labels),
+            sm::make_derive("connects", s.connects, sm::description("Times the connection was opened"), labels),
+        });
+    }
+    void retire(std::unique_ptr<client_type> c) {
+        auto p = c.get();
+        seastar::with_gate(_stopping, [p] {
+            return p->stop();
+        }).finally([c = std::move(c)] {});
+    }
+public:
+    /// \param name identifies the pool in metrics; if empty no metrics are registered
+    client_pool(protocol_type& proto, client_pool_options options, sstring name = {}, classifier classify = {})
+        : _proto(proto), _options(std::move(options)), _classify(std::move(classify)), _name(std::move(name)) {
+    }
+    client_pool(client_pool&&) = delete;
+    ~client_pool() {
+        assert(_stopped || _peers.empty());
+    }
+
+    /// Returns the connection a call with this verb to peer should use.
+    ///
+    /// \param size_hint expected size of the call's request or reply, see
+    ///        \ref client_pool_options::large_message_size
+    /// \param shard the peer's shard, if \ref client_pool_options::peer_shards is set
+    client_type& get(ipv4_addr addr, MsgType verb, size_t size_hint = 0, unsigned shard = 0) {
+        if (_stopped) {
+            throw closed_error();
+        }
+        auto& p = _peers[key(addr)];
+        auto shards = std::max(_options.peer_shards, 1u);
+        if (p.slots.empty()) {
+            p.slots = std::vector<slot>(shards * connections_per_shard());
+        }
+        auto index = (shard % shards) * connections_per_shard() + pick(verb, size_hint);
+        auto& s = p.slots[index];
+        if (!s.client || s.client->error()) {
+            if (s.client) {
+                retire(std::move(s.client));
+            } else if (!_name.empty()) {
+                register_metrics(addr, index, s);
+            }
+            ipv4_addr local;
+            if (_options.peer_shards) {
+                local = ipv4_addr(local_port_for(shard % shards));
+            }
+            s.client = std::make_unique<client_type>(_proto, _options.client, addr, local);
+            s.connects++;
+        }
+        return *s.client;
+    }
+
+    /// Stops all connections; \ref get() may not be called afterwards.
+    future<> stop() {
+        _stopped = true;
+        for (auto&& p : _peers) {
+            for (auto&& s : p.second.slots) {
+                s.metrics.clear();
+                if (s.client) {
+                    retire(std::move(s.client));
+                }
+            }
+        }
+        return _stopping.close();
+    }
+};
+
+}
@@ -37,6 +37,7 @@ namespace rpc {
 enum class exception_type : uint32_t {
     USER = 0,
     UNKNOWN_VERB = 1,
+    OVERLOADED = 2,
 };
 
 template<typename T>
@@ -197,6 +198,37 @@ inline void marshall_one(Serializer& serializer, Output& out, const T& arg) {
     serialize_helper_type::serialize(serializer, out, arg);
 }
 
+// a sink travels as its stream id; the receiving end turns it into a source
+template <typename Serializer, typename Output, typename... T>
+inline void marshall_one(Serializer& serializer, Output& out, const sink<T...>& arg) {
+    auto id = cpu_to_le(arg.get_id());
+    out.write(reinterpret_cast<const char*>(&id), sizeof(id));
+}
+
+// The client function register_handler() returns for a verb taking a source
+// has nothing to send; it only has to compile.
+template <typename Serializer, typename Output, typename... T>
+inline void marshall_one(Serializer& serializer, Output& out, const source<T...>& arg) {
+    throw std::logic_error("rpc source cannot be sent, pass a sink instead");
+}
+
+// a spliced buffer is written as is by streams other than snd_buf_writer
+template <typename Serializer, typename Output>
+inline void marshall_one(Serializer& serializer, Output& out, const spliced_buffer& arg) {
+    auto size = cpu_to_le(uint32_t(arg.size()));
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    for (auto&& f : arg.fragments()) {
+        out.write(f.get(), f.size());
+    }
+}
+
+template <typename Serializer>
+inline void marshall_one(Serializer& serializer, snd_buf_writer& out, const spliced_buffer& arg) {
+    auto size = cpu_to_le(uint32_t(arg.size()));
+    out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    out.splice(arg);
+}
+
 template <typename Serializer, typename Output, typename... T>
 inline void do_marshall(Serializer& serializer, Output& out, const T&... args) {
     // C++ guarantees that brace-initialization expressions are evaluted in order
@@ -215,30 +247,28 @@ static inline seastar::memory_output_stream<snd_buf::iterator> make_serializer_s
 
 template <typename Serializer, typename... T>
 inline snd_buf marshall(Serializer& serializer, size_t head_space, const T&... args) {
-    seastar::measuring_output_stream measure;
-    do_marshall(serializer, measure, args...);
-    snd_buf ret(measure.size() + head_space);
-    auto out = make_serializer_stream(ret);
-    out.skip(head_space);
+    snd_buf_writer out(head_space);
     do_marshall(serializer, out, args...);
-    return ret;
+    return std::move(out).finish();
 }
 
+// con is the connection the data arrived on, needed to attach sources to it;
+// it may be null where streams cannot appear.
 template <typename Serializer, typename Input>
-inline std::tuple<> do_unmarshall(Serializer& serializer, Input& in) {
+inline std::tuple<> do_unmarshall(Serializer& serializer, stream_connection* con, Input& in) {
     return std::make_tuple();
 }
 
 template<typename Serializer, typename Input, typename T>
 struct unmarshal_one {
-    static T doit(Serializer& serializer, Input& in) {
+    static T doit(Serializer& serializer, stream_connection* con, Input& in) {
         return read(serializer, in, type<T>());
     }
 };
 
 template<typename Serializer, typename Input, typename T>
 struct unmarshal_one<Serializer, Input, optional<T>> {
-    static optional<T> doit(Serializer& serializer, Input& in) {
+    static optional<T> doit(Serializer& serializer, stream_connection* con, Input& in) {
         if (in.size()) {
             return optional<T>(read(serializer, in, type<typename remove_optional<T>::type>()));
         } else {
@@ -247,18 +277,52 @@ struct unmarshal_one<Serializer, Input, optional<T>> {
     }
 };
 
+template<typename Serializer, typename Input>
+struct unmarshal_one<Serializer, Input, spliced_buffer> {
+    static spliced_buffer doit(Serializer& serializer, stream_connection* con, Input& in) {
+        uint32_t size;
+        in.read(reinterpret_cast<char*>(&size), sizeof(size));
+        size = le_to_cpu(size);
+        if (size > in.size()) {
+            throw rpc_protocol_error();
+        }
+        temporary_buffer<char> buf(size);
+        in.read(buf.get_write(), buf.size());
+        return spliced_buffer(std::move(buf));
+    }
+};
+
+template<typename Serializer, typename Input, typename... T>
+struct unmarshal_one<Serializer, Input, source<T...>> {
+    static source<T...> doit(Serializer& serializer, stream_connection* con, Input& in) {
+        int64_t id;
+        in.read(reinterpret_cast<char*>(&id), sizeof(id));
+        if (!con || !con->stream_negotiated()) {
+            throw rpc_protocol_error();
+        }
+        return con->template make_source<Serializer, T...>(le_to_cpu(id));
+    }
+};
+
+template<typename Serializer, typename Input, typename... T>
+struct unmarshal_one<Serializer, Input, sink<T...>> {
+    static sink<T...> doit(Serializer& serializer, stream_connection* con, Input& in) {
+        throw std::logic_error("rpc sink cannot be received, expect a source instead");
+    }
+};
+
 template <typename Serializer, typename Input, typename T0, typename... Trest>
-inline std::tuple<T0, Trest...> do_unmarshall(Serializer& serializer, Input& in) {
+inline std::tuple<T0, Trest...> do_unmarshall(Serializer& serializer, stream_connection* con, Input& in) {
     // FIXME: something less recursive
-    auto first = std::make_tuple(unmarshal_one<Serializer, Input, T0>::doit(serializer, in));
-    auto rest = do_unmarshall<Serializer, Input, Trest...>(serializer, in);
+    auto first = std::make_tuple(unmarshal_one<Serializer, Input, T0>::doit(serializer, con, in));
+    auto rest = do_unmarshall<Serializer, Input, Trest...>(serializer, con, in);
     return std::tuple_cat(std::move(first), std::move(rest));
 }
 
 template <typename Serializer, typename... T>
-inline std::tuple<T...> unmarshall(Serializer& serializer, rcv_buf input) {
+inline std::tuple<T...> unmarshall(Serializer& serializer, rcv_buf input, stream_connection* con = nullptr) {
     auto in = make_deserializer_stream(input);
-    return do_unmarshall<Serializer, decltype(in), T...>(serializer, in);
+    return do_unmarshall<Serializer, decltype(in), T...>(serializer, con, in);
 }
 
 static std::exception_ptr unmarshal_exception(rcv_buf& d) {
@@ -284,6 +348,9 @@ static std::exception_ptr unmarshal_exception(rcv_buf& d) {
         ex = std::make_exception_ptr(unknown_verb_error(le_to_cpu(v64)));
         break;
     }
+    case exception_type::OVERLOADED:
+        ex = std::make_exception_ptr(overloaded_error());
+        break;
     default:
         ex = std::make_exception_ptr(unknown_exception_error());
         break;
@@ -310,14 +377,14 @@ struct rcv_reply_base  {
 template<typename Serializer, typename MsgType, typename T>
 struct rcv_reply : rcv_reply_base<T, T> {
     inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, rcv_buf input) {
-        this->set_value(unmarshall<Serializer, T>(dst.serializer(), std::move(input)));
+        this->set_value(unmarshall<Serializer, T>(dst.serializer(), std::move(input), &dst));
     }
 };
 
 template<typename Serializer, typename MsgType, typename... T>
 struct rcv_reply<Serializer, MsgType, future<T...>> : rcv_reply_base<std::tuple<T...>, T...> {
     inline void get_reply(typename protocol<Serializer, MsgType>::client& dst, rcv_buf input) {
-        this->set_value(unmarshall<Serializer, T...>(dst.serializer(), std::move(input)));
+        this->set_value(unmarshall<Serializer, T...>(dst.serializer(), std::move(input), &dst));
     }
 };
 
@@ -381,16 +448,31 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
 
             // send message
             auto msg_id = dst.next_message_id();
-            snd_buf data = marshall(dst.serializer(), 28, args...);
-            static_assert(snd_buf::chunk_size >= 28, "send buffer chunk size is too small");
+            auto trace_id = dst.next_trace_id();
+            auto tracked = trace_id || dst.get_protocol().tracks_latency();
+            auto start = tracked ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+            // a traced request carries its trace id in front of the data
+            size_t trace_space = trace_id ? 8 : 0;
+            snd_buf data = marshall(dst.serializer(), 28 + trace_space, args...);
+            static_assert(snd_buf::chunk_size >= 36, "send buffer chunk size is too small");
             auto p = data.front().get_write() + 8; // 8 extra bytes for expiration timer
-            write_le<uint64_t>(p, uint64_t(t));
+            write_le<uint64_t>(p, uint64_t(t) | (trace_id ? traced_verb_bit : 0));
             write_le<int64_t>(p + 8, msg_id);
             write_le<uint32_t>(p + 16, data.size - 28);
+            if (trace_id) {
+                write_le<uint64_t>(p + 20, trace_id);
+            }
 
             // prepare reply handler, if return type is now_wait_type this does nothing, since no reply will be sent
             using wait = wait_signature_t<Ret>;
-            return when_all(dst.send(std::move(data), timeout, cancel), wait_for_reply<Serializer, MsgType>(wait(), timeout, cancel, dst, msg_id, sig)).then([] (auto r) {
+            auto reply = wait_for_reply<Serializer, MsgType>(wait(), timeout, cancel, dst, msg_id, sig);
+            auto sent = dst.send(std::move(data), timeout, cancel, uint64_t(t));
+            if (tracked && dst.track_latency(msg_id, uint64_t(t), trace_id, start)) {
+                sent = sent.then([&dst, msg_id] {
+                    dst.request_written(msg_id);
+                });
+            }
+            return when_all(std::move(sent), std::move(reply)).then([] (auto r) {
                     return std::move(std::get<1>(r)); // return future of wait_for_reply
             });
         }
@@ -414,36 +496,53 @@ auto send_helper(MsgType xt, signature<Ret (InArgs...)> xsig) {
 template <typename Serializer, typename MsgType>
 inline
 future<>
-protocol<Serializer, MsgType>::server::connection::respond(int64_t msg_id, snd_buf&& data, std::experimental::optional<rpc_clock_type::time_point> timeout) {
-    static_assert(snd_buf::chunk_size >= 12, "send buffer chunk size is too small");
+protocol<Serializer, MsgType>::server::connection::respond(int64_t msg_id, snd_buf&& data, std::experimental::optional<rpc_clock_type::time_point> timeout, uint64_t verb,
+        std::chrono::nanoseconds handler_time) {
+    static_assert(snd_buf::chunk_size >= 20, "send buffer chunk size is too small");
     auto p = data.front().get_write();
+    uint32_t header_size = 12;
+    if (this->_tracing_negotiated) {
+        write_le<uint64_t>(p, handler_time.count());
+        p += 8;
+        header_size += 8;
+    } else {
+        data.front().trim_front(8);
+        data.size -= 8;
+        p = data.front().get_write();
+    }
     write_le<int64_t>(p, msg_id);
-    write_le<uint32_t>(p + 8, data.size - 12);
-    return this->send(std::move(data), timeout);
+    write_le<uint32_t>(p + 8, data.size - header_size);
+    return this->send(std::move(data), timeout, nullptr, verb);
+}
+
+// Serializes a handler's result, leaving room for the response header; if the
+// handler failed serializes the exception instead and negates msg_id.
+template<typename Serializer, typename... RetTypes>
+inline snd_buf marshall_reply(Serializer& serializer, future<RetTypes...>&& ret, int64_t& msg_id) {
+    try {
+        return ::apply(marshall<Serializer, const RetTypes&...>,
+                std::tuple_cat(std::make_tuple(std::ref(serializer), 20), std::move(ret.get())));
+    } catch (std::exception& ex) {
+        uint32_t len = std::strlen(ex.what());
+        snd_buf data(28 + len);
+        auto os = make_serializer_stream(data);
+        os.skip(20);
+        uint32_t v32 = cpu_to_le(uint32_t(exception_type::USER));
+        os.write(reinterpret_cast<char*>(&v32), sizeof(v32));
+        v32 = cpu_to_le(len);
+        os.write(reinterpret_cast<char*>(&v32), sizeof(v32));
+        os.write(ex.what(), len);
+        msg_id = -msg_id;
+        return data;
+    }
 }
 
 template<typename Serializer, typename MsgType, typename... RetTypes>
 inline future<> reply(wait_type, future<RetTypes...>&& ret, int64_t msg_id, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
-        std::experimental::optional<rpc_clock_type::time_point> timeout) {
+        std::experimental::optional<rpc_clock_type::time_point> timeout, uint64_t verb, std::chrono::nanoseconds handler_time) {
     if (!client->error()) {
-        snd_buf data;
-        try {
-            data = ::apply(marshall<Serializer, const RetTypes&...>,
-                    std::tuple_cat(std::make_tuple(std::ref(client->serializer()), 12), std::move(ret.get())));
-        } catch (std::exception& ex) {
-            uint32_t len = std::strlen(ex.what());
-            data = snd_buf(20 + len);
-            auto os = make_serializer_stream(data);
-            os.skip(12);
-            uint32_t v32 = cpu_to_le(uint32_t(exception_type::USER));
-            os.write(reinterpret_cast<char*>(&v32), sizeof(v32));
-            v32 = cpu_to_le(len);
-            os.write(reinterpret_cast<char*>(&v32), sizeof(v32));
-            os.write(ex.what(), len);
-            msg_id = -msg_id;
-        }
-
-        return client->respond(msg_id, std::move(data), timeout);
+        auto data = marshall_reply(client->serializer(), std::move(ret), msg_id);
+        return client->respond(msg_id, std::move(data), timeout, verb, handler_time);
     } else {
         ret.ignore_ready_future();
         return make_ready_future<>();
@@ -452,7 +551,8 @@ inline future<> reply(wait_type, future<RetTypes...>&& ret, int64_t msg_id, lw_s
 
 // specialization for no_wait_type which does not send a reply
 template<typename Serializer, typename MsgType>
-inline future<> reply(no_wait_type, future<no_wait_type>&& r, int64_t msgid, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client, std::experimental::optional<rpc_clock_type::time_point> timeout) {
+inline future<> reply(no_wait_type, future<no_wait_type>&& r, int64_t msgid, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client, std::experimental::optional<rpc_clock_type::time_point> timeout, uint64_t verb,
+        std::chrono::nanoseconds handler_time) {
     try {
         r.get();
     } catch (std::exception& ex) {
@@ -482,28 +582,194 @@ auto lref_to_cref(T& x) {
     return std::ref(x);
 }
 
+// Runs func, in a thread of the scheduling group if there is one.
+template <typename Ret, typename Func>
+futurize_t<Ret> run_in_scheduling_group(seastar::thread_scheduling_group* sg, Func&& func) {
+    if (!sg) {
+        return func();
+    }
+    seastar::thread_attributes attr;
+    attr.scheduling_group = sg;
+    return seastar::async(std::move(attr), [func = std::forward<Func>(func)] () mutable {
+        return func().get();
+    }).then([] (auto&& result) {
+        typename futurize<Ret>::promise_type pr;
+        auto f = pr.get_future();
+        pr.set_value(std::move(result));
+        return f;
+    });
+}
+
+// Handlers registered without a sharder run on the shard of their connection.
+struct local_shard {};
+
+// What a handler run on another shard sends back to the connection's shard.
+struct forwarded_reply {
+    // the serialized reply, null for a no_wait verb
+    foreign_ptr<std::unique_ptr<snd_buf>> data;
+    int64_t msg_id;
+    std::chrono::nanoseconds handler_time{0};
+};
+
+template<typename Serializer, typename... RetTypes>
+inline foreign_ptr<std::unique_ptr<snd_buf>> marshall_forwarded_reply(wait_type, Serializer& serializer, future<RetTypes...>&& ret, int64_t& msg_id) {
+    return make_foreign(std::make_unique<snd_buf>(marshall_reply(serializer, std::move(ret), msg_id)));
+}
+
+// a no_wait handler's exception is passed back to be logged on the connection's shard
+template<typename Serializer>
+inline foreign_ptr<std::unique_ptr<snd_buf>> marshall_forwarded_reply(no_wait_type, Serializer& serializer, future<no_wait_type>&& ret, int64_t& msg_id) {
+    ret.get();
+    return {};
+}
+
+template<typename Serializer, typename MsgType>
+inline future<> reply_forwarded(wait_type, future<forwarded_reply> f, int64_t msg_id, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
+        std::experimental::optional<rpc_clock_type::time_point> timeout, uint64_t verb) {
+    auto r = f.get0();
+    if (client->error()) {
+        return make_ready_future<>();
+    }
+    return client->respond(r.msg_id, make_shard_local(std::move(r.data)), timeout, verb, r.handler_time);
+}
+
+template<typename Serializer, typename MsgType>
+inline future<> reply_forwarded(no_wait_type, future<forwarded_reply> f, int64_t msg_id, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
+        std::experimental::optional<rpc_clock_type::time_point> timeout, uint64_t verb) {
+    auto r = f.failed() ? make_exception_future<no_wait_type>(f.get_exception()) : make_ready_future<no_wait_type>(no_wait);
+    return reply<Serializer, MsgType>(no_wait_type(), std::move(r), msg_id, client, timeout, verb, {});
+}
+
+template <typename Serializer, typename MsgType, typename Ret, typename... InArgs, typename WantTimePoint, typename Func>
+inline std::experimental::optional<future<>>
+maybe_forward(local_shard&, Func& func, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection>& client,
+        std::experimental::optional<rpc_clock_type::time_point> timeout, int64_t msg_id, uint64_t trace_id, uint64_t verb, rcv_buf& data, WantTimePoint) {
+    return {};
+}
+
+// Hands the request to the shard the sharder picks for its first argument,
+// unless that is this shard, and returns the future of sending its reply.
+// The request is deserialized and the reply serialized on that shard, the
+// buffers of both cross shards without being copied.
+template <typename Serializer, typename MsgType, typename Ret, typename First, typename... InArgs, typename WantTimePoint, typename Func, typename Sharder>
+inline std::enable_if_t<!std::is_same<Sharder, local_shard>::value, std::experimental::optional<future<>>>
+maybe_forward(Sharder& sharder, Func& func, lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection>& client,
+        std::experimental::optional<rpc_clock_type::time_point> timeout, int64_t msg_id, uint64_t trace_id, uint64_t verb, rcv_buf& data, WantTimePoint) {
+    using wait_style = wait_signature_t<Ret>;
+    using signature = rpc::signature<Ret (First, InArgs...)>;
+    auto& serializer = client->serializer();
+    unsigned shard;
+    {
+        auto in = make_deserializer_stream(data);
+        shard = sharder(unmarshal_one<Serializer, decltype(in), First>::doit(serializer, nullptr, in)) % smp::count;
+    }
+    if (shard == engine().cpu_id()) {
+        return {};
+    }
+    auto timed = trace_id || client->tracing_negotiated();
+    auto request = make_foreign(std::make_unique<rcv_buf>(std::move(data)));
+    auto f = smp::submit_to(shard, [&serializer, &func, timeout, msg_id, trace_id, timed, request = std::move(request)] () mutable {
+        auto args = unmarshall<Serializer, First, InArgs...>(serializer, make_shard_local(std::move(request)));
+        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+        futurize_t<Ret> ret = [&] {
+            trace_id_scope scope(trace_id);
+            client_info unused;
+            return apply(func, unused, timeout, dont_want_client_info(), WantTimePoint(), signature(), std::move(args));
+        }();
+        return ret.then_wrapped([&serializer, msg_id, timed, start] (futurize_t<Ret> ret) mutable {
+            forwarded_reply r;
+            r.msg_id = msg_id;
+            r.data = marshall_forwarded_reply(wait_style(), serializer, std::move(ret), r.msg_id);
+            if (timed) {
+                r.handler_time = std::chrono::steady_clock::now() - start;
+            }
+            return r;
+        });
+    }).then_wrapped([client, timeout, msg_id, trace_id, verb] (future<forwarded_reply> f) {
+        if (trace_id && !f.failed()) {
+            auto fr = f.get0();
+            trace_record r{trace_id, verb, true};
+            r.handler = fr.handler_time;
+            client->get_protocol().trace(r);
+            f = make_ready_future<forwarded_reply>(std::move(fr));
+        }
+        return reply_forwarded<Serializer, MsgType>(wait_style(), std::move(f), msg_id, client, timeout, verb);
+    });
+    return std::experimental::optional<future<>>(std::move(f));
+}
+
 // Creates lambda to handle RPC message on a server.
 // The lambda unmarshalls all parameters, calls a handler, marshall return values and sends them back to a client
-template <typename Serializer, typename MsgType, typename Func, typename Ret, typename... InArgs, typename WantClientInfo, typename WantTimePoint>
-auto recv_helper(signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci, WantTimePoint wtp) {
+template <typename Serializer, typename MsgType, typename Func, typename Ret, typename... InArgs, typename WantClientInfo, typename WantTimePoint, typename Sharder>
+auto recv_helper(uint64_t verb, signature<Ret (InArgs...)> sig, Func&& func, WantClientInfo wci, WantTimePoint wtp, Sharder sharder) {
     using signature = decltype(sig);
     using wait_style = wait_signature_t<Ret>;
-    return [func = lref_to_cref(std::forward<Func>(func))](lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
+    return [verb, sharder = std::move(sharder), func = lref_to_cref(std::forward<Func>(func))](lw_shared_ptr<typename protocol<Serializer, MsgType>::server::connection> client,
                                                            std::experimental::optional<rpc_clock_type::time_point> timeout,
                                                            int64_t msg_id,
+                                                           uint64_t trace_id,
                                                            rcv_buf data) mutable {
         auto memory_consumed = client->estimate_request_size(data.size);
-        // note: apply is executed asynchronously with regards to networking so we cannot chain futures here by doing "return apply()"
-        auto f = client->wait_for_resources(memory_consumed, timeout).then([client, timeout, msg_id, data = std::move(data), &func] (auto permit) mutable {
+        // Runs the request once its verb group admitted it.  Waiting for the
+        // server wide resources holds up reading further requests.
+        auto serve = [client, timeout, msg_id, trace_id, verb, memory_consumed, &func, &sharder] (rcv_buf data, auto group_permit) mutable {
+            // note: apply is executed asynchronously with regards to networking so we cannot chain futures here by doing "return apply()"
+            return client->wait_for_resources(memory_consumed, timeout).then([client, timeout, msg_id, trace_id, verb, data = std::move(data), group_permit = std::move(group_permit), &func, &sharder] (auto permit) mutable {
+                try {
+                    seastar::with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, trace_id, verb, data = std::move(data), permit = std::move(permit), group_permit = std::move(group_permit), &func, &sharder] () mutable {
+                        auto forwarded = maybe_forward<Serializer, MsgType, Ret, InArgs...>(sharder, func, client, timeout, msg_id, trace_id, verb, data, WantTimePoint());
+                        if (forwarded) {
+                            return forwarded->finally([permit = std::move(permit), group_permit = std::move(group_permit)] {});
+                        }
+                        auto args = unmarshall<Serializer, InArgs...>(client->serializer(), std::move(data), client.get());
+                        // the handler's time is reported back if the client can take it
+                        auto timed = trace_id || client->tracing_negotiated();
+                        auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                        return run_in_scheduling_group<Ret>(group_permit.scheduling_group, [client, timeout, trace_id, args = std::move(args), &func] () mutable {
+                            trace_id_scope scope(trace_id);
+                            return apply(func, client->info(), timeout, WantClientInfo(), WantTimePoint(), signature(), std::move(args));
+                        }).then_wrapped([client, timeout, msg_id, trace_id, verb, timed, start, permit = std::move(permit), group_permit = std::move(group_permit)] (futurize_t<Ret> ret) mutable {
+                            std::chrono::nanoseconds handler_time{0};
+                            if (timed) {
+                                handler_time = std::chrono::steady_clock::now() - start;
+                            }
+                            if (trace_id) {
+                                trace_record r{trace_id, verb, true};
+                                r.handler = handler_time;
+                                client->get_protocol().trace(r);
+                            }
+                            return reply<Serializer, MsgType>(wait_style(), std::move(ret), msg_id, client, timeout, verb, handler_time).then([permit = std::move(permit), group_permit = std::move(group_permit)] {});
+                        });
+                    });
+                } catch (seastar::gate_closed_exception&) {/* ignore */ }
+            });
+        };
+        auto admitted = client->admit(verb, memory_consumed, timeout);
+        auto f = make_ready_future<>();
+        if (admitted.available() && !admitted.failed()) {
+            f = serve(std::move(data), admitted.get0());
+        } else {
+            // Queued behind the group's own requests, or shed.  Wait without
+            // holding up other requests or the server wide resources they
+            // need; the group's max_queue_length bounds how many wait here.
             try {
-                seastar::with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, data = std::move(data), permit = std::move(permit), &func] () mutable {
-                    auto args = unmarshall<Serializer, InArgs...>(client->serializer(), std::move(data));
-                    return apply(func, client->info(), timeout, WantClientInfo(), WantTimePoint(), signature(), std::move(args)).then_wrapped([client, timeout, msg_id, permit = std::move(permit)] (futurize_t<Ret> ret) mutable {
-                        return reply<Serializer, MsgType>(wait_style(), std::move(ret), msg_id, client, timeout).then([permit = std::move(permit)] {});
+                seastar::with_gate(client->get_server().reply_gate(), [client, timeout, msg_id, admitted = std::move(admitted), serve = std::move(serve), data = std::move(data)] () mutable {
+                    return admitted.then([serve = std::move(serve), data = std::move(data)] (auto group_permit) mutable {
+                        return serve(std::move(data), std::move(group_permit));
+                    }).handle_exception([client, msg_id, timeout] (std::exception_ptr ep) {
+                        try {
+                            std::rethrow_exception(ep);
+                        } catch (overloaded_error&) {
+                            if (!std::is_same<wait_style, no_wait_type>::value) {
+                                client->reply_overloaded(msg_id, timeout);
+                            }
+                        } catch (...) {
+                            // timed out or the server is stopping
+                        }
                     });
                 });
             } catch (seastar::gate_closed_exception&) {/* ignore */ }
-        });
+        }
 
         if (timeout) {
             f = f.handle_exception_type([] (semaphore_timed_out&) { /* ignore */ });
@@ -573,8 +839,23 @@ auto protocol<Serializer, MsgType>::register_handler(MsgType t, Func&& func) {
     using clean_sig_type = typename sig_type::clean;
     using want_client_info = typename sig_type::want_client_info;
     using want_time_point = typename sig_type::want_time_point;
-    auto recv = recv_helper<Serializer, MsgType>(clean_sig_type(), std::forward<Func>(func),
-            want_client_info(), want_time_point());
+    auto recv = recv_helper<Serializer, MsgType>(uint64_t(t), clean_sig_type(), std::forward<Func>(func),
+            want_client_info(), want_time_point(), local_shard());
+    register_receiver(t, make_copyable_function(std::move(recv)));
+    return make_client(clean_sig_type(), t);
+}
+
+template<typename Serializer, typename MsgType>
+template<typename Sharder, typename Func>
+auto protocol<Serializer, MsgType>::register_handler(MsgType t, Sharder&& sharder, Func&& func) {
+    using sig_type = signature<typename function_traits<Func>::signature>;
+    using clean_sig_type = typename sig_type::clean;
+    using want_client_info = typename sig_type::want_client_info;
+    using want_time_point = typename sig_type::want_time_point;
+    static_assert(std::is_same<want_client_info, dont_want_client_info>::value, "client_info is not available on another shard");
+    static_assert(std::tuple_size<typename clean_sig_type::arg_types>::value > 0, "the sharder needs an argument to pick a shard");
+    auto recv = recv_helper<Serializer, MsgType>(uint64_t(t), clean_sig_type(), std::forward<Func>(func),
+            want_client_info(), want_time_point(), std::forward<Sharder>(sharder));
     register_receiver(t, make_copyable_function(std::move(recv)));
     return make_client(clean_sig_type(), t);
 }
@@ -593,9 +874,53 @@ template<typename Serializer, typename MsgType>
 protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, server_socket ss, resource_limits limits, server_options opts)
         : _proto(proto), _ss(std::move(ss)), _limits(limits), _resources_available(limits.max_memory), _options(opts)
 {
+    for (auto&& l : _options.verb_groups) {
+        _verb_groups.push_back(std::make_unique<verb_group>(l));
+    }
     accept();
 }
 
+template<typename Serializer, typename MsgType>
+future<typename protocol<Serializer, MsgType>::server::request_permit>
+protocol<Serializer, MsgType>::server::connection::admit(uint64_t verb, size_t memory_consumed, std::experimental::optional<rpc_clock_type::time_point> timeout) {
+    auto& groups = _server._verb_groups;
+    auto it = _server._options.verb_group_of.find(verb);
+    if (it == _server._options.verb_group_of.end() || it->second >= groups.size()) {
+        return make_ready_future<request_permit>();
+    }
+    auto& g = *groups[it->second];
+    if (g.queued >= g.limits.max_queue_length) {
+        g.rejected++;
+        return make_exception_future<request_permit>(overloaded_error());
+    }
+    g.queued++;
+    auto units = [timeout] (rpc_semaphore& sem, size_t n) {
+        return timeout ? get_units(sem, n, *timeout) : get_units(sem, n);
+    };
+    return units(g.concurrency, 1).then([&g, memory_consumed, units] (resource_permit concurrency) mutable {
+        // a request larger than the group's memory must still get in eventually
+        return units(g.memory, std::min(memory_consumed, g.limits.max_memory)).then([&g, concurrency = std::move(concurrency)] (resource_permit memory) mutable {
+            return request_permit{std::move(memory), std::move(concurrency), g.limits.scheduling_group};
+        });
+    }).finally([&g] {
+        g.queued--;
+    });
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::server::connection::reply_overloaded(int64_t msg_id, std::experimental::optional<rpc_clock_type::time_point> timeout) {
+    snd_buf data(28);
+    static_assert(snd_buf::chunk_size >= 28, "send buffer chunk size is too small");
+    auto p = data.front().get_write() + 20;
+    write_le<uint32_t>(p, uint32_t(exception_type::OVERLOADED));
+    write_le<uint32_t>(p + 4, uint32_t(0));
+    try {
+        seastar::with_gate(_server._reply_gate, [this, msg_id, timeout, data = std::move(data)] () mutable {
+            return this->respond(-msg_id, std::move(data), timeout).then([c = this->shared_from_this()] {});
+        });
+    } catch (seastar::gate_closed_exception&) {/* ignore */}
+}
+
 template<typename Serializer, typename MsgType>
 protocol<Serializer, MsgType>::server::server(protocol<Serializer, MsgType>& proto, server_options opts, server_socket ss, resource_limits limits)
         : server(proto, std::move(ss), limits, opts)
@@ -796,19 +1121,25 @@ protocol<Serializer, MsgType>::read_frame_compressed(const Info& info, std::uniq
             }
             auto ptr = compress_header.get();
             auto size = read_le<uint32_t>(ptr);
-            return read_rcv_buf(in, size).then([this, size, &compressor, &info] (rcv_buf compressed_data) {
+            // only sent if COMPRESSION_BYPASS was negotiated
+            bool uncompressed = size & uncompressed_frame_bit;
+            size &= ~uncompressed_frame_bit;
+            return read_rcv_buf(in, size).then([this, size, uncompressed, &compressor, &info] (rcv_buf compressed_data) {
                 if (compressed_data.size != size) {
                     log(info, sprint("unexpected eof on a %s while reading compressed data: expected %d got %d", FrameType::role(), size, compressed_data.size));
                     return FrameType::empty_value();
                 }
-                auto eb = compressor->decompress(std::move(compressed_data));
+                auto eb = uncompressed ? std::move(compressed_data) : compressor->decompress(std::move(compressed_data));
                 net::packet p;
                 auto* one = boost::get<temporary_buffer<char>>(&eb.bufs);
                 if (one) {
                     p = net::packet(std::move(p), std::move(*one));
                 } else {
                     for (auto&& b : boost::get<std::vector<temporary_buffer<char>>>(eb.bufs)) {
-                        p = net::packet(std::move(p), std::move(b));
+                        // fragments of a frame read uncompressed may share a deleter, which a packet cannot hold twice
+                        auto data = b.get_write();
+                        auto size = b.size();
+                        p = net::packet(std::move(p), temporary_buffer<char>(data, size, make_object_deleter(std::move(b))));
                     }
                 }
                 return do_with(as_input_stream(std::move(p)), [this, &info] (input_stream<char>& in) {
@@ -840,6 +1171,22 @@ protocol<Serializer, MsgType>::server::connection::negotiate(feature_map request
             this->_timeout_negotiated = true;
             ret[protocol_features::TIMEOUT] = "";
             break;
+        case protocol_features::STREAM:
+            this->_stream_negotiated = true;
+            this->_unclaimed_stream_timeout = _server._options.unclaimed_stream_timeout;
+            ret[protocol_features::STREAM] = "";
+            break;
+        case protocol_features::COMPRESSION_BYPASS:
+            if (_server._options.compressor_factory) {
+                this->_compression_bypass_negotiated = true;
+                this->_compression = compression_policy(_server._options.compression);
+                ret[protocol_features::COMPRESSION_BYPASS] = "";
+            }
+            break;
+        case protocol_features::TRACING:
+            this->_tracing_negotiated = true;
+            ret[protocol_features::TRACING] = "";
+            break;
         default:
             // nothing to do
             ;
@@ -857,11 +1204,12 @@ protocol<Serializer, MsgType>::server::connection::negotiate_protocol(input_stre
     });
 }
 
+// The verb is returned as sent, so that traced_verb_bit survives a narrower MsgType.
 template<typename MsgType>
 struct request_frame {
     using opt_buf_type = std::experimental::optional<rcv_buf>;
-    using return_type = future<std::experimental::optional<uint64_t>, MsgType, int64_t, opt_buf_type>;
-    using header_type = std::tuple<std::experimental::optional<uint64_t>, MsgType, int64_t, uint32_t>;
+    using return_type = future<std::experimental::optional<uint64_t>, uint64_t, int64_t, opt_buf_type>;
+    using header_type = std::tuple<std::experimental::optional<uint64_t>, uint64_t, int64_t, uint32_t>;
     static size_t header_size() {
         return 20;
     }
@@ -869,10 +1217,10 @@ struct request_frame {
         return "server";
     }
     static auto empty_value() {
-        return make_ready_future<std::experimental::optional<uint64_t>, MsgType, int64_t, opt_buf_type>(std::experimental::nullopt, MsgType(0), 0, std::experimental::nullopt);
+        return make_ready_future<std::experimental::optional<uint64_t>, uint64_t, int64_t, opt_buf_type>(std::experimental::nullopt, 0, 0, std::experimental::nullopt);
     }
     static header_type decode_header(const char* ptr) {
-        auto type = MsgType(read_le<uint64_t>(ptr));
+        auto type = read_le<uint64_t>(ptr);
         auto msgid = read_le<int64_t>(ptr + 8);
         auto size = read_le<uint32_t>(ptr + 16);
         return std::make_tuple(std::experimental::nullopt, type, msgid, size);
@@ -881,7 +1229,7 @@ struct request_frame {
         return std::get<3>(t);
     }
     static auto make_value(const header_type& t, rcv_buf data) {
-        return make_ready_future<std::experimental::optional<uint64_t>, MsgType, int64_t, opt_buf_type>(std::get<0>(t), std::get<1>(t), std::get<2>(t), std::move(data));
+        return make_ready_future<std::experimental::optional<uint64_t>, uint64_t, int64_t, opt_buf_type>(std::get<0>(t), std::get<1>(t), std::get<2>(t), std::move(data));
     }
 };
 
@@ -899,7 +1247,7 @@ struct request_frame_with_timeout : request_frame<MsgType> {
 };
 
 template <typename Serializer, typename MsgType>
-future<std::experimental::optional<uint64_t>, MsgType, int64_t, std::experimental::optional<rcv_buf>>
+future<std::experimental::optional<uint64_t>, uint64_t, int64_t, std::experimental::optional<rcv_buf>>
 protocol<Serializer, MsgType>::server::connection::read_request_frame(input_stream<char>& in) {
     if (this->_timeout_negotiated) {
         return this->_server._proto.template read_frame<request_frame_with_timeout<MsgType>>(_info, in);
@@ -909,7 +1257,7 @@ protocol<Serializer, MsgType>::server::connection::read_request_frame(input_stre
 }
 
 template <typename Serializer, typename MsgType>
-future<std::experimental::optional<uint64_t>, MsgType, int64_t, std::experimental::optional<rcv_buf>>
+future<std::experimental::optional<uint64_t>, uint64_t, int64_t, std::experimental::optional<rcv_buf>>
 protocol<Serializer, MsgType>::server::connection::read_request_frame_compressed(input_stream<char>& in) {
     if (this->_timeout_negotiated) {
         return this->_server._proto.template read_frame_compressed<request_frame_with_timeout<MsgType>>(_info, this->_compressor, in);
@@ -934,6 +1282,17 @@ protocol<Serializer, MsgType>::client::negotiate(feature_map provided) {
         case protocol_features::TIMEOUT:
             this->_timeout_negotiated = true;
             break;
+        case protocol_features::STREAM:
+            this->_stream_negotiated = true;
+            this->_unclaimed_stream_timeout = _options.unclaimed_stream_timeout;
+            break;
+        case protocol_features::COMPRESSION_BYPASS:
+            this->_compression_bypass_negotiated = true;
+            this->_compression = compression_policy(_options.compression);
+            break;
+        case protocol_features::TRACING:
+            this->_tracing_negotiated = true;
+            break;
         default:
             // nothing to do
             ;
@@ -946,24 +1305,33 @@ future<> protocol<Serializer, MsgType>::server::connection::process() {
     send_loop();
     return this->negotiate_protocol(this->_read_buf).then([this] () mutable {
         return do_until([this] { return this->_read_buf.eof() || this->_error; }, [this] () mutable {
-            return this->read_request_frame_compressed(this->_read_buf).then([this] (std::experimental::optional<uint64_t> expire, MsgType type, int64_t msg_id, std::experimental::optional<rcv_buf> data) {
+            return this->read_request_frame_compressed(this->_read_buf).then([this] (std::experimental::optional<uint64_t> expire, uint64_t verb, int64_t msg_id, std::experimental::optional<rcv_buf> data) {
                 if (!data) {
                     this->_error = true;
                     return make_ready_future<>();
+                } else if (msg_id > 0 && (msg_id & stream_id_bit) && this->_stream_negotiated) {
+                    this->handle_stream_frame(msg_id & ~stream_id_bit, std::move(data.value()));
+                    return make_ready_future<>();
                 } else {
                     std::experimental::optional<rpc_clock_type::time_point> timeout;
                     if (expire && *expire) {
                         timeout = rpc_clock_type::now() + std::chrono::milliseconds(*expire);
                     }
-                    auto it = _server._proto._handlers.find(type);
-                    if (it != _server._proto._handlers.end()) {
-                        return it->second(this->shared_from_this(), timeout, msg_id, std::move(data.value()));
+                    uint64_t trace_id = 0;
+                    if ((verb & traced_verb_bit) && this->_tracing_negotiated) {
+                        verb &= ~traced_verb_bit;
+                        trace_id = take_trace_id(data.value());
+                    }
+                    auto type = MsgType(verb);
+                    auto handler = _server._proto._handlers.find(type);
+                    if (handler) {
+                        return (*handler)(this->shared_from_this(), timeout, msg_id, trace_id, std::move(data.value()));
                     } else {
                         return this->wait_for_resources(28, timeout).then([this, timeout, msg_id, type] (auto permit) {
                             // send unknown_verb exception back
-                            snd_buf data(28);
-                            static_assert(snd_buf::chunk_size >= 28, "send buffer chunk size is too small");
-                            auto p = data.front().get_write() + 12;
+                            snd_buf data(36);
+                            static_assert(snd_buf::chunk_size >= 36, "send buffer chunk size is too small");
+                            auto p = data.front().get_write() + 20;
                             write_le<uint32_t>(p, uint32_t(exception_type::UNKNOWN_VERB));
                             write_le<uint32_t>(p + 4, uint32_t(8));
                             write_le<uint64_t>(p + 8, uint64_t(type));
@@ -982,6 +1350,7 @@ future<> protocol<Serializer, MsgType>::server::connection::process() {
             log_exception(*this, "server connection dropped", f.get_exception());
         }
         this->_error = true;
+        this->abort_streams();
         return this->stop_send_loop().then_wrapped([this] (future<> f) {
             f.ignore_ready_future();
             this->_server._conns.erase(this->shared_from_this());
@@ -1000,10 +1369,11 @@ protocol<Serializer, MsgType>::client::negotiate_protocol(input_stream<char>& in
     });
 }
 
+// Returns the message id, the handler time in nanoseconds and the data.
 struct response_frame {
     using opt_buf_type = std::experimental::optional<rcv_buf>;
-    using return_type = future<int64_t, opt_buf_type>;
-    using header_type = std::tuple<int64_t, uint32_t>;
+    using return_type = future<int64_t, uint64_t, opt_buf_type>;
+    using header_type = std::tuple<int64_t, uint64_t, uint32_t>;
     static size_t header_size() {
         return 12;
     }
@@ -1011,34 +1381,76 @@ struct response_frame {
         return "client";
     }
     static auto empty_value() {
-        return make_ready_future<int64_t, opt_buf_type>(0, std::experimental::nullopt);
+        return make_ready_future<int64_t, uint64_t, opt_buf_type>(0, 0, std::experimental::nullopt);
     }
     static header_type decode_header(const char* ptr) {
         auto msgid = read_le<int64_t>(ptr);
         auto size = read_le<uint32_t>(ptr + 8);
-        return std::make_tuple(msgid, size);
+        return std::make_tuple(msgid, uint64_t(0), size);
     }
     static uint32_t get_size(const header_type& t) {
-        return std::get<1>(t);
+        return std::get<2>(t);
     }
     static auto make_value(const header_type& t, rcv_buf data) {
-        return make_ready_future<int64_t, opt_buf_type>(std::get<0>(t), std::move(data));
+        return make_ready_future<int64_t, uint64_t, opt_buf_type>(std::get<0>(t), std::get<1>(t), std::move(data));
+    }
+};
+
+struct response_frame_with_handler_time : response_frame {
+    static size_t header_size() {
+        return 20;
+    }
+    static header_type decode_header(const char* ptr) {
+        auto h = response_frame::decode_header(ptr + 8);
+        std::get<1>(h) = read_le<uint64_t>(ptr);
+        return h;
     }
 };
 
 // FIXME: take out-of-line?
 template<typename Serializer, typename MsgType>
 inline
-future<int64_t, std::experimental::optional<rcv_buf>>
+future<int64_t, uint64_t, std::experimental::optional<rcv_buf>>
 protocol<Serializer, MsgType>::client::read_response_frame(input_stream<char>& in) {
-    return this->_proto.template read_frame<response_frame>(this->_server_addr, in);
+    if (this->_tracing_negotiated) {
+        return this->_proto.template read_frame<response_frame_with_handler_time>(this->_server_addr, in);
+    } else {
+        return this->_proto.template read_frame<response_frame>(this->_server_addr, in);
+    }
 }
 
 template<typename Serializer, typename MsgType>
 inline
-future<int64_t, std::experimental::optional<rcv_buf>>
+future<int64_t, uint64_t, std::experimental::optional<rcv_buf>>
 protocol<Serializer, MsgType>::client::read_response_frame_compressed(input_stream<char>& in) {
-    return this->_proto.template read_frame_compressed<response_frame>(this->_server_addr, this->_compressor, in);
+    if (this->_tracing_negotiated) {
+        return this->_proto.template read_frame_compressed<response_frame_with_handler_time>(this->_server_addr, this->_compressor, in);
+    } else {
+        return this->_proto.template read_frame_compressed<response_frame>(this->_server_addr, this->_compressor, in);
+    }
+}
+
+template<typename Serializer, typename MsgType>
+void protocol<Serializer, MsgType>::client::record_latency(reply_handler_base& h, std::chrono::nanoseconds handler_time) {
+    auto now = std::chrono::steady_clock::now();
+    // the reply may be read before the send completion runs
+    auto written = h.written == std::chrono::steady_clock::time_point() ? h.start : h.written;
+    auto& proto = this->get_protocol();
+    if (proto.tracks_latency()) {
+        auto& l = proto.latency_for(h.verb);
+        l.queue.add(written - h.start);
+        l.round_trip.add(now - written);
+        if (this->_tracing_negotiated) {
+            l.handler.add(handler_time);
+        }
+    }
+    if (h.trace_id) {
+        trace_record r{h.trace_id, h.verb, false};
+        r.queue = written - h.start;
+        r.round_trip = now - written;
+        r.handler = handler_time;
+        proto.trace(r);
+    }
 }
 
 template<typename Serializer, typename MsgType>
@@ -1055,22 +1467,34 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, client_options op
         feature_map features;
         if (_options.compressor_factory) {
             features[protocol_features::COMPRESS] = _options.compressor_factory->supported();
+            features[protocol_features::COMPRESSION_BYPASS] = "";
         }
         if (_options.send_timeout_data) {
             features[protocol_features::TIMEOUT] = "";
         }
+        features[protocol_features::STREAM] = "";
+        // it costs the server a clock read around every handler and every
+        // response 8 bytes, so only ask for it when someone looks
+        if (_options.trace_sampling > 0 || this->_proto.tracks_latency() || this->_proto.has_trace_handler()) {
+            features[protocol_features::TRACING] = "";
+        }
         send_negotiation_frame(*this, std::move(features));
 
         return this->negotiate_protocol(this->_read_buf).then([this] () {
+            _negotiation_done = true;
+            _negotiated.set_value();
             send_loop();
             return do_until([this] { return this->_read_buf.eof() || this->_error; }, [this] () mutable {
-                return this->read_response_frame_compressed(this->_read_buf).then([this] (int64_t msg_id, std::experimental::optional<rcv_buf> data) {
-                    auto it = _outstanding.find(std::abs(msg_id));
+                return this->read_response_frame_compressed(this->_read_buf).then([this] (int64_t msg_id, uint64_t handler_ns, std::experimental::optional<rcv_buf> data) {
+                    std::unique_ptr<reply_handler_base> handler;
                     if (!data) {
                         this->_error = true;
-                    } else if (it != _outstanding.end()) {
-                        auto handler = std::move(it->second);
-                        _outstanding.erase(it);
+                    } else if (msg_id > 0 && (msg_id & stream_id_bit) && this->_stream_negotiated) {
+                        this->handle_stream_frame(msg_id & ~stream_id_bit, std::move(data.value()));
+                    } else if ((handler = _outstanding.remove(std::abs(msg_id)))) {
+                        if (handler->tracked) {
+                            record_latency(*handler, std::chrono::nanoseconds(handler_ns));
+                        }
                         (*handler)(*this, msg_id, std::move(data.value()));
                     } else if (msg_id < 0) {
                         try {
@@ -1096,6 +1520,11 @@ protocol<Serializer, MsgType>::client::client(protocol& proto, client_options op
             log_exception(*this, this->_connected ? "client connection dropped" : "fail to connect", f.get_exception());
         }
         this->_error = true;
+        if (!_negotiation_done) {
+            _negotiation_done = true;
+            _negotiated.set_exception(closed_error());
+        }
+        this->abort_streams();
         this->stop_send_loop().then_wrapped([this] (future<> f) {
             f.ignore_ready_future();
             this->_stopped.set_value();
@@ -1119,4 +1548,107 @@ protocol<Serializer, MsgType>::client::client(protocol<Serializer, MsgType>& pro
     : client(proto, client_options{}, std::move(socket), addr, local)
 {}
 
+template <typename Serializer, typename... Out>
+class sink_impl : public sink<Out...>::impl {
+    Serializer& _serializer;
+    lw_shared_ptr<stream_sink_state> _state;
+public:
+    sink_impl(Serializer& serializer, lw_shared_ptr<stream_sink_state> state)
+        : _serializer(serializer), _state(std::move(state)) {}
+    virtual future<> operator()(const Out&... args) override {
+        if (!_state->con || _state->closed) {
+            return make_exception_future<>(closed_error());
+        }
+        auto head_space = _state->con->stream_frame_head_space() + 4;
+        auto data = marshall(_serializer, head_space, args...);
+        // an element larger than the window still goes through, alone
+        auto cost = std::min(size_t(data.size - head_space), stream_window);
+        return _state->con->send_to_stream(_state, stream_frame_type::DATA, std::move(data), cost);
+    }
+    virtual future<> close() override {
+        if (!_state->con) {
+            return make_exception_future<>(closed_error());
+        }
+        return _state->con->close_sink(_state);
+    }
+    virtual int64_t id() const override {
+        return _state->id;
+    }
+};
+
+template <typename Serializer, typename... In>
+class source_impl : public source<In...>::impl {
+    using value_type = std::experimental::optional<std::tuple<In...>>;
+    Serializer& _serializer;
+    lw_shared_ptr<stream_source_state> _state;
+private:
+    static future<value_type> next(Serializer& serializer, lw_shared_ptr<stream_source_state> state) {
+        auto& s = *state;
+        if (!s.bufs.empty()) {
+            auto data = std::move(s.bufs.front());
+            s.bufs.pop_front();
+            if (s.con) {
+                s.con->consumed(s, std::min(size_t(data.size - 4), stream_window));
+            }
+            try {
+                auto in = make_deserializer_stream(data);
+                in.skip(4);
+                return make_ready_future<value_type>(do_unmarshall<Serializer, decltype(in), In...>(serializer, nullptr, in));
+            } catch (...) {
+                return make_exception_future<value_type>(std::current_exception());
+            }
+        }
+        if (s.ex) {
+            return make_exception_future<value_type>(s.ex);
+        }
+        if (s.eof) {
+            if (s.con) {
+                s.con->release_source(s);
+            }
+            return make_ready_future<value_type>(std::experimental::nullopt);
+        }
+        s.ready = promise<>();
+        return s.ready->get_future().then([&serializer, state = std::move(state)] () mutable {
+            return next(serializer, std::move(state));
+        });
+    }
+public:
+    source_impl(Serializer& serializer, lw_shared_ptr<stream_source_state> state)
+        : _serializer(serializer), _state(std::move(state)) {}
+    virtual ~source_impl() {
+        if (_state->con) {
+            _state->con->abandon_source(*_state);
+        }
+    }
+    virtual future<value_type> operator()() override {
+        return next(_serializer, _state);
+    }
+    virtual stream_connection* connection() const override {
+        return _state->con;
+    }
+};
+
+template <typename Serializer, typename... Out>
+sink<Out...> stream_connection::make_sink() {
+    auto id = _next_stream_id++;
+    auto state = make_lw_shared<stream_sink_state>(this, id);
+    _sinks.emplace(id, state);
+    return sink<Out...>(make_shared<sink_impl<Serializer, Out...>>(*static_cast<Serializer*>(_serializer), std::move(state)));
+}
+
+template <typename Serializer, typename... In>
+source<In...> stream_connection::make_source(int64_t id) {
+    return source<In...>(make_shared<source_impl<Serializer, In...>>(*static_cast<Serializer*>(_serializer), claim_source(id)));
+}
+
+template <typename... In>
+template <typename Serializer, typename... Out>
+sink<Out...> source<In...>::make_sink() {
+    auto con = _impl->connection();
+    if (!con) {
+        throw closed_error();
+    }
+    return con->template make_sink<Serializer, Out...>();
+}
+
 }
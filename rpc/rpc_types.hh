@@ -31,6 +31,7 @@
 #include "core/timer.hh"
 #include "core/simple-stream.hh"
 #include "core/lowres_clock.hh"
+#include "core/shared_ptr.hh"
 
 namespace rpc {
 
@@ -46,6 +47,11 @@ struct stats {
     counter_type pending = 0;
     counter_type exception_received = 0;
     counter_type sent_messages = 0;
+    // Number of writes the send loop flushed; sent_messages / flushes is the
+    // average number of messages coalesced per flush.
+    counter_type flushes = 0;
+    // Messages sent uncompressed on a compressed connection, see compression_options.
+    counter_type uncompressed_messages = 0;
     counter_type wait_reply = 0;
     counter_type timeout = 0;
 };
@@ -91,6 +97,11 @@ class unknown_verb_error : public error {
     unknown_verb_error(uint64_t type_) : error("unknown verb"), type(type_) {}
 };
 
+class overloaded_error : public error {
+public:
+    overloaded_error() : error("rpc server overloaded") {}
+};
+
 class unknown_exception_error : public error {
 public:
     unknown_exception_error() : error("unknown exception") {}
@@ -106,6 +117,11 @@ class canceled_error : public error {
     canceled_error() : error("rpc call was canceled") {}
 };
 
+class stream_not_supported_error : public error {
+public:
+    stream_not_supported_error() : error("peer does not support rpc streams") {}
+};
+
 struct no_wait_type {};
 
 // return this from a callback if client does not want to waiting for a reply
@@ -167,6 +183,7 @@ struct rcv_buf {
     using iterator = std::vector<temporary_buffer<char>>::iterator;
     rcv_buf() {}
     explicit rcv_buf(size_t size_) : size(size_) {}
+    explicit rcv_buf(temporary_buffer<char> b) : size(b.size()), bufs(std::move(b)) {};
 };
 
 struct snd_buf {
@@ -180,6 +197,62 @@ struct snd_buf {
     temporary_buffer<char>& front();
 };
 
+/// \brief Data sent as part of an rpc message without being copied
+///
+/// A spliced_buffer used as a verb argument or return value has its
+/// fragments placed into the outgoing message by reference, so a cached
+/// value can be sent by passing a share() of it.  On the wire it is a
+/// 32-bit little endian length followed by the data; the receiving side
+/// gets a spliced_buffer holding a single fragment.
+class spliced_buffer {
+    size_t _size = 0;
+    // sharing a fragment into a message does not change it
+    mutable std::vector<temporary_buffer<char>> _fragments;
+public:
+    spliced_buffer() = default;
+    explicit spliced_buffer(temporary_buffer<char> buf) : _size(buf.size()) {
+        _fragments.push_back(std::move(buf));
+    }
+    explicit spliced_buffer(net::packet p) : _size(p.len()), _fragments(p.release()) {}
+    size_t size() const {
+        return _size;
+    }
+    std::vector<temporary_buffer<char>>& fragments() const {
+        return _fragments;
+    }
+    /// Returns the data as one buffer, copying it only if it is fragmented.
+    temporary_buffer<char> linearize() const;
+};
+
+/// \brief Serializes an rpc message in a single pass
+///
+/// Data is written into slices of per-shard chunks that are recycled once
+/// all messages using them are sent, so that neither a measuring pass nor
+/// an allocation per message is needed.  A \ref spliced_buffer is appended
+/// as fragments of its own rather than copied.  Implements the output
+/// stream interface serializers write to.
+class snd_buf_writer {
+public:
+    static constexpr size_t chunk_size = 16 * 1024;
+    // smaller spliced buffers are cheaper to copy than to send as a fragment
+    static constexpr size_t min_splice_size = 512;
+private:
+    std::vector<temporary_buffer<char>> _done;
+    temporary_buffer<char> _current;
+    size_t _used = 0;
+    size_t _size = 0;
+private:
+    void close_current();
+public:
+    /// Leaves head_space contiguous bytes at the front of the message.
+    explicit snd_buf_writer(size_t head_space);
+    snd_buf_writer(snd_buf_writer&&) = delete;
+    ~snd_buf_writer();
+    void write(const char* p, size_t size);
+    void splice(const spliced_buffer& buf);
+    snd_buf finish() &&;
+};
+
 static inline seastar::memory_input_stream<rcv_buf::iterator> make_deserializer_stream(rcv_buf& input) {
     auto* b = boost::get<temporary_buffer<char>>(&input.bufs);
     if (b) {
@@ -209,4 +282,67 @@ class compressor {
     };
 };
 
+class stream_connection;
+
+/// \brief Sending end of an rpc stream.
+///
+/// A stream carries a sequence of elements of types Out... in one direction
+/// over the rpc connection it was created on, interleaved with ordinary
+/// messages.  The sink is handed to the other side by passing it as an
+/// argument to a verb (or returning it from a handler), where it shows up
+/// as a \ref source of the same types.
+template <typename... Out>
+class sink {
+public:
+    class impl {
+    public:
+        virtual ~impl() {}
+        virtual future<> operator()(const Out&... args) = 0;
+        virtual future<> close() = 0;
+        virtual int64_t id() const = 0;
+    };
+private:
+    shared_ptr<impl> _impl;
+public:
+    explicit sink(shared_ptr<impl> impl) : _impl(std::move(impl)) {}
+    /// Queues one element for sending.  The returned future resolves once
+    /// the peer has window for it; wait for it before sending more to keep
+    /// memory bounded on both ends.
+    future<> operator()(const Out&... args) {
+        return (*_impl)(args...);
+    }
+    /// Ends the stream.  The peer's source sees end-of-stream after
+    /// consuming everything sent before.
+    future<> close() {
+        return _impl->close();
+    }
+    int64_t get_id() const {
+        return _impl->id();
+    }
+};
+
+/// \brief Receiving end of an rpc stream.
+template <typename... In>
+class source {
+public:
+    class impl {
+    public:
+        virtual ~impl() {}
+        virtual future<std::experimental::optional<std::tuple<In...>>> operator()() = 0;
+        virtual stream_connection* connection() const = 0;
+    };
+private:
+    shared_ptr<impl> _impl;
+public:
+    explicit source(shared_ptr<impl> impl) : _impl(std::move(impl)) {}
+    /// Returns the next element, or a disengaged optional at end of stream.
+    future<std::experimental::optional<std::tuple<In...>>> operator()() {
+        return (*_impl)();
+    }
+    /// Creates a stream in the opposite direction on the same connection,
+    /// e.g. for a handler to return to its caller.
+    template <typename Serializer, typename... Out>
+    sink<Out...> make_sink();
+};
+
 } // namespace rpc
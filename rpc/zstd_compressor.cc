@@ -0,0 +1,146 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "zstd_compressor.hh"
+#include "core/byteorder.hh"
+#include "core/print.hh"
+#include <zstd.h>
+#include <zdict.h>
+
+namespace rpc {
+
+void zstd_compressor::factory::cdict_deleter::operator()(ZSTD_CDict* d) const {
+    ZSTD_freeCDict(d);
+}
+
+void zstd_compressor::factory::ddict_deleter::operator()(ZSTD_DDict* d) const {
+    ZSTD_freeDDict(d);
+}
+
+void zstd_compressor::cctx_deleter::operator()(ZSTD_CCtx* c) const {
+    ZSTD_freeCCtx(c);
+}
+
+void zstd_compressor::dctx_deleter::operator()(ZSTD_DCtx* c) const {
+    ZSTD_freeDCtx(c);
+}
+
+zstd_compressor::factory::factory(int level) : _name("ZSTD"), _level(level) {
+}
+
+zstd_compressor::factory::factory(temporary_buffer<char> dictionary, int level)
+        : _name(sprint("ZSTD:%u", ZSTD_getDictID_fromDict(dictionary.get(), dictionary.size())))
+        , _level(level)
+        , _cdict(ZSTD_createCDict(dictionary.get(), dictionary.size(), level))
+        , _ddict(ZSTD_createDDict(dictionary.get(), dictionary.size())) {
+    if (!_cdict || !_ddict) {
+        throw std::runtime_error("failed to load zstd dictionary");
+    }
+}
+
+std::unique_ptr<rpc::compressor> zstd_compressor::factory::negotiate(sstring feature, bool is_server) const {
+    return feature == _name ? std::make_unique<rpc::zstd_compressor>(_level, _cdict.get(), _ddict.get()) : nullptr;
+}
+
+temporary_buffer<char> zstd_compressor::train_dictionary(const std::vector<temporary_buffer<char>>& samples, size_t max_size) {
+    std::vector<char> flat;
+    std::vector<size_t> sizes;
+    for (auto&& s : samples) {
+        flat.insert(flat.end(), s.begin(), s.end());
+        sizes.push_back(s.size());
+    }
+    temporary_buffer<char> dict(max_size);
+    auto size = ZDICT_trainFromBuffer(dict.get_write(), dict.size(), flat.data(), sizes.data(), sizes.size());
+    if (ZDICT_isError(size)) {
+        throw std::runtime_error(sprint("zstd dictionary training failed: %s", ZDICT_getErrorName(size)));
+    }
+    dict.trim(size);
+    return dict;
+}
+
+zstd_compressor::zstd_compressor(int level, const ZSTD_CDict* cdict, const ZSTD_DDict* ddict)
+        : _level(level), _cdict(cdict), _ddict(ddict) {
+}
+
+static temporary_buffer<char> linearize(boost::variant<std::vector<temporary_buffer<char>>, temporary_buffer<char>>& v, uint32_t size) {
+    auto* one = boost::get<temporary_buffer<char>>(&v);
+    if (one) {
+        // no need to linearize
+        return std::move(*one);
+    } else {
+        temporary_buffer<char> src(size);
+        auto p = src.get_write();
+        for (auto&& b : boost::get<std::vector<temporary_buffer<char>>>(v)) {
+            p = std::copy_n(b.begin(), b.size(), p);
+        }
+        return src;
+    }
+}
+
+snd_buf zstd_compressor::compress(size_t head_space, snd_buf data) {
+    if (!_cctx) {
+        _cctx.reset(ZSTD_createCCtx());
+    }
+    head_space += 4;
+    auto bound = ZSTD_compressBound(data.size);
+    temporary_buffer<char> dst(head_space + bound);
+    temporary_buffer<char> src = linearize(data.bufs, data.size);
+    size_t size;
+    if (_cdict) {
+        size = ZSTD_compress_usingCDict(_cctx.get(), dst.get_write() + head_space, bound, src.begin(), src.size(), _cdict);
+    } else {
+        size = ZSTD_compressCCtx(_cctx.get(), dst.get_write() + head_space, bound, src.begin(), src.size(), _level);
+    }
+    if (ZSTD_isError(size)) {
+        throw std::runtime_error(sprint("RPC frame zstd compression failure: %s", ZSTD_getErrorName(size)));
+    }
+    dst.trim(size + head_space);
+    write_le<uint32_t>(dst.get_write() + (head_space - 4), data.size);
+    return snd_buf(std::move(dst));
+}
+
+rcv_buf zstd_compressor::decompress(rcv_buf data) {
+    if (data.size < 4) {
+        return rcv_buf();
+    }
+    temporary_buffer<char> src = linearize(data.bufs, data.size);
+    auto size = read_le<uint32_t>(src.get());
+    src.trim_front(4);
+    if (!size) {
+        return rcv_buf(std::move(src));
+    }
+    if (!_dctx) {
+        _dctx.reset(ZSTD_createDCtx());
+    }
+    temporary_buffer<char> dst(size);
+    size_t ret;
+    if (_ddict) {
+        ret = ZSTD_decompress_usingDDict(_dctx.get(), dst.get_write(), dst.size(), src.begin(), src.size(), _ddict);
+    } else {
+        ret = ZSTD_decompressDCtx(_dctx.get(), dst.get_write(), dst.size(), src.begin(), src.size());
+    }
+    if (ZSTD_isError(ret) || ret != size) {
+        throw std::runtime_error("RPC frame zstd decompression failure");
+    }
+    return rcv_buf(std::move(dst));
+}
+
+}
@@ -0,0 +1,73 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#pragma once
+
+#include "core/sstring.hh"
+#include "rpc/rpc_types.hh"
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+namespace rpc {
+    class zstd_compressor : public compressor {
+    public:
+        // Both sides must be given the same dictionary (or none); the
+        // dictionary id is part of the negotiated feature name, so peers
+        // with different dictionaries fall back to another algorithm.
+        class factory: public rpc::compressor::factory {
+            struct cdict_deleter { void operator()(ZSTD_CDict_s*) const; };
+            struct ddict_deleter { void operator()(ZSTD_DDict_s*) const; };
+            sstring _name;
+            int _level;
+            std::unique_ptr<ZSTD_CDict_s, cdict_deleter> _cdict;
+            std::unique_ptr<ZSTD_DDict_s, ddict_deleter> _ddict;
+        public:
+            explicit factory(int level = 1);
+            factory(temporary_buffer<char> dictionary, int level = 1);
+            virtual const sstring& supported() const override {
+                return _name;
+            }
+            virtual std::unique_ptr<rpc::compressor> negotiate(sstring feature, bool is_server) const override;
+        };
+        // Builds a dictionary of at most max_size bytes from sample messages,
+        // for use by factory(dictionary).  Dictionaries pay off for small
+        // messages that share structure, which compress poorly on their own.
+        static temporary_buffer<char> train_dictionary(const std::vector<temporary_buffer<char>>& samples, size_t max_size = 16 * 1024);
+    private:
+        struct cctx_deleter { void operator()(ZSTD_CCtx_s*) const; };
+        struct dctx_deleter { void operator()(ZSTD_DCtx_s*) const; };
+        int _level;
+        const ZSTD_CDict_s* _cdict;
+        const ZSTD_DDict_s* _ddict;
+        std::unique_ptr<ZSTD_CCtx_s, cctx_deleter> _cctx;
+        std::unique_ptr<ZSTD_DCtx_s, dctx_deleter> _dctx;
+    public:
+        zstd_compressor(int level, const ZSTD_CDict_s* cdict, const ZSTD_DDict_s* ddict);
+        ~zstd_compressor() {}
+        // compress data, leaving head_space empty in returned buffer
+        snd_buf compress(size_t head_space, snd_buf data) override;
+        // decompress data
+        rcv_buf decompress(rcv_buf data) override;
+    };
+}
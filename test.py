@@ -41,9 +41,11 @@ boost_tests = [
     'weak_ptr_test',
     'fileiotest',
     'packet_test',
+    'arp_test',
     'tls_test',
     'rpc_test',
     'connect_test',
+    'udp_test',
     'json_formatter_test',
     'execution_stage_test',
 ]
@@ -0,0 +1,207 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#define BOOST_TEST_MODULE core
+
+#include <boost/test/included/unit_test.hpp>
+#include "net/arp.hh"
+#include "net/ip.hh"
+#include <random>
+#include <unordered_map>
+
+using namespace net;
+
+// A key that lands in the slot of a table of 8 its value says, to place
+// entries at the end of the table and around it.
+struct slot_key {
+    uint32_t id;
+    unsigned home;
+    bool operator==(const slot_key& x) const {
+        return id == x.id;
+    }
+};
+
+namespace std {
+
+template <>
+struct hash<slot_key> {
+    size_t operator()(const slot_key& k) const {
+        // The table multiplies hashes by the 64-bit golden ratio and keeps
+        // the top bits; multiply the slot by its inverse to undo that.
+        uint64_t golden = 0x9e3779b97f4a7c15ull;
+        uint64_t inverse = golden;
+        for (int i = 0; i < 5; ++i) {
+            inverse *= 2 - golden * inverse;
+        }
+        return ((uint64_t(k.home) << 61) + k.id) * inverse;
+    }
+};
+
+}
+
+using slot_table = neighbor_table<slot_key, int>;
+
+static void require_found(slot_table& t, slot_key k, int value) {
+    auto e = t.find(k);
+    BOOST_REQUIRE(e);
+    BOOST_REQUIRE_EQUAL(e->hwaddr, value);
+}
+
+BOOST_AUTO_TEST_CASE(test_wraparound) {
+    slot_table t(8);
+    // a chain starting at the last slot, wrapping to the first ones
+    slot_key a{1, 7}, b{2, 7}, c{3, 7}, d{4, 0};
+    t.insert(a).hwaddr = 1;
+    t.insert(b).hwaddr = 2;
+    t.insert(c).hwaddr = 3;
+    t.insert(d).hwaddr = 4;
+    BOOST_REQUIRE_EQUAL(t.size(), 4u);
+    require_found(t, a, 1);
+    require_found(t, b, 2);
+    require_found(t, c, 3);
+    require_found(t, d, 4);
+    BOOST_REQUIRE(!t.find(slot_key{5, 7}));
+    BOOST_REQUIRE(!t.find(slot_key{5, 0}));
+
+    // inserting an existing key returns its entry
+    BOOST_REQUIRE_EQUAL(t.insert(c).hwaddr, 3);
+    BOOST_REQUIRE_EQUAL(t.size(), 4u);
+
+    // the rest of the chain moves back across the end of the table
+    t.erase(a);
+    BOOST_REQUIRE_EQUAL(t.size(), 3u);
+    BOOST_REQUIRE(!t.find(a));
+    require_found(t, b, 2);
+    require_found(t, c, 3);
+    require_found(t, d, 4);
+
+    t.erase(c);
+    BOOST_REQUIRE(!t.find(c));
+    require_found(t, b, 2);
+    require_found(t, d, 4);
+
+    t.erase(b);
+    t.erase(b);
+    BOOST_REQUIRE_EQUAL(t.size(), 1u);
+    require_found(t, d, 4);
+    t.erase(d);
+    BOOST_REQUIRE_EQUAL(t.size(), 0u);
+    BOOST_REQUIRE(!t.find(d));
+}
+
+BOOST_AUTO_TEST_CASE(test_random_against_map) {
+    slot_table t(8);
+    std::unordered_map<uint32_t, int> model;
+    std::default_random_engine rnd;
+    std::uniform_int_distribution<uint32_t> ids(0, 15);
+    std::bernoulli_distribution insert;
+    for (int i = 0; i < 10000; ++i) {
+        // few distinct homes, at the end and the start of the table, so
+        // chains collide and wrap
+        auto id = ids(rnd);
+        slot_key k{id, id % 2 ? 7u : 0u};
+        if (insert(rnd)) {
+            t.insert(k).hwaddr = i;
+            model[id] = i;
+        } else {
+            t.erase(k);
+            model.erase(id);
+        }
+        BOOST_REQUIRE_EQUAL(t.size(), model.size());
+        for (uint32_t j = 0; j < 16; ++j) {
+            auto e = t.find(slot_key{j, j % 2 ? 7u : 0u});
+            auto m = model.find(j);
+            BOOST_REQUIRE_EQUAL(bool(e), m != model.end());
+            if (e) {
+                BOOST_REQUIRE_EQUAL(e->hwaddr, m->second);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_growth) {
+    neighbor_table<ipv4_address, ethernet_address> t(4);
+    auto hw = [] (uint32_t i) {
+        return ethernet_address{0, 0, uint8_t(i >> 16), uint8_t(i >> 8), uint8_t(i), 1};
+    };
+    for (uint32_t i = 0; i < 1000; ++i) {
+        t.insert(ipv4_address(0x0a000000 + i)).hwaddr = hw(i);
+    }
+    BOOST_REQUIRE_EQUAL(t.size(), 1000u);
+    for (uint32_t i = 0; i < 1000; ++i) {
+        auto e = t.find(ipv4_address(0x0a000000 + i));
+        BOOST_REQUIRE(e);
+        BOOST_REQUIRE(e->hwaddr.mac == hw(i).mac);
+    }
+    for (uint32_t i = 0; i < 1000; i += 2) {
+        t.erase(ipv4_address(0x0a000000 + i));
+    }
+    BOOST_REQUIRE_EQUAL(t.size(), 500u);
+    for (uint32_t i = 0; i < 1000; ++i) {
+        BOOST_REQUIRE_EQUAL(bool(t.find(ipv4_address(0x0a000000 + i))), i % 2 == 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_expiry) {
+    using namespace std::chrono_literals;
+    neighbor_table<ipv4_address, ethernet_address> t;
+    auto now = lowres_clock::now();
+    auto add = [&] (uint32_t ip, lowres_clock::time_point expires, bool used) {
+        auto& e = t.insert(ipv4_address(ip));
+        e.expires = expires;
+        e.used = used;
+    };
+    add(1, lowres_clock::time_point::max(), true);   // static
+    add(2, now, true);                               // expired
+    add(3, now - 1s, false);                         // expired
+    add(4, now + 2s, true);                          // to refresh
+    add(5, now + 2s, false);                         // not used, left to expire
+    add(6, now + 30s, true);                         // not due yet
+
+    std::vector<uint32_t> refreshed;
+    t.age(now, 5s, [&] (decltype(t)::entry& e) {
+        refreshed.push_back(uint32_t(e.paddr.ip));
+    });
+    BOOST_REQUIRE_EQUAL(t.size(), 4u);
+    BOOST_REQUIRE(t.find(ipv4_address(1)));
+    BOOST_REQUIRE(!t.find(ipv4_address(2)));
+    BOOST_REQUIRE(!t.find(ipv4_address(3)));
+    BOOST_REQUIRE(t.find(ipv4_address(5)));
+    BOOST_REQUIRE(t.find(ipv4_address(6))->used);
+    BOOST_REQUIRE_EQUAL(refreshed.size(), 1u);
+    BOOST_REQUIRE_EQUAL(refreshed[0], 4u);
+    BOOST_REQUIRE(!t.find(ipv4_address(4))->used);
+
+    // refreshed once until used again; then gone when it expires
+    refreshed.clear();
+    t.age(now + 1s, 5s, [&] (decltype(t)::entry& e) {
+        refreshed.push_back(uint32_t(e.paddr.ip));
+    });
+    BOOST_REQUIRE(refreshed.empty());
+    t.age(now + 2s, 5s, [&] (decltype(t)::entry& e) {
+        refreshed.push_back(uint32_t(e.paddr.ip));
+    });
+    BOOST_REQUIRE(refreshed.empty());
+    BOOST_REQUIRE(!t.find(ipv4_address(4)));
+    BOOST_REQUIRE(!t.find(ipv4_address(5)));
+    BOOST_REQUIRE_EQUAL(t.size(), 2u);
+    BOOST_REQUIRE(t.find(ipv4_address(1)));
+}
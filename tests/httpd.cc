@@ -10,8 +10,21 @@
 #include "http/routes.hh"
 #include "http/exception.hh"
 #include "http/transformers.hh"
+#include "http/function_handlers.hh"
+#include "http/client.hh"
+#include "http/compression.hh"
+#include "http/file_handler.hh"
+#include "http/hpack.hh"
+#include "http/http2.hh"
 #include "core/future-util.hh"
+#include "core/thread.hh"
+#include "core/sleep.hh"
 #include "tests/test-utils.hh"
+#include "tests/loopback_socket.hh"
+#include <zlib.h>
+#include <fstream>
+#include <numeric>
+#include <zstd.h>
 
 using namespace httpd;
 
@@ -32,6 +45,29 @@ SEASTAR_TEST_CASE(test_reply)
     return make_ready_future<>();
 }
 
+SEASTAR_TEST_CASE(test_header_map)
+{
+    header_map h;
+    h["Content-Type"] = "text/plain";
+    h["X-Count"] = "1";
+    BOOST_REQUIRE_EQUAL(h["content-type"], "text/plain");
+    BOOST_REQUIRE(h.find("CONTENT-TYPE") == h.begin());
+    BOOST_REQUIRE_EQUAL(h.count("X-Counts"), 0u);
+    BOOST_REQUIRE(!header_map::name_equals("X-Count", "X\rCount"));
+    h["x-count"] = "2";
+    BOOST_REQUIRE_EQUAL(h.size(), 2u);
+    BOOST_REQUIRE_EQUAL(h.erase("X-COUNT"), 1u);
+    BOOST_REQUIRE_EQUAL(h.size(), 1u);
+
+    reply r;
+    r.set_version("1.1");
+    r.add_header("content-length", "12");
+    r.add_header("X-Custom", "yes");
+    BOOST_REQUIRE_EQUAL(r.format_head({{"Content-Length", "3"}}),
+            "HTTP/1.1 200 OK\r\nX-Custom: yes\r\nContent-Length: 3\r\n\r\n");
+    return make_ready_future<>();
+}
+
 SEASTAR_TEST_CASE(test_str_matcher)
 {
 
@@ -52,6 +88,25 @@ SEASTAR_TEST_CASE(test_param_matcher)
     return make_ready_future<>();
 }
 
+SEASTAR_TEST_CASE(test_parameters_copy)
+{
+    parameters copy;
+    {
+        sstring url = "/abc/hello";
+        parameters param;
+        param.set_view("param", std::experimental::string_view(url).substr(4));
+        param.set("other", "/value");
+        copy = param;
+        parameters constructed(param);
+        url = "/xyz/world";
+        BOOST_REQUIRE_EQUAL(param["param"], "world");
+        BOOST_REQUIRE_EQUAL(constructed["param"], "hello");
+    }
+    BOOST_REQUIRE_EQUAL(copy["param"], "hello");
+    BOOST_REQUIRE_EQUAL(copy.path("other"), "/value");
+    return make_ready_future<>();
+}
+
 SEASTAR_TEST_CASE(test_match_rule)
 {
 
@@ -154,6 +209,53 @@ SEASTAR_TEST_CASE(test_routes) {
     });
 }
 
+SEASTAR_TEST_CASE(test_routes_priority) {
+    return seastar::async([] {
+        routes route;
+        auto reply_with = [] (sstring name) {
+            return new function_handler([name] (const_req req) {
+                sstring res = name;
+                for (auto p : {"id", "op", "path"}) {
+                    if (req.param.exists(p)) {
+                        res += sstring(" ") + p + "=" + req.param.at(p);
+                    }
+                }
+                return res;
+            }, "txt");
+        };
+        route.add(&(new match_rule(reply_with("item")))->add_str("/api/items").add_param("id"), GET);
+        route.add(&(new match_rule(reply_with("special")))->add_str("/api/items/special"), GET);
+        route.add(&(new match_rule(reply_with("op")))->add_str("/api").add_param("id").add_str("/op").add_param("op"), GET);
+        // not made of whole segments, tried one by one
+        route.add(GET, url("/files/"), reply_with("dir"));
+        route.add(GET, url("/files").remainder("path"), reply_with("files"));
+        route.put(GET, "/api/items/all", reply_with("all"));
+
+        auto get = [&route] (sstring path) {
+            auto req = std::make_unique<request>();
+            req->_method = "GET";
+            req->_url = path + "?x=1";
+            return route.handle(path, std::move(req), std::make_unique<reply>()).get0()->_content;
+        };
+        BOOST_REQUIRE_EQUAL(get("/api/items/12"), "item id=/12");
+        BOOST_REQUIRE_EQUAL(get("/api/items/12/"), "item id=/12");
+        // added after the rule with a parameter, which matches first
+        BOOST_REQUIRE_EQUAL(get("/api/items/special"), "item id=/special");
+        BOOST_REQUIRE_EQUAL(get("/api/items/all"), "all");
+        BOOST_REQUIRE_EQUAL(get("/api/12/op/sum"), "op id=/12 op=/sum");
+        BOOST_REQUIRE_EQUAL(get("/api/items/op/sum"), "op id=/items op=/sum");
+        BOOST_REQUIRE_EQUAL(get("/files"), "files path=");
+        BOOST_REQUIRE_EQUAL(get("/files/a/b/c.txt"), "files path=/a/b/c.txt");
+        BOOST_REQUIRE_EQUAL(get("/files//"), "dir");
+        BOOST_REQUIRE_EQUAL((int)route.handle("/api/items", std::make_unique<request>(), std::make_unique<reply>()).get0()->_status,
+                (int)reply::status_type::not_found);
+
+        // a rule added later is matched once the rules change
+        route.add(&(new match_rule(reply_with("first")))->add_str("/first"), GET);
+        BOOST_REQUIRE_EQUAL(get("/first"), "first");
+    });
+}
+
 SEASTAR_TEST_CASE(test_transformer) {
     request req;
     content_replace cr("json");
@@ -165,3 +267,963 @@ SEASTAR_TEST_CASE(test_transformer) {
     BOOST_REQUIRE_EQUAL(content, "hello-http-xyz-localhost");
     return make_ready_future<>();
 }
+
+// Sends a request over a new loopback connection and returns everything
+// the server writes until it closes the connection.  Must run in a thread.
+static sstring exchange(loopback_connection_factory& lcf, const sstring& req) {
+    auto s = lcf.make_new_connection(make_lw_shared<loopback_buffer>(), make_lw_shared<loopback_buffer>()).get0();
+    auto in = s.input();
+    auto out = s.output();
+    out.write(req).get();
+    out.flush().get();
+    sstring response;
+    for (;;) {
+        auto buf = in.read().get0();
+        if (buf.empty()) {
+            break;
+        }
+        response += sstring(buf.get(), buf.size());
+    }
+    return response;
+}
+
+SEASTAR_TEST_CASE(test_streamed_reply) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        future_handler_function stream = [] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            rep->write_body("txt", [] (output_stream<char>&& out) {
+                return do_with(std::move(out), [] (output_stream<char>& out) {
+                    return out.write("hello ").then([&out] {
+                        return out.flush();
+                    }).then([&out] {
+                        return out.write("world");
+                    }).then([&out] {
+                        return out.close();
+                    });
+                });
+            });
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        };
+        server._routes.put(GET, "/stream", new function_handler(stream, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        auto response = exchange(lcf, "GET /stream HTTP/1.1\r\nConnection: Close\r\n\r\n");
+        BOOST_REQUIRE_EQUAL(response.find("HTTP/1.1 200 OK\r\n"), 0u);
+        BOOST_REQUIRE(response.find("Transfer-Encoding: chunked\r\n") != sstring::npos);
+        BOOST_REQUIRE(response.find("Content-Length") == sstring::npos);
+        auto body = response.substr(response.find("\r\n\r\n") + 4);
+        BOOST_REQUIRE_EQUAL(body, "6\r\nhello \r\n5\r\nworld\r\n0\r\n\r\n");
+
+        // no chunked encoding in HTTP/1.0, the body ends with the connection
+        response = exchange(lcf, "GET /stream HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n");
+        BOOST_REQUIRE_EQUAL(response.find("HTTP/1.0 200 OK\r\n"), 0u);
+        BOOST_REQUIRE(response.find("Transfer-Encoding") == sstring::npos);
+        BOOST_REQUIRE(response.find("Keep-Alive") == sstring::npos);
+        body = response.substr(response.find("\r\n\r\n") + 4);
+        BOOST_REQUIRE_EQUAL(body, "hello world");
+
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_json_stream_reply) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        std::vector<int> values(1000);
+        std::iota(values.begin(), values.end(), 0);
+        json_request_function stream = [&values] (const_req req) {
+            return json::stream_range_as_array(values, [] (int i) {
+                return std::map<sstring, int>({{"\"value\"", i}, {"\"square\"", i * i}});
+            });
+        };
+        server._routes.put(GET, "/json", new function_handler(stream));
+        server.listen(lcf.get_server_socket()).get();
+
+        std::vector<std::map<sstring, int>> expected;
+        for (auto i : values) {
+            expected.push_back({{"\"value\"", i}, {"\"square\"", i * i}});
+        }
+        auto response = exchange(lcf, "GET /json HTTP/1.0\r\n\r\n");
+        BOOST_REQUIRE_EQUAL(response.find("HTTP/1.0 200 OK\r\n"), 0u);
+        auto body = response.substr(response.find("\r\n\r\n") + 4);
+        BOOST_REQUIRE_EQUAL(body, json::formatter::to_json(expected));
+
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_route_stats) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        promise<> release;
+        auto echo = new function_handler([] (const_req req) {
+            return req.content;
+        }, "txt");
+        auto fail = new function_handler([] (const_req req) -> sstring {
+            throw std::runtime_error("failed");
+        }, "txt");
+        auto stream = new function_handler([] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            rep->write_body("txt", [] (output_stream<char>&& out) {
+                return do_with(std::move(out), [] (output_stream<char>& out) {
+                    return out.write("hello ").then([&out] {
+                        return out.write("world");
+                    }).then([&out] {
+                        return out.close();
+                    });
+                });
+            });
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        }, "txt");
+        auto wait = new function_handler([&release] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            return release.get_future().then([rep = std::move(rep)] () mutable {
+                return std::move(rep);
+            });
+        }, "txt");
+        server._routes.put(POST, "/echo", echo);
+        server._routes.put(GET, "/fail", fail);
+        server._routes.put(GET, "/stream", stream);
+        server._routes.add(GET, url("/wait").remainder("path"), wait);
+        promise<> finish;
+        auto slow_stream = new function_handler([&finish] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            rep->write_body("txt", [&finish] (output_stream<char>&& out) {
+                return do_with(std::move(out), [&finish] (output_stream<char>& out) {
+                    return out.write("hello").then([&out] {
+                        return out.flush();
+                    }).then([&finish] {
+                        return finish.get_future();
+                    }).then([&out] {
+                        return out.close();
+                    });
+                });
+            });
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        }, "txt");
+        server._routes.put(GET, "/slow_stream", slow_stream);
+        server.listen(lcf.get_server_socket()).get();
+
+        exchange(lcf, "POST /echo HTTP/1.1\r\nContent-Length: 5\r\nConnection: Close\r\n\r\nhello");
+        exchange(lcf, "POST /echo HTTP/1.1\r\nContent-Length: 3\r\nConnection: Close\r\n\r\nabc");
+        BOOST_REQUIRE(echo->_stats);
+        BOOST_REQUIRE_EQUAL(echo->_stats->latency.count(), 2u);
+        BOOST_REQUIRE_EQUAL(echo->_stats->replies[1], 2u);
+        BOOST_REQUIRE_EQUAL(echo->_stats->request_bytes, 8u);
+        BOOST_REQUIRE_EQUAL(echo->_stats->response_bytes, 8u);
+        BOOST_REQUIRE_EQUAL(echo->_stats->requests_in_flight, 0u);
+
+        exchange(lcf, "GET /fail HTTP/1.1\r\nConnection: Close\r\n\r\n");
+        BOOST_REQUIRE_EQUAL(fail->_stats->replies[4], 1u);
+        BOOST_REQUIRE_EQUAL(fail->_stats->replies[1], 0u);
+
+        // streamed bodies are counted as they are written
+        exchange(lcf, "GET /stream HTTP/1.1\r\nConnection: Close\r\n\r\n");
+        BOOST_REQUIRE_EQUAL(stream->_stats->response_bytes, 11u);
+
+        auto waiting = lcf.make_new_connection(make_lw_shared<loopback_buffer>(), make_lw_shared<loopback_buffer>()).get0();
+        auto out = waiting.output();
+        out.write("GET /wait/x HTTP/1.1\r\n\r\n").get();
+        out.flush().get();
+        while (!wait->_stats || !wait->_stats->requests_in_flight) {
+            later().get();
+        }
+        release.set_value();
+        while (wait->_stats->requests_in_flight) {
+            later().get();
+        }
+        BOOST_REQUIRE_EQUAL(wait->_stats->replies[1], 1u);
+        out.close().get();
+
+        // a streamed reply is in flight until its body is written
+        auto streaming = lcf.make_new_connection(make_lw_shared<loopback_buffer>(), make_lw_shared<loopback_buffer>()).get0();
+        auto streaming_out = streaming.output();
+        streaming_out.write("GET /slow_stream HTTP/1.1\r\n\r\n").get();
+        streaming_out.flush().get();
+        while (!slow_stream->_stats || slow_stream->_stats->response_bytes < 5) {
+            later().get();
+        }
+        BOOST_REQUIRE_EQUAL(slow_stream->_stats->requests_in_flight, 1u);
+        BOOST_REQUIRE_EQUAL(slow_stream->_stats->latency.count(), 0u);
+        finish.set_value();
+        while (slow_stream->_stats->requests_in_flight) {
+            later().get();
+        }
+        BOOST_REQUIRE_EQUAL(slow_stream->_stats->latency.count(), 1u);
+        streaming_out.close().get();
+
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_request_body) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        request_function echo = [] (const_req req) {
+            return sprint("%d:%s", req.content.size(), req.content);
+        };
+        server._routes.put(POST, "/echo", new function_handler(echo, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        auto response = exchange(lcf, "POST /echo HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+                "POST /echo HTTP/1.1\r\nTransfer-Encoding: chunked\r\nConnection: Close\r\n\r\n"
+                "3\r\nabc\r\n4;ext=1\r\ndefg\r\n0\r\nTrailer: x\r\n\r\n");
+        BOOST_REQUIRE(response.find("\r\n\r\n5:helloHTTP/1.1 200 OK\r\n") != sstring::npos);
+        BOOST_REQUIRE_EQUAL(response.substr(response.size() - 13), "\r\n\r\n7:abcdefg");
+
+        server.set_body_memory_limit(4);
+        response = exchange(lcf, "POST /echo HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello");
+        BOOST_REQUIRE_EQUAL(response.find("HTTP/1.1 413 Payload Too Large\r\n"), 0u);
+
+        // two bodies that fit the limit one at a time but not together, each
+        // half sent before the rest of either: one waits for the other
+        server.set_body_memory_limit(10);
+        std::vector<connected_socket> conns;
+        std::vector<output_stream<char>> outs;
+        for (auto i = 0; i < 2; i++) {
+            conns.push_back(lcf.make_new_connection(make_lw_shared<loopback_buffer>(), make_lw_shared<loopback_buffer>()).get0());
+            outs.push_back(conns.back().output());
+        }
+        for (auto part : {"abcd", "ABCD"}) {
+            for (auto&& out : outs) {
+                if (part[0] == 'a') {
+                    out.write("POST /echo HTTP/1.1\r\nContent-Length: 8\r\nConnection: Close\r\n\r\n").get();
+                }
+                out.write(part).get();
+                out.flush().get();
+            }
+            sleep(std::chrono::milliseconds(10)).get();
+        }
+        for (auto&& c : conns) {
+            auto in = c.input();
+            sstring response;
+            while (auto buf = in.read().get0()) {
+                response += sstring(buf.get(), buf.size());
+            }
+            BOOST_REQUIRE_EQUAL(response.substr(response.size() - 10), "8:abcdABCD");
+        }
+
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_too_many_headers) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        server._routes.put(GET, "/hello", new function_handler([] (const_req req) {
+            return "hello";
+        }, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        auto request = [] (size_t headers) {
+            sstring req = "GET /hello HTTP/1.1\r\n";
+            for (size_t i = 0; i < headers; i++) {
+                req += sprint("X-Header-%d: %d\r\n", i, i);
+            }
+            return req + "Connection: close\r\n\r\n";
+        };
+        auto max = http_request_parser::max_headers;
+        auto response = exchange(lcf, request(max - 1));
+        BOOST_REQUIRE_EQUAL(response.find("HTTP/1.1 200 OK\r\n"), 0u);
+        response = exchange(lcf, request(max));
+        BOOST_REQUIRE_EQUAL(response.find("HTTP/1.1 431 Request Header Fields Too Large\r\n"), 0u);
+
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_streamed_request_body) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        server.set_content_streaming(true);
+        server.set_body_memory_limit(4);
+        future_handler_function count = [] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            auto& in = *req->content_stream;
+            return do_with(size_t(0), std::move(rep), [&in] (size_t& total, std::unique_ptr<reply>& rep) {
+                return repeat([&in, &total] {
+                    return in.read().then([&total] (temporary_buffer<char> buf) {
+                        BOOST_REQUIRE_LE(buf.size(), 4u);
+                        total += buf.size();
+                        return buf.empty() ? stop_iteration::yes : stop_iteration::no;
+                    });
+                }).then([&total, &rep] {
+                    rep->_content = to_sstring(total);
+                    return std::move(rep);
+                });
+            });
+        };
+        future_handler_function first = [] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            return req->content_stream->read().then([rep = std::move(rep)] (temporary_buffer<char> buf) mutable {
+                rep->_content = sstring(buf.get(), buf.size());
+                return std::move(rep);
+            });
+        };
+        server._routes.put(POST, "/count", new function_handler(count, "txt"));
+        server._routes.put(POST, "/first", new function_handler(first, "txt"));
+        server._routes.put(GET, "/count", new function_handler(count, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        // the body the handler leaves unread is skipped
+        auto response = exchange(lcf, "POST /count HTTP/1.1\r\nContent-Length: 10\r\n\r\n0123456789"
+                "POST /first HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nabc\r\n3\r\ndef\r\n0\r\n\r\n"
+                "GET /count HTTP/1.1\r\nConnection: Close\r\n\r\n");
+        BOOST_REQUIRE(response.find("\r\n\r\n10HTTP/1.1 200 OK\r\n") != sstring::npos);
+        BOOST_REQUIRE(response.find("\r\n\r\nabcHTTP/1.1 200 OK\r\n") != sstring::npos);
+        BOOST_REQUIRE_EQUAL(response.substr(response.size() - 5), "\r\n\r\n0");
+
+        server.stop().get();
+    });
+}
+
+class loopback_http_connection_factory : public http::connection_factory {
+    loopback_connection_factory& _lcf;
+public:
+    explicit loopback_http_connection_factory(loopback_connection_factory& lcf) : _lcf(lcf) {
+    }
+    virtual future<connected_socket> make() override {
+        return _lcf.make_new_connection(make_lw_shared<loopback_buffer>(), make_lw_shared<loopback_buffer>());
+    }
+};
+
+SEASTAR_TEST_CASE(test_http_client) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        request_function echo = [] (const_req req) {
+            return req.content;
+        };
+        handle_function hello = [] (const_req req, reply& rep) {
+            rep.add_header("X-Reply", "1");
+            return "hello";
+        };
+        server._routes.put(POST, "/echo", new function_handler(echo, "txt"));
+        server._routes.put(GET, "/hello", new function_handler(hello, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        http::client_options co;
+        co.max_connections = 1;
+        co.max_pipelined = 4;
+        http::client client(std::make_unique<loopback_http_connection_factory>(lcf), "test", co);
+
+        auto rsp = client.make_request(http::request("GET", "/hello")).get0();
+        BOOST_REQUIRE_EQUAL(rsp._status, 200);
+        BOOST_REQUIRE_EQUAL(rsp._content, "hello");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("X-Reply"), "1");
+        rsp = client.make_request(http::request("GET", "/missing")).get0();
+        BOOST_REQUIRE_EQUAL(rsp._status, 404);
+
+        // pipelined on the one connection
+        std::vector<future<http::response>> pipelined;
+        for (int i = 0; i < 4; i++) {
+            http::request req("POST", "/echo");
+            req._content = to_sstring(i);
+            pipelined.push_back(client.make_request(std::move(req)));
+        }
+        for (int i = 0; i < 4; i++) {
+            BOOST_REQUIRE_EQUAL(pipelined[i].get0()._content, to_sstring(i));
+        }
+
+        // streamed request and response bodies
+        http::request req("POST", "/echo");
+        req.write_body([] (output_stream<char>&& out) {
+            return do_with(std::move(out), [] (output_stream<char>& out) {
+                return out.write("chunked ").then([&out] {
+                    return out.flush();
+                }).then([&out] {
+                    return out.write("body");
+                }).then([&out] {
+                    return out.close();
+                });
+            });
+        });
+        sstring body;
+        client.make_request(std::move(req), [&body] (const http::response& rsp, input_stream<char>& in) {
+            BOOST_REQUIRE_EQUAL(rsp._status, 200);
+            return in.read_exactly(7).then([&body] (temporary_buffer<char> buf) {
+                body = sstring(buf.get(), buf.size());
+            });
+        }).get();
+        BOOST_REQUIRE_EQUAL(body, "chunked");
+        // the rest of the body was skipped
+        BOOST_REQUIRE_EQUAL(client.make_request(http::request("GET", "/hello")).get0()._content, "hello");
+        BOOST_REQUIRE_EQUAL(server.total_connections(), 1u);
+
+        client.close().get();
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_http_client_timeout) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        future_handler_function slow = [] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            return sleep(std::chrono::milliseconds(500)).then([rep = std::move(rep)] () mutable {
+                return std::move(rep);
+            });
+        };
+        server._routes.put(GET, "/slow", new function_handler(slow, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        http::client client(std::make_unique<loopback_http_connection_factory>(lcf), "test");
+        auto timeout = http::client::clock_type::now() + std::chrono::milliseconds(50);
+        BOOST_REQUIRE_THROW(client.make_request(http::request("GET", "/slow"), timeout).get(), timed_out_error);
+        // the timed out connection is not reused
+        BOOST_REQUIRE_EQUAL(client.make_request(http::request("GET", "/slow")).get0()._status, 200);
+        BOOST_REQUIRE_EQUAL(server.total_connections(), 2u);
+
+        client.close().get();
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_http_client_retry) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        auto ss = lcf.get_server_socket();
+        // answers the first request of a connection and closes it, though
+        // it was not asked to
+        auto serve_one = [&ss] {
+            return ss.accept().then([] (connected_socket fd, socket_address) {
+                auto in = fd.input();
+                auto out = fd.output();
+                return do_with(std::move(fd), std::move(in), std::move(out), sstring(), [] (auto& fd, auto& in, auto& out, sstring& head) {
+                    return repeat([&in, &head] {
+                        return in.read().then([&head] (temporary_buffer<char> buf) {
+                            head.append(buf.get(), buf.size());
+                            return buf.empty() || head.find("\r\n\r\n") != sstring::npos ? stop_iteration::yes : stop_iteration::no;
+                        });
+                    }).then([&out] {
+                        return out.write("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+                    }).then([&out] {
+                        return out.close();
+                    });
+                });
+            });
+        };
+        auto served = serve_one().then(serve_one);
+
+        http::client client(std::make_unique<loopback_http_connection_factory>(lcf), "test");
+        BOOST_REQUIRE_EQUAL(client.make_request(http::request("GET", "/")).get0()._content, "ok");
+        // sent again on a new connection
+        BOOST_REQUIRE_EQUAL(client.make_request(http::request("GET", "/")).get0()._content, "ok");
+        // not safe to send again
+        BOOST_REQUIRE_THROW(client.make_request(http::request("POST", "/")).get(), std::runtime_error);
+        served.get();
+
+        client.close().get();
+    });
+}
+
+static sstring decompress(const sstring& data, content_encoding e) {
+    sstring out(sstring::initialized_later(), 1 << 20);
+    size_t size;
+    if (e == content_encoding::zstd) {
+        size = ZSTD_decompress(out.begin(), out.size(), data.begin(), data.size());
+        BOOST_REQUIRE(!ZSTD_isError(size));
+    } else {
+        z_stream zs = {};
+        // 32 more window bits detect the gzip or zlib header
+        BOOST_REQUIRE_EQUAL(inflateInit2(&zs, 15 + 32), Z_OK);
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.begin()));
+        zs.avail_in = data.size();
+        zs.next_out = reinterpret_cast<Bytef*>(out.begin());
+        zs.avail_out = out.size();
+        BOOST_REQUIRE_EQUAL(inflate(&zs, Z_FINISH), Z_STREAM_END);
+        size = zs.total_out;
+        inflateEnd(&zs);
+    }
+    return out.substr(0, size);
+}
+
+SEASTAR_TEST_CASE(test_compression) {
+    BOOST_REQUIRE(negotiate_encoding("", {content_encoding::gzip}) == content_encoding::identity);
+    BOOST_REQUIRE(negotiate_encoding("GZIP", {content_encoding::gzip}) == content_encoding::gzip);
+    BOOST_REQUIRE(negotiate_encoding("gzip;q=0.5, zstd", {content_encoding::gzip, content_encoding::zstd})
+            == content_encoding::zstd);
+    BOOST_REQUIRE(negotiate_encoding("deflate, gzip", {content_encoding::gzip, content_encoding::deflate})
+            == content_encoding::gzip);
+    BOOST_REQUIRE(negotiate_encoding("*;q=0.1, gzip;q=0", {content_encoding::gzip, content_encoding::deflate})
+            == content_encoding::deflate);
+    BOOST_REQUIRE(negotiate_encoding("*;q=0", {content_encoding::gzip}) == content_encoding::identity);
+
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        sstring json;
+        for (int i = 0; i < 1000; i++) {
+            json += sprint("{\"id\": %d, \"name\": \"item\"},", i);
+        }
+        request_function large = [json] (const_req req) {
+            return json;
+        };
+        request_function small = [] (const_req req) {
+            return "{}";
+        };
+        future_handler_function stream = [json] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            rep->write_body("json", [json] (output_stream<char>&& out) {
+                return do_with(std::move(out), [json] (output_stream<char>& out) {
+                    return out.write(json).then([&out] {
+                        return out.flush();
+                    }).then([&out, json] {
+                        return out.write(json);
+                    }).then([&out] {
+                        return out.close();
+                    });
+                });
+            });
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        };
+        server._routes.put(GET, "/large", new function_handler(large, "json"));
+        server._routes.put(GET, "/small", new function_handler(small, "json"));
+        server._routes.put(GET, "/binary", new function_handler(large, "bin"));
+        server._routes.put(GET, "/never", &(new function_handler(large, "json"))->set_compression(reply::compression_mode::never));
+        server._routes.put(GET, "/stream", new function_handler(stream, "json"));
+        compression_options co;
+        co.encodings = {content_encoding::zstd, content_encoding::gzip, content_encoding::deflate};
+        server.set_compression(co);
+        server.listen(lcf.get_server_socket()).get();
+
+        http::client client(std::make_unique<loopback_http_connection_factory>(lcf), "test");
+        auto get = [&client] (const sstring& url, const sstring& accept_encoding) {
+            http::request req("GET", url);
+            if (!accept_encoding.empty()) {
+                req.add_header("Accept-Encoding", accept_encoding);
+            }
+            return client.make_request(std::move(req)).get0();
+        };
+
+        for (auto e : {content_encoding::gzip, content_encoding::deflate, content_encoding::zstd}) {
+            auto rsp = get("/large", to_string(e));
+            BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), to_string(e));
+            BOOST_REQUIRE_EQUAL(rsp.get_header("Vary"), "Accept-Encoding");
+            BOOST_REQUIRE(rsp._content.size() < json.size() / 4);
+            BOOST_REQUIRE_EQUAL(decompress(rsp._content, e), json);
+        }
+        auto rsp = get("/stream", "gzip");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "gzip");
+        BOOST_REQUIRE_EQUAL(decompress(rsp._content, content_encoding::gzip), json + json);
+
+        rsp = get("/large", "");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Vary"), "Accept-Encoding");
+        BOOST_REQUIRE_EQUAL(rsp._content, json);
+        for (auto url : {"/small", "/binary", "/never"}) {
+            rsp = get(url, "gzip");
+            BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "");
+            BOOST_REQUIRE_EQUAL(rsp.get_header("Vary"), "");
+        }
+
+
+        // copies compressed ahead of time
+        char dir[] = "/tmp/httpd_test_XXXXXX";
+        BOOST_REQUIRE(::mkdtemp(dir));
+        auto write_file = [&dir] (const sstring& name, const sstring& content) {
+            std::ofstream(sstring(dir) + "/" + name) << content;
+        };
+        sstring plain;
+        for (int i = 0; i < 100; i++) {
+            plain += "plain text, long enough to compress\n";
+        }
+        write_file("a.txt", plain);
+        write_file("a.txt.gz", "gzipped");
+        server._routes.add(GET, url("/files").remainder("path"), (new directory_handler(sstring(dir) + "/"))->set_precompressed(true));
+        rsp = get("/files/a.txt", "gzip, deflate");
+        BOOST_REQUIRE_EQUAL(rsp._content, "gzipped");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "gzip");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Type"), "text/plain");
+        // no copy for zstd, so compressed while sent
+        rsp = get("/files/a.txt", "zstd");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "zstd");
+        BOOST_REQUIRE_EQUAL(decompress(rsp._content, content_encoding::zstd), plain);
+        rsp = get("/files/a.txt", "");
+        BOOST_REQUIRE_EQUAL(rsp._content, plain);
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Encoding"), "");
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Vary"), "Accept-Encoding");
+        for (auto name : {"a.txt", "a.txt.gz"}) {
+            ::unlink((sstring(dir) + "/" + name).c_str());
+        }
+        ::rmdir(dir);
+
+        client.close().get();
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_file_ranges) {
+    return seastar::async([] {
+        char dir[] = "/tmp/httpd_test_XXXXXX";
+        BOOST_REQUIRE(::mkdtemp(dir));
+        sstring data(sstring::initialized_later(), 100000);
+        for (size_t i = 0; i < data.size(); i++) {
+            data[i] = 'a' + i % 26;
+        }
+        std::ofstream(sstring(dir) + "/data.bin") << data;
+
+        // over tcp, where the files are sent by sendfile
+        http_server server("test");
+        server._routes.add(GET, url("/files").remainder("path"), new directory_handler(sstring(dir) + "/"));
+        ipv4_addr addr("127.0.0.1", 10080);
+        server.listen(addr).get();
+        http::client client(addr);
+        auto get = [&client] (std::initializer_list<std::pair<sstring, sstring>> headers) {
+            http::request req("GET", "/files/data.bin");
+            for (auto&& h : headers) {
+                req.add_header(h.first, h.second);
+            }
+            return client.make_request(std::move(req)).get0();
+        };
+
+        auto rsp = get({});
+        BOOST_REQUIRE_EQUAL(rsp._status, 200);
+        BOOST_REQUIRE(rsp._content == data);
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Accept-Ranges"), "bytes");
+        auto etag = rsp.get_header("ETag");
+        BOOST_REQUIRE(!etag.empty());
+
+        rsp = get({{"If-None-Match", "\"other\", " + etag}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 304);
+        BOOST_REQUIRE(rsp._content.empty());
+        rsp = get({{"If-None-Match", "W/" + etag}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 304);
+        rsp = get({{"If-None-Match", "\"other\""}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 200);
+
+        rsp = get({{"Range", "bytes=10-19"}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 206);
+        BOOST_REQUIRE_EQUAL(rsp._content, data.substr(10, 10));
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Range"), "bytes 10-19/100000");
+        rsp = get({{"Range", "bytes=99990-"}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 206);
+        BOOST_REQUIRE_EQUAL(rsp._content, data.substr(99990));
+        rsp = get({{"Range", "bytes=-5"}});
+        BOOST_REQUIRE_EQUAL(rsp._content, data.substr(99995));
+        rsp = get({{"Range", "bytes=99990-200000"}});
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Range"), "bytes 99990-99999/100000");
+        rsp = get({{"Range", "bytes=100000-"}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 416);
+        BOOST_REQUIRE_EQUAL(rsp.get_header("Content-Range"), "bytes */100000");
+        // ranges that are not understood, or of another version, get it all
+        for (auto range : {"bytes=5-1", "bytes=0-1,5-6", "lines=1-2"}) {
+            rsp = get({{"Range", range}});
+            BOOST_REQUIRE_EQUAL(rsp._status, 200);
+            BOOST_REQUIRE_EQUAL(rsp._content.size(), data.size());
+        }
+        rsp = get({{"Range", "bytes=0-0"}, {"If-Range", "\"other\""}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 200);
+        rsp = get({{"Range", "bytes=0-0"}, {"If-Range", etag}});
+        BOOST_REQUIRE_EQUAL(rsp._status, 206);
+        BOOST_REQUIRE_EQUAL(rsp._content, "a");
+
+        client.close().get();
+        server.stop().get();
+        ::unlink((sstring(dir) + "/data.bin").c_str());
+        ::rmdir(dir);
+    });
+}
+
+static sstring unhex(const char* s) {
+    sstring r(sstring::initialized_later(), strlen(s) / 2);
+    for (size_t i = 0; i < r.size(); i++) {
+        r[i] = std::stoi(std::string(s + 2 * i, 2), nullptr, 16);
+    }
+    return r;
+}
+
+SEASTAR_TEST_CASE(test_hpack) {
+    using headers = std::vector<hpack::header>;
+    // RFC 7541 C.3 and C.4: requests on a connection, without and with
+    // Huffman coding, the second one referring to the dynamic table
+    headers first = {{":method", "GET"}, {":scheme", "http"}, {":path", "/"}, {":authority", "www.example.com"}};
+    headers second = first;
+    second.emplace_back("cache-control", "no-cache");
+    for (auto blocks : {std::make_pair("828684410f7777772e6578616d706c652e636f6d", "828684be58086e6f2d6361636865"),
+            std::make_pair("828684418cf1e3c2e5f23a6ba0ab90f4ff", "828684be5886a8eb10649cbf")}) {
+        hpack::decoder d;
+        BOOST_REQUIRE(d.decode(unhex(blocks.first), 4096) == first);
+        BOOST_REQUIRE(d.decode(unhex(blocks.second), 4096) == second);
+    }
+
+    BOOST_REQUIRE_EQUAL(hpack::huffman_decode(unhex("f1e3c2e5f23a6ba0ab90f4ff")), "www.example.com");
+    BOOST_REQUIRE_THROW(hpack::huffman_decode("\xff"), hpack::decoding_error);
+    hpack::decoder d;
+    BOOST_REQUIRE_THROW(d.decode(unhex("80"), 4096), hpack::decoding_error);
+    BOOST_REQUIRE_THROW(d.decode(unhex("c0"), 4096), hpack::decoding_error);
+    BOOST_REQUIRE_THROW(d.decode(unhex("410f7777772e6578616d706c652e636f6d"), 10), hpack::decoding_error);
+
+    // what the encoder writes decodes the same, across evictions from a
+    // small table and a change of its size
+    hpack::encoder e(256);
+    hpack::decoder d2(256);
+    size_t first_size = 0;
+    for (unsigned i = 0; i < 40; i++) {
+        if (i == 20) {
+            e.set_max_table_size(100);
+        }
+        headers hs = {{":status", i % 2 ? "200" : "201"}, {"content-type", "text/plain"},
+                {"x-request", to_sstring(i % 7)}, {"content-length", to_sstring(i)}};
+        std::vector<char> block;
+        e.begin(block);
+        for (auto&& h : hs) {
+            e.encode(block, h.first, h.second);
+        }
+        BOOST_REQUIRE(d2.decode(std::experimental::string_view(block.data(), block.size()), 4096) == hs);
+        if (i == 0) {
+            first_size = block.size();
+        } else if (i == 14) {
+            // by then the headers are in the table, and sent as indexes
+            BOOST_REQUIRE_LT(block.size(), first_size / 2);
+        }
+    }
+    return make_ready_future<>();
+}
+
+struct h2_frame {
+    http2::frame_type type;
+    uint8_t flags;
+    uint32_t stream_id;
+    sstring payload;
+};
+
+static void write_h2_frame(output_stream<char>& out, http2::frame_type type, uint8_t flags, uint32_t stream_id,
+        const sstring& payload = {}) {
+    char head[9] = {char(payload.size() >> 16), char(payload.size() >> 8), char(payload.size()), char(type),
+            char(flags), char(stream_id >> 24), char(stream_id >> 16), char(stream_id >> 8), char(stream_id)};
+    out.write(head, sizeof(head)).get();
+    out.write(payload).get();
+    out.flush().get();
+}
+
+static h2_frame read_h2_frame(input_stream<char>& in) {
+    auto head = in.read_exactly(9).get0();
+    BOOST_REQUIRE_EQUAL(head.size(), 9u);
+    auto p = reinterpret_cast<const uint8_t*>(head.get());
+    size_t length = p[0] << 16 | p[1] << 8 | p[2];
+    h2_frame f{http2::frame_type(p[3]), p[4], uint32_t(p[5] & 0x7f) << 24 | p[6] << 16 | p[7] << 8 | p[8], {}};
+    if (length) {
+        auto payload = in.read_exactly(length).get0();
+        BOOST_REQUIRE_EQUAL(payload.size(), length);
+        f.payload = sstring(payload.get(), payload.size());
+    }
+    return f;
+}
+
+static sstring u32(uint32_t v) {
+    return sstring({char(v >> 24), char(v >> 16), char(v >> 8), char(v)});
+}
+
+SEASTAR_TEST_CASE(test_http2) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        request_function hello = [] (const_req req) {
+            return sstring("hello ") + req.get_header("Host");
+        };
+        request_function echo = [] (const_req req) {
+            return req.content;
+        };
+        request_function big = [] (const_req req) {
+            return sstring(100000, 'x');
+        };
+        future_handler_function stream = [] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            rep->write_body("txt", [] (output_stream<char>&& out) {
+                return do_with(std::move(out), [] (output_stream<char>& out) {
+                    return out.write("hello ").then([&out] {
+                        return out.flush();
+                    }).then([&out] {
+                        return out.write("world");
+                    }).then([&out] {
+                        return out.close();
+                    });
+                });
+            });
+            return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+        };
+        server._routes.put(GET, "/hello", new function_handler(hello, "txt"));
+        server._routes.put(POST, "/echo", new function_handler(echo, "txt"));
+        server._routes.put(GET, "/big", new function_handler(big, "txt"));
+        server._routes.put(GET, "/stream", new function_handler(stream, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        auto s = lcf.make_new_connection(make_lw_shared<loopback_buffer>(), make_lw_shared<loopback_buffer>()).get0();
+        auto in = s.input();
+        auto out = s.output();
+        out.write("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n").get();
+        // a small window for each stream, so that the large reply has to
+        // wait for WINDOW_UPDATE
+        const uint32_t window = 1000;
+        write_h2_frame(out, http2::frame_type::settings, 0, 0, sstring({0, 4}) + u32(window));
+        auto f = read_h2_frame(in);
+        BOOST_REQUIRE(f.type == http2::frame_type::settings && !(f.flags & http2::flags::ack));
+
+        hpack::encoder encoder;
+        auto send_headers = [&] (uint32_t id, const char* method, const char* path, bool end) {
+            std::vector<char> block;
+            encoder.begin(block);
+            encoder.encode(block, ":method", method);
+            encoder.encode(block, ":scheme", "http");
+            encoder.encode(block, ":path", path);
+            encoder.encode(block, ":authority", "localhost");
+            write_h2_frame(out, http2::frame_type::headers, http2::flags::end_headers | (end ? http2::flags::end_stream : 0),
+                    id, sstring(block.data(), block.size()));
+        };
+        send_headers(1, "GET", "/big", true);
+        send_headers(3, "GET", "/hello", true);
+        send_headers(5, "POST", "/echo", false);
+        write_h2_frame(out, http2::frame_type::data, 0, 5, "abc");
+        write_h2_frame(out, http2::frame_type::data, http2::flags::end_stream, 5, "def");
+        send_headers(7, "GET", "/stream", true);
+        // an upper case name makes a request malformed
+        std::vector<char> block;
+        encoder.begin(block);
+        encoder.encode(block, ":method", "GET");
+        encoder.encode(block, "X-Upper", "1");
+        write_h2_frame(out, http2::frame_type::headers, http2::flags::end_headers | http2::flags::end_stream,
+                9, sstring(block.data(), block.size()));
+
+        hpack::decoder decoder;
+        std::map<uint32_t, std::vector<hpack::header>> headers;
+        std::map<uint32_t, sstring> bodies;
+        std::set<uint32_t> ended;
+        bool settings_acked = false;
+        bool reset = false;
+        int64_t connection_window = 65535;
+        std::map<uint32_t, int64_t> windows;
+        // the replies are interleaved; the small ones are not held up by
+        // the large one
+        while (ended.size() < 4 || !reset) {
+            auto f = read_h2_frame(in);
+            switch (f.type) {
+            case http2::frame_type::settings:
+                settings_acked = settings_acked || (f.flags & http2::flags::ack);
+                break;
+            case http2::frame_type::headers:
+                BOOST_REQUIRE(f.flags & http2::flags::end_headers);
+                headers[f.stream_id] = decoder.decode(f.payload, 65536);
+                windows[f.stream_id] = window;
+                break;
+            case http2::frame_type::data:
+                bodies[f.stream_id] += f.payload;
+                connection_window -= f.payload.size();
+                windows[f.stream_id] -= f.payload.size();
+                BOOST_REQUIRE_GE(connection_window, 0);
+                BOOST_REQUIRE_GE(windows[f.stream_id], 0);
+                if (f.stream_id == 1 && ended.size() < 3) {
+                    BOOST_REQUIRE_LE(bodies[1].size(), window);
+                }
+                if (!f.payload.empty()) {
+                    write_h2_frame(out, http2::frame_type::window_update, 0, 0, u32(f.payload.size()));
+                    write_h2_frame(out, http2::frame_type::window_update, 0, f.stream_id, u32(f.payload.size()));
+                    connection_window += f.payload.size();
+                    windows[f.stream_id] += f.payload.size();
+                }
+                break;
+            case http2::frame_type::rst_stream:
+                BOOST_REQUIRE_EQUAL(f.stream_id, 9u);
+                BOOST_REQUIRE(f.payload == u32(uint32_t(http2::error_code::protocol_error)));
+                reset = true;
+                break;
+            default:
+                break;
+            }
+            if ((f.type == http2::frame_type::headers || f.type == http2::frame_type::data)
+                    && (f.flags & http2::flags::end_stream)) {
+                ended.insert(f.stream_id);
+            }
+        }
+        BOOST_REQUIRE(settings_acked);
+        for (auto id : {1, 3, 5, 7}) {
+            BOOST_REQUIRE_EQUAL(headers[id][0].first, ":status");
+            BOOST_REQUIRE_EQUAL(headers[id][0].second, "200");
+        }
+        BOOST_REQUIRE_EQUAL(bodies[1], sstring(100000, 'x'));
+        BOOST_REQUIRE_EQUAL(bodies[3], "hello localhost");
+        BOOST_REQUIRE_EQUAL(bodies[5], "abcdef");
+        BOOST_REQUIRE_EQUAL(bodies[7], "hello world");
+        auto content_length = std::find(headers[3].begin(), headers[3].end(), hpack::header("content-length", "15"));
+        BOOST_REQUIRE(content_length != headers[3].end());
+
+        write_h2_frame(out, http2::frame_type::ping, 0, 0, "12345678");
+        f = read_h2_frame(in);
+        BOOST_REQUIRE(f.type == http2::frame_type::ping && (f.flags & http2::flags::ack));
+        BOOST_REQUIRE_EQUAL(f.payload, "12345678");
+
+        // a protocol error closes the connection after a GOAWAY
+        write_h2_frame(out, http2::frame_type::push_promise, http2::flags::end_headers, 1, u32(2));
+        f = read_h2_frame(in);
+        BOOST_REQUIRE(f.type == http2::frame_type::goaway);
+        BOOST_REQUIRE(f.payload == u32(9) + u32(uint32_t(http2::error_code::protocol_error)));
+        BOOST_REQUIRE(in.read().get0().empty());
+
+        server.stop().get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_http2_rapid_reset) {
+    return seastar::async([] {
+        loopback_connection_factory lcf;
+        http_server server("test");
+        promise<> release;
+        shared_future<> released(release.get_future());
+        future_handler_function wait = [released] (std::unique_ptr<request> req, std::unique_ptr<reply> rep) {
+            return released.get_future().then([rep = std::move(rep)] () mutable {
+                rep->done("txt");
+                return std::move(rep);
+            });
+        };
+        server._routes.put(GET, "/wait", new function_handler(wait, "txt"));
+        server.listen(lcf.get_server_socket()).get();
+
+        auto s = lcf.make_new_connection(make_lw_shared<loopback_buffer>(), make_lw_shared<loopback_buffer>()).get0();
+        auto in = s.input();
+        auto out = s.output();
+        out.write("PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n").get();
+        write_h2_frame(out, http2::frame_type::settings, 0, 0);
+        hpack::encoder encoder;
+        auto send_headers = [&] (uint32_t id) {
+            std::vector<char> block;
+            encoder.begin(block);
+            encoder.encode(block, ":method", "GET");
+            encoder.encode(block, ":scheme", "http");
+            encoder.encode(block, ":path", "/wait");
+            write_h2_frame(out, http2::frame_type::headers, http2::flags::end_headers | http2::flags::end_stream,
+                    id, sstring(block.data(), block.size()));
+        };
+        auto cancel = u32(uint32_t(http2::error_code::cancel));
+        uint32_t id = 1;
+        for (unsigned i = 0; i < http2::connection::max_concurrent_streams; i++, id += 2) {
+            send_headers(id);
+            write_h2_frame(out, http2::frame_type::rst_stream, 0, id, cancel);
+        }
+        // the handlers of the reset streams still count
+        auto refused = id;
+        send_headers(refused);
+        id += 2;
+        release.set_value();
+        sleep(std::chrono::milliseconds(10)).get();
+        // none of the reset streams was answered
+        send_headers(id);
+        write_h2_frame(out, http2::frame_type::rst_stream, 0, id, cancel);
+
+        bool refused_reset = false;
+        for (;;) {
+            auto f = read_h2_frame(in);
+            if (f.type == http2::frame_type::rst_stream) {
+                BOOST_REQUIRE_EQUAL(f.stream_id, refused);
+                BOOST_REQUIRE(f.payload == u32(uint32_t(http2::error_code::refused_stream)));
+                refused_reset = true;
+            }
+            if (f.type == http2::frame_type::goaway) {
+                BOOST_REQUIRE(f.payload == u32(id) + u32(uint32_t(http2::error_code::enhance_your_calm)));
+                break;
+            }
+        }
+        BOOST_REQUIRE(refused_reset);
+        BOOST_REQUIRE(in.read().get0().empty());
+
+        server.stop().get();
+    });
+}
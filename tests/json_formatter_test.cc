@@ -27,7 +27,11 @@
 #include "core/reactor.hh"
 #include "core/do_with.hh"
 #include "core/future-util.hh"
+#include "core/thread.hh"
+#include "core/vector-data-sink.hh"
 #include "json/formatter.hh"
+#include "json/json_elements.hh"
+#include <limits>
 
 using namespace seastar;
 using namespace json;
@@ -52,3 +56,95 @@ SEASTAR_TEST_CASE(test_collections) {
 
     return make_ready_future();
 }
+
+// What a body writer writes to a stream whose buffer is small, so that a
+// value goes out in many pieces.  Must run in a thread.
+static sstring write_to_string(std::function<future<>(output_stream<char>&&)> writer) {
+    vector_data_sink::vector_type packets;
+    writer(output_stream<char>(data_sink(std::make_unique<vector_data_sink>(packets)), 8)).get();
+    sstring res;
+    for (auto& p : packets) {
+        for (auto& f : p.fragments()) {
+            res += sstring(f.base, f.size);
+        }
+    }
+    return res;
+}
+
+template<typename T>
+static sstring write_value_to_string(const T& val) {
+    return write_to_string([&val] (output_stream<char>&& s) {
+        return do_with(std::move(s), [&val] (output_stream<char>& s) {
+            return formatter::write(s, val).finally([&s] {
+                return s.close();
+            });
+        });
+    });
+}
+
+template<typename T>
+static void check_write(const T& val) {
+    BOOST_CHECK_EQUAL(formatter::to_json(val), write_value_to_string(val));
+}
+
+struct test_object : public json_base {
+    json_element<int> id;
+    json_element<sstring> name;
+    json_list<double> values;
+    test_object() {
+        add(&id, "id");
+        add(&name, "name");
+        add(&values, "values");
+    }
+};
+
+SEASTAR_TEST_CASE(test_numbers) {
+    BOOST_CHECK_EQUAL("0", formatter::to_json(0));
+    BOOST_CHECK_EQUAL("-42", formatter::to_json(-42));
+    BOOST_CHECK_EQUAL(sstring(std::to_string(std::numeric_limits<long>::min())), formatter::to_json(std::numeric_limits<long>::min()));
+    BOOST_CHECK_EQUAL(sstring(std::to_string(std::numeric_limits<unsigned long>::max())),
+            formatter::to_json(std::numeric_limits<unsigned long>::max()));
+    for (double d : {0.0, -0.0, 7.0, -3.0, 999999.0, 1e6, 0.1, -2.5, 1e-7, 123456.7, 1e300}) {
+        BOOST_CHECK_EQUAL(to_sstring(d), formatter::to_json(d));
+    }
+    BOOST_CHECK_THROW(formatter::to_json(std::numeric_limits<double>::infinity()), std::out_of_range);
+    BOOST_CHECK_THROW(formatter::to_json(std::numeric_limits<float>::quiet_NaN()), std::invalid_argument);
+    return make_ready_future();
+}
+
+SEASTAR_TEST_CASE(test_write) {
+    return seastar::async([] {
+        check_write(3);
+        check_write(-1234567890123L);
+        check_write(42UL);
+        check_write(3.5);
+        check_write(1.5f);
+        check_write(true);
+        check_write(false);
+        check_write(sstring("apa"));
+        check_write(std::map<int,int>({{1,2},{3,4}}));
+        check_write(std::vector<std::pair<int,int>>({{1,2},{3,4}}));
+        check_write(std::vector<std::vector<int>>({{1,2},{3,4}}));
+        check_write(std::vector<int>());
+
+        test_object obj;
+        obj.id = 7;
+        obj.values.push(0.5);
+        obj.values.push(2);
+        check_write(obj);
+        obj.name = "seven";
+        check_write(obj);
+        check_write(json_void());
+
+        BOOST_CHECK_THROW(write_value_to_string(std::numeric_limits<double>::infinity()), std::out_of_range);
+    });
+}
+
+SEASTAR_TEST_CASE(test_stream_object) {
+    return seastar::async([] {
+        BOOST_CHECK_EQUAL("[1,2,3]", write_to_string(stream_object(std::vector<int>({1, 2, 3}))));
+        BOOST_CHECK_EQUAL("[[1,1],[2,4],[3,9]]", write_to_string(stream_range_as_array(std::vector<int>({1, 2, 3}), [] (int i) {
+            return std::vector<int>({i, i * i});
+        })));
+    });
+}
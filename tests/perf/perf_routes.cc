@@ -0,0 +1,149 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+// Measures httpd::routes dispatch over a REST API shaped like the ones
+// json2code.py generates: a number of resources, each with a collection,
+// an item with a parameter, a sub resource of the item and a catch all.
+// Urls hitting every route are dispatched by routes::handle, and by trying
+// the match rules one by one, as routes used to; the rate and the number
+// of allocations per request are reported for each.
+
+#include "../../core/reactor.hh"
+#include "../../core/app-template.hh"
+#include "../../core/memory.hh"
+#include "../../core/thread.hh"
+#include "../../core/print.hh"
+#include "../../http/routes.hh"
+#include <random>
+
+using clock_type = std::chrono::steady_clock;
+
+using namespace httpd;
+
+class empty_handler : public handler_base {
+public:
+    virtual future<std::unique_ptr<reply>> handle(const sstring& path,
+            std::unique_ptr<request> req, std::unique_ptr<reply> rep) override {
+        return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+    }
+};
+
+static std::vector<match_rule*> make_rules(unsigned resources) {
+    std::vector<match_rule*> rules;
+    for (unsigned i = 0; i < resources; i++) {
+        auto base = sprint("/api/v1/resource%d", i);
+        auto r = new match_rule(new empty_handler());
+        r->add_str(base);
+        rules.push_back(r);
+        r = new match_rule(new empty_handler());
+        r->add_str(base).add_param("id");
+        rules.push_back(r);
+        r = new match_rule(new empty_handler());
+        r->add_str(base).add_param("id").add_str("/children").add_param("child");
+        rules.push_back(r);
+        r = new match_rule(new empty_handler());
+        r->add_str(base + "/files").add_param("path", true);
+        rules.push_back(r);
+    }
+    return rules;
+}
+
+static std::vector<sstring> make_urls(unsigned resources) {
+    std::vector<sstring> urls;
+    for (unsigned i = 0; i < resources; i++) {
+        auto base = sprint("/api/v1/resource%d", i);
+        urls.push_back(base);
+        urls.push_back(base + "/1234");
+        urls.push_back(base + "/1234/children/abcd");
+        urls.push_back(base + "/files/some/file.txt");
+    }
+    urls.push_back("/api/v1/missing");
+    std::shuffle(urls.begin(), urls.end(), std::default_random_engine(1));
+    return urls;
+}
+
+static std::unique_ptr<request> make_request(const sstring& url) {
+    auto req = std::make_unique<request>();
+    req->_method = "GET";
+    req->_url = url;
+    return req;
+}
+
+template <typename Dispatch>
+static void run(const char* name, const std::vector<sstring>& urls, unsigned requests, Dispatch&& dispatch) {
+    unsigned found = 0;
+    auto mallocs = memory::stats().mallocs();
+    auto start = clock_type::now();
+    for (unsigned i = 0; i < requests; i++) {
+        auto& url = urls[i % urls.size()];
+        found += dispatch(url, make_request(url)).get0()->_status == reply::status_type::ok;
+    }
+    auto elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+    mallocs = memory::stats().mallocs() - mallocs;
+    print("%-12s %10d %12.0f %9.1f %9d\n", name, urls.size() - 1, requests / elapsed,
+            double(mallocs) / requests, found);
+}
+
+int main(int ac, char** av) {
+    app_template at;
+    namespace bpo = boost::program_options;
+    at.add_options()
+            ("resources", bpo::value<std::vector<unsigned>>()->multitoken()
+                    ->default_value(std::vector<unsigned>{4, 32, 256}, "4 32 256"), "Resources in the API, 4 routes each")
+            ("requests", bpo::value<unsigned>()->default_value(200000), "Requests to dispatch per run")
+            ;
+    return at.run(ac, av, [&at] {
+        auto& config = at.configuration();
+        auto resources = config["resources"].as<std::vector<unsigned>>();
+        auto requests = config["requests"].as<unsigned>();
+        return seastar::async([=] {
+            print("%-12s %10s %12s %9s %9s\n", "router", "routes", "requests/s", "allocs", "found");
+            for (auto n : resources) {
+                auto urls = make_urls(n);
+
+                auto rules = make_rules(n);
+                run("one-by-one", urls, requests, [&rules] (const sstring& url, std::unique_ptr<request> req) {
+                    for (auto r : rules) {
+                        auto handler = r->get(url, req->param);
+                        if (handler) {
+                            return handler->handle(url, std::move(req), std::make_unique<reply>());
+                        }
+                        req->param.clear();
+                    }
+                    auto rep = std::make_unique<reply>();
+                    rep->set_status(reply::status_type::not_found);
+                    return make_ready_future<std::unique_ptr<reply>>(std::move(rep));
+                });
+                for (auto r : rules) {
+                    delete r;
+                }
+
+                routes r;
+                for (auto rule : make_rules(n)) {
+                    r.add(rule, GET);
+                }
+                run("trie", urls, requests, [&r] (const sstring& url, std::unique_ptr<request> req) {
+                    return r.handle(url, std::move(req), std::make_unique<reply>());
+                });
+            }
+        });
+    });
+}
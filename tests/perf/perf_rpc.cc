@@ -0,0 +1,238 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+// Measures rpc::protocol throughput and latency: a client and a server on
+// shard 0 exchange echo calls, over the in-memory loopback socket (which
+// isolates the rpc code paths) and over TCP on 127.0.0.1.  Every combination
+// of message size, calls in flight, lz4 compression and the timeout feature
+// is run, and for each the call rate, latency percentiles and the number of
+// allocations per call (client and server together) are reported.
+
+#include "../../core/reactor.hh"
+#include "../../core/app-template.hh"
+#include "../../core/future-util.hh"
+#include "../../core/memory.hh"
+#include "../../core/thread.hh"
+#include "../../core/print.hh"
+#include "../../rpc/rpc.hh"
+#include "../../rpc/lz4_compressor.hh"
+#include "../loopback_socket.hh"
+#include <boost/range/irange.hpp>
+#include <algorithm>
+#include <random>
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+struct serializer {
+};
+
+template <typename Output>
+inline void write(serializer, Output& out, uint32_t v) {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+template <typename Input>
+inline uint32_t read(serializer, Input& in, rpc::type<uint32_t>) {
+    uint32_t v;
+    in.read(reinterpret_cast<char*>(&v), sizeof(v));
+    return v;
+}
+
+template <typename Output>
+inline void write(serializer s, Output& out, const sstring& v) {
+    write(s, out, uint32_t(v.size()));
+    out.write(v.c_str(), v.size());
+}
+
+template <typename Input>
+inline sstring read(serializer s, Input& in, rpc::type<sstring>) {
+    auto size = read(s, in, rpc::type<uint32_t>());
+    sstring ret(sstring::initialized_later(), size);
+    in.read(ret.begin(), size);
+    return ret;
+}
+
+using perf_proto = rpc::protocol<serializer>;
+
+struct bench_config {
+    bool tcp;
+    bool compress;
+    bool timeout;
+    size_t size;
+    unsigned concurrency;
+};
+
+static double to_us(clock_type::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+class rpc_bench {
+    perf_proto _proto{serializer()};
+    rpc::lz4_compressor::factory _lz4;
+    loopback_connection_factory _lcf;
+    std::unique_ptr<perf_proto::server> _loopback_server;
+    std::unique_ptr<perf_proto::server> _tcp_server;
+    ipv4_addr _tcp_addr;
+    unsigned _local_port;
+    std::function<future<sstring> (perf_proto::client&, rpc::rpc_clock_type::duration, const sstring&)> _echo_with_timeout;
+    std::function<future<sstring> (perf_proto::client&, const sstring&)> _echo;
+private:
+    // Local port of a new TCP connection; the server hands connections to
+    // the shard of their port, and it only runs on shard 0.
+    ipv4_addr next_local_addr() {
+        _local_port += smp::count;
+        if (_local_port > 60999) {
+            _local_port = 32768 + smp::count - 32768 % smp::count;
+        }
+        return ipv4_addr(_local_port);
+    }
+    std::unique_ptr<perf_proto::client> connect(const bench_config& c) {
+        rpc::client_options co;
+        co.send_timeout_data = c.timeout;
+        if (c.compress) {
+            co.compressor_factory = &_lz4;
+        }
+        if (c.tcp) {
+            return std::make_unique<perf_proto::client>(_proto, co, _tcp_addr, next_local_addr());
+        }
+        auto socket = seastar::socket(std::make_unique<loopback_socket_impl>(_lcf));
+        return std::make_unique<perf_proto::client>(_proto, co, std::move(socket), ipv4_addr());
+    }
+    future<sstring> call(perf_proto::client& client, const bench_config& c, const sstring& payload) {
+        if (c.timeout) {
+            return _echo_with_timeout(client, 10s, payload);
+        }
+        return _echo(client, payload);
+    }
+public:
+    explicit rpc_bench(uint16_t port) : _tcp_addr("127.0.0.1", port) {
+        std::random_device rd;
+        _local_port = 32768 + std::uniform_int_distribution<unsigned>(0, 20000)(rd);
+        _local_port -= _local_port % smp::count;
+        auto echo = _proto.register_handler(1, [] (sstring payload) {
+            return payload;
+        });
+        _echo = echo;
+        _echo_with_timeout = echo;
+        rpc::server_options so;
+        so.compressor_factory = &_lz4;
+        _loopback_server = std::make_unique<perf_proto::server>(_proto, so, _lcf.get_server_socket());
+        listen_options lo(true);
+        lo.lba = seastar::load_balancing_algorithm::port;
+        _tcp_server = std::make_unique<perf_proto::server>(_proto, so, engine().listen(make_ipv4_address(_tcp_addr), lo));
+    }
+
+    // Must be called in a thread.
+    void run(const bench_config& c, unsigned calls) {
+        sstring payload(sstring::initialized_later(), c.size);
+        // compressible, but not trivially so
+        for (size_t i = 0; i < c.size; i++) {
+            payload[i] = 'a' + (i * 7 + i / 64) % 23;
+        }
+        auto client = connect(c);
+        // negotiate before measuring
+        call(*client, c, payload).get();
+
+        std::vector<clock_type::duration> latencies;
+        latencies.reserve(calls);
+        unsigned issued = 0;
+        auto mallocs = memory::stats().mallocs();
+        auto start = clock_type::now();
+        parallel_for_each(boost::irange(0u, c.concurrency), [&] (unsigned) {
+            return do_until([&] { return issued == calls; }, [&] {
+                ++issued;
+                auto call_start = clock_type::now();
+                return call(*client, c, payload).then([&, call_start] (sstring reply) {
+                    latencies.push_back(clock_type::now() - call_start);
+                });
+            });
+        }).get();
+        auto elapsed = clock_type::now() - start;
+        mallocs = memory::stats().mallocs() - mallocs;
+        client->stop().get();
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies] (double p) {
+            return to_us(latencies[std::min(latencies.size() - 1, size_t(latencies.size() * p))]);
+        };
+        print("%9s %5s %7s %8d %6d %12.0f %9.1f %9.1f %9.1f %9.1f\n", c.tcp ? "tcp" : "loopback",
+                c.compress ? "lz4" : "none", c.timeout ? "yes" : "no", c.size, c.concurrency,
+                calls / std::chrono::duration<double>(elapsed).count(), double(mallocs) / calls,
+                percentile(0.5), percentile(0.99), percentile(0.999));
+    }
+
+    future<> stop() {
+        return _loopback_server->stop().then([this] {
+            return _tcp_server->stop();
+        });
+    }
+};
+
+int main(int ac, char** av) {
+    app_template at;
+    namespace bpo = boost::program_options;
+    at.add_options()
+            ("port", bpo::value<uint16_t>()->default_value(10000), "Server port for the TCP runs")
+            ("transport", bpo::value<sstring>()->default_value("all"), "loopback, tcp or all")
+            ("message-sizes", bpo::value<std::vector<size_t>>()->multitoken()
+                    ->default_value(std::vector<size_t>{64, 4096, 65536}, "64 4096 65536"), "Payload sizes in bytes")
+            ("concurrency", bpo::value<std::vector<unsigned>>()->multitoken()
+                    ->default_value(std::vector<unsigned>{1, 16, 128}, "1 16 128"), "Calls in flight")
+            ("calls", bpo::value<unsigned>()->default_value(20000), "Calls to measure per combination")
+            ;
+    return at.run(ac, av, [&at] {
+        auto& config = at.configuration();
+        auto port = config["port"].as<uint16_t>();
+        auto transport = config["transport"].as<sstring>();
+        auto sizes = config["message-sizes"].as<std::vector<size_t>>();
+        auto concurrency = config["concurrency"].as<std::vector<unsigned>>();
+        auto calls = config["calls"].as<unsigned>();
+        if (!calls) {
+            print("error: --calls must be at least 1\n");
+            return make_ready_future<>();
+        }
+        return seastar::async([=] {
+            std::vector<bool> transports;
+            if (transport != "tcp") {
+                transports.push_back(false);
+            }
+            if (transport != "loopback") {
+                transports.push_back(true);
+            }
+            rpc_bench bench(port);
+            print("%9s %5s %7s %8s %6s %12s %9s %9s %9s %9s\n", "transport", "comp", "timeout", "msgsize",
+                    "conc", "calls/s", "allocs", "p50(us)", "p99(us)", "p999(us)");
+            for (auto tcp : transports) {
+                for (auto compress : {false, true}) {
+                    for (auto timeout : {false, true}) {
+                        for (auto size : sizes) {
+                            for (auto conc : concurrency) {
+                                bench.run(bench_config{tcp, compress, timeout, size, conc}, calls);
+                            }
+                        }
+                    }
+                }
+            }
+            bench.stop().get();
+        });
+    });
+}
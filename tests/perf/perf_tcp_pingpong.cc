@@ -0,0 +1,138 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+// Measures TCP round-trip latency between two shards: the last shard sends
+// fixed-size messages to a server on shard 0, which echoes them back.  Run
+// with --busy-poll-us 0 and with a busy-poll budget to compare.
+
+#include "../../core/reactor.hh"
+#include "../../core/app-template.hh"
+#include "../../core/future-util.hh"
+#include "../../core/print.hh"
+#include <algorithm>
+
+using namespace std::chrono_literals;
+using clock_type = std::chrono::steady_clock;
+
+static future<> serve(server_socket& listener, size_t size, std::chrono::microseconds busy_poll) {
+    return listener.accept().then([size, busy_poll] (connected_socket s, socket_address) {
+        s.set_nodelay(true);
+        s.set_busy_poll(busy_poll);
+        auto in = s.input();
+        auto out = s.output();
+        return do_with(std::move(s), std::move(in), std::move(out), [size] (auto& s, auto& in, auto& out) {
+            return repeat([size, &in, &out] {
+                return in.read_exactly(size).then([&out] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        return make_ready_future<stop_iteration>(stop_iteration::yes);
+                    }
+                    return out.write(std::move(buf)).then([&out] {
+                        return out.flush();
+                    }).then([] {
+                        return stop_iteration::no;
+                    });
+                });
+            }).then([&out] {
+                return out.close();
+            });
+        });
+    });
+}
+
+static future<std::vector<clock_type::duration>>
+ping(socket_address sa, size_t size, unsigned round_trips, std::chrono::microseconds busy_poll) {
+    return engine().connect(sa).then([=] (connected_socket s) {
+        s.set_nodelay(true);
+        s.set_busy_poll(busy_poll);
+        auto in = s.input();
+        auto out = s.output();
+        std::vector<clock_type::duration> latencies;
+        latencies.reserve(round_trips);
+        return do_with(std::move(s), std::move(in), std::move(out), std::move(latencies), sstring(sstring::initialized_later(), size),
+                [round_trips, size] (auto& s, auto& in, auto& out, auto& latencies, auto& msg) {
+            std::fill(msg.begin(), msg.end(), 'x');
+            return repeat([round_trips, size, &in, &out, &latencies, &msg] {
+                if (latencies.size() == round_trips) {
+                    return make_ready_future<stop_iteration>(stop_iteration::yes);
+                }
+                auto start = clock_type::now();
+                return out.write(msg).then([&out] {
+                    return out.flush();
+                }).then([size, &in] {
+                    return in.read_exactly(size);
+                }).then([start, &latencies] (temporary_buffer<char> buf) {
+                    if (buf.empty()) {
+                        throw std::runtime_error("connection closed by server");
+                    }
+                    latencies.push_back(clock_type::now() - start);
+                    return stop_iteration::no;
+                });
+            }).then([&out] {
+                return out.close();
+            }).then([&latencies] {
+                return std::move(latencies);
+            });
+        });
+    });
+}
+
+static double to_us(clock_type::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+int main(int ac, char** av) {
+    app_template at;
+    namespace bpo = boost::program_options;
+    at.add_options()
+            ("port", bpo::value<uint16_t>()->default_value(10000), "Server port")
+            ("message-size", bpo::value<size_t>()->default_value(64), "Size of each message in bytes")
+            ("round-trips", bpo::value<unsigned>()->default_value(100000), "Round trips to measure")
+            ("busy-poll-us", bpo::value<unsigned>()->default_value(0), "Busy-poll budget for both sockets (0 to disable)")
+            ;
+    return at.run(ac, av, [&at] {
+        auto port = at.configuration()["port"].as<uint16_t>();
+        auto size = at.configuration()["message-size"].as<size_t>();
+        auto round_trips = at.configuration()["round-trips"].as<unsigned>();
+        auto busy_poll = std::chrono::microseconds(at.configuration()["busy-poll-us"].as<unsigned>());
+        if (!round_trips) {
+            print("error: --round-trips must be at least 1\n");
+            return make_ready_future<>();
+        }
+        auto sa = make_ipv4_address({"127.0.0.1", port});
+        listen_options lo;
+        lo.reuse_address = true;
+        auto listener = make_lw_shared<server_socket>(engine().listen(sa, lo));
+        auto served = serve(*listener, size, busy_poll);
+        return smp::submit_to(smp::count - 1, [=] {
+            return ping(sa, size, round_trips, busy_poll);
+        }).then([=] (std::vector<clock_type::duration> latencies) {
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [&latencies] (double p) {
+                return to_us(latencies[std::min(latencies.size() - 1, size_t(latencies.size() * p))]);
+            };
+            print("%10s %10s %10s %10s %10s %10s\n", "msgsize", "busypoll", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+            print("%10d %10d %10.1f %10.1f %10.1f %10.1f\n", size, busy_poll.count(),
+                    percentile(0.5), percentile(0.99), percentile(0.999), to_us(latencies.back()));
+        }).finally([served = std::move(served), listener] () mutable {
+            return std::move(served).finally([listener] {});
+        });
+    });
+}
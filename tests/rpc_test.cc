@@ -23,10 +23,14 @@
 #include "loopback_socket.hh"
 #include "rpc/rpc.hh"
 #include "rpc/lz4_compressor.hh"
+#include "rpc/zstd_compressor.hh"
+#include "rpc/rpc_client_pool.hh"
 #include "rpc/multi_algo_compressor_factory.hh"
 #include "test-utils.hh"
 #include "core/thread.hh"
 #include "core/sleep.hh"
+#include "core/posix.hh"
+#include <random>
 
 using namespace seastar;
 
@@ -259,3 +263,571 @@ SEASTAR_TEST_CASE(test_rpc_cancel) {
         });
     });
 }
+
+SEASTAR_TEST_CASE(test_rpc_stream_sink_source) {
+    return with_rpc_env({}, {}, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            proto.register_handler(1, [] (rpc::source<sstring> source) {
+                return do_with(std::move(source), uint64_t(0), [] (rpc::source<sstring>& source, uint64_t& total) {
+                    return repeat([&source, &total] {
+                        return source().then([&total] (std::experimental::optional<std::tuple<sstring>> data) {
+                            if (!data) {
+                                return stop_iteration::yes;
+                            }
+                            total += std::get<0>(*data).size();
+                            return stop_iteration::no;
+                        });
+                    }).then([&total] {
+                        return total;
+                    });
+                });
+            });
+            auto call = proto.make_client<uint64_t (rpc::sink<sstring>)>(1);
+            auto sink = c1.make_stream_sink<sstring>().get0();
+            auto f = call(c1, sink);
+            // several stream windows' worth, so the sink has to wait for credit
+            for (auto i = 0; i < 64; i++) {
+                sink(sstring(sstring::initialized_later(), 100000)).get();
+            }
+            sink.close().get();
+            BOOST_REQUIRE_EQUAL(f.get0(), 64 * 100000);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_stream_returned_sink) {
+    return with_rpc_env({}, {}, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            proto.register_handler(1, [] (rpc::source<int> source) {
+                auto sink = source.make_sink<serializer, int>();
+                // echo every element back doubled, in the background
+                repeat([source, sink] () mutable {
+                    return source().then([sink] (std::experimental::optional<std::tuple<int>> data) mutable {
+                        if (!data) {
+                            return sink.close().then([] { return stop_iteration::yes; });
+                        }
+                        return sink(std::get<0>(*data) * 2).then([] { return stop_iteration::no; });
+                    });
+                }).handle_exception([] (std::exception_ptr) {});
+                return sink;
+            });
+            auto call = proto.make_client<rpc::source<int> (rpc::sink<int>)>(1);
+            auto sink = c1.make_stream_sink<int>().get0();
+            auto source = call(c1, sink).get0();
+            for (auto i = 0; i < 100; i++) {
+                sink(i).get();
+            }
+            sink.close().get();
+            int count = 0, sum = 0;
+            while (auto data = source().get0()) {
+                count++;
+                sum += std::get<0>(*data);
+            }
+            BOOST_REQUIRE_EQUAL(count, 100);
+            BOOST_REQUIRE_EQUAL(sum, 2 * 99 * 100 / 2);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_stream_unclaimed) {
+    rpc::server_options so;
+    so.unclaimed_stream_timeout = std::chrono::milliseconds(100);
+    return with_rpc_env({}, {}, so, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            proto.register_handler(1, [] (rpc::source<sstring> source) {
+                return source().then_wrapped([source] (auto f) {
+                    try {
+                        f.get();
+                        return 0;
+                    } catch (rpc::timeout_error&) {
+                        return 1;
+                    }
+                });
+            });
+            auto call = proto.make_client<int (rpc::sink<sstring>)>(1);
+            auto sink = c1.make_stream_sink<sstring>().get0();
+            // nobody makes a source for the stream; once its data is dropped
+            // the sink gets its credit back and can go on
+            for (auto i = 0; i < 32; i++) {
+                sink(sstring(sstring::initialized_later(), 100000)).get();
+            }
+            BOOST_REQUIRE_EQUAL(call(c1, sink).get0(), 1);
+            sink.close().get();
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_send_batching) {
+    return with_rpc_env({}, {}, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            proto.enable_metrics("test");
+            auto c1 = connect(ipv4_addr());
+            auto sum = proto.register_handler(1, [](int a, int b) {
+                return make_ready_future<int>(a+b);
+            });
+            sum(c1, 0, 0).get();
+            auto before = c1.get_stats();
+            // queued without yielding, so the send loop sees them all at once
+            std::vector<future<int>> fs;
+            rpc::cancellable cancel;
+            for (auto i = 0; i < 1000; i++) {
+                fs.push_back(i == 500 ? sum(c1, cancel, i, 1) : sum(c1, i, 1));
+            }
+            cancel.cancel();
+            for (auto i = 0; i < 1000; i++) {
+                if (i == 500) {
+                    BOOST_REQUIRE_THROW(fs[i].get(), rpc::canceled_error);
+                } else {
+                    BOOST_REQUIRE_EQUAL(fs[i].get0(), i + 1);
+                }
+            }
+            auto after = c1.get_stats();
+            BOOST_REQUIRE_EQUAL(after.sent_messages - before.sent_messages, 999);
+            BOOST_REQUIRE_LT(after.flushes - before.flushes, 10);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_verb_and_reply_tables) {
+    return with_rpc_env({}, {}, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            // one verb in the dense range, one past it
+            auto small = proto.register_handler(7, [] (int a) { return a + 1; });
+            auto large = proto.register_handler(100000, [] (int a) { return a + 2; });
+            BOOST_REQUIRE_EQUAL(small(c1, 1).get0(), 2);
+            BOOST_REQUIRE_EQUAL(large(c1, 1).get0(), 3);
+            proto.unregister_handler(7);
+            BOOST_REQUIRE_THROW(small(c1, 1).get(), rpc::unknown_verb_error);
+            BOOST_REQUIRE_EQUAL(large(c1, 1).get0(), 3);
+
+            // a call that stays outstanding while message ids wrap around the reply ring
+            promise<> release;
+            shared_future<> released(release.get_future());
+            auto stuck = proto.register_handler(8, [released] {
+                return released.get_future().then([] { return 42; });
+            });
+            auto fstuck = stuck(c1);
+            for (auto i = 0; i < 20; i++) {
+                std::vector<future<int>> fs;
+                for (auto j = 0; j < 100; j++) {
+                    fs.push_back(large(c1, j));
+                }
+                for (auto j = 0; j < 100; j++) {
+                    BOOST_REQUIRE_EQUAL(fs[j].get0(), j + 2);
+                }
+            }
+            BOOST_REQUIRE_EQUAL(c1.get_stats().wait_reply, 1);
+            release.set_value();
+            BOOST_REQUIRE_EQUAL(fstuck.get0(), 42);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().wait_reply, 0);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_zstd_dictionary) {
+    std::vector<temporary_buffer<char>> samples;
+    for (auto i = 0; i < 2000; i++) {
+        auto s = sprint("{\"key\": \"partition-%d\", \"column\": \"value\", \"timestamp\": %d, \"ttl\": 0}", i % 97, i * 7919);
+        samples.emplace_back(s.c_str(), s.size());
+    }
+    auto factory = make_lw_shared<rpc::zstd_compressor::factory>(rpc::zstd_compressor::train_dictionary(samples, 4096));
+    rpc::server_options so;
+    rpc::client_options co;
+    so.compressor_factory = factory.get();
+    co.compressor_factory = factory.get();
+    return with_rpc_env({}, co, so, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            auto echo = proto.register_handler(1, [] (sstring s) { return s; });
+            for (auto i = 0; i < 10; i++) {
+                auto msg = sprint("{\"key\": \"partition-%d\", \"column\": \"value\", \"timestamp\": %d, \"ttl\": 0}", i, i);
+                BOOST_REQUIRE_EQUAL(echo(c1, msg).get0(), msg);
+            }
+            sstring big(sstring::initialized_later(), 300000);
+            for (size_t i = 0; i < big.size(); i++) {
+                big[i] = 'a' + i % 23;
+            }
+            BOOST_REQUIRE_EQUAL(echo(c1, big).get0(), big);
+            BOOST_REQUIRE_EQUAL(c1.get_stats().uncompressed_messages, 0);
+            c1.stop().get();
+        });
+    }).finally([factory] {});
+}
+
+SEASTAR_TEST_CASE(test_rpc_compression_threshold_and_adaptive) {
+    auto factory = std::make_unique<rpc::zstd_compressor::factory>();
+    rpc::server_options so;
+    rpc::client_options co;
+    so.compressor_factory = factory.get();
+    co.compressor_factory = factory.get();
+    co.compression.threshold = 1000;
+    co.compression.adaptive = true;
+    return with_rpc_env({}, co, so, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            auto small = proto.register_handler(1, [] (sstring s) { return s.size(); });
+            auto random = proto.register_handler(2, [] (sstring s) { return s.size(); });
+            auto text = proto.register_handler(3, [] (sstring s) { return s.size(); });
+            BOOST_REQUIRE_EQUAL(small(c1, sstring(10, 'x')).get0(), 10);
+            auto stats = c1.get_stats();
+            BOOST_REQUIRE_EQUAL(stats.uncompressed_messages, 1);
+
+            std::default_random_engine rnd;
+            sstring noise(sstring::initialized_later(), 4000);
+            for (auto i = 0; i < 200; i++) {
+                std::generate(noise.begin(), noise.end(), [&rnd] { return char(rnd()); });
+                BOOST_REQUIRE_EQUAL(random(c1, noise).get0(), 4000);
+            }
+            // incompressible verb stops being compressed after a sample window
+            BOOST_REQUIRE_GE(c1.get_stats().uncompressed_messages - stats.uncompressed_messages, 100);
+
+            stats = c1.get_stats();
+            for (auto i = 0; i < 200; i++) {
+                BOOST_REQUIRE_EQUAL(text(c1, sstring(4000, 'y')).get0(), 4000);
+            }
+            BOOST_REQUIRE_EQUAL(c1.get_stats().uncompressed_messages, stats.uncompressed_messages);
+            c1.stop().get();
+        });
+    }).finally([factory = std::move(factory)] {});
+}
+
+// A port on 127.0.0.1 that nothing listens on, picked by the kernel.
+static ipv4_addr unused_local_addr() {
+    auto fd = file_desc::socket(AF_INET, SOCK_STREAM, 0);
+    socket_address sa(make_ipv4_address(ipv4_addr("127.0.0.1", 0)));
+    fd.bind(sa.u.sa, sizeof(sa.u.in));
+    return ipv4_addr(fd.get_address());
+}
+
+SEASTAR_TEST_CASE(test_rpc_client_pool) {
+    return seastar::async([] {
+        test_rpc_proto proto(serializer{});
+        auto sum = proto.register_handler(1, [] (int a, int b) { return a + b; });
+        auto echo = proto.register_handler(2, [] (sstring s) { return s; });
+        auto addr = unused_local_addr();
+        rpc::client_pool_options po;
+        po.connections_per_peer = 3;
+        po.large_message_size = 1000;
+        // the server runs on shard 0 only, connections must land there
+        po.peer_shards = smp::count;
+        rpc::client_pool<serializer> pool(proto, po, "test");
+
+        // nothing listens yet, so the first connection fails...
+        BOOST_REQUIRE_THROW(sum(pool.get(addr, 1), 1, 2).get(), rpc::closed_error);
+        listen_options lo(true);
+        lo.lba = seastar::load_balancing_algorithm::port;
+        test_rpc_proto::server server(proto, engine().listen(make_ipv4_address(addr), lo));
+        // ...and is replaced on next use
+        auto& c1 = pool.get(addr, 1);
+        BOOST_REQUIRE_EQUAL(sum(c1, 2, 3).get0(), 5);
+
+        auto& c2 = pool.get(addr, 2);
+        auto& large = pool.get(addr, 1, 5000);
+        BOOST_REQUIRE(&c1 != &c2);
+        BOOST_REQUIRE(&c1 != &large && &c2 != &large);
+        // two connections for ordinary calls, chosen by verb
+        BOOST_REQUIRE_EQUAL(&pool.get(addr, 3), &c1);
+        BOOST_REQUIRE_EQUAL(&pool.get(addr, 1, 999), &c1);
+
+        sstring big(5000, 'b');
+        BOOST_REQUIRE_EQUAL(echo(pool.get(addr, 2, big.size()), big).get0(), big);
+        BOOST_REQUIRE_EQUAL(echo(c2, "small").get0(), "small");
+
+        pool.stop().get();
+        server.stop().get();
+    });
+}
+
+// A server on every shard, each replying with the shard it runs on.
+struct shard_server {
+    test_rpc_proto proto{serializer{}};
+    std::unique_ptr<test_rpc_proto::server> server;
+    explicit shard_server(ipv4_addr addr) {
+        proto.register_handler(1, [] { return engine().cpu_id(); });
+        listen_options lo(true);
+        lo.lba = seastar::load_balancing_algorithm::port;
+        server = std::make_unique<test_rpc_proto::server>(proto, engine().listen(make_ipv4_address(addr), lo));
+    }
+    future<> stop() {
+        return server->stop();
+    }
+};
+
+static thread_local std::unique_ptr<shard_server> local_shard_server;
+
+SEASTAR_TEST_CASE(test_rpc_client_pool_shards) {
+    return seastar::async([] {
+        auto addr = unused_local_addr();
+        smp::invoke_on_all([addr] {
+            local_shard_server = std::make_unique<shard_server>(addr);
+        }).get();
+        test_rpc_proto proto(serializer{});
+        auto where = proto.make_client<unsigned ()>(1);
+        rpc::client_pool_options po;
+        po.connections_per_peer = 2;
+        po.peer_shards = smp::count;
+        rpc::client_pool<serializer> pool(proto, po);
+        for (unsigned shard = 0; shard < smp::count; shard++) {
+            for (unsigned verb = 0; verb < 2; verb++) {
+                BOOST_REQUIRE_EQUAL(where(pool.get(addr, verb, 0, shard)).get0(), shard);
+            }
+        }
+        pool.stop().get();
+        smp::invoke_on_all([] {
+            return local_shard_server->stop().finally([] {
+                local_shard_server.reset();
+            });
+        }).get();
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_verb_group_limits) {
+    rpc::server_options so;
+    rpc::verb_group_limits slow_group;
+    slow_group.max_concurrency = 1;
+    slow_group.max_queue_length = 2;
+    so.verb_groups.push_back(slow_group);
+    so.verb_group_of[1] = 0;
+    return with_rpc_env({}, {}, so, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            promise<> release;
+            shared_future<> released(release.get_future());
+            int running = 0, max_running = 0;
+            auto slow = proto.register_handler(1, [released, &running, &max_running] {
+                max_running = std::max(max_running, ++running);
+                return released.get_future().then([&running] {
+                    --running;
+                    return 1;
+                });
+            });
+            auto fast = proto.register_handler(2, [] { return 2; });
+            std::vector<future<int>> fs;
+            for (auto i = 0; i < 5; i++) {
+                fs.push_back(slow(c1));
+            }
+            // one running, two queued, two shed
+            BOOST_REQUIRE_THROW(fs[3].get(), rpc::overloaded_error);
+            BOOST_REQUIRE_THROW(fs[4].get(), rpc::overloaded_error);
+            BOOST_REQUIRE_EQUAL(s.rejected_requests(0), 2);
+            // other verbs are not held up
+            BOOST_REQUIRE_EQUAL(fast(c1).get0(), 2);
+            release.set_value();
+            for (auto i = 0; i < 3; i++) {
+                BOOST_REQUIRE_EQUAL(fs[i].get0(), 1);
+            }
+            BOOST_REQUIRE_EQUAL(max_running, 1);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_verb_group_isolation) {
+    // room for two requests server wide
+    rpc::resource_limits limits;
+    limits.basic_request_size = 1000;
+    limits.max_memory = 2000;
+    rpc::server_options so;
+    rpc::verb_group_limits slow_group;
+    slow_group.max_concurrency = 1;
+    so.verb_groups.push_back(slow_group);
+    so.verb_group_of[1] = 0;
+    return with_rpc_env(limits, {}, so, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            promise<> release;
+            shared_future<> released(release.get_future());
+            auto slow = proto.register_handler(1, [released] {
+                return released.get_future().then([] { return 1; });
+            });
+            auto fast = proto.register_handler(2, [] { return 2; });
+            std::vector<future<int>> fs;
+            for (auto i = 0; i < 5; i++) {
+                fs.push_back(slow(c1));
+            }
+            // requests queued in their group take no server wide memory
+            BOOST_REQUIRE_EQUAL(fast(c1).get0(), 2);
+            BOOST_REQUIRE_EQUAL(fast(c1).get0(), 2);
+            release.set_value();
+            for (auto&& f : fs) {
+                BOOST_REQUIRE_EQUAL(f.get0(), 1);
+            }
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_verb_group_scheduling) {
+    using namespace std::chrono_literals;
+    static seastar::thread_scheduling_group sg(10ms, 0.5);
+    rpc::server_options so;
+    rpc::verb_group_limits group;
+    group.scheduling_group = &sg;
+    so.verb_groups.push_back(group);
+    so.verb_group_of[1] = 0;
+    return with_rpc_env({}, {}, so, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto c1 = connect(ipv4_addr());
+            auto f = proto.register_handler(1, [] (int x) {
+                BOOST_REQUIRE(seastar::thread::running_in_thread());
+                return sleep(1ms).then([x] { return x * 2; });
+            });
+            BOOST_REQUIRE_EQUAL(f(c1, 21).get0(), 42);
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_spliced_buffer) {
+    {
+        // writes span chunks, large spliced buffers are shared and small ones copied
+        sstring big(sstring::initialized_later(), rpc::snd_buf_writer::chunk_size + 100);
+        std::fill(big.begin(), big.end(), 'b');
+        temporary_buffer<char> cached(64 * 1024);
+        std::fill(cached.get_write(), cached.get_write() + cached.size(), 'c');
+        rpc::snd_buf_writer out(28);
+        out.write(big.data(), big.size());
+        out.splice(rpc::spliced_buffer(cached.share()));
+        out.splice(rpc::spliced_buffer(temporary_buffer<char>("small", 5)));
+        auto buf = std::move(out).finish();
+        BOOST_REQUIRE_EQUAL(buf.size, 28 + big.size() + cached.size() + 5);
+        BOOST_REQUIRE_GE(buf.front().size(), 28);
+        auto& frags = boost::get<std::vector<temporary_buffer<char>>>(buf.bufs);
+        auto spliced = std::find_if(frags.begin(), frags.end(), [&cached] (auto& f) { return f.get() == cached.get(); });
+        BOOST_REQUIRE(spliced != frags.end());
+        BOOST_REQUIRE_EQUAL(spliced->size(), cached.size());
+        sstring all;
+        for (auto&& f : frags) {
+            all += sstring(f.get(), f.size());
+        }
+        BOOST_REQUIRE(all.substr(28) == big + sstring(cached.get(), cached.size()) + "small");
+    }
+    return with_rpc_env({}, {}, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, connect] {
+            auto c1 = connect(ipv4_addr());
+            auto echo = proto.register_handler(1, [] (int tag, rpc::spliced_buffer b) {
+                return make_ready_future<rpc::spliced_buffer, int>(std::move(b), tag);
+            });
+            for (auto size : {size_t(10), size_t(100 * 1024)}) {
+                temporary_buffer<char> cached(size);
+                for (size_t i = 0; i < size; i++) {
+                    cached.get_write()[i] = char(i);
+                }
+                ::net::packet p(cached.share(0, size / 2));
+                p = ::net::packet(std::move(p), temporary_buffer<char>(cached.get() + size / 2, size - size / 2));
+                auto ret = echo(c1, 7, rpc::spliced_buffer(std::move(p))).get();
+                BOOST_REQUIRE_EQUAL(std::get<1>(ret), 7);
+                auto data = std::get<0>(ret).linearize();
+                BOOST_REQUIRE_EQUAL(data.size(), size);
+                BOOST_REQUIRE(std::equal(data.begin(), data.end(), cached.begin()));
+            }
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_latency_and_tracing) {
+    rpc::client_options co;
+    co.trace_sampling = 1;
+    return with_rpc_env({}, co, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, connect] {
+            proto.enable_latency_metrics("test_latency");
+            std::vector<rpc::trace_record> records;
+            proto.set_trace_handler([&records] (const rpc::trace_record& r) {
+                records.push_back(r);
+            });
+            uint64_t seen_by_handler = 0;
+            auto call = proto.register_handler(1, [&seen_by_handler] (int x) {
+                seen_by_handler = rpc::current_trace_id();
+                return sleep(std::chrono::milliseconds(1)).then([x] {
+                    return x + 1;
+                });
+            });
+            auto c1 = connect(ipv4_addr());
+            for (int i = 0; i < 10; i++) {
+                BOOST_REQUIRE_EQUAL(call(c1, i).get0(), i + 1);
+            }
+            auto l = proto.get_latency(1);
+            BOOST_REQUIRE(l);
+            // the first call may go out before tracing is negotiated
+            BOOST_REQUIRE_GE(l->round_trip.count(), 9);
+            BOOST_REQUIRE_EQUAL(l->queue.count(), l->round_trip.count());
+            BOOST_REQUIRE_GE(l->handler.count(), 9);
+            BOOST_REQUIRE(l->handler.quantile(0.5) >= std::chrono::milliseconds(1));
+            BOOST_REQUIRE(l->round_trip.sum() >= l->handler.sum());
+
+            BOOST_REQUIRE_NE(seen_by_handler, 0);
+            auto server_record = std::find_if(records.begin(), records.end(), [seen_by_handler] (auto& r) {
+                return r.server && r.trace_id == seen_by_handler;
+            });
+            auto client_record = std::find_if(records.begin(), records.end(), [seen_by_handler] (auto& r) {
+                return !r.server && r.trace_id == seen_by_handler;
+            });
+            BOOST_REQUIRE(server_record != records.end());
+            BOOST_REQUIRE(client_record != records.end());
+            BOOST_REQUIRE_EQUAL(client_record->verb, 1);
+            BOOST_REQUIRE_EQUAL(client_record->handler.count(), server_record->handler.count());
+            c1.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_tracing_negotiated_on_demand) {
+    return with_rpc_env({}, {}, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, &s, connect] {
+            auto call = proto.register_handler(1, [] (int x) { return x + 1; });
+            auto tracing_connections = [&s] {
+                unsigned n = 0;
+                s.foreach_connection([&n] (auto& c) {
+                    n += c.tracing_negotiated();
+                });
+                return n;
+            };
+            // nobody records latencies or traces: no handler timing
+            auto c1 = connect(ipv4_addr());
+            BOOST_REQUIRE_EQUAL(call(c1, 1).get0(), 2);
+            BOOST_REQUIRE_EQUAL(tracing_connections(), 0);
+            proto.enable_latency_metrics("test_on_demand");
+            auto c2 = connect(ipv4_addr());
+            BOOST_REQUIRE_EQUAL(call(c2, 1).get0(), 2);
+            BOOST_REQUIRE_EQUAL(tracing_connections(), 1);
+            c1.stop().get();
+            c2.stop().get();
+        });
+    });
+}
+
+SEASTAR_TEST_CASE(test_rpc_forward_to_shard) {
+    return with_rpc_env({}, {}, {}, true, [] (test_rpc_proto& proto, test_rpc_proto::server& s, connect_fn connect) {
+        return seastar::async([&proto, connect] {
+            auto c1 = connect(ipv4_addr());
+            auto where = proto.register_handler(1, [] (unsigned key) { return key; }, [] (unsigned key, sstring payload) {
+                if (payload == "fail") {
+                    throw std::runtime_error("failed on shard " + to_sstring(engine().cpu_id()));
+                }
+                return make_ready_future<unsigned, sstring>(engine().cpu_id(), payload + payload);
+            });
+            sstring payload(sstring::initialized_later(), 64 * 1024);
+            std::fill(payload.begin(), payload.end(), 'p');
+            for (unsigned key = 0; key < 2 * smp::count; key++) {
+                auto ret = where(c1, key, payload).get();
+                BOOST_REQUIRE_EQUAL(std::get<0>(ret), key % smp::count);
+                BOOST_REQUIRE(std::get<1>(ret) == payload + payload);
+            }
+            auto last = smp::count - 1;
+            BOOST_REQUIRE_EXCEPTION(where(c1, last, "fail").get(), std::runtime_error, [last] (auto& ex) {
+                return sstring(ex.what()) == "failed on shard " + to_sstring(last);
+            });
+            c1.stop().get();
+        });
+    });
+}
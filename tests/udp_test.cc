@@ -0,0 +1,82 @@
+/*
+ * This file is open source software, licensed to you under the terms
+ * of the Apache License, Version 2.0 (the "License").  See the NOTICE file
+ * distributed with this work for additional information regarding copyright
+ * ownership.  You may not use this file except in compliance with the License.
+ *
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied.  See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+/*
+ * Copyright (C) 2017 ScyllaDB
+ */
+
+#include "tests/test-utils.hh"
+#include "core/future-util.hh"
+#include "core/thread.hh"
+#include "net/api.hh"
+
+using namespace net;
+
+static sstring payload(unsigned i) {
+    // runs of datagrams of the same size, which go out as segments of a
+    // single message, and one too large to be copied out of the receive ring
+    size_t size = i == 30 ? 4000 : 100 + i / 8 * 10;
+    return sstring(size, char('a' + i % 26));
+}
+
+SEASTAR_TEST_CASE(test_udp_batches) {
+    return seastar::async([] {
+        // more than a sendmmsg()/recvmmsg() batch
+        constexpr unsigned count = 40;
+        ipv4_addr server_addr("127.0.0.1", 10040);
+        ipv4_addr client_addr("127.0.0.1", 10041);
+        // bound to the wildcard address, so the address datagrams were sent
+        // to only comes from their IP_PKTINFO control messages
+        auto server = engine().net().make_udp_channel(ipv4_addr(server_addr.port));
+        auto client = engine().net().make_udp_channel(client_addr);
+
+        // all queued before the channel flushes any
+        std::vector<future<>> sent;
+        for (unsigned i = 0; i < count; ++i) {
+            auto s = payload(i);
+            sent.push_back(client.send(server_addr, packet(s.c_str(), s.size())));
+        }
+        for (auto& f : when_all(sent.begin(), sent.end()).get0()) {
+            f.get();
+        }
+
+        for (unsigned i = 0; i < count; ++i) {
+            auto dgram = server.receive().get0();
+            BOOST_REQUIRE_EQUAL(dgram.get_src().ip, client_addr.ip);
+            BOOST_REQUIRE_EQUAL(dgram.get_src().port, client_addr.port);
+            BOOST_REQUIRE_EQUAL(dgram.get_dst().ip, server_addr.ip);
+            BOOST_REQUIRE_EQUAL(dgram.get_dst_port(), server_addr.port);
+            auto& p = dgram.get_data();
+            p.linearize();
+            auto& f = p.frag(0);
+            BOOST_REQUIRE_EQUAL(sstring(f.base, f.size), payload(i));
+        }
+
+        client.close();
+        server.close();
+    });
+}
+
+SEASTAR_TEST_CASE(test_udp_send_after_close) {
+    return seastar::async([] {
+        auto chan = engine().net().make_udp_channel(ipv4_addr("127.0.0.1", 10042));
+        auto f = chan.send(ipv4_addr("127.0.0.1", 10043), "lost");
+        chan.close();
+        BOOST_REQUIRE_THROW(f.get(), std::system_error);
+        BOOST_REQUIRE_THROW(chan.send(ipv4_addr("127.0.0.1", 10043), "lost").get(), std::system_error);
+    });
+}